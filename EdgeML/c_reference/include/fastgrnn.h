@@ -8,6 +8,7 @@
 #define ERR_TEMPLRW_NOT_INIT -2
 #define ERR_TEMPLRU_NOT_INIT -3
 #define ERR_NORMFEATURES_NOT_INIT -4
+#define ERR_FUSEDPARAMS_NOT_INIT -5
 
 /**
  * @brief Model paramters for low-rank FastGRNN
@@ -74,6 +75,60 @@ int fastgrnn_lr(float* const hiddenState, unsigned hiddenDims,
   const float* const input, unsigned inputDims, unsigned steps,
   const void* params, void* buffers, int backward, int normalize);
 
+/**
+ * @brief Low-rank FastGRNN parameters rearranged for fastgrnn_lr_fused by fastgrnn_lr_fuse_params
+ * @var       lr           pointer to the low-rank FastGRNN parameters
+ * @var       W1           pointer to W1 transposed, size inputDims*wRank; with normalization, to W1 / stdDev
+ *                         transposed for each step, size inputDims*wRank*steps
+ * @var       B1           pointer to -(W1 / stdDev) * mean for each step, size wRank*steps, not used if normalization is off
+ * @var       U1           pointer to U1 transposed, size hiddenDims*uRank
+ * @var       W2U2         pointer to W2 and U2 transposed and stacked, size (wRank+uRank)*hiddenDims
+ */
+typedef struct FastGRNN_LR_Fused_Params {
+  const FastGRNN_LR_Params* lr;
+  float* W1;
+  float* B1;
+  float* U1;
+  float* W2U2;
+} FastGRNN_LR_Fused_Params;
+
+/**
+ * @brief Fills the parameters of fastgrnn_lr_fused from those of fastgrnn_lr, once per model
+ * @param[in]       lrParams     pointer to low-rank FastGRNN parameters
+ * @param[in]       hiddenDims   dimension of hidden state of the FastGRNN cell
+ * @param[in]       inputDims    dimension of input vector for each step
+ * @param[in]       steps        number of steps of FastGRNN cell
+ * @param[in]       normalize    fold mean-var normalization into W1 and B1, 0 for no, 1 for yes
+ * @param[in,out]   fusedParams  pointer to fused parameters, with the arrays allocated by the caller
+ * @return     The function returns <code>0</code> on success
+ *             <code>ERR_FUSEDPARAMS_NOT_INIT</code> if an array of fusedParams is not allocated
+ */
+int fastgrnn_lr_fuse_params(const FastGRNN_LR_Params* lrParams, unsigned hiddenDims,
+  unsigned inputDims, unsigned steps, int normalize, FastGRNN_LR_Fused_Params* fusedParams);
+
+/**
+ * @brief Multi-step updates of a FastGRNN cell with low rank W, U, fused into one pass per step
+ * Computes what fastgrnn_lr does, up to rounding: the products are summed in a different order and
+ * sigmoid and tanh are approximated (see fastgrnn.c), for differences in the order of 1e-7 per step.
+ * preComp and normFeatures are not used.
+ * @param[in,out]   hiddenState  pointer to initial hidden state and output hidden state
+ * @param[in]       hiddenDims   dimension of hidden state of the FastGRNN cell
+ * @param[in]       input        pointer to concatenated input vectors for all steps, size inputDims*steps
+ * @param[in]       inputDims    dimension of input vector for each step
+ * @param[in]       steps        number of steps of FastGRNN cell, as passed to fastgrnn_lr_fuse_params
+ * @param[in]       params       pointer to fused model parameters, FastGRNN_LR_Fused_Params
+ * @param[in]       buffers      pointer to buffer spaces, FastGRNN_LR_Buffers
+ * @param[in]       backward     direction of the pass, 0 for forward, 1 for backward
+ * @param[in]       normalize    apply mean-var normalization, 0 for no, 1 for yes
+ * @return     The function returns <code>0</code> on success
+ *             <code>ERR_TEMPLRW_NOT_INIT</code> if tempLRW not allocated
+ *             <code>ERR_TEMPLRU_NOT_INIT</code> if tempLRU not allocated
+ *             <code>ERR_FUSEDPARAMS_NOT_INIT</code> if an array of params is not allocated
+*/
+int fastgrnn_lr_fused(float* const hiddenState, unsigned hiddenDims,
+  const float* const input, unsigned inputDims, unsigned steps,
+  const void* params, void* buffers, int backward, int normalize);
+
 /**
  * @brief Model paramters for low-rank FastGRNN
  * @var       mean         pointer to mean of input vector for normalization, size inputDims
@@ -51,6 +51,176 @@ int fastgrnn_lr(float* const hiddenState, unsigned hiddenDims,
   return 0;
 }
 
+// Lanes of the fused kernel: independent sums that compilers map onto vector registers
+#define FASTGRNN_LANES 8
+
+// e^x as 2^n * e^r with |r| <= ln(2)/2, e^r from the degree 6 polynomial of the Cephes expf.
+// Relative error below 1e-7 for x in [-87, 87] (measured against double); x is clamped to that range.
+static inline float fastExp(float x) {
+  // Clamps the magnitude on the bits: float comparisons may trap, so compilers do not vectorize
+  // them into selects, while integer ones are
+  union { float f; int i; } clamped;
+  clamped.f = x;
+  int magnitude = clamped.i & 0x7fffffff;
+  magnitude = magnitude < 0x42ae0000 ? magnitude : 0x42ae0000;  // 87.0f
+  clamped.i = (clamped.i & (int)0x80000000) | magnitude;
+  x = clamped.f;
+
+  // Adding and removing 1.5 * 2^23 rounds to the nearest integer
+  float n = (x * 1.44269504f + 12582912.0f) - 12582912.0f;
+  float r = x - n * 0.693359375f + n * 2.12194440e-4f;
+  float p = 1.9875691500e-4f;
+  p = p * r + 1.3981999507e-3f;
+  p = p * r + 8.3334519073e-3f;
+  p = p * r + 4.1665795894e-2f;
+  p = p * r + 1.6666665459e-1f;
+  p = p * r + 5.0000001201e-1f;
+  p = p * r * r + r + 1.0f;
+  union { int i; float f; } scale;
+  scale.i = ((int)n + 127) << 23;
+  return p * scale.f;
+}
+
+// Absolute error below 1e-7, as 1 / (1 + expf(-x))
+static inline float fastSigmoid(float x) {
+  return 1.0f / (1.0f + fastExp(-x));
+}
+
+// Absolute error below 2e-7
+static inline float fastTanh(float x) {
+  return 1.0f - 2.0f / (1.0f + fastExp(2.0f * x));
+}
+
+// sums[k] += mat[r * ncols + first + k] * vec[r] over rows r, for k < count <= FASTGRNN_LANES.
+// Each lane adds up its own column in order, so the lanes are vectorized without reassociating sums.
+static inline void columnBlock(const float* const mat, const float* const vec,
+  unsigned nrows, unsigned ncols, unsigned first, unsigned count, float* const sums) {
+  const float* row = mat + first;
+  for (unsigned r = 0; r < nrows; r++, row += ncols)
+    for (unsigned k = 0; k < count; k++)
+      sums[k] += row[k] * vec[r];
+}
+
+// ret = matT^T * vec + bias (bias may be 0), for matT of size len * rank
+static inline void lowRankProjection(const float* const matT, const float* const vec,
+  unsigned len, unsigned rank, const float* const bias, float* const ret) {
+  for (unsigned first = 0; first < rank; first += FASTGRNN_LANES) {
+    unsigned count = rank - first < FASTGRNN_LANES ? rank - first : FASTGRNN_LANES;
+    float sums[FASTGRNN_LANES] = { 0.0f };
+    columnBlock(matT, vec, len, rank, first, count, sums);
+    for (unsigned k = 0; k < count; k++)
+      ret[first + k] = bias ? sums[k] + bias[first + k] : sums[k];
+  }
+}
+
+// Updates hiddenState[first, first + count). The rows of W2 * tempLRW + U2 * tempLRU are summed
+// in registers and go straight through the gates.
+static inline void fusedGateBlock(float* const hiddenState, unsigned hiddenDims,
+  unsigned first, unsigned count, const FastGRNN_LR_Fused_Params* const tparams,
+  const float* const tempLRW, const float* const tempLRU) {
+
+  const FastGRNN_LR_Params* lr = tparams->lr;
+  float preComp[FASTGRNN_LANES] = { 0.0f };
+  columnBlock(tparams->W2U2, tempLRW, lr->wRank, hiddenDims, first, count, preComp);
+  columnBlock(tparams->W2U2 + lr->wRank * hiddenDims, tempLRU, lr->uRank, hiddenDims,
+    first, count, preComp);
+
+  // Locals, as stores to hiddenState could otherwise change them for the compiler
+  const float* const Bg = lr->Bg + first;
+  const float* const Bh = lr->Bh + first;
+  const float zeta = lr->sigmoid_zeta;
+  const float nu = lr->sigmoid_nu;
+  float newState[FASTGRNN_LANES];
+  for (unsigned k = 0; k < count; k++) {
+    float gate = fastSigmoid(preComp[k] + Bg[k]);
+    float update = fastTanh(preComp[k] + Bh[k]);
+    newState[k] = gate * hiddenState[first + k] + (zeta * (1.0f - gate) + nu) * update;
+  }
+  for (unsigned k = 0; k < count; k++)
+    hiddenState[first + k] = newState[k];
+}
+
+int fastgrnn_lr_fuse_params(const FastGRNN_LR_Params* lrParams, unsigned hiddenDims,
+  unsigned inputDims, unsigned steps, int normalize, FastGRNN_LR_Fused_Params* fusedParams) {
+
+  if (fusedParams->W1 == 0 || fusedParams->U1 == 0 || fusedParams->W2U2 == 0 ||
+    (normalize && fusedParams->B1 == 0))
+    return ERR_FUSEDPARAMS_NOT_INIT;
+
+  fusedParams->lr = lrParams;
+  unsigned wRank = lrParams->wRank;
+  unsigned uRank = lrParams->uRank;
+  for (unsigned i = 0; i < hiddenDims; i++) {
+    for (unsigned r = 0; r < uRank; r++)
+      fusedParams->U1[i * uRank + r] = lrParams->U1[r * hiddenDims + i];
+    for (unsigned r = 0; r < wRank; r++)
+      fusedParams->W2U2[r * hiddenDims + i] = lrParams->W2[i * wRank + r];
+    for (unsigned r = 0; r < uRank; r++)
+      fusedParams->W2U2[(wRank + r) * hiddenDims + i] = lrParams->U2[i * uRank + r];
+  }
+
+  if (normalize) {
+    // W1 * ((x - mean) / stdDev) = (W1 / stdDev) * x - (W1 / stdDev) * mean
+    for (unsigned t = 0; t < steps; t++) {
+      float* W1 = fusedParams->W1 + t * inputDims * wRank;
+      const float* mean = lrParams->mean + t * inputDims;
+      const float* stdDev = lrParams->stdDev + t * inputDims;
+      for (unsigned r = 0; r < wRank; r++) {
+        float bias = 0.0f;
+        for (unsigned d = 0; d < inputDims; d++) {
+          W1[d * wRank + r] = lrParams->W1[r * inputDims + d] / stdDev[d];
+          bias -= W1[d * wRank + r] * mean[d];
+        }
+        fusedParams->B1[t * wRank + r] = bias;
+      }
+    }
+  }
+  else {
+    for (unsigned r = 0; r < wRank; r++)
+      for (unsigned d = 0; d < inputDims; d++)
+        fusedParams->W1[d * wRank + r] = lrParams->W1[r * inputDims + d];
+  }
+  return 0;
+}
+
+int fastgrnn_lr_fused(float* const hiddenState, unsigned hiddenDims,
+  const float* const input, unsigned inputDims, unsigned steps,
+  const void* params, void* buffers, int backward, int normalize) {
+
+  const FastGRNN_LR_Fused_Params* tparams = (const FastGRNN_LR_Fused_Params*)params;
+  FastGRNN_LR_Buffers* tbuffers = (FastGRNN_LR_Buffers*)buffers;
+
+  if (tbuffers->tempLRW == 0) return ERR_TEMPLRW_NOT_INIT;
+  if (tbuffers->tempLRU == 0) return ERR_TEMPLRU_NOT_INIT;
+  if (tparams->W1 == 0 || tparams->U1 == 0 || tparams->W2U2 == 0 ||
+    (normalize && tparams->B1 == 0))
+    return ERR_FUSEDPARAMS_NOT_INIT;
+
+  const FastGRNN_LR_Params* lr = tparams->lr;
+  for (unsigned t = 0; t < steps; t++) {
+    unsigned offset = backward ? steps - 1 - t : t;
+
+    // Low-rank projections of the input, normalized through W1, and of the previous hidden state
+    if (normalize)
+      lowRankProjection(tparams->W1 + offset * inputDims * lr->wRank, input + offset * inputDims,
+        inputDims, lr->wRank, tparams->B1 + offset * lr->wRank, tbuffers->tempLRW);
+    else
+      lowRankProjection(tparams->W1, input + offset * inputDims,
+        inputDims, lr->wRank, 0, tbuffers->tempLRW);
+    lowRankProjection(tparams->U1, hiddenState, hiddenDims, lr->uRank, 0, tbuffers->tempLRU);
+
+    // The projections are done with hiddenState, so it is updated in place
+    unsigned first = 0;
+    for (; first + FASTGRNN_LANES <= hiddenDims; first += FASTGRNN_LANES)
+      fusedGateBlock(hiddenState, hiddenDims, first, FASTGRNN_LANES, tparams,
+        tbuffers->tempLRW, tbuffers->tempLRU);
+    if (first < hiddenDims)
+      fusedGateBlock(hiddenState, hiddenDims, first, hiddenDims - first, tparams,
+        tbuffers->tempLRW, tbuffers->tempLRU);
+  }
+  return 0;
+}
+
 int fastgrnn(float* const hiddenState, unsigned hiddenDims,
   const float* const input, unsigned inputDims, unsigned steps,
   const void* params, void* buffers, int backward, int normalize) {
@@ -85,6 +85,22 @@ int main() {
     .normFeatures = normFeatures
   };
 
+  float fusedW1[INPUT_DIMS * USPS_WRANK * TIME_STEPS];
+  float fusedB1[USPS_WRANK * TIME_STEPS];
+  float fusedU1[HIDDEN_DIMS * USPS_URANK];
+  float fusedW2U2[(USPS_WRANK + USPS_URANK) * HIDDEN_DIMS];
+  FastGRNN_LR_Fused_Params USPS_fused_params = {
+    .W1   = fusedW1,
+    .B1   = fusedB1,
+    .U1   = fusedU1,
+    .W2U2 = fusedW2U2
+  };
+  fastgrnn_lr_fuse_params(&USPS_params, HIDDEN_DIMS, INPUT_DIMS, TIME_STEPS, 1, &USPS_fused_params);
+
+  float fusedHiddenState[HIDDEN_DIMS] = { 0.0 };
+  float fusedClassScores[NUM_CLASSES] = { 0.0 };
+  int errors = 0;
+
   for (unsigned n = 0; n < NUM_EXAMPLES; ++n) {
     memset(hiddenState, 0, sizeof(float) * HIDDEN_DIMS);
     fastgrnn_lr(hiddenState, HIDDEN_DIMS, 
@@ -94,5 +110,22 @@ int main() {
 
     printf("Example: %d  Predicted class: %d  Actual class:  %d\n",
       n, argmax(classScores, NUM_CLASSES), labels[n]);
+
+    // The fused kernel should agree up to its approximations
+    memset(fusedHiddenState, 0, sizeof(float) * HIDDEN_DIMS);
+    fastgrnn_lr_fused(fusedHiddenState, HIDDEN_DIMS,
+      input + n * INPUT_DIMS * TIME_STEPS, INPUT_DIMS, TIME_STEPS,
+      &USPS_fused_params, &buffers, 0, 1);
+    FC(FC_weights, FCbias, fusedHiddenState, HIDDEN_DIMS, fusedClassScores, NUM_CLASSES);
+
+    float maxDiff = 0.0f;
+    for (unsigned i = 0; i < HIDDEN_DIMS; ++i)
+      maxDiff = max(maxDiff, fabsf(fusedHiddenState[i] - hiddenState[i]));
+    if (maxDiff > 1e-5f || argmax(fusedClassScores, NUM_CLASSES) != argmax(classScores, NUM_CLASSES)) {
+      printf("Example: %d  Fused kernel differs by %e\n", n, maxDiff);
+      errors++;
+    }
   }
+  printf("Fused kernel: %s\n", errors ? "Failed" : "Passed");
+  return errors ? 1 : 0;
 }
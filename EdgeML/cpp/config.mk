@@ -2,7 +2,7 @@
 # Licensed under the MIT license.
 
 DEBUGGING_FLAGS = #-DLIGHT_LOGGER #-DLOGGER #-DTIMER -DCONCISE #-DSTDERR_ONSCREEN #-DLIGHT_LOGGER -DVERBOSE #-DDUMP #-DVERIFY
-CONFIG_FLAGS = -DSINGLE #-DXML -DZERO_BASED_IO 
+CONFIG_FLAGS = -DSINGLE #-DXML -DZERO_BASED_IO -DNUMA -DHUGEPAGES -DSPARSE_INDEX_32
 
 MKL_EIGEN_FLAGS = -DEIGEN_USE_BLAS -DMKL_ILP64
 
@@ -0,0 +1,109 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "Bonsai.h"
+#include "cascade.h"
+
+using namespace EdgeML;
+
+using namespace EdgeML::Bonsai;
+
+static void exitWithHelp()
+{
+  LOG_INFO("./BonsaiCascade [Options]\n");
+  LOG_INFO("Scores with a small model and forwards only the points whose top-1/top-2 score margin is below a threshold to a large model.");
+  LOG_INFO("-S    : [Required] Model directory of the small model, with loadableModel and loadableMeanStd as written by Bonsai training.");
+  LOG_INFO("-L    : [Required] Model directory of the large model, with the same classes and dimension.");
+  LOG_INFO("-f    : [Required] Input format. Takes two values [0 and 1]. 0 is for libsvmFormat(default), 1 is for tab/space separated input.");
+  LOG_INFO("-C    : [Required unless -t is given] Held-out file to calibrate the threshold on.");
+  LOG_INFO("-c    : [Required with -C] Number of points in the calibration file.");
+  LOG_INFO("-I    : [Required] Test file.");
+  LOG_INFO("-N    : [Required] Number of points in the test file.");
+  LOG_INFO("-a    : Largest loss of accuracy against the large model that calibration may trade for speed. Default: 0.005.");
+  LOG_INFO("-t    : Threshold on the margin, instead of calibrating one.");
+  LOG_INFO("-b    : Batch size. Default: 1024.");
+  exit(1);
+}
+
+static CascadeStageFunction stageOf(const BonsaiPredictor& predictor)
+{
+  return [&predictor](MatrixXuf& Yscores, const SparseMatrixuf& X) {
+    predictor.scoreBatch(Yscores, X);
+  };
+}
+
+int main(int argc, char **argv)
+{
+#ifdef LINUX
+  trapfpe();
+  struct sigaction sa;
+  sigemptyset (&sa.sa_mask);
+  sa.sa_flags = SA_SIGINFO;
+  sa.sa_sigaction = fpehandler;
+  sigaction (SIGFPE, &sa, NULL);
+#endif
+  assert (sizeof(MKL_INT) == sizeof(Eigen::Index));
+
+  std::string smallModelDir, largeModelDir, calibrationFile, testFile;
+  DataFormat dataformatType = libsvmFormat;
+  dataCount_t ncalibration = 0, ntest = 0, batchSize = 1024;
+  FP_TYPE maxLoss = 0.005;
+  FP_TYPE threshold = -1;
+  bool isFormatSet = false;
+
+  for (int i = 1; i < argc; ++i) {
+    if (i % 2 == 1) {
+      if (argv[i][0] != '-' || i + 1 == argc) exitWithHelp();
+      continue;
+    }
+    switch (argv[i - 1][1]) {
+      case 'S': smallModelDir = argv[i]; break;
+      case 'L': largeModelDir = argv[i]; break;
+      case 'f':
+        if (argv[i][0] == '0') dataformatType = libsvmFormat;
+        else if (argv[i][0] == '1') dataformatType = interfaceIngestFormat;
+        else exitWithHelp();
+        isFormatSet = true;
+        break;
+      case 'C': calibrationFile = argv[i]; break;
+      case 'c': ncalibration = strtol(argv[i], NULL, 0); break;
+      case 'I': testFile = argv[i]; break;
+      case 'N': ntest = strtol(argv[i], NULL, 0); break;
+      case 'a': maxLoss = (FP_TYPE)strtod(argv[i], NULL); break;
+      case 't': threshold = (FP_TYPE)strtod(argv[i], NULL); break;
+      case 'b': batchSize = strtol(argv[i], NULL, 0); break;
+      default: exitWithHelp();
+    }
+  }
+  if (smallModelDir.empty() || largeModelDir.empty() || !isFormatSet || testFile.empty() || ntest == 0 || batchSize <= 0)
+    exitWithHelp();
+  if (threshold < 0 && (calibrationFile.empty() || ncalibration == 0))
+    exitWithHelp();
+
+  BonsaiPredictor small(smallModelDir + "/loadableModel", smallModelDir + "/loadableMeanStd");
+  BonsaiPredictor large(largeModelDir + "/loadableModel", largeModelDir + "/loadableMeanStd");
+  const BonsaiModel::BonsaiHyperParams& hyperParams = large.getHyperParams();
+  if (small.getHyperParams().numClasses != hyperParams.numClasses
+      || small.getHyperParams().dataDimension != hyperParams.dataDimension) {
+    LOG_ERROR("The small and the large model must have the same number of classes and the same dimension");
+    exit(1);
+  }
+
+  // Binary models score the second class 0, so the margin is the magnitude of the score
+  ModelCascade cascade(stageOf(small), stageOf(large), hyperParams.numClasses);
+  if (threshold >= 0)
+    cascade.setThreshold(threshold);
+  else {
+    Data calibrationData(FileIngest,
+      DataFormatParams{ ncalibration, 0, 0, hyperParams.numClasses, hyperParams.dataDimension });
+    calibrationData.loadDataFromFile(dataformatType, calibrationFile, "", "");
+    cascade.calibrate(calibrationData.Xtrain, calibrationData.Ytrain, multiclass, maxLoss, batchSize);
+  }
+
+  Data testData(FileIngest,
+    DataFormatParams{ 0, 0, ntest, hyperParams.numClasses, hyperParams.dataDimension });
+  testData.loadDataFromFile(dataformatType, "", "", testFile);
+  cascade.test(testData.Xtest, testData.Ytest, multiclass, batchSize);
+
+  return 0;
+}
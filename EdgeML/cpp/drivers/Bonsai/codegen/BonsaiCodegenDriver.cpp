@@ -0,0 +1,53 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "Bonsai.h"
+
+using namespace EdgeML;
+
+using namespace EdgeML::Bonsai;
+
+static void exitWithHelp()
+{
+  LOG_INFO("./BonsaiCodegen [Options]\n");
+  LOG_INFO("Compiles a trained model into a self-contained C source with its dimensions and parameters as constants.");
+  LOG_INFO("-M    : [Required] Model directory with loadableModel and loadableMeanStd, as written by Bonsai training.");
+  LOG_INFO("-O    : [Required] C file to write.");
+  LOG_INFO("-x    : Prefix of the generated names. Default: bonsai.");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+#ifdef LINUX
+  trapfpe();
+  struct sigaction sa;
+  sigemptyset (&sa.sa_mask);
+  sa.sa_flags = SA_SIGINFO;
+  sa.sa_sigaction = fpehandler;
+  sigaction (SIGFPE, &sa, NULL);
+#endif
+  assert (sizeof(MKL_INT) == sizeof(Eigen::Index));
+
+  std::string modelDir, outFile, prefix = "bonsai";
+
+  for (int i = 1; i < argc; ++i) {
+    if (i % 2 == 1) {
+      if (argv[i][0] != '-' || i + 1 == argc) exitWithHelp();
+      continue;
+    }
+    switch (argv[i - 1][1]) {
+      case 'M': modelDir = argv[i]; break;
+      case 'O': outFile = argv[i]; break;
+      case 'x': prefix = argv[i]; break;
+      default: exitWithHelp();
+    }
+  }
+  if (modelDir.empty() || outFile.empty() || prefix.empty())
+    exitWithHelp();
+
+  BonsaiPredictor predictor(modelDir + "/loadableModel", modelDir + "/loadableMeanStd");
+  predictor.generateC(outFile, prefix);
+
+  return 0;
+}
@@ -0,0 +1,171 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "Bonsai.h"
+#include "metrics.h"
+#include "model_registry.h"
+#include "scoring_server.h"
+
+#ifdef LINUX
+#include <pthread.h>
+#endif
+
+using namespace EdgeML;
+using namespace EdgeML::Bonsai;
+
+static ScoringServer* runningServer = NULL;
+
+static void stopHandler(int)
+{
+  if (runningServer)
+    runningServer->stop();
+}
+
+static void exitWithHelp()
+{
+  LOG_INFO("./BonsaiServer [Options]\n");
+  LOG_INFO("Serving options:");
+  LOG_INFO("-M    : [Required] Directory of the Model (loadableModel and loadableMeanStd).");
+  LOG_INFO("-S    : [Required] Path of the unix domain socket to listen on (or connect to with -L).");
+  LOG_INFO("-b    : Largest micro-batch scored in one call. Default: 64.");
+  LOG_INFO("-t    : Longest the oldest request waits for its micro-batch to fill, in microseconds. Default: 500.");
+  LOG_INFO("-w    : Number of worker threads scoring micro-batches. Default: 1.");
+  LOG_INFO("-s    : Seconds between statistics log lines, 0 to disable. Default: 10.");
+  LOG_INFO("Send SIGHUP to reload the model and its mean and stdDev from the same directory without pausing scoring.");
+  LOG_INFO("Load generation options (replay a labelled file against a running server):");
+  LOG_INFO("-L    : Test file to replay, in libsvm format.");
+  LOG_INFO("-N    : Number of points in the test file.");
+  LOG_INFO("-c    : Number of concurrent client connections. Default: 1.");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+#ifdef LINUX
+  trapfpe();
+  struct sigaction sa;
+  sigemptyset (&sa.sa_mask);
+  sa.sa_flags = SA_SIGINFO;
+  sa.sa_sigaction = fpehandler;
+  sigaction (SIGFPE, &sa, NULL);
+
+  // Block SIGHUP before any thread is created so that every thread inherits the mask
+  sigset_t reloadSignals;
+  sigemptyset(&reloadSignals);
+  sigaddset(&reloadSignals, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &reloadSignals, NULL);
+#endif
+  assert (sizeof(MKL_INT) == sizeof(Eigen::Index));
+
+  std::string modelDir, loadFile;
+  ScoringServerParams params;
+  dataCount_t numTest = 0;
+  int concurrency = 1;
+
+  for (int i = 1; i < argc; ++i) {
+    if (i % 2 == 1) {
+      if (argv[i][0] != '-' || i + 1 == argc) exitWithHelp();
+      continue;
+    }
+    switch (argv[i - 1][1]) {
+      case 'M': modelDir = argv[i]; break;
+      case 'S': params.socketPath = argv[i]; break;
+      case 'b': params.maxBatchSize = strtol(argv[i], NULL, 0); break;
+      case 't': params.maxQueueDelayMicros = strtol(argv[i], NULL, 0); break;
+      case 'w': params.numWorkers = (int)strtol(argv[i], NULL, 0); break;
+      case 's': params.statsIntervalSeconds = (int)strtol(argv[i], NULL, 0); break;
+      case 'L': loadFile = argv[i]; break;
+      case 'N': numTest = strtol(argv[i], NULL, 0); break;
+      case 'c': concurrency = (int)strtol(argv[i], NULL, 0); break;
+      default: exitWithHelp();
+    }
+  }
+  if (modelDir.empty() || params.socketPath.empty()) exitWithHelp();
+
+  if (!loadFile.empty()) {
+    if (numTest == 0) exitWithHelp();
+    BonsaiPredictor predictor(modelDir + "/loadableModel", modelDir + "/loadableMeanStd");
+    const BonsaiModel::BonsaiHyperParams& hyperParams = predictor.getHyperParams();
+    Data testData(FileIngest,
+      DataFormatParams{ 0, 0, numTest, hyperParams.numClasses, hyperParams.dataDimension });
+    testData.loadDataFromFile(libsvmFormat, "", "", loadFile);
+
+    MatrixXuf Yscores = MatrixXuf::Zero(hyperParams.numClasses, testData.Xtest.cols());
+    runScoringLoad(params.socketPath, testData.Xtest, concurrency, Yscores);
+
+    ResultStruct res = evaluate(Yscores, testData.Ytest, multiclass);
+    LOG_INFO("Accuracy of served scores: " + std::to_string(res.accuracy));
+    return 0;
+  }
+
+  // Reads the model and its mean and stdDev. Runs off the serving path,
+  // so a reload never stalls the workers. A truncated or corrupt model file
+  // is rejected here rather than asserting in the running server.
+  auto loadPredictor = [](const std::string& dir) -> BonsaiPredictor* {
+    std::vector<char> model;
+    if (!BonsaiModel::readModelFile(dir + "/loadableModel", model, true)
+      || !std::ifstream(dir + "/loadableMeanStd").good())
+      return NULL;
+    BonsaiPredictor* predictor = new BonsaiPredictor(model.size(), model.data(), true);
+    predictor->importMeanStd(dir + "/loadableMeanStd");
+    return predictor;
+  };
+
+  // A reloaded model must keep the request and response shapes the clients rely on
+  auto validatePredictor = [&params](const BonsaiPredictor& predictor) {
+    if (params.dimension != 0
+      && (predictor.getHyperParams().dataDimension != params.dimension
+        || predictor.getHyperParams().numClasses != params.numLabels)) {
+      LOG_WARNING("Reloaded model changes the number of features or classes");
+      return false;
+    }
+    return predictor.isModelValid();
+  };
+
+  params.dimension = 0;
+  ModelRegistry<BonsaiPredictor> registry(loadPredictor, validatePredictor);
+  if (!registry.load(modelDir)) exitWithHelp();
+
+  {
+    ModelRegistry<BonsaiPredictor>::Snapshot predictor = registry.acquire();
+    params.dimension = predictor->getHyperParams().dataDimension;
+    params.numLabels = predictor->getHyperParams().numClasses;
+  }
+
+  ScoringServer server(params,
+    [&registry](MatrixXuf& Yscores, SparseMatrixuf& X) {
+      // Pins the live model for this micro-batch; a concurrent reload does not affect it
+      ModelRegistry<BonsaiPredictor>::Snapshot predictor = registry.acquire();
+      predictor->scoreBatch(Yscores, X);
+    });
+
+#ifdef LINUX
+  runningServer = &server;
+  signal(SIGINT, stopHandler);
+  signal(SIGTERM, stopHandler);
+
+  // SIGHUP was blocked before any thread started and is picked up here with sigwait,
+  // so the reload runs on an ordinary thread instead of in signal context.
+  std::atomic<bool> isServing(true);
+  std::thread reloader([&]() {
+    int signalNumber;
+    while (sigwait(&reloadSignals, &signalNumber) == 0 && isServing) {
+      registry.load(modelDir);
+      // Frees the previous version once the micro-batches still scoring on it are done
+      while (registry.reclaim() > 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+#endif
+
+  server.serve();
+  runningServer = NULL;
+
+#ifdef LINUX
+  isServing = false;
+  pthread_kill(reloader.native_handle(), SIGHUP);
+  reloader.join();
+#endif
+
+  return 0;
+}
@@ -0,0 +1,364 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "ProtoNN.h"
+#include "ProtoNNFunctions.h"
+#include "numa_utils.h"
+#include "hugepages.h"
+#include <chrono>
+#include <random>
+
+#ifdef LINUX
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace EdgeML;
+using namespace EdgeML::ProtoNN;
+
+static void exitWithHelp()
+{
+  LOG_INFO("./ProtoNNBenchmark [Options]\n");
+  LOG_INFO("Scores a labelled test file with a trained model in the configurations of one benchmark and reports throughput.");
+  LOG_INFO("-M    : [Required] Model file written by ProtoNNTrain.");
+  LOG_INFO("-n    : [Required for min-max normalized models] Normalization parameters file (minMaxParams).");
+  LOG_INFO("-I    : [Required] Test file, in libsvm format.");
+  LOG_INFO("-e    : [Required] Number of points in the test file.");
+  LOG_INFO("-b    : Batch size. Default: 1024.");
+  LOG_INFO("-r    : Number of passes over the test file per configuration. Default: 5.");
+  LOG_INFO("-k    : Benchmark to run. Default: numa.");
+  LOG_INFO("          numa: default page placement vs. per-node partitions with per-node model replicas.");
+  LOG_INFO("                Reports per-node streamed bandwidth, page placement of the data and numastat deltas.");
+  LOG_INFO("          hugepages: small vs. transparent vs. reserved huge pages for the data, the WX cache and the read buffers.");
+  LOG_INFO("                Reports throughput and dTLB read misses of batch scoring and of training gradient steps on random batches.");
+  exit(1);
+}
+
+struct BenchmarkSetup
+{
+  std::string modelFile, normParamFile;
+  dataCount_t batchSize;
+  int repeats;
+};
+
+static double secondsSince(const std::chrono::steady_clock::time_point& start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static std::string pagesToString(const std::vector<size_t>& pages)
+{
+  std::string out;
+  for (size_t n = 0; n < pages.size(); ++n)
+    out += (n ? ", node " : "node ") + std::to_string(NumaTopology::host().nodeIds[n]) + ": " + std::to_string(pages[n]);
+  return out;
+}
+
+static void loadTestData(
+  Data& testData,
+  const std::string& testFile,
+  const ProtoNNPredictor& predictor)
+{
+  testData.loadDataFromFile(libsvmFormat, "", "", testFile);
+  testData.finalizeData();
+  predictor.normalizeBatch(testData.Xtest);
+}
+
+static size_t bytesOfColumns(const SparseMatrixuf& X, const Eigen::Index begin, const Eigen::Index end)
+{
+  return (X.outerIndexPtr()[end] - X.outerIndexPtr()[begin]) * (sizeof(FP_TYPE) + sizeof(sparseIndex_t));
+}
+
+//
+// Compares scoring with the pages wherever the loading thread put them against
+// scoring one partition per node with a model replica on each node.
+//
+static void benchmarkNuma(
+  const BenchmarkSetup& setup,
+  const ProtoNNPredictor& predictor,
+  const SparseMatrixuf& X)
+{
+  const ProtoNNModel::ProtoNNHyperParams& hyperParams = predictor.getHyperParams();
+  const NumaTopology& topology = NumaTopology::host();
+  const dataCount_t n = X.cols();
+  const size_t paramBytes = sizeof(FP_TYPE) * (hyperParams.d * hyperParams.D + hyperParams.d * hyperParams.m + hyperParams.l * hyperParams.m);
+  const size_t dataBytes = bytesOfColumns(X, 0, n);
+
+  LOG_INFO("Test data: " + std::to_string(dataBytes >> 20) + " MiB, resident pages per node: "
+    + pagesToString(residentPagesPerNode(X.valuePtr(), sizeof(FP_TYPE) * X.nonZeros())));
+
+  // Default placement: one scoring thread, MKL threads wherever the OS puts them
+  MatrixXuf baseline = MatrixXuf::Zero(hyperParams.l, n);
+  std::vector<NumaNodeStats> before = readNumaStats();
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int r = 0; r < setup.repeats; ++r)
+    for (dataCount_t begin = 0; begin < n; begin += setup.batchSize) {
+      const dataCount_t curBatchSize = std::min(setup.batchSize, n - begin);
+      MatrixXuf Yscores = MatrixXuf::Zero(hyperParams.l, curBatchSize);
+      predictor.scoreBatch(Yscores, X.middleCols(begin, curBatchSize));
+      baseline.middleCols(begin, curBatchSize) = Yscores;
+    }
+  double seconds = secondsSince(start);
+  LOG_INFO("default placement: " + std::to_string(seconds / setup.repeats) + " s/pass, "
+    + std::to_string(n * setup.repeats / seconds) + " points/s");
+  LOG_INFO("  numastat: " + numaStatsDelta(before, readNumaStats()));
+
+  // Partitioned: replicas are built by node-local threads, X partitions are copied to node-local pages
+  NumaReplicated<ProtoNNPredictor> replicas([&setup]() {
+    ProtoNNPredictor *replica = new ProtoNNPredictor(setup.modelFile);
+    if (replica->getHyperParams().normalizationType == minMax)
+      replica->importMinMax(setup.normParamFile);
+    return replica;
+  });
+
+  MatrixXuf partitioned = MatrixXuf::Zero(hyperParams.l, n);
+  const std::vector<Eigen::Index> bounds = nodePartition(n);
+  std::vector<double> nodeSeconds(topology.numNodes(), 0.0);
+  before = readNumaStats();
+  start = std::chrono::steady_clock::now();
+  for (int r = 0; r < setup.repeats; ++r)
+    numaPartitionedScore(X, partitioned, setup.batchSize,
+      [&](const int node, MatrixXuf& Yscores, const SparseMatrixuf& Xblock) {
+        std::chrono::steady_clock::time_point nodeStart = std::chrono::steady_clock::now();
+        replicas.onNode(node).scoreBatch(Yscores, Xblock);
+        nodeSeconds[node] += secondsSince(nodeStart);
+      });
+  seconds = secondsSince(start);
+  LOG_INFO("NUMA partitioned over " + std::to_string(topology.numNodes()) + " node(s): "
+    + std::to_string(seconds / setup.repeats) + " s/pass, " + std::to_string(n * setup.repeats / seconds) + " points/s");
+
+  // Bytes each node streamed from its own memory: its slice of X plus one read of the parameters per batch
+  for (int node = 0; node < topology.numNodes(); ++node) {
+    const Eigen::Index numPoints = bounds[node + 1] - bounds[node];
+    const size_t numBatches = (numPoints + setup.batchSize - 1) / setup.batchSize;
+    const double bytes = (double)setup.repeats * (bytesOfColumns(X, bounds[node], bounds[node + 1]) + numBatches * paramBytes);
+    LOG_INFO("  node " + std::to_string(topology.nodeIds[node]) + ": " + std::to_string(numPoints) + " points, "
+      + std::to_string(bytes / nodeSeconds[node] / 1e9) + " GB/s streamed while scoring");
+  }
+  LOG_INFO("  numastat: " + numaStatsDelta(before, readNumaStats()));
+
+  LOG_INFO("Max score difference between configurations: " + std::to_string((baseline - partitioned).cwiseAbs().maxCoeff()));
+}
+
+//
+// Data-TLB read misses in user space of this process, counting threads created after start().
+// perf_event_open may be unavailable (no PMU in a VM, or perf_event_paranoid); then count() is -1.
+//
+class DtlbMissCounter
+{
+  int fd;
+
+public:
+  DtlbMissCounter()
+    : fd(-1)
+  {
+#ifdef LINUX
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB
+      | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+      | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+  }
+
+  ~DtlbMissCounter()
+  {
+#ifdef LINUX
+    if (fd >= 0)
+      close(fd);
+#endif
+  }
+
+  void start()
+  {
+#ifdef LINUX
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  }
+
+  int64_t count()
+  {
+    int64_t misses = -1;
+#ifdef LINUX
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+        misses = -1;
+    }
+#endif
+    return misses;
+  }
+};
+
+static std::string throughputToString(
+  const double seconds,
+  const int64_t misses,
+  const dataCount_t points)
+{
+  return std::to_string(points / seconds) + " points/s, "
+    + (misses < 0 ? std::string("dTLB misses n/a") : std::to_string((double)misses / points) + " dTLB misses/point");
+}
+
+//
+// Loads the test data once per page policy, so that the read buffers, X and the WX cache are
+// all allocated under it, and runs the two access patterns that miss the TLB the most:
+// scoring batches in random order, and the W and Z phase gradients of training on random
+// batches (the test data stands in for the training data).
+//
+static void benchmarkHugePages(
+  const BenchmarkSetup& setup,
+  const ProtoNNPredictor& predictor,
+  const std::string& testFile,
+  const dataCount_t ntest)
+{
+  const ProtoNNModel::ProtoNNHyperParams& hyperParams = predictor.getHyperParams();
+  ProtoNNModel model(setup.modelFile);
+
+#ifdef LINUX
+  std::ifstream thpSetting("/sys/kernel/mm/transparent_hugepage/enabled");
+  std::string setting;
+  std::getline(thpSetting, setting);
+  LOG_INFO("transparent_hugepage/enabled: " + (setting.empty() ? std::string("n/a") : setting));
+#endif
+
+  DtlbMissCounter counter;
+  const HugePagePolicy policies[] = { smallPages, transparentHugePages, reservedHugePages };
+  MatrixXuf reference;
+
+  for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); ++p) {
+    setHugePagePolicy(policies[p]);
+    const size_t hugeBytesBefore = transparentHugePageBytes();
+
+    Data testData(FileIngest, DataFormatParams{ 0, 0, ntest, hyperParams.l, hyperParams.D });
+    loadTestData(testData, testFile, predictor);
+    const SparseMatrixuf& X = testData.Xtest;
+    const LabelMatType Y(testData.Ytest);
+    const dataCount_t n = X.cols();
+
+    MatrixXuf WX(model.params.W.rows(), n);
+    adviseHugePages(WX);
+    mm(WX, model.params.W, CblasNoTrans, X, CblasNoTrans, 1.0, 0.0L);
+
+    LOG_INFO(hugePagePolicyName(policies[p]) + ": " + std::to_string(bytesOfColumns(X, 0, n) >> 20) + " MiB of data, "
+      + std::to_string((sizeof(FP_TYPE) * WX.size()) >> 20) + " MiB of WX, "
+      + std::to_string(((int64_t)transparentHugePageBytes() - (int64_t)hugeBytesBefore) >> 20) + " MiB more in transparent huge pages");
+
+    std::vector<dataCount_t> batchBegins;
+    for (dataCount_t begin = 0; begin < n; begin += setup.batchSize)
+      batchBegins.push_back(begin);
+    std::shuffle(batchBegins.begin(), batchBegins.end(), std::mt19937(42));
+
+    MatrixXuf scores = MatrixXuf::Zero(hyperParams.l, n);
+    counter.start();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int r = 0; r < setup.repeats; ++r)
+      for (size_t b = 0; b < batchBegins.size(); ++b) {
+        const dataCount_t curBatchSize = std::min(setup.batchSize, n - batchBegins[b]);
+        MatrixXuf Yscores = MatrixXuf::Zero(hyperParams.l, curBatchSize);
+        predictor.scoreBatch(Yscores, X.middleCols(batchBegins[b], curBatchSize));
+        scores.middleCols(batchBegins[b], curBatchSize) = Yscores;
+      }
+    double seconds = secondsSince(start);
+    LOG_INFO("  batch scoring: " + throughputToString(seconds, counter.count(), n * setup.repeats));
+
+    MatrixXuf gradW, gradZ;
+    counter.start();
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < setup.repeats; ++r)
+      for (size_t b = 0; b < batchBegins.size(); ++b) {
+        const Eigen::Index begin = batchBegins[b];
+        const Eigen::Index end = std::min(begin + (Eigen::Index)setup.batchSize, (Eigen::Index)n);
+        Workspace::Scope scope;
+
+        // W phase: gathers the batch from X
+        MatrixXuf& WXbatch = scope.matrix(WX.rows(), end - begin);
+        WXbatch.setZero();
+        mm(WXbatch, model.params.W, CblasNoTrans, X, CblasNoTrans, 1.0, 0.0L, begin, end);
+        MatrixXuf& D = scope.matrix(end - begin, model.params.B.cols());
+        gaussianKernelInto(D, model.params.B, WXbatch, hyperParams.gamma, 0, end - begin);
+        gradL_WInto(gradW, model.params.B, Y, model.params.Z, model.params.W, X, D, hyperParams.gamma, begin, end);
+
+        // Z phase: reads the batch from the WX cache
+        gaussianKernelInto(D, model.params.B, WX, hyperParams.gamma, begin, end);
+        gradL_ZInto(gradZ, model.params.Z, Y, D, begin, end);
+      }
+    seconds = secondsSince(start);
+    LOG_INFO("  training gradient steps: " + throughputToString(seconds, counter.count(), n * setup.repeats));
+
+    if (p == 0)
+      reference = scores;
+    else
+      LOG_INFO("  max score difference to " + hugePagePolicyName(policies[0]) + ": "
+        + std::to_string((reference - scores).cwiseAbs().maxCoeff()));
+  }
+}
+
+int main(int argc, char **argv)
+{
+#ifdef LINUX
+  trapfpe();
+  struct sigaction sa;
+  sigemptyset (&sa.sa_mask);
+  sa.sa_flags = SA_SIGINFO;
+  sa.sa_sigaction = fpehandler;
+  sigaction (SIGFPE, &sa, NULL);
+#endif
+
+  assert(sizeof(MKL_INT) == sizeof(Eigen::Index) && "MKL BLAS routines are called directly on data of an Eigen matrix. Hence, the index sizes should match.");
+
+  BenchmarkSetup setup;
+  setup.batchSize = 1024;
+  setup.repeats = 5;
+  std::string testFile, benchmark = "numa";
+  dataCount_t ntest = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    if (i % 2 == 1) {
+      if (argv[i][0] != '-' || i + 1 == argc) exitWithHelp();
+      continue;
+    }
+    switch (argv[i - 1][1]) {
+      case 'M': setup.modelFile = argv[i]; break;
+      case 'n': setup.normParamFile = argv[i]; break;
+      case 'I': testFile = argv[i]; break;
+      case 'e': ntest = strtol(argv[i], NULL, 0); break;
+      case 'b': setup.batchSize = strtol(argv[i], NULL, 0); break;
+      case 'r': setup.repeats = (int)strtol(argv[i], NULL, 0); break;
+      case 'k': benchmark = argv[i]; break;
+      default: exitWithHelp();
+    }
+  }
+  if (setup.modelFile.empty() || testFile.empty() || ntest == 0 || setup.batchSize == 0 || setup.repeats <= 0)
+    exitWithHelp();
+
+  ProtoNNPredictor predictor(setup.modelFile);
+  const ProtoNNModel::ProtoNNHyperParams& hyperParams = predictor.getHyperParams();
+  if (hyperParams.normalizationType == minMax) {
+    if (setup.normParamFile.empty()) exitWithHelp();
+    predictor.importMinMax(setup.normParamFile);
+  }
+
+  if (benchmark == "numa") {
+    Data testData(FileIngest, DataFormatParams{ 0, 0, ntest, hyperParams.l, hyperParams.D });
+    loadTestData(testData, testFile, predictor);
+    benchmarkNuma(setup, predictor, testData.Xtest);
+  }
+  else if (benchmark == "hugepages")
+    benchmarkHugePages(setup, predictor, testFile, ntest);
+  else
+    exitWithHelp();
+
+  return 0;
+}
@@ -0,0 +1,118 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "ProtoNN.h"
+#include "cascade.h"
+#include <memory>
+
+using namespace EdgeML;
+using namespace EdgeML::ProtoNN;
+
+static void exitWithHelp()
+{
+  LOG_INFO("./ProtoNNCascade [Options]\n");
+  LOG_INFO("Scores with a small model and forwards only the points whose top-1/top-2 score margin is below a threshold to a large model.");
+  LOG_INFO("-S    : [Required] Model file of the small model, written by ProtoNNTrain.");
+  LOG_INFO("-s    : [Required for a min-max normalized small model] Normalization parameters file of the small model (minMaxParams).");
+  LOG_INFO("-L    : [Required] Model file of the large model, with the same labels and dimension.");
+  LOG_INFO("-l    : [Required for a min-max normalized large model] Normalization parameters file of the large model (minMaxParams).");
+  LOG_INFO("-C    : [Required unless -t is given] Held-out file to calibrate the threshold on, in libsvm format.");
+  LOG_INFO("-c    : [Required with -C] Number of points in the calibration file.");
+  LOG_INFO("-I    : [Required] Test file, in libsvm format.");
+  LOG_INFO("-e    : [Required] Number of points in the test file.");
+  LOG_INFO("-a    : Largest loss of accuracy (prec@1 for multilabel problems) against the large model that calibration may trade for speed. Default: 0.005.");
+  LOG_INFO("-t    : Threshold on the margin, instead of calibrating one.");
+  LOG_INFO("-b    : Batch size. Default: 1024.");
+  exit(1);
+}
+
+static std::unique_ptr<ProtoNNPredictor> loadPredictor(
+  const std::string& modelFile,
+  const std::string& normParamFile)
+{
+  std::unique_ptr<ProtoNNPredictor> predictor(new ProtoNNPredictor(modelFile));
+  if (predictor->getHyperParams().normalizationType == minMax) {
+    if (normParamFile.empty()) exitWithHelp();
+    predictor->importMinMax(normParamFile);
+  }
+  return predictor;
+}
+
+static CascadeStageFunction stageOf(const ProtoNNPredictor& predictor)
+{
+  return [&predictor](MatrixXuf& Yscores, const SparseMatrixuf& X) {
+    SparseMatrixuf normalizedX(X);
+    predictor.normalizeBatch(normalizedX);
+    predictor.scoreBatch(Yscores, normalizedX);
+  };
+}
+
+int main(int argc, char **argv)
+{
+#ifdef LINUX
+  trapfpe();
+  struct sigaction sa;
+  sigemptyset (&sa.sa_mask);
+  sa.sa_flags = SA_SIGINFO;
+  sa.sa_sigaction = fpehandler;
+  sigaction (SIGFPE, &sa, NULL);
+#endif
+
+  assert(sizeof(MKL_INT) == sizeof(Eigen::Index) && "MKL BLAS routines are called directly on data of an Eigen matrix. Hence, the index sizes should match.");
+
+  std::string smallModelFile, smallNormParamFile, largeModelFile, largeNormParamFile;
+  std::string calibrationFile, testFile;
+  dataCount_t ncalibration = 0, ntest = 0, batchSize = 1024;
+  FP_TYPE maxLoss = 0.005;
+  FP_TYPE threshold = -1;
+
+  for (int i = 1; i < argc; ++i) {
+    if (i % 2 == 1) {
+      if (argv[i][0] != '-' || i + 1 == argc) exitWithHelp();
+      continue;
+    }
+    switch (argv[i - 1][1]) {
+      case 'S': smallModelFile = argv[i]; break;
+      case 's': smallNormParamFile = argv[i]; break;
+      case 'L': largeModelFile = argv[i]; break;
+      case 'l': largeNormParamFile = argv[i]; break;
+      case 'C': calibrationFile = argv[i]; break;
+      case 'c': ncalibration = strtol(argv[i], NULL, 0); break;
+      case 'I': testFile = argv[i]; break;
+      case 'e': ntest = strtol(argv[i], NULL, 0); break;
+      case 'a': maxLoss = (FP_TYPE)strtod(argv[i], NULL); break;
+      case 't': threshold = (FP_TYPE)strtod(argv[i], NULL); break;
+      case 'b': batchSize = strtol(argv[i], NULL, 0); break;
+      default: exitWithHelp();
+    }
+  }
+  if (smallModelFile.empty() || largeModelFile.empty() || testFile.empty() || ntest == 0 || batchSize <= 0)
+    exitWithHelp();
+  if (threshold < 0 && (calibrationFile.empty() || ncalibration == 0))
+    exitWithHelp();
+
+  std::unique_ptr<ProtoNNPredictor> small = loadPredictor(smallModelFile, smallNormParamFile);
+  std::unique_ptr<ProtoNNPredictor> large = loadPredictor(largeModelFile, largeNormParamFile);
+  const ProtoNNModel::ProtoNNHyperParams& hyperParams = large->getHyperParams();
+  if (small->getHyperParams().l != hyperParams.l || small->getHyperParams().D != hyperParams.D) {
+    LOG_ERROR("The small and the large model must have the same number of labels and the same dimension");
+    exit(1);
+  }
+
+  ModelCascade cascade(stageOf(*small), stageOf(*large), hyperParams.l);
+  if (threshold >= 0)
+    cascade.setThreshold(threshold);
+  else {
+    Data calibrationData(FileIngest, DataFormatParams{ ncalibration, 0, 0, hyperParams.l, hyperParams.D });
+    calibrationData.loadDataFromFile(libsvmFormat, calibrationFile, "", "");
+    calibrationData.finalizeData();
+    cascade.calibrate(calibrationData.Xtrain, calibrationData.Ytrain, hyperParams.problemType, maxLoss, batchSize);
+  }
+
+  Data testData(FileIngest, DataFormatParams{ 0, 0, ntest, hyperParams.l, hyperParams.D });
+  testData.loadDataFromFile(libsvmFormat, "", "", testFile);
+  testData.finalizeData();
+  cascade.test(testData.Xtest, testData.Ytest, hyperParams.problemType, batchSize);
+
+  return 0;
+}
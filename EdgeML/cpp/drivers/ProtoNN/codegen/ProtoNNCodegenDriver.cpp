@@ -0,0 +1,57 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "ProtoNN.h"
+
+using namespace EdgeML;
+using namespace EdgeML::ProtoNN;
+
+static void exitWithHelp()
+{
+  LOG_INFO("./ProtoNNCodegen [Options]\n");
+  LOG_INFO("Compiles a trained model into a self-contained C source with its dimensions and parameters as constants.");
+  LOG_INFO("-M    : [Required] Model file written by ProtoNNTrain.");
+  LOG_INFO("-n    : [Required for min-max normalized models] Normalization parameters file (minMaxParams).");
+  LOG_INFO("-O    : [Required] C file to write.");
+  LOG_INFO("-x    : Prefix of the generated names. Default: protonn.");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+#ifdef LINUX
+  trapfpe();
+  struct sigaction sa;
+  sigemptyset (&sa.sa_mask);
+  sa.sa_flags = SA_SIGINFO;
+  sa.sa_sigaction = fpehandler;
+  sigaction (SIGFPE, &sa, NULL);
+#endif
+
+  std::string modelFile, normParamFile, outFile, prefix = "protonn";
+
+  for (int i = 1; i < argc; ++i) {
+    if (i % 2 == 1) {
+      if (argv[i][0] != '-' || i + 1 == argc) exitWithHelp();
+      continue;
+    }
+    switch (argv[i - 1][1]) {
+      case 'M': modelFile = argv[i]; break;
+      case 'n': normParamFile = argv[i]; break;
+      case 'O': outFile = argv[i]; break;
+      case 'x': prefix = argv[i]; break;
+      default: exitWithHelp();
+    }
+  }
+  if (modelFile.empty() || outFile.empty() || prefix.empty())
+    exitWithHelp();
+
+  ProtoNNPredictor predictor(modelFile);
+  if (predictor.getHyperParams().normalizationType == minMax) {
+    if (normParamFile.empty()) exitWithHelp();
+    predictor.importMinMax(normParamFile);
+  }
+  predictor.generateC(outFile, prefix);
+
+  return 0;
+}
@@ -23,9 +23,13 @@ int main(int argc, char **argv) {
   ProtoNN::ProtoNNPredictor predictor(argc, (const char**)argv);
   EdgeML::ResultStruct res;
 
-  res = predictor.test(); 
+  if (predictor.isStreaming())
+    res = predictor.testStreaming();
+  else {
+    res = predictor.test(); 
 
-  predictor.saveTopKScores();
+    predictor.saveTopKScores();
+  }
 
   switch(res.problemType) {
     case binary:
@@ -36,6 +40,9 @@ int main(int argc, char **argv) {
       LOG_INFO("Prec@1: " + std::to_string(res.precision1));
       LOG_INFO("Prec@3: " + std::to_string(res.precision3));
       LOG_INFO("Prec@5: " + std::to_string(res.precision5));
+      LOG_INFO("nDCG@1: " + std::to_string(res.ndcg1));
+      LOG_INFO("nDCG@3: " + std::to_string(res.ndcg3));
+      LOG_INFO("nDCG@5: " + std::to_string(res.ndcg5));
       break;
     default:
       assert(false);
@@ -0,0 +1,118 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "ProtoNN.h"
+#include "model_registry.h"
+
+using namespace EdgeML;
+using namespace EdgeML::ProtoNN;
+
+//
+// Reloads truncated copies of a trained model into a ModelRegistry, the way
+// ProtoNNServer does on SIGHUP. Every reload must be rejected without asserting, and the
+// model that was live before must keep scoring as it did.
+//
+// Usage: ProtoNNReloadTest <model file written by ProtoNNTrain>
+//
+
+static void writeFile(const std::string& file, const std::vector<char>& bytes)
+{
+  std::ofstream outfile(file, std::ios::out|std::ios::binary|std::ios::trunc);
+  outfile.write(bytes.data(), bytes.size());
+}
+
+static MatrixXuf scoreProbe(const ProtoNNPredictor& predictor)
+{
+  const ProtoNNModel::ProtoNNHyperParams& hyperParams = predictor.getHyperParams();
+  SparseMatrixuf X(hyperParams.D, 1);
+  for (featureCount_t f = 0; f < hyperParams.D; f += 3)
+    X.insert(f, 0) = (FP_TYPE)((f % 7) + 1) / 7;
+  X.makeCompressed();
+  MatrixXuf Yscores(hyperParams.l, 1);
+  predictor.scoreBatch(Yscores, X);
+  return Yscores;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc != 2) {
+    LOG_ERROR("Usage: ProtoNNReloadTest <model file>");
+    return 1;
+  }
+  const std::string modelFile = argv[1];
+  const std::string corruptFile = modelFile + ".reloadTest";
+
+  auto loadPredictor = [](const std::string& file) -> ProtoNNPredictor* {
+    std::vector<char> model;
+    if (!ProtoNNModel::readModelFile(file, model))
+      return NULL;
+    return new ProtoNNPredictor(model.size(), model.data());
+  };
+  auto validatePredictor = [](const ProtoNNPredictor& predictor) {
+    return predictor.isModelValid();
+  };
+  ModelRegistry<ProtoNNPredictor> registry(loadPredictor, validatePredictor);
+  if (!registry.load(modelFile)) {
+    LOG_ERROR("Cannot load " + modelFile);
+    return 1;
+  }
+
+  std::ifstream infile(modelFile, std::ios::in|std::ios::binary);
+  const std::vector<char> file((std::istreambuf_iterator<char>(infile)), std::istreambuf_iterator<char>());
+  const size_t headerBytes = sizeof(size_t) + sizeof(ProtoNNModel::ProtoNNHyperParams) + 1;
+
+  uint64_t liveId;
+  MatrixXuf liveScores;
+  {
+    ModelRegistry<ProtoNNPredictor>::Snapshot predictor = registry.acquire();
+    liveId = predictor.id();
+    liveScores = scoreProbe(*predictor);
+  }
+
+  // Cuts inside the size header, the hyperparameters, the flags and each parameter
+  std::vector<size_t> cuts = { 0, sizeof(size_t) / 2, sizeof(size_t), headerBytes / 2,
+    headerBytes - 1, headerBytes, headerBytes + 3 };
+  for (int part = 1; part < 8; ++part)
+    cuts.push_back(headerBytes + (file.size() - headerBytes) * part / 8);
+  cuts.push_back(file.size() - 1);
+
+  int numFailures = 0;
+  for (size_t cut : cuts) {
+    std::vector<char> truncated(file.begin(), file.begin() + cut);
+
+    // As written, the size header no longer matches the file
+    writeFile(corruptFile, truncated);
+    if (registry.load(corruptFile)) {
+      LOG_ERROR("Reloaded a model truncated to " + std::to_string(cut) + " bytes");
+      ++numFailures;
+    }
+
+    // With a consistent size header, the parameter bounds checks must catch it
+    if (cut >= sizeof(size_t)) {
+      const size_t modelSize = cut - sizeof(size_t);
+      memcpy(truncated.data(), &modelSize, sizeof(modelSize));
+      writeFile(corruptFile, truncated);
+      if (registry.load(corruptFile)) {
+        LOG_ERROR("Reloaded a model truncated to " + std::to_string(cut) + " bytes with a matching size");
+        ++numFailures;
+      }
+    }
+  }
+
+  std::remove(corruptFile.c_str());
+
+  {
+    ModelRegistry<ProtoNNPredictor>::Snapshot predictor = registry.acquire();
+    if (predictor.id() != liveId || scoreProbe(*predictor) != liveScores) {
+      LOG_ERROR("The live model changed after rejected reloads");
+      ++numFailures;
+    }
+  }
+
+  if (numFailures > 0) {
+    LOG_ERROR(std::to_string(numFailures) + " reload checks failed");
+    return 1;
+  }
+  LOG_INFO("Rejected " + std::to_string(cuts.size()) + " truncated models; the live model kept serving");
+  return 0;
+}
@@ -0,0 +1,183 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "ProtoNN.h"
+#include "model_registry.h"
+#include "scoring_server.h"
+
+#ifdef LINUX
+#include <pthread.h>
+#endif
+
+using namespace EdgeML;
+using namespace EdgeML::ProtoNN;
+
+static ScoringServer* runningServer = NULL;
+
+static void stopHandler(int)
+{
+  if (runningServer)
+    runningServer->stop();
+}
+
+static void exitWithHelp()
+{
+  LOG_INFO("./ProtoNNServer [Options]\n");
+  LOG_INFO("Serving options:");
+  LOG_INFO("-M    : [Required] Model file written by ProtoNNTrain.");
+  LOG_INFO("-S    : [Required] Path of the unix domain socket to listen on (or connect to with -L).");
+  LOG_INFO("-n    : [Required for min-max normalized models] Normalization parameters file (minMaxParams).");
+  LOG_INFO("-b    : Largest micro-batch scored in one call. Default: 64.");
+  LOG_INFO("-t    : Longest the oldest request waits for its micro-batch to fill, in microseconds. Default: 500.");
+  LOG_INFO("-w    : Number of worker threads scoring micro-batches. Default: 1.");
+  LOG_INFO("-s    : Seconds between statistics log lines, 0 to disable. Default: 10.");
+  LOG_INFO("Send SIGHUP to reload the model (and normalization parameters) from the same files without pausing scoring.");
+  LOG_INFO("Load generation options (replay a labelled file against a running server):");
+  LOG_INFO("-L    : Test file to replay.");
+  LOG_INFO("-e    : Number of points in the test file.");
+  LOG_INFO("-F    : Format of the test file. Only 0 (libsvm) is supported.");
+  LOG_INFO("-c    : Number of concurrent client connections. Default: 1.");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+#ifdef LINUX
+  trapfpe();
+  struct sigaction sa;
+  sigemptyset (&sa.sa_mask);
+  sa.sa_flags = SA_SIGINFO;
+  sa.sa_sigaction = fpehandler;
+  sigaction (SIGFPE, &sa, NULL);
+
+  // Block SIGHUP before any thread is created so that every thread inherits the mask
+  sigset_t reloadSignals;
+  sigemptyset(&reloadSignals);
+  sigaddset(&reloadSignals, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &reloadSignals, NULL);
+#endif
+
+  assert(sizeof(MKL_INT) == sizeof(Eigen::Index) && "MKL BLAS routines are called directly on data of an Eigen matrix. Hence, the index sizes should match.");
+
+  std::string modelFile, normParamFile, loadFile;
+  ScoringServerParams params;
+  dataCount_t ntest = 0;
+  int concurrency = 1;
+
+  for (int i = 1; i < argc; ++i) {
+    if (i % 2 == 1) {
+      if (argv[i][0] != '-' || i + 1 == argc) exitWithHelp();
+      continue;
+    }
+    switch (argv[i - 1][1]) {
+      case 'M': modelFile = argv[i]; break;
+      case 'S': params.socketPath = argv[i]; break;
+      case 'n': normParamFile = argv[i]; break;
+      case 'b': params.maxBatchSize = strtol(argv[i], NULL, 0); break;
+      case 't': params.maxQueueDelayMicros = strtol(argv[i], NULL, 0); break;
+      case 'w': params.numWorkers = (int)strtol(argv[i], NULL, 0); break;
+      case 's': params.statsIntervalSeconds = (int)strtol(argv[i], NULL, 0); break;
+      case 'L': loadFile = argv[i]; break;
+      case 'e': ntest = strtol(argv[i], NULL, 0); break;
+      case 'F': if (argv[i][0] != '0') exitWithHelp(); break;
+      case 'c': concurrency = (int)strtol(argv[i], NULL, 0); break;
+      default: exitWithHelp();
+    }
+  }
+  if (modelFile.empty() || params.socketPath.empty()) exitWithHelp();
+
+  if (!loadFile.empty()) {
+    if (ntest == 0) exitWithHelp();
+    ProtoNNPredictor predictor(modelFile);
+    const ProtoNNModel::ProtoNNHyperParams& hyperParams = predictor.getHyperParams();
+    Data testData(FileIngest, DataFormatParams{ 0, 0, ntest, hyperParams.l, hyperParams.D });
+    testData.loadDataFromFile(libsvmFormat, "", "", loadFile);
+    testData.finalizeData();
+
+    MatrixXuf Yscores = MatrixXuf::Zero(hyperParams.l, testData.Xtest.cols());
+    runScoringLoad(params.socketPath, testData.Xtest, concurrency, Yscores);
+
+    ResultStruct res = evaluate(Yscores, testData.Ytest, hyperParams.problemType);
+    LOG_INFO("Accuracy of served scores: " + std::to_string(res.accuracy));
+    return 0;
+  }
+
+  // Reads the model, its normalization parameters and precomputes the scoring constants.
+  // Runs off the serving path, so a reload never stalls the workers. A truncated or corrupt
+  // model file is rejected here rather than asserting in the running server.
+  auto loadPredictor = [&normParamFile](const std::string& file) -> ProtoNNPredictor* {
+    std::vector<char> model;
+    if (!ProtoNNModel::readModelFile(file, model))
+      return NULL;
+    ProtoNNPredictor* predictor = new ProtoNNPredictor(model.size(), model.data());
+    if (predictor->getHyperParams().normalizationType == minMax) {
+      if (normParamFile.empty() || !std::ifstream(normParamFile).good()) {
+        LOG_WARNING("Min-max normalized model needs a readable normalization parameters file (-n)");
+        delete predictor;
+        return NULL;
+      }
+      predictor->importMinMax(normParamFile);
+    }
+    return predictor;
+  };
+
+  // A reloaded model must keep the request and response shapes the clients rely on
+  auto validatePredictor = [&params](const ProtoNNPredictor& predictor) {
+    if (params.dimension != 0
+      && (predictor.getHyperParams().D != params.dimension
+        || predictor.getHyperParams().l != params.numLabels)) {
+      LOG_WARNING("Reloaded model changes the number of features or labels");
+      return false;
+    }
+    return predictor.isModelValid();
+  };
+
+  params.dimension = 0;
+  ModelRegistry<ProtoNNPredictor> registry(loadPredictor, validatePredictor);
+  if (!registry.load(modelFile)) exitWithHelp();
+
+  {
+    ModelRegistry<ProtoNNPredictor>::Snapshot predictor = registry.acquire();
+    params.dimension = predictor->getHyperParams().D;
+    params.numLabels = predictor->getHyperParams().l;
+  }
+
+
+  ScoringServer server(params,
+    [&registry](MatrixXuf& Yscores, SparseMatrixuf& X) {
+      // Pins the live model for this micro-batch; a concurrent reload does not affect it
+      ModelRegistry<ProtoNNPredictor>::Snapshot predictor = registry.acquire();
+      predictor->normalizeBatch(X);
+      predictor->scoreBatch(Yscores, X);
+    });
+
+#ifdef LINUX
+  runningServer = &server;
+  signal(SIGINT, stopHandler);
+  signal(SIGTERM, stopHandler);
+
+  // SIGHUP was blocked before any thread started and is picked up here with sigwait,
+  // so the reload runs on an ordinary thread instead of in signal context.
+  std::atomic<bool> isServing(true);
+  std::thread reloader([&]() {
+    int signalNumber;
+    while (sigwait(&reloadSignals, &signalNumber) == 0 && isServing) {
+      registry.load(modelFile);
+      // Frees the previous version once the micro-batches still scoring on it are done
+      while (registry.reclaim() > 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+#endif
+
+  server.serve();
+  runningServer = NULL;
+
+#ifdef LINUX
+  isServing = false;
+  pthread_kill(reloader.native_handle(), SIGHUP);
+  reloader.join();
+#endif
+
+  return 0;
+}
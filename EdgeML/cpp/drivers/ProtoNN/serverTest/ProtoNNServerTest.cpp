@@ -0,0 +1,108 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "scoring_server.h"
+#include <chrono>
+#include <future>
+
+#ifdef LINUX
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace EdgeML;
+
+//
+// Connects to a ScoringServer, sends a complete request followed by the first half of
+// another, and disconnects. The server must answer the complete request, drop the partial
+// one, and still shut down when stopped.
+//
+// Usage: ProtoNNServerTest [socket path]
+//
+
+#ifdef LINUX
+static int connectTo(const std::string& socketPath)
+{
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+  // serve() binds the socket on its own thread
+  for (int attempt = 0; attempt < 100; ++attempt) {
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0)
+      return fd;
+    close(fd);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+  return -1;
+}
+#endif
+
+int main(int argc, char** argv)
+{
+#ifdef LINUX
+  ScoringServerParams params;
+  params.socketPath = argc > 1 ? argv[1] : "/tmp/ProtoNNServerTest." + std::to_string(getpid());
+  params.dimension = 4;
+  params.numLabels = 2;
+  params.statsIntervalSeconds = 0;
+
+  ScoringServer server(params, [](MatrixXuf& Yscores, SparseMatrixuf&) { Yscores.setOnes(); });
+  std::future<void> served = std::async(std::launch::async, [&server] { server.serve(); });
+
+  const int fd = connectTo(params.socketPath);
+  if (fd < 0) {
+    LOG_ERROR("Cannot connect to the scoring server at " + params.socketPath);
+    return 1;
+  }
+
+  // One complete request, then the count and indices of another but not its values
+  const uint32_t numIndices = 2;
+  const uint32_t indices[2] = { 0, 3 };
+  const FP_TYPE values[2] = { 1.0, 2.0 };
+  std::vector<char> frames;
+  frames.insert(frames.end(), (const char *)&numIndices, (const char *)(&numIndices + 1));
+  frames.insert(frames.end(), (const char *)indices, (const char *)(indices + 2));
+  frames.insert(frames.end(), (const char *)values, (const char *)(values + 2));
+  frames.insert(frames.end(), (const char *)&numIndices, (const char *)(&numIndices + 1));
+  frames.insert(frames.end(), (const char *)indices, (const char *)(indices + 2));
+
+  int numFailures = 0;
+  if (send(fd, frames.data(), frames.size(), MSG_NOSIGNAL) != (ssize_t)frames.size()) {
+    LOG_ERROR("Cannot send the requests");
+    ++numFailures;
+  }
+
+  uint32_t numScores = 0;
+  FP_TYPE scores[2];
+  if (recv(fd, &numScores, sizeof(numScores), MSG_WAITALL) != sizeof(numScores)
+    || numScores != params.numLabels
+    || recv(fd, scores, sizeof(scores), MSG_WAITALL) != sizeof(scores)) {
+    LOG_ERROR("The complete request was not answered");
+    ++numFailures;
+  }
+  close(fd);
+
+  // Give the reader time to see the truncated frame before stopping
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  server.stop();
+  if (served.wait_for(std::chrono::seconds(10)) != std::future_status::ready) {
+    LOG_ERROR("The scoring server did not shut down after a client left mid-request");
+    // The serving thread cannot be joined
+    _exit(1);
+  }
+
+  if (numFailures > 0) {
+    LOG_ERROR(std::to_string(numFailures) + " server checks failed");
+    return 1;
+  }
+  LOG_INFO("The scoring server shut down after a client left mid-request");
+  return 0;
+#else
+  LOG_ERROR("The scoring server needs unix domain sockets and is only supported on Linux");
+  return 1;
+#endif
+}
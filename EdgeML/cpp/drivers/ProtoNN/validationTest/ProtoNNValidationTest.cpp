@@ -0,0 +1,104 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "ProtoNNFunctions.h"
+
+using namespace EdgeML;
+using namespace EdgeML::ProtoNN;
+
+//
+// Trains on a synthetic multiclass data set that is also passed as the validation set.
+// The validation pipeline then scores the same points as the training evaluation, so
+// after every phase the validation accuracy must equal the training accuracy. Run it in
+// the default build, where the labels are dense (LabelMatType is MatrixXuf) while
+// Data holds them sparse.
+//
+// Usage: ProtoNNValidationTest
+//
+
+static void setParam(MatrixXuf& param, const MatrixXuf& value)
+{
+  param = value;
+}
+
+static void setParam(SparseMatrixuf& param, const MatrixXuf& value)
+{
+  param = value.sparseView();
+}
+
+int main()
+{
+  const featureCount_t D = 20;
+  const labelCount_t l = 10;
+  const dataCount_t n = 3000;
+
+  ProtoNNModel::ProtoNNHyperParams hyperParams;
+  hyperParams.problemType = ProblemFormat::multiclass;
+  hyperParams.initializationType = InitializationFormat::sample;
+  hyperParams.normalizationType = NormalizationFormat::none;
+  hyperParams.ntrain = n;
+  hyperParams.nvalidation = n;
+  hyperParams.batchSize = 256;
+  hyperParams.iters = 3;
+  hyperParams.epochs = 2;
+  hyperParams.D = D;
+  hyperParams.d = 5;
+  hyperParams.m = 40;
+  hyperParams.l = l;
+  hyperParams.finalizeHyperParams();
+
+  // Points are scattered around a center per class
+  MatrixXuf centers = MatrixXuf::Random(D, l);
+  MatrixXuf X = MatrixXuf::Random(D, n) * (FP_TYPE)0.6;
+  MatrixXuf Y = MatrixXuf::Zero(l, n);
+  for (dataCount_t i = 0; i < n; ++i) {
+    const labelCount_t label = (labelCount_t)(rand() % l);
+    X.col(i) += centers.col(label);
+    Y(label, i) = 1;
+  }
+
+  Data data;
+  data.Xtrain = X.sparseView();
+  data.Ytrain = Y.sparseView();
+  data.Xvalidation = data.Xtrain;
+  data.Yvalidation = data.Ytrain;
+  data.isDataLoaded = true;
+
+  // Prototypes are projections of sampled points, and carry their labels
+  ProtoNNModel model(hyperParams);
+  const MatrixXuf W = MatrixXuf::Random(hyperParams.d, D);
+  const MatrixXuf WX = W * X;
+  MatrixXuf B(hyperParams.d, hyperParams.m), Z(l, hyperParams.m);
+  for (labelCount_t j = 0; j < hyperParams.m; ++j) {
+    const dataCount_t i = (dataCount_t)j * n / hyperParams.m;
+    B.col(j) = WX.col(i);
+    Z.col(j) = Y.col(i);
+  }
+  setParam(model.params.W, W);
+  setParam(model.params.B, B);
+  setParam(model.params.Z, Z);
+  model.hyperParams.gamma = medianHeuristic(model.params.B, WX, model.hyperParams.gammaNumerator);
+
+  std::vector<FP_TYPE> stats(model.hyperParams.iters * 9 + 3);
+  altMinSGD(data, model, stats.data(), ".");
+
+  // Each phase stores objective, training accuracy and validation accuracy
+  int numFailures = 0;
+  for (int phase = 0; phase < model.hyperParams.iters * 3 + 1; ++phase) {
+    const FP_TYPE trainAccuracy = stats[phase * 3 + 1];
+    const FP_TYPE validationAccuracy = stats[phase * 3 + 2];
+    if (std::abs(trainAccuracy - validationAccuracy) > 1e-5) {
+      LOG_ERROR("Phase " + std::to_string(phase) + ": validation accuracy " + std::to_string(validationAccuracy)
+        + " on the training data differs from training accuracy " + std::to_string(trainAccuracy));
+      ++numFailures;
+    }
+  }
+
+  if (numFailures > 0) {
+    LOG_ERROR(std::to_string(numFailures) + " validation checks failed");
+    return 1;
+  }
+  LOG_INFO("Validation accuracy matched training accuracy after all "
+    + std::to_string(model.hyperParams.iters * 3 + 1) + " phases");
+  return 0;
+}
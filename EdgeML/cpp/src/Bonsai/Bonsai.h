@@ -5,6 +5,10 @@
 #define __BONSAI_H__
 
 #include "Data.h"
+#include "data_stream.h"
+#include "output_writer.h"
+#include "param_matrix.h"
+#include "quantized.h"
 
 
 namespace EdgeML
@@ -214,32 +218,45 @@ namespace EdgeML
       ///
       void importSparseModel(const size_t numBytes, const char *const fromModel);
 
+      ///
+      /// Whether importModel (@isDense) or importSparseModel can read @fromModel: its size header
+      /// is @numBytes, its tree shape is consistent and the matrices it describes fill the rest.
+      /// Never asserts, so models from untrusted files can be checked before importing.
+      ///
+      static bool isModelBufferValid(const size_t numBytes, const char *const fromModel, const bool isDense);
+
+      ///
+      /// Function to read a model file into @model. Returns false if the file is unreadable, its
+      /// size does not match the size it stores, or the model fails isModelBufferValid.
+      ///
+      static bool readModelFile(const std::string& modelFile, std::vector<char>& model, const bool isDense);
+
       ///
       /// Access W of class classID across all nodes. Returns the corresponding W Matrix (numNodesxprojection Dimension)
       ///
-      WMatType getW(const labelCount_t& classID);
+      WMatType getW(const labelCount_t& classID) const;
 
       ///
       /// Access V of class classID across all nodes. Returns the corresponding V Matrix (numNodesxprojection Dimension)
       ///
-      VMatType getV(const labelCount_t& classID);
+      VMatType getV(const labelCount_t& classID) const;
 
       ///
       /// Access W of class classID for a given node. Returns the corresponding W Matrix (1xprojection Dimension)
       ///    
       WMatType getW(const labelCount_t& classID,
-        const labelCount_t& globalNodeID);
+        const labelCount_t& globalNodeID) const;
 
       ///
       /// Access V of class classID for a given node. Returns the corresponding V Matrix (1xprojection Dimension)
       ///
       VMatType getV(const labelCount_t& classID,
-        const labelCount_t& globalNodeID);
+        const labelCount_t& globalNodeID) const;
 
       ///
       /// Access Theta(Decison Boundary) for a given node.
       ///
-      ThetaMatType getTheta(const labelCount_t& globalNodeID);
+      ThetaMatType getTheta(const labelCount_t& globalNodeID) const;
 
 
       ///
@@ -555,7 +572,43 @@ namespace EdgeML
       MatrixXuf mean; ///< Object to hold the mean of the train data from imported model
       MatrixXuf stdDev; ///< Object to hold stdDev of the train data from imported model
 
+      ///
+      /// The normalization and the 1/projectionDimension factor folded into the projection, so that
+      /// ZX of a raw point is projectedOffset plus featureScale(f) * x_f times column f of Z, summed
+      /// over its nonzero features f. The bias feature has scale 0. Set by importMeanStd
+      ///
+      MatrixXuf featureScale;
+      MatrixXuf projectedOffset;
+
       BonsaiModel model; ///< Object to hold the imported model
+
+      ///
+      /// Z, W, V and Theta as used for scoring, each dense or sparse by its density in the loaded
+      /// model, independent of the SPARSE_*_BONSAI types it was trained with
+      ///
+      ParamMatrix paramZ, paramW, paramV, paramTheta;
+
+      ///
+      /// Int8 scoring engine set up by quantize(): Z, W, V and Theta in int8 with their own
+      /// scales, and ZX quantized with one scale calibrated on held-out data
+      ///
+      bool isQuantized;
+      QuantizedMatrix quantZ, quantW, quantV, quantTheta;
+      FP_TYPE quantZXScale;
+
+      std::string calibrationFile; ///< Held-out points for quantize() from the command line (-Q, -q, -s)
+      dataCount_t numCalibration;
+      QuantScaleMode quantScaleMode;
+
+      OutputFormat predictionFormat; ///< Format of the batchEvaluate predictions file, from the command line (-o)
+      dataCount_t chunkPoints; ///< Points per chunk when the test file is streamed, from the command line (-c); 0 loads it whole
+
+      ///
+      /// Int8 scores of one normalized dense point. Thread safe
+      ///
+      void quantizedScore(const FP_TYPE *const X,
+        FP_TYPE *scores) const;
+
       Data testData;
       dataCount_t numTest;
       DataFormat dataformatType;
@@ -565,6 +618,36 @@ namespace EdgeML
       void setFromArgs(const int argc, const char** argv);
       void exitWithHelp();
 
+      ///
+      /// Picks the scoring representation of the parameters once the model is loaded
+      ///
+      void initializeParams();
+
+      ///
+      /// Sets featureScale and projectedOffset from Z, mean and stdDev
+      ///
+      void foldNormalization();
+
+      ///
+      /// Scores of all classes from the projection ZX of one point
+      ///
+      void projectionScore(const MatrixXuf& ZX,
+        FP_TYPE *scores) const;
+
+      ///
+      /// Writes the predicted class of one point, the last of its highest scores, and that score
+      /// to predwriter. Returns the zero-based predicted class
+      ///
+      labelCount_t writePrediction(OutputWriter& predwriter,
+        const FP_TYPE *const scores) const;
+
+      ///
+      /// Logs the test accuracy and records it in runInfo and in the resultDump of dataDir
+      ///
+      void reportAccuracy(const FP_TYPE accuracy,
+        const std::string& dataDir,
+        const std::string& currResultsPath);
+
     public:
       
       ///
@@ -580,6 +663,12 @@ namespace EdgeML
         const char *const fromModel,
         const bool isDense = true);
 
+      ///
+      /// Constructor instantiating model and normalization from files, without loading test data
+      ///
+      BonsaiPredictor(const std::string& modelFile,
+        const std::string& meanStdFile);
+
       ~BonsaiPredictor();
 
       ///
@@ -593,6 +682,15 @@ namespace EdgeML
       ///
       void importMeanStd(std::string meanStdFile);
 
+      ///
+      /// Writes a self-contained C source scoring raw inputs with this model to @outFile, for
+      /// deployment on devices: dimensions and tree depth are compile-time constants, the
+      /// normalization is folded into Z, and parameters are static const arrays with the zeros
+      /// of sparse ones removed. Exported names start with @prefix.
+      ///
+      void generateC(const std::string& outFile,
+        const std::string& prefix = "bonsai") const;
+
       ///
       /// Function to Score an incoming Dense Data Point.Not thread safe
       ///
@@ -604,12 +702,12 @@ namespace EdgeML
       ///
       FP_TYPE predictionScoreOfClassID(const MatrixXuf& ZX,
         const std::vector<int> path,
-        const labelCount_t& classID);
+        const labelCount_t& classID) const;
 
       ///
       /// Computes and returns the path traversed in Bonsai Tree
       ///
-      std::vector<int> treePath(const MatrixXuf& ZX);
+      std::vector<int> treePath(const MatrixXuf& ZX) const;
 
       ///
       /// Function to return the scores of all classes for a given Dense Data Point
@@ -619,14 +717,16 @@ namespace EdgeML
         FP_TYPE *scores);
 
       ///
-      /// Function to return the scores of all classes for a given Sparse Data Point
+      /// Function to return the scores of all classes for a given normalized Sparse Data Point.
+      /// Reads only the columns of Z of its nonzeros
       ///
       void predictionSparseScore(
         const SparseMatrixuf& X,
         FP_TYPE *scores);
 
       ///
-      /// Function to Score an incoming sparse Data Point.Not thread safe
+      /// Function to Score an incoming sparse Data Point, in time proportional to its nonzeros
+      /// unless scoring is in int8. Not thread safe
       ///
       void scoreSparseDataPoint(
         FP_TYPE* scores,
@@ -634,6 +734,34 @@ namespace EdgeML
         const featureCount_t *const indices,
         const featureCount_t& numIndices);
 
+      ///
+      /// Function to score the columns of a raw (unnormalized) sparse batch with one sparse projection
+      /// product, normalized through featureScale and projectedOffset without densifying the batch.
+      /// Only reads the model, so concurrent calls are safe once the mean and stdDev are imported
+      ///
+      void scoreBatch(
+        MatrixXuf& Yscores,
+        const SparseMatrixuf& X) const;
+
+      ///
+      /// Function to switch all scoring to the int8 engine. The range of ZX is calibrated on the
+      /// raw (unnormalized) held-out points in calibrationX; mode picks per-row or per-tensor
+      /// scales for Z, W, V and Theta. Logs how often the top label agrees with float scoring
+      ///
+      void quantize(const SparseMatrixuf& calibrationX,
+        const QuantScaleMode mode = perRowScale);
+
+      ///
+      /// Function to return the hyperparams of the model loaded
+      ///
+      const BonsaiModel::BonsaiHyperParams& getHyperParams() const { return model.hyperParams; }
+
+      ///
+      /// Function to check parameter shapes against the hyperparams and that the parameters and the
+      /// imported mean and stdDev are finite. Logs the first problem found and returns false
+      ///
+      bool isModelValid() const;
+
       ///
       /// Function to return total nonzeros in the model loaded
       ///
@@ -647,7 +775,9 @@ namespace EdgeML
         const FP_TYPE& correct);
 
       ///
-      /// Function to predict an entire test dataset
+      /// Function to predict an entire test dataset. Writes the predicted class and its score for
+      /// each point to currResultsPath/predClassAndScore, or with -o 1 to predClassAndScore.bin
+      /// as a uint32 class and a float32 score per point.
       ///
       void batchEvaluate(
         const SparseMatrixuf& Xtest,
@@ -656,7 +786,19 @@ namespace EdgeML
         const std::string& currResultsPath);
       
       ///
-      /// Function to predict an entire test dataset
+      /// Function to predict a test file a chunk of chunkSize points at a time, as it is read, with
+      /// the output of batchEvaluate. Chunks are scored with scoreBatch while the next one is parsed,
+      /// and their predictions written before the next is scored, so memory is bounded by the chunk
+      /// size. Reads at most maxPoints points, or the whole file if it is 0
+      ///
+      void streamEvaluate(const std::string& testFile,
+        const dataCount_t chunkSize,
+        const dataCount_t maxPoints,
+        const std::string& dataDir,
+        const std::string& currResultsPath);
+
+      ///
+      /// Function to predict an entire test dataset, streamed if the command line asked for it (-c)
       ///
       void evaluate();
     };
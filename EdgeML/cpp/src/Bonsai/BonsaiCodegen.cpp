@@ -0,0 +1,121 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "Bonsai.h"
+#include "c_codegen.h"
+#include <fstream>
+
+using namespace EdgeML;
+using namespace EdgeML::Bonsai;
+
+//
+// The mean-std normalization and the 1/projectionDimension factor are folded into Z and a
+// bias, so the generated scorer projects raw features directly, one nonzero feature at a
+// time from the rows of Z^T. Rows of W and V are reordered node by node, so that the
+// classes of a node on the path are contiguous.
+//
+void BonsaiPredictor::generateC(
+  const std::string& outFile,
+  const std::string& prefix) const
+{
+  const BonsaiModel::BonsaiHyperParams& hyperParams = model.hyperParams;
+  const featureCount_t numFeatures = hyperParams.dataDimension - 1; // The last dimension is the bias
+  const featureCount_t projDim = hyperParams.projectionDimension;
+  const labelCount_t classes = hyperParams.internalClasses;
+  const int depth = hyperParams.treeDepth;
+
+  std::ofstream out(outFile);
+  assert(out.is_open());
+
+  std::string upper(prefix);
+  for (size_t i = 0; i < upper.size(); ++i)
+    upper[i] = (char)toupper(upper[i]);
+
+  const MatrixXuf Z = model.params.Z;
+  MatrixXuf foldedZ(projDim, numFeatures);
+  MatrixXuf bias = Z.col(numFeatures) / (FP_TYPE)projDim;
+  for (featureCount_t f = 0; f < numFeatures; ++f) {
+    foldedZ.col(f) = Z.col(f) / (stdDev(f, 0) * (FP_TYPE)projDim);
+    bias -= foldedZ.col(f) * mean(f, 0);
+  }
+
+  const MatrixXuf W = model.params.W, V = model.params.V;
+  MatrixXuf nodeW(W.rows(), projDim), nodeV(V.rows(), projDim);
+  for (int node = 0; node < hyperParams.totalNodes; ++node)
+    for (labelCount_t c = 0; c < classes; ++c) {
+      nodeW.row(node * classes + c) = W.row(hyperParams.totalNodes * c + node);
+      nodeV.row(node * classes + c) = V.row(hyperParams.totalNodes * c + node);
+    }
+
+  out << "/*\n"
+      << " * Bonsai model compiled to C by BonsaiCodegen. Do not edit.\n"
+      << " * " << numFeatures << " features, projection dimension " << projDim << ", depth " << depth
+      << ", " << hyperParams.numClasses << " classes.\n"
+      << " *\n"
+      << " *   void " << prefix << "_score(const float *x, float *scores);  x: raw features, scores: one per class\n"
+      << " *   unsigned " << prefix << "_predict(const float *x);           class with the highest score\n"
+      << " *\n"
+      << " * Define " << upper << "_BENCHMARK to build a timing harness.\n"
+      << " */\n"
+      << "#include <math.h>\n"
+      << "#include <stdint.h>\n\n"
+      << "#define " << upper << "_FEATURES " << numFeatures << "\n"
+      << "#define " << upper << "_PROJECTION_DIM " << projDim << "\n"
+      << "#define " << upper << "_DEPTH " << depth << "\n"
+      << "#define " << upper << "_CLASSES " << hyperParams.numClasses << "\n\n";
+
+  size_t bytesZ, bytesW, bytesV, bytesTheta = 0;
+  emitCRows(out, prefix + "_Z", foldedZ.transpose(), &bytesZ);
+  emitCArray(out, prefix + "_Z_bias", bias.data(), projDim);
+  emitCRows(out, prefix + "_W", nodeW, &bytesW);
+  emitCRows(out, prefix + "_V", nodeV, &bytesV);
+  if (hyperParams.internalNodes > 0)
+    emitCRows(out, prefix + "_Theta", MatrixXuf(model.params.Theta), &bytesTheta);
+
+  out << "void " << prefix << "_score(const float *x, float *scores)\n"
+      << "{\n"
+      << "  float zx[" << projDim << "];\n"
+      << "  unsigned f, c, level, node = 0;\n\n"
+      << "  for (c = 0; c < " << projDim << "; ++c)\n"
+      << "    zx[c] = " << prefix << "_Z_bias[c];\n"
+      << "  for (f = 0; f < " << numFeatures << "; ++f)\n"
+      << "    if (x[f] != 0.0f)\n"
+      << "      " << prefix << "_Z_axpy(f, x[f], zx);\n\n"
+      << "  for (c = 0; c < " << hyperParams.numClasses << "; ++c)\n"
+      << "    scores[c] = 0.0f;\n"
+      << "  for (level = 0; level <= " << depth << "; ++level) {\n"
+      << "    for (c = 0; c < " << classes << "; ++c) {\n"
+      << "      const unsigned row = node * " << classes << " + c;\n"
+      << "      scores[c] += " << prefix << "_W_dot(row, zx) * tanhf(" << cFloatLiteral(hyperParams.Sigma)
+      << " * " << prefix << "_V_dot(row, zx));\n"
+      << "    }\n";
+  if (hyperParams.internalNodes > 0)
+    out << "    if (level < " << depth << ")\n"
+        << "      node = " << prefix << "_Theta_dot(node, zx) > 0.0f ? 2 * node + 1 : 2 * node + 2;\n";
+  out << "  }\n";
+  // Binary models score the negative class, as in predictionScore
+  if (hyperParams.internalClasses <= 2)
+    out << "  for (c = 0; c < " << classes << "; ++c)\n"
+        << "    scores[c] = -scores[c];\n";
+  out << "}\n\n";
+
+  // Ties go to the last class, as in batchEvaluate
+  out << "unsigned " << prefix << "_predict(const float *x)\n"
+      << "{\n"
+      << "  float scores[" << hyperParams.numClasses << "];\n"
+      << "  unsigned c, best = 0;\n"
+      << "  " << prefix << "_score(x, scores);\n"
+      << "  for (c = 1; c < " << hyperParams.numClasses << "; ++c)\n"
+      << "    if (scores[c] >= scores[best])\n"
+      << "      best = c;\n"
+      << "  return best;\n"
+      << "}\n\n";
+
+  emitCBenchmark(out, upper + "_BENCHMARK", prefix + "_score", numFeatures, hyperParams.numClasses);
+  out.close();
+
+  LOG_INFO("Wrote " + outFile + ": Z, W, V and Theta take "
+    + std::to_string(bytesZ + sizeof(float) * projDim + bytesW + bytesV + bytesTheta) + " bytes, against "
+    + std::to_string(sizeof(float) * (size_t)projDim * (hyperParams.dataDimension + W.rows() + V.rows() + hyperParams.internalNodes))
+    + " dense");
+}
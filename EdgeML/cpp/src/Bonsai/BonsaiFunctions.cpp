@@ -105,7 +105,9 @@ void Bonsai::gradYhatW(
   assert(gradOut.cols() == trainer.model.hyperParams.projectionDimension);
 
   trainer.treeCache.partialZGradient = MatrixXuf::Zero(trainer.model.hyperParams.projectionDimension, ZX.cols());
-  MatrixXuf CoeffMat = MatrixXuf::Zero((trainer.model.hyperParams.internalClasses) * (trainer.model.hyperParams.totalNodes), ZX.cols());
+  Workspace::Scope scope;
+  MatrixXuf& CoeffMat = scope.matrix((trainer.model.hyperParams.internalClasses) * (trainer.model.hyperParams.totalNodes), ZX.cols());
+  CoeffMat.setZero();
 
   gradWCoeff(CoeffMat, ZX, trainer, classLst, margin);
   mm(gradOut, CoeffMat, CblasNoTrans, ZX, CblasTrans, (FP_TYPE)1.0, (FP_TYPE)0.0);
@@ -123,7 +125,9 @@ void Bonsai::gradYhatV(
   assert(gradOut.rows() == (trainer.model.hyperParams.totalNodes) * (trainer.model.hyperParams.internalClasses));
   assert(gradOut.cols() == trainer.model.hyperParams.projectionDimension);
 
-  MatrixXuf CoeffMat = MatrixXuf::Zero((trainer.model.hyperParams.internalClasses) * (trainer.model.hyperParams.totalNodes), ZX.cols());
+  Workspace::Scope scope;
+  MatrixXuf& CoeffMat = scope.matrix((trainer.model.hyperParams.internalClasses) * (trainer.model.hyperParams.totalNodes), ZX.cols());
+  CoeffMat.setZero();
   gradVCoeff(CoeffMat, ZX, trainer, classLst, margin);
 
   mm(gradOut, CoeffMat, CblasNoTrans, ZX, CblasTrans, (FP_TYPE)1.0, (FP_TYPE)0.0);
@@ -137,7 +141,9 @@ void Bonsai::gradYhatTheta(MatrixXuf& gradOut,
   assert(gradOut.rows() == trainer.model.hyperParams.internalNodes);
   assert(gradOut.cols() == trainer.model.hyperParams.projectionDimension);
 
-  MatrixXuf CoeffMat = MatrixXuf::Zero(trainer.model.hyperParams.internalNodes, ZX.cols());
+  Workspace::Scope scope;
+  MatrixXuf& CoeffMat = scope.matrix(trainer.model.hyperParams.internalNodes, ZX.cols());
+  CoeffMat.setZero();
   gradThetaCoeff(CoeffMat, ZX, trainer, classLst, margin);
 
   if(trainer.model.hyperParams.internalNodes > 0)
@@ -156,27 +162,31 @@ void Bonsai::gradYhatZ(
   assert(gradOut.rows() == trainer.model.hyperParams.projectionDimension);
   assert(gradOut.cols() == trainer.model.hyperParams.dataDimension);
 
-  MatrixXuf CoeffMatW = MatrixXuf::Zero(trainer.model.hyperParams.internalClasses * trainer.model.hyperParams.totalNodes, ZX.cols());
-  MatrixXuf CoeffMatV = MatrixXuf::Zero(trainer.model.hyperParams.internalClasses * trainer.model.hyperParams.totalNodes, ZX.cols());
-  MatrixXuf CoeffMatTheta = MatrixXuf::Zero(trainer.model.hyperParams.internalNodes, ZX.cols());
+  Workspace::Scope scope;
+  MatrixXuf& CoeffMatW = scope.matrix(trainer.model.hyperParams.internalClasses * trainer.model.hyperParams.totalNodes, ZX.cols());
+  MatrixXuf& CoeffMatV = scope.matrix(trainer.model.hyperParams.internalClasses * trainer.model.hyperParams.totalNodes, ZX.cols());
+  MatrixXuf& CoeffMatTheta = scope.matrix(trainer.model.hyperParams.internalNodes, ZX.cols());
+  CoeffMatW.setZero();
+  CoeffMatV.setZero();
+  CoeffMatTheta.setZero();
 
   gradWCoeff(CoeffMatW, ZX, trainer, classLst, margin);
   gradVCoeff(CoeffMatV, ZX, trainer, classLst, margin);
   gradThetaCoeff(CoeffMatTheta, ZX, trainer, classLst, margin);
 
+  // Products with the class's rows of W and V are written straight into the column, without copies
+  const labelCount_t totalNodes = trainer.model.hyperParams.totalNodes;
   for (int n = 0; n < ZX.cols(); n++)
   {
-	MatrixXuf partialZGradientColN = MatrixXuf::Zero(trainer.model.hyperParams.projectionDimension, 1);
+	const labelCount_t classNodesStart = (labelCount_t)classLst(0, n)*totalNodes;
 
-	mm(partialZGradientColN, trainer.model.getW((labelCount_t)classLst(0, n)),
-	  CblasTrans, CoeffMatW.block((labelCount_t)classLst(0, n)*trainer.model.hyperParams.totalNodes, n, trainer.model.hyperParams.totalNodes, 1),
-	  CblasNoTrans, (FP_TYPE)1.0, (FP_TYPE)1.0);
+	trainer.treeCache.partialZGradient.col(n).noalias()
+	  = trainer.model.params.W.middleRows(classNodesStart, totalNodes).transpose()
+	  * CoeffMatW.block(classNodesStart, n, totalNodes, 1);
 
-	mm(partialZGradientColN, trainer.model.getV((labelCount_t)classLst(0, n)),
-	  CblasTrans, CoeffMatV.block((labelCount_t)classLst(0, n)*trainer.model.hyperParams.totalNodes, n, trainer.model.hyperParams.totalNodes, 1),
-	  CblasNoTrans, (FP_TYPE)1.0, (FP_TYPE)1.0);
-
-	trainer.treeCache.partialZGradient.col(n) = partialZGradientColN;
+	trainer.treeCache.partialZGradient.col(n).noalias()
+	  += trainer.model.params.V.middleRows(classNodesStart, totalNodes).transpose()
+	  * CoeffMatV.block(classNodesStart, n, totalNodes, 1);
   }
 
   if(trainer.model.hyperParams.internalNodes > 0)
@@ -203,7 +213,8 @@ void Bonsai::gradLossParam(
 
   if (trainer.model.hyperParams.numClasses > 2)
   {
-	MatrixXuf gradBestClass(gradOut.rows(), gradOut.cols());
+	Workspace::Scope scope;
+	MatrixXuf& gradBestClass = scope.matrix(gradOut.rows(), gradOut.cols());
 	gradYParam(gradBestClass, Y, X, ZX, trainer, trueBestClassIndex.row(1), margin);
 
 	gradOut -= gradBestClass;
@@ -233,7 +244,8 @@ void Bonsai::gradLossParam(
 
   if (trainer.model.hyperParams.numClasses > 2)
   {
-	MatrixXuf gradBestClass(gradOut.rows(), gradOut.cols());
+	Workspace::Scope scope;
+	MatrixXuf& gradBestClass = scope.matrix(gradOut.rows(), gradOut.cols());
 	gradYParam(gradBestClass, Y, X, ZX, trainer, trueBestClassIndex.row(1), margin);
 
 	gradOut -= gradBestClass;
@@ -369,14 +381,16 @@ MatrixXuf Bonsai::Armijo(std::function<FP_TYPE(const MatrixXuf&)> Loss,
   FP_TYPE s = (FP_TYPE)1.0;
   FP_TYPE beta = (FP_TYPE)0.5;
 
-  FP_TYPE initLoss = Loss(MatrixXuf(param));
+  Workspace::Scope scope;
+  const MatrixXuf& paramDense = denseView(scope, param);
+  FP_TYPE initLoss = Loss(paramDense);
 
   MatrixXuf paramPlusSGrad(param.rows(), param.cols());
   FP_TYPE curLoss;
 
   int runCount = 0;
   do {
-	paramPlusSGrad = MatrixXuf(param) - s*grad;
+	paramPlusSGrad = paramDense - s*grad;
 	hardThrsd(paramPlusSGrad, targetSparsity);
 	curLoss = Loss(paramPlusSGrad);
 	s *= beta;
@@ -390,6 +404,7 @@ void Bonsai::jointSgdBonsai(EdgeML::Bonsai::BonsaiTrainer& trainer)
 {
   Logger logger("jointSgdBonsai");
   Timer timer("jointSgdBonsai");
+  retainFreedMemory();
 
   enum training_phase {
 	DENSE_TRAIN, CORE_IHT_THRESH, CORE_IHT_FC, SPARSE_RETRAIN
@@ -427,10 +442,15 @@ void Bonsai::jointSgdBonsai(EdgeML::Bonsai::BonsaiTrainer& trainer)
   MatrixXuf gradW(trainer.model.params.W.rows(), trainer.model.params.W.cols());
   MatrixXuf gradTheta(trainer.model.params.Theta.rows(), trainer.model.params.Theta.cols());
 
+  AllocationStats iterStart = readAllocationStats();
+
   // TODO: update the hyperParams.iter to *= sqrt(ntrain).
   // TODO: Ask for more sensible default iteration parameters
   for (int i = 0; i < numBatches; ++i)
   {
+	// Temporaries of this batch; the full and the last partial batch each keep their own storage
+	Workspace::Scope scope;
+
 	if (end == trainer.data.Xtrain.cols())  end = 0;
 	begin = (i == 0) ? 0 : end;
 	end = std::min(begin + batchSize, trainer.data.Xtrain.cols());
@@ -441,8 +461,8 @@ void Bonsai::jointSgdBonsai(EdgeML::Bonsai::BonsaiTrainer& trainer)
 		+ "=========================== ");
 	LOG_INFO("points: (" + std::to_string(begin) + "," + std::to_string(end) + ")");
 
-	// Move to outside the loop
-	MatrixXuf ZX_i = MatrixXuf::Zero(trainer.model.params.Z.rows(), end - begin);
+	MatrixXuf& ZX_i = scope.matrix(trainer.model.params.Z.rows(), end - begin);
+	ZX_i.setZero();
 	SparseMatrixuf X_sliced = trainer.data.Xtrain.middleCols(begin, end - begin);
 	LabelMatType Y_sliced = trainer.data.Ytrain.middleCols(begin, end - begin);
 
@@ -466,7 +486,7 @@ void Bonsai::jointSgdBonsai(EdgeML::Bonsai::BonsaiTrainer& trainer)
 
 	timer.nextTime("starting gradZ");
 
-	mm(ZX_i, MatrixXuf(trainer.model.params.Z), CblasNoTrans,
+	mm(ZX_i, denseView(scope, trainer.model.params.Z), CblasNoTrans,
 	  X_sliced, CblasNoTrans, (FP_TYPE)1.0 / trainer.model.hyperParams.projectionDimension, (FP_TYPE)0.0L);
 
 	if (i == 0 || i == 2 * numBatches / 3 || i == 1 * numBatches / 3)
@@ -524,8 +544,9 @@ void Bonsai::jointSgdBonsai(EdgeML::Bonsai::BonsaiTrainer& trainer)
 	MatrixXuf Wupdated = Armijo<WMatType>(
 	  [&trainer, &X_sliced, &Y_sliced, &ZX_i](const MatrixXuf &W)->FP_TYPE
 	{
-	  FP_TYPE obj_val = trainer.computeObjective(MatrixXuf(trainer.model.params.Z), W,
-		MatrixXuf(trainer.model.params.V), MatrixXuf(trainer.model.params.Theta),
+	  Workspace::Scope scope;
+	  FP_TYPE obj_val = trainer.computeObjective(denseView(scope, trainer.model.params.Z), W,
+		denseView(scope, trainer.model.params.V), denseView(scope, trainer.model.params.Theta),
 		ZX_i, Y_sliced);
 	  return obj_val;
 	}
@@ -541,8 +562,9 @@ void Bonsai::jointSgdBonsai(EdgeML::Bonsai::BonsaiTrainer& trainer)
 	MatrixXuf Vupdated = Armijo<VMatType>(
 	  [&trainer, &X_sliced, &Y_sliced, &ZX_i](const MatrixXuf &V)->FP_TYPE
 	{
-	  FP_TYPE obj_val = trainer.computeObjective(MatrixXuf(trainer.model.params.Z), MatrixXuf(trainer.model.params.W),
-		V, MatrixXuf(trainer.model.params.Theta),
+	  Workspace::Scope scope;
+	  FP_TYPE obj_val = trainer.computeObjective(denseView(scope, trainer.model.params.Z), denseView(scope, trainer.model.params.W),
+		V, denseView(scope, trainer.model.params.Theta),
 		ZX_i, Y_sliced);
 	  return obj_val;
 	}
@@ -558,8 +580,9 @@ void Bonsai::jointSgdBonsai(EdgeML::Bonsai::BonsaiTrainer& trainer)
 	MatrixXuf Thetaupdated = Armijo<ThetaMatType>(
 	  [&trainer, &X_sliced, &Y_sliced, &ZX_i](const MatrixXuf &Theta)->FP_TYPE
 	{
-	  FP_TYPE obj_val = trainer.computeObjective(MatrixXuf(trainer.model.params.Z), MatrixXuf(trainer.model.params.W),
-		MatrixXuf(trainer.model.params.V), Theta,
+	  Workspace::Scope scope;
+	  FP_TYPE obj_val = trainer.computeObjective(denseView(scope, trainer.model.params.Z), denseView(scope, trainer.model.params.W),
+		denseView(scope, trainer.model.params.V), Theta,
 		ZX_i, Y_sliced);
 	  return obj_val;
 	}
@@ -574,9 +597,10 @@ void Bonsai::jointSgdBonsai(EdgeML::Bonsai::BonsaiTrainer& trainer)
 	MatrixXuf Zupdated = Armijo<ZMatType>(
 	  [&trainer, &X_sliced, &Y_sliced, &ZX_i](const MatrixXuf &Z)->FP_TYPE
 	{
+	  Workspace::Scope scope;
 	  mm(ZX_i, Z, CblasNoTrans, X_sliced, CblasNoTrans, (FP_TYPE)1.0L / trainer.model.hyperParams.projectionDimension, (FP_TYPE)0.0L);
-	  FP_TYPE obj_val = trainer.computeObjective(Z, MatrixXuf(trainer.model.params.W),
-		MatrixXuf(trainer.model.params.V), MatrixXuf(trainer.model.params.Theta),
+	  FP_TYPE obj_val = trainer.computeObjective(Z, denseView(scope, trainer.model.params.W),
+		denseView(scope, trainer.model.params.V), denseView(scope, trainer.model.params.Theta),
 		ZX_i, Y_sliced);
 	  return obj_val;
 	}
@@ -591,7 +615,7 @@ void Bonsai::jointSgdBonsai(EdgeML::Bonsai::BonsaiTrainer& trainer)
 
 	if (end >= trainer.data.Xtrain.cols())
 	{
-	  mm(ZX, MatrixXuf(trainer.model.params.Z), CblasNoTrans, trainer.data.Xtrain, CblasNoTrans, (FP_TYPE)1.0 / trainer.model.hyperParams.projectionDimension, (FP_TYPE)0.0L);
+	  mm(ZX, denseView(scope, trainer.model.params.Z), CblasNoTrans, trainer.data.Xtrain, CblasNoTrans, (FP_TYPE)1.0 / trainer.model.hyperParams.projectionDimension, (FP_TYPE)0.0L);
 	  FP_TYPE objval = trainer.computeObjective(ZX, trainer.data.Ytrain);
 
 	  LOG_INFO("Finished Iter:" + std::to_string(i / batchesPerIter) + "  "
@@ -599,6 +623,11 @@ void Bonsai::jointSgdBonsai(EdgeML::Bonsai::BonsaiTrainer& trainer)
 		+"nnz(V): " + std::to_string(countnnz(trainer.model.params.V)) + "/" + std::to_string(trainer.model.params.V.rows()*trainer.model.params.V.cols()) + "  " +
 		+"nnz(Theta): " + std::to_string(countnnz(trainer.model.params.Theta)) + "/" + std::to_string(trainer.model.params.Theta.rows()*trainer.model.params.Theta.cols()) + "  " +
 		+"nnz(Z): " + std::to_string(countnnz(trainer.model.params.Z)) + "/" + std::to_string(trainer.model.params.Z.rows()*trainer.model.params.Z.cols()));
+
+	  // Zero workspace allocations and page faults once every batch shape has been seen
+	  const AllocationStats iterEnd = readAllocationStats();
+	  LOG_INFO("Memory in iter " + std::to_string(i / batchesPerIter) + ": " + allocationStatsDelta(iterStart, iterEnd));
+	  iterStart = iterEnd;
 	}
 	iterations_within_phase++;
   }
@@ -7,6 +7,7 @@
 #include "utils.h"
 #include "blas_routines.h"
 #include "par_utils.h"
+#include "workspace.h"
 #include "Bonsai.h"
 
 
@@ -13,19 +13,11 @@ BonsaiModel::BonsaiModel(
   std::string modelFile, 
   const bool isDense)
 {
-  std::ifstream infile(modelFile, std::ios::in|std::ios::binary);
-  assert(infile.is_open());
+  std::vector<char> model;
+  const bool isModelRead = readModelFile(modelFile, model, isDense);
+  assert(isModelRead && "Model file is missing, truncated or corrupt");
 
-  size_t modelSize;
-  infile.read((char*)&modelSize, sizeof(modelSize));
-  infile.close();
-  infile.open(modelFile, std::ios::in|std::ios::binary);
-  char* modelBuff = new char[modelSize];
-  infile.read((char*)modelBuff, modelSize);
-  infile.close();  
-
-  (isDense) ? importModel(modelSize, modelBuff) : importSparseModel(modelSize, modelBuff);
-  delete[] modelBuff;
+  (isDense) ? importModel(model.size(), model.data()) : importSparseModel(model.size(), model.data());
 }
 
 BonsaiModel::BonsaiModel(
@@ -352,27 +344,90 @@ void BonsaiModel::importSparseModel(
   assert(numBytes == offset);
 }
 
-WMatType BonsaiModel::getW(const labelCount_t& classID)
+bool BonsaiModel::isModelBufferValid(
+  const size_t numBytes,
+  const char *const fromModel,
+  const bool isDense)
+{
+  size_t modelSize;
+  BonsaiHyperParams storedHyperParams;
+  size_t offset = sizeof(modelSize) + sizeof(storedHyperParams);
+  if (numBytes < offset) return false;
+
+  memcpy((void *)&modelSize, fromModel, sizeof(modelSize));
+  memcpy((void *)&storedHyperParams, fromModel + sizeof(modelSize), sizeof(storedHyperParams));
+  if (modelSize != numBytes || !storedHyperParams.isModelInitialized) return false;
+  if (storedHyperParams.treeDepth < 0 || storedHyperParams.treeDepth > 30
+    || storedHyperParams.internalNodes != (1 << storedHyperParams.treeDepth) - 1
+    || storedHyperParams.totalNodes != 2 * storedHyperParams.internalNodes + 1) return false;
+
+  // Same order and shapes as resizeParamsFromHyperParams and importModel
+  const Eigen::Index classNodes
+    = (Eigen::Index)storedHyperParams.internalClasses * storedHyperParams.totalNodes;
+  const Eigen::Index shapes[4][2] = {
+    { (Eigen::Index)storedHyperParams.projectionDimension, (Eigen::Index)storedHyperParams.dataDimension },
+    { classNodes, (Eigen::Index)storedHyperParams.projectionDimension },
+    { classNodes, (Eigen::Index)storedHyperParams.projectionDimension },
+    { (Eigen::Index)storedHyperParams.internalNodes, (Eigen::Index)storedHyperParams.projectionDimension } };
+  for (int param = 0; param < 4; ++param) {
+    const size_t bytes = isDense
+      ? checkDenseMatrixBuffer(fromModel + offset, numBytes - offset, shapes[param][0], shapes[param][1])
+      : checkSparseMatrixBuffer(fromModel + offset, numBytes - offset, shapes[param][0], shapes[param][1]);
+    if (bytes == 0) return false;
+    offset += bytes;
+  }
+  return offset == numBytes;
+}
+
+bool BonsaiModel::readModelFile(
+  const std::string& modelFile,
+  std::vector<char>& model,
+  const bool isDense)
+{
+  std::ifstream infile(modelFile, std::ios::in|std::ios::binary|std::ios::ate);
+  if (!infile.is_open()) {
+    LOG_WARNING("Cannot open model file " + modelFile);
+    return false;
+  }
+  const std::streamoff fileSize = infile.tellg();
+  infile.seekg(0);
+
+  // The model, whose size it starts with, is the whole file
+  model.resize(fileSize > 0 ? (size_t)fileSize : 0);
+  size_t modelSize;
+  if (model.size() < sizeof(modelSize) || !infile.read(model.data(), model.size())) {
+    LOG_WARNING("Model file " + modelFile + " is truncated");
+    return false;
+  }
+  memcpy((void *)&modelSize, model.data(), sizeof(modelSize));
+  if (modelSize != model.size() || !isModelBufferValid(model.size(), model.data(), isDense)) {
+    LOG_WARNING("Model file " + modelFile + " is truncated or corrupt");
+    return false;
+  }
+  return true;
+}
+
+WMatType BonsaiModel::getW(const labelCount_t& classID) const
 {
   return(params.W.middleRows(hyperParams.totalNodes*classID, hyperParams.totalNodes));
 }
 
-VMatType BonsaiModel::getV(const labelCount_t& classID)
+VMatType BonsaiModel::getV(const labelCount_t& classID) const
 {
   return(params.V.middleRows(hyperParams.totalNodes*classID, hyperParams.totalNodes));
 }
 
-WMatType BonsaiModel::getW(const labelCount_t& classID, const labelCount_t& globalNodeID)
+WMatType BonsaiModel::getW(const labelCount_t& classID, const labelCount_t& globalNodeID) const
 {
   return(params.W.middleRows(hyperParams.totalNodes*classID + globalNodeID, 1));
 }
 
-VMatType BonsaiModel::getV(const labelCount_t& classID, const labelCount_t& globalNodeID)
+VMatType BonsaiModel::getV(const labelCount_t& classID, const labelCount_t& globalNodeID) const
 {
   return(params.V.middleRows(hyperParams.totalNodes*classID + globalNodeID, 1));
 }
 
-ThetaMatType BonsaiModel::getTheta(const labelCount_t& globalNodeID)
+ThetaMatType BonsaiModel::getTheta(const labelCount_t& globalNodeID) const
 {
   return(params.Theta.middleRows(globalNodeID, 1));
 }
@@ -3,6 +3,7 @@
 
 #include "blas_routines.h" 
 #include "Bonsai.h"
+#include "numa_utils.h"
 
 using namespace EdgeML;
 using namespace	EdgeML::Bonsai;
@@ -16,6 +17,11 @@ void BonsaiPredictor::exitWithHelp()
   LOG_INFO("-N    : [Required] Number of data points in the test data.");
   LOG_INFO("-D    : [Required] Directory of data with test.txt present in it.");
   LOG_INFO("-M    : [Required] Directory of the Model (loadableModel and loadableMeanStd).");
+  LOG_INFO("-Q    : [Optional] File of held-out points, in the format of test.txt. Scores in int8, calibrated on them.");
+  LOG_INFO("-q    : [Optional] Number of points in the -Q file.");
+  LOG_INFO("-s    : [Optional] Int8 scales of the parameters. 0 (Per tensor), 1 (Per row, default).");
+  LOG_INFO("-o    : [Optional] Format of the predictions file. 0 (Text predClassAndScore, default), 1 (Binary predClassAndScore.bin).");
+  LOG_INFO("-c    : [Optional] Stream test.txt in chunks of this many points instead of loading it whole. -N then caps the points read; 0 reads the whole file.");
   exit(1);
 }
 
@@ -50,6 +56,25 @@ void BonsaiPredictor::setFromArgs(
           dataDir = argv[i];
           required++;
           break;
+        case 'Q':
+          calibrationFile = argv[i];
+          break;
+        case 'q':
+          numCalibration = int(atoi(argv[i]));
+          break;
+        case 's':
+          if (argv[i][0] == '0') quantScaleMode = perTensorScale;
+          else if (argv[i][0] == '1') quantScaleMode = perRowScale;
+          else exitWithHelp();
+          break;
+        case 'o':
+          if (argv[i][0] == '0') predictionFormat = textOutput;
+          else if (argv[i][0] == '1') predictionFormat = binaryOutput;
+          else exitWithHelp();
+          break;
+        case 'c':
+          chunkPoints = int(atoi(argv[i]));
+          break;
         default:
           LOG_INFO("Unknown option: " + std::to_string(argv[i - 1][1]));
           exitWithHelp();
@@ -64,10 +89,15 @@ BonsaiPredictor::BonsaiPredictor(
   const int argc,
   const char** argv)
 {
+  numCalibration = 0;
+  quantScaleMode = perRowScale;
+  predictionFormat = textOutput;
+  chunkPoints = 0;
   setFromArgs(argc, argv);
   std::string modelFile = modelDir + "/loadableModel"; 
  
   model = BonsaiModel(modelFile, 1);
+  initializeParams();
 
   feedDataValBuffer = new FP_TYPE[model.hyperParams.dataDimension];
   feedDataFeatureBuffer = new labelCount_t[model.hyperParams.dataDimension];
@@ -85,7 +115,17 @@ BonsaiPredictor::BonsaiPredictor(
   if(model.hyperParams.dataformatType != dataformatType)
     LOG_INFO("WARNING: The Train and Test input formats don't match.");
 
-  testData.loadDataFromFile(dataformatType, "", "", dataDir + "/test.txt");
+  if (chunkPoints == 0)
+    testData.loadDataFromFile(dataformatType, "", "", dataDir + "/test.txt");
+
+  if (!calibrationFile.empty()) {
+    if (numCalibration <= 0) exitWithHelp();
+    Data calibrationData(FileIngest,
+      DataFormatParams{numCalibration, 0, 0, model.hyperParams.numClasses, model.hyperParams.dataDimension});
+    calibrationData.loadDataFromFile(dataformatType, calibrationFile, "", "");
+    quantize(calibrationData.Xtrain, quantScaleMode);
+  }
+
   evaluate();
 }
 
@@ -95,6 +135,11 @@ BonsaiPredictor::BonsaiPredictor(
   const bool isDense)
   : model(numBytes, fromModel, isDense)
 {
+  numCalibration = 0;
+  quantScaleMode = perRowScale;
+  predictionFormat = textOutput;
+  chunkPoints = 0;
+  initializeParams();
   feedDataValBuffer = new FP_TYPE[model.hyperParams.dataDimension];
   feedDataFeatureBuffer = new labelCount_t[model.hyperParams.dataDimension];
 
@@ -102,6 +147,126 @@ BonsaiPredictor::BonsaiPredictor(
   stdDev = MatrixXuf::Zero(model.hyperParams.dataDimension, 1);
 }
 
+BonsaiPredictor::BonsaiPredictor(
+  const std::string& modelFile,
+  const std::string& meanStdFile)
+  : model(modelFile, true)
+{
+  numCalibration = 0;
+  quantScaleMode = perRowScale;
+  predictionFormat = textOutput;
+  chunkPoints = 0;
+  initializeParams();
+  feedDataValBuffer = new FP_TYPE[model.hyperParams.dataDimension];
+  feedDataFeatureBuffer = new labelCount_t[model.hyperParams.dataDimension];
+
+  mean = MatrixXuf::Zero(model.hyperParams.dataDimension, 1);
+  stdDev = MatrixXuf::Zero(model.hyperParams.dataDimension, 1);
+
+  importMeanStd(meanStdFile);
+}
+
+void BonsaiPredictor::initializeParams()
+{
+  paramZ.set(model.params.Z);
+  paramW.set(model.params.W);
+  paramV.set(model.params.V);
+  paramTheta.set(model.params.Theta);
+  LOG_INFO("Scoring with Z " + paramZ.description() + ", W " + paramW.description()
+    + ", V " + paramV.description() + " and Theta " + paramTheta.description());
+  isQuantized = false;
+}
+
+void BonsaiPredictor::quantize(
+  const SparseMatrixuf& calibrationX,
+  const QuantScaleMode mode)
+{
+  const BonsaiModel::BonsaiHyperParams& hyperParams = model.hyperParams;
+  assert((featureCount_t)calibrationX.rows() == hyperParams.dataDimension);
+  assert(calibrationX.cols() > 0);
+
+  isQuantized = false;
+  quantZ.quantize(model.params.Z, mode);
+  quantW.quantize(model.params.W, mode);
+  quantV.quantize(model.params.V, mode);
+  quantTheta.quantize(model.params.Theta, mode);
+
+  // One scale for ZX, covering all but the largest 0.1% of its values on the held-out points
+  MatrixXuf normalizedX = MatrixXuf(calibrationX);
+  for (Eigen::Index i = 0; i < normalizedX.cols(); ++i)
+    normalizedX.col(i) = (normalizedX.col(i) - mean).cwiseQuotient(stdDev);
+  normalizedX.row(hyperParams.dataDimension - 1).setOnes();
+  MatrixXuf ZX = MatrixXuf(hyperParams.projectionDimension, calibrationX.cols());
+  mm(ZX, paramZ, CblasNoTrans, normalizedX, CblasNoTrans,
+    (FP_TYPE)1.0 / hyperParams.projectionDimension, (FP_TYPE)0.0);
+  std::vector<FP_TYPE> magnitudes(ZX.size());
+  for (Eigen::Index i = 0; i < ZX.size(); ++i)
+    magnitudes[i] = std::abs(ZX.data()[i]);
+  quantZXScale = calibrateScale(magnitudes, (FP_TYPE)0.999, (FP_TYPE)0.0);
+
+  MatrixXuf floatScores(hyperParams.numClasses, calibrationX.cols());
+  scoreBatch(floatScores, calibrationX);
+  isQuantized = true;
+  MatrixXuf quantizedScores(hyperParams.numClasses, calibrationX.cols());
+  scoreBatch(quantizedScores, calibrationX);
+
+  dataCount_t agreeing = 0;
+  for (Eigen::Index i = 0; i < calibrationX.cols(); ++i) {
+    Eigen::Index floatTop, quantizedTop;
+    floatScores.col(i).maxCoeff(&floatTop);
+    quantizedScores.col(i).maxCoeff(&quantizedTop);
+    if (floatTop == quantizedTop)
+      ++agreeing;
+  }
+
+  LOG_INFO("Scoring in int8 with " + std::string(mode == perRowScale ? "per-row" : "per-tensor")
+    + " scales: Z, W, V and Theta take "
+    + std::to_string(quantZ.memoryBytes() + quantW.memoryBytes() + quantV.memoryBytes() + quantTheta.memoryBytes())
+    + " bytes, against "
+    + std::to_string(paramZ.memoryBytes() + paramW.memoryBytes() + paramV.memoryBytes() + paramTheta.memoryBytes())
+    + " for scoring in float");
+  LOG_INFO("Top label agrees with float scoring on " + std::to_string(agreeing) + " of "
+    + std::to_string(calibrationX.cols()) + " calibration points");
+}
+
+void BonsaiPredictor::quantizedScore(
+  const FP_TYPE *const X,
+  FP_TYPE *scores) const
+{
+  const BonsaiModel::BonsaiHyperParams& hyperParams = model.hyperParams;
+  thread_local std::vector<int8_t> xq, zxq;
+  thread_local std::vector<FP_TYPE> zx;
+  xq.resize(hyperParams.dataDimension);
+  zx.resize(hyperParams.projectionDimension);
+  zxq.resize(hyperParams.projectionDimension);
+
+  const FP_TYPE xScale = quantizeVector(xq.data(), X, hyperParams.dataDimension);
+  quantZ.rowsTimes(zx.data(), 0, hyperParams.projectionDimension, xq.data(),
+    xScale / hyperParams.projectionDimension);
+  quantizeVector(zxq.data(), zx.data(), hyperParams.projectionDimension, quantZXScale);
+
+  // Scales are positive, so the branch only needs the sign of the integer dot product
+  thread_local std::vector<int> path;
+  path.assign(1, 0);
+  int currNode = 0;
+  while (currNode < hyperParams.internalNodes) {
+    currNode = quantTheta.rowDot(currNode, zxq.data()) > 0 ? 2 * currNode + 1 : 2 * currNode + 2;
+    path.push_back(currNode);
+  }
+
+  FP_TYPE ymult = hyperParams.internalClasses <= 2 ? (FP_TYPE)-1.0 : (FP_TYPE)1.0;
+  for (labelCount_t c = 0; c < hyperParams.internalClasses; c++) {
+    FP_TYPE score = (FP_TYPE)0.0;
+    for (size_t i = 0; i < path.size(); i++) {
+      const Eigen::Index row = hyperParams.totalNodes * c + path[i];
+      const FP_TYPE WZX = quantW.rowDot(row, zxq.data()) * quantW.scale(row) * quantZXScale;
+      const FP_TYPE VZX = quantV.rowDot(row, zxq.data()) * quantV.scale(row) * quantZXScale;
+      score += WZX * tanh(hyperParams.Sigma * VZX);
+    }
+    scores[c] = ymult*score;
+  }
+}
+
 void BonsaiPredictor::importMeanStd(
   std::string meanStdFile)
 {
@@ -136,6 +301,26 @@ void BonsaiPredictor::importMeanStd(
   offset += sizeof(FP_TYPE) * stdDev.rows() * stdDev.cols();
 
   assert(numBytes == offset);
+  foldNormalization();
+}
+
+void BonsaiPredictor::foldNormalization()
+{
+  const featureCount_t numFeatures = model.hyperParams.dataDimension - 1; // The last dimension is the bias
+  const FP_TYPE invProjDim = (FP_TYPE)1.0 / model.hyperParams.projectionDimension;
+
+  // ((x - mean) ./ stdDev) with the bias feature set to 1, projected and scaled, is
+  // Z * diag(featureScale) * x + Z * offsetInput
+  featureScale = MatrixXuf::Zero(model.hyperParams.dataDimension, 1);
+  MatrixXuf offsetInput(model.hyperParams.dataDimension, 1);
+  for (featureCount_t f = 0; f < numFeatures; ++f) {
+    featureScale(f, 0) = invProjDim / stdDev(f, 0);
+    offsetInput(f, 0) = -mean(f, 0) * featureScale(f, 0);
+  }
+  offsetInput(numFeatures, 0) = invProjDim;
+
+  projectedOffset.resize(model.hyperParams.projectionDimension, 1);
+  paramZ.timesVector(projectedOffset.data(), offsetInput.data());
 }
 
 
@@ -148,48 +333,60 @@ BonsaiPredictor::~BonsaiPredictor()
 FP_TYPE BonsaiPredictor::predictionScoreOfClassID(
   const MatrixXuf& ZX,
   const std::vector<int> path,
-  const labelCount_t& ClassID)
+  const labelCount_t& ClassID) const
 {
   FP_TYPE score = (FP_TYPE)0.0;
   // Hadamard
   MatrixXuf WZX = MatrixXuf::Zero(1, 1);
   MatrixXuf VZX = MatrixXuf::Zero(1, 1);
   for (int i = 0; i < path.size(); i++) {
-    mm(WZX, model.getW(ClassID, path[i]), CblasNoTrans, ZX, CblasNoTrans, (FP_TYPE)1.0, (FP_TYPE)0.0L);
-    mm(VZX, model.getV(ClassID, path[i]), CblasNoTrans, ZX, CblasNoTrans, (FP_TYPE)1.0, (FP_TYPE)0.0L);
+    const Eigen::Index row = model.hyperParams.totalNodes * ClassID + path[i];
+    paramW.rowsTimes(WZX, row, 1, ZX);
+    paramV.rowsTimes(VZX, row, 1, ZX);
     score += WZX(0, 0) * tanh(model.hyperParams.Sigma * VZX(0, 0));
   }
   return score;
 }
 
-std::vector<int> BonsaiPredictor::treePath(const MatrixXuf& ZX)
+std::vector<int> BonsaiPredictor::treePath(const MatrixXuf& ZX) const
 {
   std::vector<int> visitedNodesList;
   visitedNodesList.push_back(0);
   int curr_node = 0;
   MatrixXuf ThetaZX = MatrixXuf::Zero(1, 1);
   while (curr_node < model.hyperParams.internalNodes) {
-    mm(ThetaZX, model.getTheta(curr_node), CblasNoTrans, ZX, CblasNoTrans, (FP_TYPE)1.0, (FP_TYPE)0.0L);
+    paramTheta.rowsTimes(ThetaZX, curr_node, 1, ZX);
     curr_node = ThetaZX(0, 0) > (FP_TYPE)0.0 ? 2 * curr_node + 1 : 2 * curr_node + 2;
     visitedNodesList.push_back(curr_node);
   }
   return visitedNodesList;
 }
 
+void BonsaiPredictor::projectionScore(
+  const MatrixXuf& ZX,
+  FP_TYPE *scores) const
+{
+  std::vector<int> path = treePath(ZX);
+  FP_TYPE ymult = model.hyperParams.internalClasses <= 2 ? (FP_TYPE)-1.0 : (FP_TYPE)1.0;
+  for (labelCount_t c = 0; c < model.hyperParams.internalClasses; c++)
+    scores[c] = ymult*predictionScoreOfClassID(ZX, path, c);
+}
+
 void BonsaiPredictor::predictionScore(
   const MatrixXuf& X,
   FP_TYPE *scores)
 {
   assert(X.cols() == 1);
+  if (isQuantized) {
+    quantizedScore(X.data(), scores);
+    return;
+  }
   MatrixXuf ZX = MatrixXuf(model.hyperParams.projectionDimension, 1);
 
-  mm(ZX, model.params.Z, CblasNoTrans, X, CblasNoTrans,
+  mm(ZX, paramZ, CblasNoTrans, X, CblasNoTrans,
     (FP_TYPE)1.0 / model.hyperParams.projectionDimension, (FP_TYPE)0.0);
 
-  std::vector<int> path = treePath(ZX);
-  FP_TYPE ymult = model.hyperParams.internalClasses <= 2 ? (FP_TYPE)-1.0 : (FP_TYPE)1.0;
-  for (labelCount_t c = 0; c < model.hyperParams.internalClasses; c++)
-    scores[c] = ymult*predictionScoreOfClassID(ZX, path, c);
+  projectionScore(ZX, scores);
 }
 
 void BonsaiPredictor::predictionSparseScore(
@@ -197,15 +394,17 @@ void BonsaiPredictor::predictionSparseScore(
   FP_TYPE *scores)
 {
   assert(X.cols() == 1);
-  MatrixXuf ZX = MatrixXuf(model.hyperParams.projectionDimension, 1);
+  if (isQuantized) {
+    quantizedScore(MatrixXuf(X).data(), scores);
+    return;
+  }
+  MatrixXuf ZX = MatrixXuf::Zero(model.hyperParams.projectionDimension, 1);
 
-  mm(ZX, model.params.Z, CblasNoTrans, MatrixXuf(X), CblasNoTrans,
-    (FP_TYPE)1.0 / model.hyperParams.projectionDimension, (FP_TYPE)0.0);
+  const FP_TYPE invProjDim = (FP_TYPE)1.0 / model.hyperParams.projectionDimension;
+  for (SparseMatrixuf::InnerIterator it(X, 0); it; ++it)
+    paramZ.columnAxpy(ZX.data(), it.row(), invProjDim * it.value());
 
-  std::vector<int> path = treePath(ZX);
-  FP_TYPE ymult = model.hyperParams.internalClasses <= 2 ? (FP_TYPE)-1.0 : (FP_TYPE)1.0;
-  for (labelCount_t c = 0; c < model.hyperParams.internalClasses; c++)
-    scores[c] = ymult*predictionScoreOfClassID(ZX, path, c);
+  projectionScore(ZX, scores);
 }
 
 void BonsaiPredictor::scoreSparseDataPoint(
@@ -216,6 +415,19 @@ void BonsaiPredictor::scoreSparseDataPoint(
 {
   memset(scores, 0, sizeof(FP_TYPE)*model.hyperParams.numClasses);
 
+  if (!isQuantized) {
+    assert((featureCount_t)featureScale.rows() == model.hyperParams.dataDimension);
+    MatrixXuf ZX = projectedOffset;
+    for (featureCount_t f = 0; f < numIndices; ++f) {
+      assert(indices[f] < model.hyperParams.dataDimension);
+      // The bias feature has scale 0, its value is in projectedOffset
+      paramZ.columnAxpy(ZX.data(), indices[f], values[f] * featureScale(indices[f], 0));
+    }
+    projectionScore(ZX, scores);
+    return;
+  }
+
+  // Int8 scoring quantizes the whole normalized point
   MatrixXuf dataPoint = MatrixXuf::Zero(model.hyperParams.dataDimension, 1);
 
   for (featureCount_t f = 0; f < numIndices; ++f)
@@ -256,9 +468,173 @@ void BonsaiPredictor::scoreDenseDataPoint(
   predictionScore(dataPoint, scores);
 }
 
+void BonsaiPredictor::scoreBatch(
+  MatrixXuf& Yscores,
+  const SparseMatrixuf& X) const
+{
+  assert((featureCount_t)X.rows() == model.hyperParams.dataDimension);
+  assert((labelCount_t)Yscores.rows() == model.hyperParams.numClasses);
+  assert(Yscores.cols() == X.cols());
+
+  if (isQuantized) {
+    MatrixXuf normalizedX = MatrixXuf(X);
+    for (Eigen::Index i = 0; i < normalizedX.cols(); ++i)
+      normalizedX.col(i) = (normalizedX.col(i) - mean).cwiseQuotient(stdDev);
+    normalizedX.row(model.hyperParams.dataDimension - 1).setOnes();
+    for (Eigen::Index i = 0; i < normalizedX.cols(); ++i)
+      quantizedScore(normalizedX.col(i).data(), Yscores.col(i).data());
+    return;
+  }
+
+  // Only the nonzeros are scaled; the bias feature gets scale 0
+  assert((featureCount_t)featureScale.rows() == model.hyperParams.dataDimension);
+  SparseMatrixuf scaledX(X);
+  for (Eigen::Index k = 0; k < scaledX.outerSize(); ++k)
+    for (SparseMatrixuf::InnerIterator it(scaledX, k); it; ++it)
+      it.valueRef() *= featureScale(it.row(), 0);
+
+  MatrixXuf ZX = MatrixXuf(model.hyperParams.projectionDimension, X.cols());
+  mm(ZX, paramZ, CblasNoTrans, scaledX, CblasNoTrans, (FP_TYPE)1.0, (FP_TYPE)0.0);
+  ZX.colwise() += projectedOffset.col(0);
+
+  Yscores.setZero();
+  for (Eigen::Index i = 0; i < ZX.cols(); ++i) {
+    MatrixXuf ZXi = ZX.col(i);
+    projectionScore(ZXi, Yscores.col(i).data());
+  }
+}
+
+template<class MatType>
+static bool allFinite(const MatType& A)
+{
+  return MatrixXuf(A).allFinite();
+}
+
+bool BonsaiPredictor::isModelValid() const
+{
+  const BonsaiModel::BonsaiHyperParams& hyperParams = model.hyperParams;
+
+  if ((featureCount_t)model.params.Z.rows() != hyperParams.projectionDimension
+    || (featureCount_t)model.params.Z.cols() != hyperParams.dataDimension
+    || (labelCount_t)model.params.W.rows() != hyperParams.internalClasses * hyperParams.totalNodes
+    || (labelCount_t)model.params.V.rows() != hyperParams.internalClasses * hyperParams.totalNodes
+    || model.params.Theta.rows() != hyperParams.internalNodes
+    || (featureCount_t)model.params.W.cols() != hyperParams.projectionDimension
+    || (featureCount_t)model.params.V.cols() != hyperParams.projectionDimension
+    || (featureCount_t)model.params.Theta.cols() != hyperParams.projectionDimension) {
+    LOG_WARNING("Model parameter shapes do not match its hyperparameters");
+    return false;
+  }
+  if (!std::isfinite(hyperParams.Sigma)) {
+    LOG_WARNING("Model has a non-finite sigma");
+    return false;
+  }
+  if (!allFinite(model.params.Z) || !allFinite(model.params.W)
+    || !allFinite(model.params.V) || !allFinite(model.params.Theta)) {
+    LOG_WARNING("Model parameters contain non-finite values");
+    return false;
+  }
+  if (!mean.allFinite() || !stdDev.allFinite()) {
+    LOG_WARNING("Mean or stdDev contain non-finite values");
+    return false;
+  }
+  // The last dimension is the constant bias feature and is overwritten with ones
+  if ((stdDev.topRows(hyperParams.dataDimension - 1).array() == (FP_TYPE)0.0).any()) {
+    LOG_WARNING("stdDev contains zeros");
+    return false;
+  }
+  return true;
+}
+
 void BonsaiPredictor::evaluate()
 {
-  batchEvaluate(testData.Xtest, testData.Ytest, dataDir, modelDir);
+  if (chunkPoints > 0)
+    streamEvaluate(dataDir + "/test.txt", chunkPoints, numTest, dataDir, modelDir);
+  else
+    batchEvaluate(testData.Xtest, testData.Ytest, dataDir, modelDir);
+}
+
+labelCount_t BonsaiPredictor::writePrediction(
+  OutputWriter& predwriter,
+  const FP_TYPE *const scores) const
+{
+  labelCount_t predLabel = 0;
+  FP_TYPE maxScore = scores[0];
+  for (labelCount_t j = 0; j < model.hyperParams.numClasses; j++) {
+    if (maxScore <= scores[j]) {
+      maxScore = scores[j];
+      predLabel = j;
+    }
+  }
+
+  const labelCount_t outLabel = model.hyperParams.isOneIndex ? predLabel + 1 : predLabel;
+  if (predwriter.format() == binaryOutput) {
+    predwriter.putUint32((uint32_t)outLabel);
+    predwriter.putFloat32((float)maxScore);
+  }
+  else {
+    // maxScore as ostream's default precision printed it
+    predwriter.putInt(outLabel);
+    predwriter.put('\t');
+    predwriter.putFloat(maxScore, 6);
+    predwriter.put('\n');
+  }
+  return predLabel;
+}
+
+void BonsaiPredictor::reportAccuracy(
+  const FP_TYPE accuracy,
+  const std::string& dataDir,
+  const std::string& currResultsPath)
+{
+  LOG_INFO("Final Test Accuracy = " + std::to_string(accuracy));
+
+  dumpRunInfo(currResultsPath, accuracy);
+
+  std::ofstream allDumper(dataDir + "/BonsaiResults" + "/resultDump", std::ofstream::out | std::ofstream::app);
+  allDumper << totalNonZeros() << " " << accuracy << " " << currResultsPath << "\n";
+  allDumper.close();
+}
+
+void BonsaiPredictor::streamEvaluate(
+  const std::string& testFile,
+  const dataCount_t chunkSize,
+  const dataCount_t maxPoints,
+  const std::string& dataDir,
+  const std::string& currResultsPath)
+{
+  const bool isBinary = predictionFormat == binaryOutput;
+  std::string predLabelPath = currResultsPath + (isBinary ? "/predClassAndScore.bin" : "/predClassAndScore");
+  OutputWriter predwriter(predLabelPath, predictionFormat);
+
+  LOG_INFO("Streaming " + testFile + " in chunks of " + std::to_string(chunkSize) + " points");
+  DataStream stream(testFile, dataformatType, model.hyperParams.dataDimension,
+    model.hyperParams.numClasses, chunkSize, maxPoints);
+  assert(stream.isOpen());
+
+  SparseMatrixuf X, Y;
+  MatrixXuf scores;
+  dataCount_t correct = 0;
+  while (stream.next(X, Y)) {
+    scores.resize(model.hyperParams.numClasses, X.cols());
+    scoreBatch(scores, X);
+    for (Eigen::Index i = 0; i < X.cols(); ++i) {
+      const labelCount_t predLabel = writePrediction(predwriter, scores.col(i).data());
+      // The last label of a point, as batchEvaluate takes it
+      labelCount_t label = -1;
+      for (SparseMatrixuf::InnerIterator it(Y, i); it; ++it)
+        label = (labelCount_t)it.row();
+      if (label == predLabel)
+        correct++;
+    }
+    predwriter.flush();
+  }
+
+  if (!predwriter.close())
+    LOG_WARNING("Error in writing " + predLabelPath);
+
+  assert(stream.count() > 0);
+  reportAccuracy((FP_TYPE)correct / (FP_TYPE)stream.count(), dataDir, currResultsPath);
 }
 
 void BonsaiPredictor::batchEvaluate(
@@ -267,8 +643,9 @@ void BonsaiPredictor::batchEvaluate(
   const std::string& dataDir,
   const std::string& currResultsPath)
 {
-  std::string predLabelPath = currResultsPath + "/predClassAndScore";
-  std::ofstream predwriter(predLabelPath);
+  const bool isBinary = predictionFormat == binaryOutput;
+  std::string predLabelPath = currResultsPath + (isBinary ? "/predClassAndScore.bin" : "/predClassAndScore");
+  OutputWriter predwriter(predLabelPath, predictionFormat);
 
   dataCount_t nTest = Xtest.cols();
   featureCount_t dataDim = Xtest.rows();
@@ -281,42 +658,66 @@ void BonsaiPredictor::batchEvaluate(
 
   labelCount_t *label = new labelCount_t[1];
 
+#ifdef NUMA
+  // Score one partition of the test points per node, each against a copy of the model on its node
+  MatrixXuf allScores;
+  if (NumaTopology::host().numNodes() > 1 && !isQuantized) {
+    size_t modelSize = model.modelStat();
+    char *modelBuffer = new char[modelSize];
+    model.exportModel(modelSize, modelBuffer);
+
+    size_t meanStdSize = sizeof(meanStdSize) + sizeof(FP_TYPE) * (mean.size() + stdDev.size());
+    char *meanStdBuffer = new char[meanStdSize];
+    memcpy(meanStdBuffer, &meanStdSize, sizeof(meanStdSize));
+    memcpy(meanStdBuffer + sizeof(meanStdSize), mean.data(), sizeof(FP_TYPE) * mean.size());
+    memcpy(meanStdBuffer + sizeof(meanStdSize) + sizeof(FP_TYPE) * mean.size(), stdDev.data(), sizeof(FP_TYPE) * stdDev.size());
+
+    NumaReplicated<BonsaiPredictor> replicas([&]() {
+      BonsaiPredictor *replica = new BonsaiPredictor(modelSize, modelBuffer);
+      replica->importMeanStd(meanStdSize, meanStdBuffer);
+      return replica;
+    });
+    delete[] modelBuffer;
+    delete[] meanStdBuffer;
+
+    allScores = MatrixXuf::Zero(model.hyperParams.numClasses, nTest);
+    numaPartitionedScore(Xtest, allScores, 1024,
+      [&replicas](const int node, MatrixXuf& Yscores, const SparseMatrixuf& X) {
+        replicas.onNode(node).scoreBatch(Yscores, X);
+      });
+  }
+#endif
+
   int correct = 0;
   for (dataCount_t i = 0; i < nTest; ++i) {
-    featureCount_t count = 0;
-    while (count < dataDim) {
-      trainvals[count] = Xtest.coeff(count, i);
-      count++;
-    }
+#ifdef NUMA
+    if (allScores.cols() == nTest)
+      memcpy(scoreArray, allScores.col(i).data(), sizeof(FP_TYPE) * nLabels);
+    else
+#endif
+    {
+      featureCount_t count = 0;
+      while (count < dataDim) {
+        trainvals[count] = Xtest.coeff(count, i);
+        count++;
+      }
 
-    scoreDenseDataPoint(scoreArray, trainvals);
+      scoreDenseDataPoint(scoreArray, trainvals);
+    }
 
-    labelCount_t predLabel = 0;
-    FP_TYPE maxScore = scoreArray[0];
-    for (labelCount_t j = 0; j < nLabels; j++) {
-      if (maxScore <= scoreArray[j]) {
-        maxScore = scoreArray[j];
-        predLabel = j;
-      }
+    const labelCount_t predLabel = writePrediction(predwriter, scoreArray);
+    for (labelCount_t j = 0; j < nLabels; j++)
       if (Ytest.coeff(j, i) == 1) label[0] = j;
-    }
 
     if (label[0] == predLabel) correct++;
-    (model.hyperParams.isOneIndex) ? predLabel++ : predLabel;
-    predwriter << predLabel << "\t" << maxScore << "\n";
   }
 
-  predwriter.close();
+  if (!predwriter.close())
+    LOG_WARNING("Error in writing " + predLabelPath);
 
   FP_TYPE accuracy = (FP_TYPE)(correct) / ((FP_TYPE)nTest);
 
-  LOG_INFO("Final Test Accuracy = " + std::to_string(accuracy));
-
-  dumpRunInfo(currResultsPath, accuracy);
-
-  std::ofstream allDumper(dataDir + "/BonsaiResults" + "/resultDump", std::ofstream::out | std::ofstream::app);
-  allDumper << totalNonZeros() << " " << accuracy << " " << currResultsPath << "\n";
-  allDumper.close();
+  reportAccuracy(accuracy, dataDir, currResultsPath);
 
   delete[] scoreArray;
   delete[] trainvals;
@@ -2,6 +2,7 @@
 // Licensed under the MIT license.
 
 #include "BonsaiFunctions.h"
+#include "numa_utils.h"
 
 using namespace EdgeML;
 using namespace EdgeML::Bonsai;
@@ -172,11 +173,20 @@ void BonsaiTrainer::finalizeData()
   initializeTrainVariables(data.Ytrain);
 
   meanVarNormalize(data.Xtrain, mean, stdDev);
+
+#ifdef NUMA
+  // Spread the training data over the nodes so that no single memory controller serves all reads
+  pinParallelWorkers();
+  interleaveMatrix(data.Xtrain);
+  interleaveMatrix(data.Ytrain);
+#endif
 }
 
 FP_TYPE BonsaiTrainer::computeObjective(const MatrixXuf& ZX, const LabelMatType& Y)
 {
-  return computeObjective(MatrixXuf(model.params.Z), MatrixXuf(model.params.W), MatrixXuf(model.params.V), MatrixXuf(model.params.Theta), ZX, Y);
+  Workspace::Scope scope;
+  return computeObjective(denseView(scope, model.params.Z), denseView(scope, model.params.W),
+    denseView(scope, model.params.V), denseView(scope, model.params.Theta), ZX, Y);
 }
 
 FP_TYPE BonsaiTrainer::computeObjective(
@@ -418,12 +428,11 @@ void BonsaiTrainer::computeScoreOfClassID(
   assert(VXClassIDScratch.rows() == model.hyperParams.totalNodes);
   assert(VXClassIDScratch.cols() == ZX.cols());
 
-  mm(WXClassIDScratch,
-    MatrixXuf(Wmat.middleRows(model.hyperParams.totalNodes*classID, model.hyperParams.totalNodes)), CblasNoTrans,
-    ZX, CblasNoTrans, (FP_TYPE)1.0, (FP_TYPE)0.0L);
-  mm(VXClassIDScratch,
-    MatrixXuf(Vmat.middleRows(model.hyperParams.totalNodes*classID, model.hyperParams.totalNodes)), CblasNoTrans,
-    ZX, CblasNoTrans, (FP_TYPE)1.0, (FP_TYPE)0.0L);
+  // Products with the rows of the class, without copying them out
+  WXClassIDScratch.noalias()
+    = Wmat.middleRows(model.hyperParams.totalNodes*classID, model.hyperParams.totalNodes) * ZX;
+  VXClassIDScratch.noalias()
+    = Vmat.middleRows(model.hyperParams.totalNodes*classID, model.hyperParams.totalNodes) * ZX;
 
   // The code below this commented section is an optimized version
   /* for (int i = 0; i < VXClassIDScratch.rows(); i++)
@@ -440,8 +449,7 @@ void BonsaiTrainer::computeScoreOfClassID(
   // 3-way in-place hadamard into WXClassIDScratch
   hadamard3(WXClassIDScratch, WXClassIDScratch, VXClassIDScratch, treeCache.nodeProbability);
   // This computes the column sums of WXClassIDScratch
-  MatrixXuf onesVec = MatrixXuf::Ones(1, WXClassIDScratch.rows());
-  mm(Score, onesVec, CblasNoTrans, WXClassIDScratch, CblasNoTrans, (FP_TYPE)1.0, (FP_TYPE)0.0);
+  Score.noalias() = WXClassIDScratch.colwise().sum();
 }
 
 void BonsaiTrainer::getTrueBestClass(
@@ -452,14 +460,15 @@ void BonsaiTrainer::getTrueBestClass(
   const LabelMatType& Y,
   const MatrixXuf& ZX)
 {
-  MatrixXuf WXClassID = MatrixXuf::Zero(model.hyperParams.totalNodes, ZX.cols());
-  MatrixXuf VXClassID = MatrixXuf::Zero(model.hyperParams.totalNodes, ZX.cols());
+  Workspace::Scope scope;
+  MatrixXuf& WXClassID = scope.matrix(model.hyperParams.totalNodes, ZX.cols());
+  MatrixXuf& VXClassID = scope.matrix(model.hyperParams.totalNodes, ZX.cols());
+  MatrixXuf& ScoreCL = scope.matrix(1, ZX.cols());
 
   // trueClassScore+=ScoreCL o Y.row(class_i);
   // bestClassScore=max(bestClassScore,ScoreCL o (1.0 - Y.row(class_i))) -- incorrect;
   if (model.hyperParams.internalClasses <= 2)
   {
-    MatrixXuf ScoreCL = MatrixXuf::Zero(1, ZX.cols());
     computeScoreOfClassID(ScoreCL, Wmat, Vmat, ZX, 0, WXClassID, VXClassID);
     trueBestScore.row(0) = ScoreCL;
     trueBestScore.row(1) = MatrixXuf::Zero(1, trueBestScore.cols());
@@ -468,7 +477,6 @@ void BonsaiTrainer::getTrueBestClass(
   {
     for (labelCount_t class_i = 0; class_i < model.hyperParams.internalClasses; class_i++)
     {
-      MatrixXuf ScoreCL = MatrixXuf::Zero(1, ZX.cols());
       computeScoreOfClassID(ScoreCL, Wmat, Vmat, ZX, class_i, WXClassID, VXClassID);
 
       for (int n = 0; n < ZX.cols(); n++)
@@ -490,7 +498,8 @@ void BonsaiTrainer::getTrueBestClass(
 
 void BonsaiTrainer::fillNodeProbability(const MatrixXuf& ZX)
 {
-  treeCache.fillNodeProbability(model, MatrixXuf(model.params.Theta), ZX);
+  Workspace::Scope scope;
+  treeCache.fillNodeProbability(model, denseView(scope, model.params.Theta), ZX);
 }
 
 void BonsaiTrainer::TreeCache::fillNodeProbability(
@@ -531,12 +540,12 @@ void BonsaiTrainer::TreeCache::fillWX(
   const MatrixXufINT& classID)
 {
   //treeCache.WXWeight = MatrixXuf::Zero(totalNodes*internalClasses, Xdata.cols());
+  // Written in place: no per-point copies of the column or of the rows of the class
   for (int n = 0; n < Xdata.cols(); n++)
   {
-    MatrixXuf X = Xdata.col(n);
-    MatrixXuf WXWeightcolN = MatrixXuf::Zero(model.hyperParams.totalNodes, 1);// treeCache.WXWeight.block(classID(0, n)*totalNodes, n, totalNodes, 1);
-    mm(WXWeightcolN, MatrixXuf(Wmat.middleRows(model.hyperParams.totalNodes*(labelCount_t)classID(0, n), model.hyperParams.totalNodes)), CblasNoTrans, X, CblasNoTrans, (FP_TYPE)1.0, (FP_TYPE)0.0L);
-    WXWeight.block((labelCount_t)classID(0, n)*model.hyperParams.totalNodes, n, model.hyperParams.totalNodes, 1) = WXWeightcolN;
+    const labelCount_t classNodesStart = model.hyperParams.totalNodes*(labelCount_t)classID(0, n);
+    WXWeight.block(classNodesStart, n, model.hyperParams.totalNodes, 1).noalias()
+      = Wmat.middleRows(classNodesStart, model.hyperParams.totalNodes) * Xdata.col(n);
   }
 };
 
@@ -553,11 +562,9 @@ void BonsaiTrainer::TreeCache::fillTanhVX(
 {
   for (int n = 0; n < Xdata.cols(); n++)
   {
-    MatrixXuf X = Xdata.col(n);
-    // Need a function which returns it as a reference to make it faster
-    MatrixXuf VXWeightcolN = MatrixXuf::Zero(model.hyperParams.totalNodes, 1);;// treeCache.tanhVXWeight.block(classID(0, n)*totalNodes, n, totalNodes, 1);
-    mm(VXWeightcolN, MatrixXuf(Vmat.middleRows(model.hyperParams.totalNodes*(labelCount_t)classID(0, n), model.hyperParams.totalNodes)), CblasNoTrans, X, CblasNoTrans, (FP_TYPE)1.0, (FP_TYPE)0.0L);
-    tanhVXWeight.block((labelCount_t)classID(0, n)*(model.hyperParams.totalNodes), n, (model.hyperParams.totalNodes), 1) = VXWeightcolN;
+    const labelCount_t classNodesStart = model.hyperParams.totalNodes*(labelCount_t)classID(0, n);
+    tanhVXWeight.block(classNodesStart, n, model.hyperParams.totalNodes, 1).noalias()
+      = Vmat.middleRows(classNodesStart, model.hyperParams.totalNodes) * Xdata.col(n);
   }
 };
 
@@ -5,7 +5,12 @@
 #define __PROTONN_H__
 
 #include "Data.h"
+#include "data_stream.h"
+#include "kd_tree.h"
 #include "metrics.h"
+#include "output_writer.h"
+#include "param_matrix.h"
+#include "quantized.h"
 
 namespace EdgeML
 {
@@ -96,6 +101,10 @@ namespace EdgeML
 
       struct ProtoNNParams params;
       struct ProtoNNHyperParams hyperParams;
+
+      // Precision of the parameters stored dense in the model file. Kept out of hyperParams,
+      // whose layout old model files fix. Reduced-precision models also score in it.
+      ParamPrecision paramPrecision = fullPrecision;
       size_t modelStat();
 
       //
@@ -104,6 +113,20 @@ namespace EdgeML
       void exportModel(const size_t modelSize, char *const toModel);
       void importModel(const size_t numBytes, const char *const fromModel);
 
+      //
+      // Whether importModel can read @fromModel: its hyperparameters and flags are sane, and
+      // the parameters they describe fill exactly @numBytes. Never asserts, so models from
+      // untrusted files (e.g. reloaded by a running server) can be checked before importing.
+      //
+      static bool isModelBufferValid(const size_t numBytes, const char *const fromModel);
+
+      //
+      // Reads a model file, i.e. the model size and then the model, into @model.
+      // Returns false if the file is unreadable, its size does not match the size it
+      // stores, or the model fails isModelBufferValid.
+      //
+      static bool readModelFile(const std::string& modelFile, std::vector<char>& model);
+
 
       ProtoNNModel();
       ProtoNNModel(std::string fromModelFile);
@@ -128,10 +151,18 @@ namespace EdgeML
       std::string modelDir;
       std::string outDir;
       std::string commandLine;
+      FP_TYPE compactionBudget = -1; // Accuracy drop allowed to prototype compaction, negative for none
+      int numWorkers = 1;            // Data-parallel training processes
+      bool allowColumnSparseW = false; // Column-sparse W updates on sparse data (-L 1), see altMinSGD
 
       void normalize();
       void initializeModel();
 
+      // Runs altMinSGD in numWorkers processes forked from this one, each on an equal shard
+      // of the training data, and leaves the model they agree on in this one. The model is
+      // initialized after forking, as BLAS must not have run before.
+      void trainDataParallel(FP_TYPE *const stats);
+
     public:
         //
         // Call this constructor if:
@@ -225,17 +256,69 @@ namespace EdgeML
       Data testData;
       FP_TYPE* dataPoint;	// for scoreSparseDataPoint
 
-#ifdef SPARSE_Z_PROTONN
-      // for mkl csc_mv call
-      char matdescra[6] = { 'G', 'X', 'X', 'C', 'X', 'X' }; // 'X' means unused
-      char transa = 'n';
-      MKL_INT ZRows;
-      MKL_INT ZCols;
-      FP_TYPE alpha, beta;
-#endif
+      // W and Z as used for scoring, dense or sparse by their density in this model,
+      // whatever SPARSE_W_PROTONN/SPARSE_Z_PROTONN the model was trained with.
+      // Dense ones are held in model.paramPrecision.
+      ParamMatrix paramW, paramZ;
+
+      // Set by -p, to score in another precision than the model file was stored in
+      bool isPrecisionOverridden;
+      ParamPrecision overriddenPrecision;
+
+      // Int8 scoring engine, set up by quantize(). W and Z have their own scales; WX and the
+      // prototypes (rows of quantB) share one, so that distances are integer sums.
+      bool isQuantized;
+      QuantizedMatrix quantW, quantZ, quantB;
+      std::vector<int64_t> quantBNormSq;
+      FP_TYPE quantWXScale;
+
+      // Kernel of a prototype relative to the nearest one, in units of 1/127, indexed by the
+      // difference of their integer distances shifted right by quantKernelShift. Differences
+      // past the end of the table have kernels that round to 0.
+      std::vector<int8_t> quantKernelTable;
+      int quantKernelShift;
+
+      // Held-out points for quantize() from the command line (-Q, -q, -s)
+      std::string calibrationFile;
+      dataCount_t ncalibration;
+      QuantScaleMode quantScaleMode;
+
+      // Int8 scores of one normalized dense point. Thread safe.
+      void scoreQuantized(
+        FP_TYPE *const scores,
+        const FP_TYPE *const values) const;
+
+      // Prototype index, set up by indexPrototypes(). Scoring then only visits the prototypes
+      // within indexRadius of WX.
+      bool isIndexed;
+      KdTree prototypeIndex;
+      FP_TYPE indexRadius;
+
+      // Cutoff from the command line (-r), 0 for exact scoring
+      FP_TYPE indexCutoff;
+
+      // Format of the saveTopKScores file, from the command line (-o)
+      OutputFormat predictionFormat;
+
+      // Points per chunk when the test file is streamed rather than loaded, from the command
+      // line (-c); 0 loads it whole
+      dataCount_t chunkPoints;
+
+      // Scores of the point projected to @wx, from the indexed prototypes. Returns the number
+      // of prototypes whose distance was computed. Thread safe.
+      size_t scoreIndexed(
+        FP_TYPE *const scores,
+        const FP_TYPE *const wx) const;
 
       void RBF();
 
+      // Sets up the buffers and model constants used by the point-wise scoring calls
+      void initializePointScoring();
+
+      // Gives @replica, loaded from this model's exported bytes, the parameters and scoring
+      // setup of this predictor as it scores them: -p, quantize() and indexPrototypes()
+      void copyScoringSetup(ProtoNNPredictor& replica) const;
+
       void setFromArgs(const int argc, const char** argv);
 
       void createOutputDirs();
@@ -247,6 +330,9 @@ namespace EdgeML
         const size_t numBytes,
         const char *const fromModel);
 
+      // Use this constructor when loading a model file without test data, e.g., for serving.
+      explicit ProtoNNPredictor(const std::string& modelFile);
+
       // Use this constructor when loading model from file through command line
       ProtoNNPredictor(
         const int& argc,
@@ -277,14 +363,88 @@ namespace EdgeML
         dataCount_t startIdx,
         dataCount_t batchSize);
 
+      // Scores the columns of @X, which must already be normalized.
+      // Uses no member scratch space, so concurrent calls are safe.
+      void scoreBatch(
+        MatrixXuf& Yscores,
+        const SparseMatrixuf& X) const;
+
+      // Top @k labels (k x n, best first) and their scores for the columns of @X, which must
+      // already be normalized. Scores are computed for blocks of labels and reduced to the
+      // top k right away, so memory is O(k n) instead of O(l n). Thread safe.
+      void topKBatch(
+        MatrixXlabel& topKLabels,
+        MatrixXuf& topKScores,
+        const SparseMatrixuf& X,
+        const labelCount_t k) const;
+
+      // Switches all scoring to the int8 engine: data, W, Z and the kernel values are int8
+      // and products accumulate in int32. @calibrationX holds held-out points, normalized as
+      // for scoring, on which the range of WX is calibrated; @mode picks per-row or per-tensor
+      // scales for W and Z. Logs how often the top label agrees with float scoring on them.
+      void quantize(
+        const SparseMatrixuf& calibrationX,
+        const QuantScaleMode mode = perRowScale);
+
+      //
+      // Switches all float scoring to a k-d tree over the prototypes. A point then only gets
+      // the kernel terms of the prototypes within @cutoff kernel widths (cutoff / gamma) of WX;
+      // each term dropped is below exp(-cutoff^2), e.g., 1.2e-4 for a cutoff of 3. Logs the
+      // error against exact scoring on @checkX (normalized, may be empty), the prototypes
+      // visited per point and the time taken by both.
+      // The int8 engine of quantize() takes precedence over the index.
+      //
+      void indexPrototypes(
+        const FP_TYPE cutoff,
+        const SparseMatrixuf& checkX);
+
+      // Load min-max parameters for normalizeBatch when the model came from a binary stream
+      void importMinMax(std::string normParamFile);
+
+      // Writes a self-contained C source scoring raw inputs with this model to @outFile, for
+      // deployment on devices: dimensions are compile-time constants, parameters static const
+      // arrays with the zeros of sparse ones removed. Exported names start with @prefix.
+      // Min-max models need importMinMax first.
+      void generateC(
+        const std::string& outFile,
+        const std::string& prefix = "protonn") const;
+
+      // Normalizes the columns of @X the way the training data was normalized. Thread safe.
+      void normalizeBatch(SparseMatrixuf& X) const;
+
+      const ProtoNNModel::ProtoNNHyperParams& getHyperParams() const { return model.hyperParams; }
+
+      // Checks parameter shapes against the hyperparameters and that all parameters and
+      // precomputed constants are finite. Logs the first problem found and returns false.
+      bool isModelValid() const;
+
       ResultStruct testBatchWise();
 
       ResultStruct testPointWise();
 
       ResultStruct test();
 
+      //
+      // Writes the true labels and the top @topk labels with their scores for each test point,
+      // to outDir/detailedPrediction by default. The binary format (-o 1) is a uint32 k, then
+      // per point a uint32 count of true labels, those labels as uint32, and k (uint32 label,
+      // float32 score) pairs, best first.
+      //
       void saveTopKScores(std::string filename="", int topk=5);
 
+      // Whether the test file is streamed (-c), in which case testStreaming() replaces
+      // test() and saveTopKScores()
+      bool isStreaming() const { return chunkPoints > 0; }
+
+      //
+      // Scores the test file a chunk at a time, as it is read, and writes the file of
+      // saveTopKScores as it goes. Each chunk goes through topKBatch in batches of batchSize
+      // points while the next chunk is parsed, so memory is bounded by the chunk size and
+      // results appear after the first chunk. Reads at most ntest points, or the whole file
+      // if ntest is 0. Returns the metrics of test().
+      //
+      ResultStruct testStreaming(std::string filename="", int topk=5);
+
       void normalize();
     };
   }
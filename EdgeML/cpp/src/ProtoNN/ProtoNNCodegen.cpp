@@ -0,0 +1,141 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "ProtoNN.h"
+#include "c_codegen.h"
+#include <fstream>
+
+using namespace EdgeML;
+using namespace EdgeML::ProtoNN;
+
+//
+// The generated scorer accumulates WX one feature at a time from the rows of W^T, skipping
+// zero features, so that no normalized copy of the input is needed and sparse inputs cost
+// only their nonzeros. Each prototype then adds its kernel value times its row of Z^T to
+// the scores. Normalization follows normalizeBatch: min-max rescales nonzero features
+// only, and l2 scales WX by the inverse norm of the input.
+//
+void ProtoNNPredictor::generateC(
+  const std::string& outFile,
+  const std::string& prefix) const
+{
+  const ProtoNNModel::ProtoNNHyperParams& hyperParams = model.hyperParams;
+  const featureCount_t D = hyperParams.D, d = hyperParams.d;
+  const labelCount_t m = hyperParams.m, L = hyperParams.l;
+
+  std::ofstream out(outFile);
+  assert(out.is_open());
+
+  std::string upper(prefix);
+  for (size_t i = 0; i < upper.size(); ++i)
+    upper[i] = (char)toupper(upper[i]);
+
+  std::string normalization = "no";
+  if (hyperParams.normalizationType == minMax) normalization = "min-max";
+  else if (hyperParams.normalizationType == l2) normalization = "l2";
+
+  out << "/*\n"
+      << " * ProtoNN model compiled to C by ProtoNNCodegen. Do not edit.\n"
+      << " * D = " << D << " features, d = " << d << ", m = " << m << " prototypes, L = " << L
+      << " labels, " << normalization << " normalization.\n"
+      << " *\n"
+      << " *   void " << prefix << "_score(const float *x, float *scores);  x: D raw features, scores: L\n"
+      << " *   unsigned " << prefix << "_predict(const float *x);           label with the highest score\n"
+      << " *\n"
+      << " * Define " << upper << "_BENCHMARK to build a timing harness.\n"
+      << " */\n"
+      << "#include <math.h>\n"
+      << "#include <stdint.h>\n\n"
+      << "#define " << upper << "_FEATURES " << D << "\n"
+      << "#define " << upper << "_PROJECTION_DIM " << d << "\n"
+      << "#define " << upper << "_PROTOTYPES " << m << "\n"
+      << "#define " << upper << "_LABELS " << L << "\n\n";
+
+  if (hyperParams.normalizationType == minMax) {
+    assert((featureCount_t)testData.min.rows() == D && (featureCount_t)testData.max.rows() == D && "Min-max parameters need to be loaded with importMinMax");
+    std::vector<FP_TYPE> inverseRange(D);
+    for (featureCount_t f = 0; f < D; ++f) {
+      const FP_TYPE range = testData.max(f, 0) - testData.min(f, 0);
+      if (range == (FP_TYPE)0.0)
+        LOG_WARNING("Feature " + std::to_string(f) + " has a zero min-max range; it is scaled by 0 in the generated code");
+      inverseRange[f] = range != (FP_TYPE)0.0 ? (FP_TYPE)1.0 / range : (FP_TYPE)0.0;
+    }
+    emitCArray(out, prefix + "_min", testData.min.data(), D);
+    emitCArray(out, prefix + "_inverse_range", inverseRange.data(), D);
+  }
+
+  size_t bytesW, bytesB, bytesZ;
+  const MatrixXuf W = model.params.W;
+  const MatrixXuf B = model.params.B;
+  const MatrixXuf Z = model.params.Z;
+  emitCRows(out, prefix + "_W", W.transpose(), &bytesW);
+  const bool isDenseB = emitCRows(out, prefix + "_B", B.transpose(), &bytesB);
+  if (!isDenseB) {
+    const MatrixXuf normSq = B.colwise().squaredNorm();
+    emitCArray(out, prefix + "_B_norm_sq", normSq.data(), m);
+    bytesB += sizeof(float) * m;
+  }
+  emitCRows(out, prefix + "_Z", Z.transpose(), &bytesZ);
+
+  out << "void " << prefix << "_score(const float *x, float *scores)\n"
+      << "{\n"
+      << "  float wx[" << d << "];\n";
+  if (hyperParams.normalizationType == l2)
+    out << "  float xNormSq = 0.0f;\n";
+  if (!isDenseB)
+    out << "  float wxNormSq = 0.0f;\n";
+  out << "  unsigned f, j, k;\n\n"
+      << "  for (k = 0; k < " << d << "; ++k)\n"
+      << "    wx[k] = 0.0f;\n"
+      << "  for (k = 0; k < " << L << "; ++k)\n"
+      << "    scores[k] = 0.0f;\n\n"
+      << "  for (f = 0; f < " << D << "; ++f) {\n"
+      << "    if (x[f] == 0.0f)\n"
+      << "      continue;\n";
+  if (hyperParams.normalizationType == minMax)
+    out << "    " << prefix << "_W_axpy(f, (x[f] - " << prefix << "_min[f]) * " << prefix << "_inverse_range[f], wx);\n";
+  else
+    out << "    " << prefix << "_W_axpy(f, x[f], wx);\n";
+  if (hyperParams.normalizationType == l2)
+    out << "    xNormSq += x[f] * x[f];\n";
+  out << "  }\n";
+  if (hyperParams.normalizationType == l2)
+    out << "  if (xNormSq > 0.0f) {\n"
+        << "    const float inverseNorm = 1.0f / sqrtf(xNormSq);\n"
+        << "    for (k = 0; k < " << d << "; ++k)\n"
+        << "      wx[k] *= inverseNorm;\n"
+        << "  }\n";
+  if (!isDenseB)
+    out << "  for (k = 0; k < " << d << "; ++k)\n"
+        << "    wxNormSq += wx[k] * wx[k];\n";
+  out << "\n"
+      << "  for (j = 0; j < " << m << "; ++j) {\n";
+  if (isDenseB)
+    out << "    float distance = 0.0f;\n"
+        << "    for (k = 0; k < " << d << "; ++k) {\n"
+        << "      const float difference = wx[k] - " << prefix << "_B[j][k];\n"
+        << "      distance += difference * difference;\n"
+        << "    }\n";
+  else
+    out << "    const float distance = wxNormSq + " << prefix << "_B_norm_sq[j] - 2.0f * " << prefix << "_B_dot(j, wx);\n";
+  out << "    " << prefix << "_Z_axpy(j, expf(" << cFloatLiteral(-hyperParams.gamma * hyperParams.gamma) << " * distance), scores);\n"
+      << "  }\n"
+      << "}\n\n";
+
+  out << "unsigned " << prefix << "_predict(const float *x)\n"
+      << "{\n"
+      << "  float scores[" << L << "];\n"
+      << "  unsigned k, best = 0;\n"
+      << "  " << prefix << "_score(x, scores);\n"
+      << "  for (k = 1; k < " << L << "; ++k)\n"
+      << "    if (scores[k] > scores[best])\n"
+      << "      best = k;\n"
+      << "  return best;\n"
+      << "}\n\n";
+
+  emitCBenchmark(out, upper + "_BENCHMARK", prefix + "_score", D, L);
+  out.close();
+
+  LOG_INFO("Wrote " + outFile + ": W, B and Z take " + std::to_string(bytesW + bytesB + bytesZ)
+    + " bytes, against " + std::to_string(sizeof(float) * ((size_t)d * D + (size_t)d * m + (size_t)L * m)) + " dense");
+}
@@ -16,7 +16,9 @@ FP_TYPE EdgeML::L(
 {
   //tmp = (Y - Z*D').^4;
   assert(end - begin == D.rows());
-  MatrixXuf temp = Y.middleCols(begin, end - begin);
+  Workspace::Scope scope;
+  MatrixXuf& temp = scope.matrix(Y.rows(), end - begin);
+  temp = Y.middleCols(begin, end - begin);
   mm(temp, Z, CblasNoTrans, D, CblasTrans, -1.0, 1.0);
 
 #if defined(L2)
@@ -97,7 +99,8 @@ FP_TYPE EdgeML::batchEvaluate(
   const MatrixXuf& WX, const MatrixXuf& WXval,
   const FP_TYPE& gamma,
   const EdgeML::ProblemFormat& problemType,
-  FP_TYPE* const stats)
+  FP_TYPE* const stats,
+  SharedMemoryAllReduce *const allReduce)
 {
   Timer timer("batchEvaluate");
   /*  std::function<FP_TYPE(const MatrixXuf&,
@@ -145,16 +148,6 @@ FP_TYPE EdgeML::batchEvaluate(
       accuracyTrain += (idx2 - idx1) * accuracy(Z, YBatch, D, problemType);
   }
 
-  LOG_INFO("Training objective: " + std::to_string(objective));
-  stats[0] = objective;
-  if (problemType == EdgeML::ProblemFormat::binary || problemType == EdgeML::ProblemFormat::multiclass) {
-    LOG_INFO("Training accuracy: " + std::to_string(accuracyTrain / n));
-    stats[1] = accuracyTrain / n;
-  }
-  else if (problemType == EdgeML::ProblemFormat::multilabel) {
-    LOG_INFO("Training prec@1: " + std::to_string(accuracyTrain / n));
-    stats[1] = accuracyTrain / n;
-  }
   if (nvalid > 0) {
     for (dataCount_t i = 0; i < validationBatches; ++i) {
       Eigen::Index idx1 = (i*(Eigen::Index)bs) % nvalid;
@@ -173,6 +166,30 @@ FP_TYPE EdgeML::batchEvaluate(
       else if (problemType == EdgeML::ProblemFormat::multilabel)
         accuracyValidation += (idx2 - idx1) * accuracy(Z, YBatch, D, problemType);
     }
+  }
+
+  if (allReduce != NULL) {
+    // Totals over the shards of all workers
+    FP_TYPE totals[5] = { objective, accuracyTrain, (FP_TYPE)n, accuracyValidation, (FP_TYPE)nvalid };
+    allReduce->sum(totals, 5);
+    objective = totals[0];
+    accuracyTrain = totals[1];
+    n = (dataCount_t)totals[2];
+    accuracyValidation = totals[3];
+    nvalid = (dataCount_t)totals[4];
+  }
+
+  LOG_INFO("Training objective: " + std::to_string(objective));
+  stats[0] = objective;
+  if (problemType == EdgeML::ProblemFormat::binary || problemType == EdgeML::ProblemFormat::multiclass) {
+    LOG_INFO("Training accuracy: " + std::to_string(accuracyTrain / n));
+    stats[1] = accuracyTrain / n;
+  }
+  else if (problemType == EdgeML::ProblemFormat::multilabel) {
+    LOG_INFO("Training prec@1: " + std::to_string(accuracyTrain / n));
+    stats[1] = accuracyTrain / n;
+  }
+  if (nvalid > 0) {
     if (problemType == EdgeML::ProblemFormat::binary || problemType == EdgeML::ProblemFormat::multiclass) {
       LOG_INFO("Validation accuracy: " + std::to_string(accuracyValidation / nvalid));
       stats[2] = accuracyValidation / nvalid;
@@ -188,29 +205,85 @@ FP_TYPE EdgeML::batchEvaluate(
   return objective;
 }
 
+// Squared norms of the columns of @B, as a 1 X m row
+static void squaredColumnNorms(MatrixXuf& BColSum, const MatrixXuf& B)
+{
+  BColSum.resize(1, B.cols());
+  BColSum.noalias() = B.colwise().squaredNorm();
+}
+
+#ifdef SPARSE_B_PROTONN
+static void squaredColumnNorms(MatrixXuf& BColSum, const SparseMatrixuf& B)
+{
+  BColSum.resize(1, B.cols());
+  BColSum.setZero();
+  for (Eigen::Index k = 0; k < B.outerSize(); ++k)
+    for (SparseMatrixuf::InnerIterator it(B, k); it; ++it)
+      BColSum(0, it.col()) += it.value() * it.value();
+}
+#endif
+
+// Stored coefficients of a dense or sparse parameter, so that per-entry scans
+// such as the sparsity count in accProxSGD touch only what is actually stored
+static const FP_TYPE* storedValues(const MatrixXuf& param) { return param.data(); }
+static std::ptrdiff_t storedValueCount(const MatrixXuf& param) { return param.size(); }
+#if defined(SPARSE_Z_PROTONN) || defined(SPARSE_W_PROTONN) || defined(SPARSE_B_PROTONN)
+static const FP_TYPE* storedValues(const SparseMatrixuf& param) { return param.valuePtr(); }
+static std::ptrdiff_t storedValueCount(const SparseMatrixuf& param) { return param.nonZeros(); }
+#endif
+
+MatrixXuf EdgeML::gaussianKernel(
+  const BMatType& B, const MatrixXuf& WX,
+  const FP_TYPE gamma,
+  const Eigen::Index begin, const Eigen::Index end)
+{
+  MatrixXuf D;
+  gaussianKernelInto(D, B, WX, gamma, begin, end);
+  return D;
+}
+
 MatrixXuf EdgeML::gaussianKernel(
+  const BMatType& B, const MatrixXuf& BColSum,
+  const MatrixXuf& WX, const FP_TYPE gamma,
+  const Eigen::Index begin, const Eigen::Index end)
+{
+  MatrixXuf D;
+  gaussianKernelInto(D, B, BColSum, WX, gamma, begin, end);
+  return D;
+}
+
+void EdgeML::gaussianKernelInto(
+  MatrixXuf& D,
   const BMatType& B, const MatrixXuf& WX,
   const FP_TYPE gamma,
   const Eigen::Index begin, const Eigen::Index end)
+{
+  Workspace::Scope scope;
+  MatrixXuf& BColSum = scope.matrix(1, B.cols());
+  squaredColumnNorms(BColSum, B);
+
+  gaussianKernelInto(D, B, BColSum, WX, gamma, begin, end);
+}
+
+void EdgeML::gaussianKernelInto(
+  MatrixXuf& D,
+  const BMatType& B, const MatrixXuf& BColSum,
+  const MatrixXuf& WX, const FP_TYPE gamma,
+  const Eigen::Index begin, const Eigen::Index end)
 {
   assert(begin < (Eigen::Index)0x7fffffff
     && end < (Eigen::Index)0x7fffffff
     && begin < end);
+  assert(BColSum.rows() == 1 && BColSum.cols() == B.cols());
 
   Timer timer("gaussianKernel");
   timer.nextTime("starting computation");
+  Workspace::Scope scope;
 
-  static int debug_int = 0;
-
-  MatrixXuf BColSum = MatrixXuf::Zero(1, B.cols());
-  MatrixXuf BAccumulator = MatrixXuf::Constant(1, B.rows(), 1.0);
-  BMatType  B_B = B.cwiseProduct(B);
-
-  mm(BColSum, BAccumulator, CblasNoTrans, B_B, CblasNoTrans, 1.0, 0.0L);
-  timer.nextTime("BColSum");
-  MatrixXuf WXColSum = WX.middleCols(begin, end - begin).array().square().colwise().sum();
+  MatrixXuf& WXColSum = scope.matrix(1, end - begin);
+  WXColSum = WX.middleCols(begin, end - begin).array().square().colwise().sum();
   timer.nextTime("WXColSum");
-  MatrixXuf D(end - begin, B.cols());
+  D.resize(end - begin, B.cols());
 
   // D = (2.0 * gamma * gamma) * WX.transpose() * B;
   mm(D,
@@ -221,10 +294,12 @@ MatrixXuf EdgeML::gaussianKernel(
 
   timer.nextTime("Inner product of B,WX");
 
-  MatrixXuf gammaSqCol = MatrixXuf::Constant(end - begin, 1, -gamma*gamma);
+  MatrixXuf& gammaSqCol = scope.matrix(end - begin, 1);
+  gammaSqCol.setConstant(-gamma*gamma);
   mm(D, gammaSqCol, CblasNoTrans, BColSum, CblasNoTrans, 1.0, 1.0);
 
-  MatrixXuf gammaSqRow = MatrixXuf::Constant(1, B.cols(), -gamma*gamma);
+  MatrixXuf& gammaSqRow = scope.matrix(1, B.cols());
+  gammaSqRow.setConstant(-gamma*gamma);
   mm(D, WXColSum, CblasTrans, gammaSqRow, CblasNoTrans, 1.0, 1.0);
 
   timer.nextTime("Outer product of WX with constant row");
@@ -232,8 +307,6 @@ MatrixXuf EdgeML::gaussianKernel(
   parallelExp(D);
   LOG_DIAGNOSTIC(D);
   timer.nextTime("point-wise exponentation");
-
-  return D;
 }
 
 MatrixXuf EdgeML::gaussianKernel(
@@ -246,11 +319,24 @@ MatrixXuf EdgeML::gradL_B(
   const BMatType& B, const LabelMatType& Y, const ZMatType& Z,
   const MatrixXuf& WX, const MatrixXuf& D, const FP_TYPE gamma,
   const Eigen::Index begin, const Eigen::Index end)
+{
+  MatrixXuf grad;
+  gradL_BInto(grad, B, Y, Z, WX, D, gamma, begin, end);
+  return grad;
+}
+
+void EdgeML::gradL_BInto(
+  MatrixXuf& grad,
+  const BMatType& B, const LabelMatType& Y, const ZMatType& Z,
+  const MatrixXuf& WX, const MatrixXuf& D, const FP_TYPE gamma,
+  const Eigen::Index begin, const Eigen::Index end)
 {
   assert(end - begin == D.rows());
   Timer timer("gradL_B");
+  Workspace::Scope scope;
   //T = ((Y' - D*Z').^3)*Z;
-  MatrixXuf temp = Y.middleCols(begin, end - begin).transpose().eval();
+  MatrixXuf& temp = scope.matrix(end - begin, Y.rows());
+  temp = Y.middleCols(begin, end - begin).transpose();
   mm(temp, D, CblasNoTrans, Z, CblasTrans, -1.0, 1.0);
   timer.nextTime("computing temp = Y' - D*Z'");
 
@@ -269,7 +355,8 @@ MatrixXuf EdgeML::gradL_B(
 #endif
   LOG_DIAGNOSTIC(temp);
 
-  MatrixXuf T = MatrixXuf::Zero(D.rows(), D.cols());
+  MatrixXuf& T = scope.matrix(D.rows(), D.cols());
+  T.setZero();
   mm(T, temp, CblasNoTrans, Z, CblasNoTrans, 1.0, 0.0L);
   timer.nextTime("computing T = temp * Z");
 
@@ -278,13 +365,14 @@ MatrixXuf EdgeML::gradL_B(
   timer.nextTime("computing T = T .* D");
 
   //v = 8 * gamma^2 * (B * sparse(1:m, 1:m, sum(DT, 1)) - WX * DT);
-  MatrixXuf ret = B;
+  grad = B;
+  MatrixXuf& colMult = scope.matrix(B.cols(), 1);
 #if defined(L4)
-  VectorXf colMult = 8.0 * gamma * gamma * T.colwise().sum();
+  colMult = 8.0 * gamma * gamma * T.colwise().sum().transpose();
 #elif defined(L2)
-  VectorXf colMult = 4.0 * gamma * gamma * T.colwise().sum();
+  colMult = 4.0 * gamma * gamma * T.colwise().sum().transpose();
 #elif defined(L1)
-  VectorXf colMult = 2.0 * gamma * gamma * T.colwise().sum();
+  colMult = 2.0 * gamma * gamma * T.colwise().sum().transpose();
 #else
   assert(false);
 #endif 
@@ -294,23 +382,23 @@ MatrixXuf EdgeML::gradL_B(
 #endif
   // TODO: pfor (or map) and vectorize
   pfor(Eigen::Index i = 0; i < B.cols(); ++i)
-    ret.col(i).noalias() = ret.col(i) * colMult(i);
+    grad.col(i).noalias() = grad.col(i) * colMult(i, 0);
   timer.nextTime("multiplying columns of B");
 
 #if defined(L4)
-  mm(ret,
+  mm(grad,
     WX, CblasNoTrans,
     T, CblasNoTrans,
     -8.0 * gamma * gamma, 1.0,
     begin, end);
 #elif defined(L2)
-  mm(ret,
+  mm(grad,
     WX, CblasNoTrans,
     T, CblasNoTrans,
     (FP_TYPE)-4.0 * gamma * gamma, (FP_TYPE)1.0,
     begin, end);
 #elif defined(L1)
-  mm(ret,
+  mm(grad,
     WX, CblasNoTrans,
     T, CblasNoTrans,
     -2.0 * gamma * gamma, 1.0,
@@ -320,7 +408,7 @@ MatrixXuf EdgeML::gradL_B(
 #endif
   timer.nextTime("computing WX * T");
 
-  return ret / D.rows();
+  grad /= D.rows();
 }
 
 MatrixXuf EdgeML::gradL_B(
@@ -382,15 +470,26 @@ MatrixXuf EdgeML::gradL_Z(
 MatrixXuf EdgeML::gradL_Z(
   const ZMatType& Z, const LabelMatType& Y, const MatrixXuf& D,
   const Eigen::Index begin, const Eigen::Index end)
+{
+  MatrixXuf grad;
+  gradL_ZInto(grad, Z, Y, D, begin, end);
+  return grad;
+}
+
+void EdgeML::gradL_ZInto(
+  MatrixXuf& grad,
+  const ZMatType& Z, const LabelMatType& Y, const MatrixXuf& D,
+  const Eigen::Index begin, const Eigen::Index end)
 {
   assert(end - begin == D.rows());
   Timer timer("gradL_Z");
-  LabelMatType YMiddle = Y.middleCols(begin, end - begin);
-  MatrixXuf ret(YMiddle.rows(), D.cols());
-  mm(ret, YMiddle, CblasNoTrans, D, CblasNoTrans, 1.0, 0.0);
-  timer.nextTime("computing ret = Y*D");
+  Workspace::Scope scope;
+  grad.resize(Y.rows(), D.cols());
+  grad.setZero();
+  mm(grad, Y, CblasNoTrans, D, CblasNoTrans, 1.0, 0.0, begin, end);
+  timer.nextTime("computing grad = Y*D");
 
-  MatrixXuf DtimesD(D.cols(), D.cols());
+  MatrixXuf& DtimesD = scope.matrix(D.cols(), D.cols());
   mm(DtimesD, D, CblasTrans, D, CblasNoTrans, 1.0, 0.0);
   timer.nextTime("computing DtimesD = D'*D");
 
@@ -399,18 +498,18 @@ MatrixXuf EdgeML::gradL_Z(
 #endif
 
 #if defined(L4)
-  mm(ret, Z, CblasNoTrans, DtimesD, CblasNoTrans, 4.0, -4.0);
+  mm(grad, Z, CblasNoTrans, DtimesD, CblasNoTrans, 4.0, -4.0);
 #elif defined(L2)
-  mm(ret, Z, CblasNoTrans, DtimesD, CblasNoTrans, 2.0, -2.0);
+  mm(grad, Z, CblasNoTrans, DtimesD, CblasNoTrans, 2.0, -2.0);
 #elif defined(L1)
-  mm(ret, Z, CblasNoTrans, DtimesD, CblasNoTrans, 1.0, -1.0);
+  mm(grad, Z, CblasNoTrans, DtimesD, CblasNoTrans, 1.0, -1.0);
 #else
   assert(false);
 #endif
 
-  timer.nextTime("computing ret = ret - Z*DtimesD");
+  timer.nextTime("computing grad = grad - Z*DtimesD");
 
-  return ret / D.rows();
+  grad /= D.rows();
 }
 
 MatrixXuf EdgeML::gradL_W(
@@ -419,10 +518,28 @@ MatrixXuf EdgeML::gradL_W(
   const FP_TYPE gamma,
   const Eigen::Index begin, const Eigen::Index end)
 {
-  assert(end - begin == D.rows());
-  Timer timer("gradL_W");
+  MatrixXuf grad;
+  gradL_WInto(grad, B, Y, Z, W, X, D, gamma, begin, end);
+  return grad;
+}
+
+//
+// Turns @WXMiddle = W * X on points [begin, end) into the matrix whose product with
+// X' on the same points is the gradient of W, before the division by the batch size
+//
+static void weightProjectedPoints(
+  MatrixXuf& WXMiddle,
+  const BMatType& B, const LabelMatType& Y, const ZMatType& Z,
+  const MatrixXuf& D,
+  const FP_TYPE gamma,
+  const Eigen::Index begin, const Eigen::Index end,
+  Timer& timer)
+{
+  assert(end - begin == D.rows() && end - begin == WXMiddle.cols());
+  Workspace::Scope scope;
   //T = ((Y' - D*Z').^3)*Z;
-  MatrixXuf temp = Y.middleCols(begin, end - begin).transpose().eval();
+  MatrixXuf& temp = scope.matrix(end - begin, Y.rows());
+  temp = Y.middleCols(begin, end - begin).transpose();
   timer.nextTime("creating temp");
   mm(temp, D, CblasNoTrans, Z, CblasTrans, -1.0, 1.0);
   timer.nextTime("computing temp = Y' - D*Z'");
@@ -442,7 +559,8 @@ MatrixXuf EdgeML::gradL_W(
 #endif
   LOG_DIAGNOSTIC(temp);
 
-  MatrixXuf T = MatrixXuf::Zero(D.rows(), D.cols());
+  MatrixXuf& T = scope.matrix(D.rows(), D.cols());
+  T.setZero();
 
 #if defined(L4)
   mm(T, temp, CblasNoTrans, Z, CblasNoTrans, (FP_TYPE)8.0*gamma*gamma, (FP_TYPE)0.0);
@@ -460,36 +578,97 @@ MatrixXuf EdgeML::gradL_W(
   timer.nextTime("computing T = T .* D");
 
   //v = -8 * gamma^2 * (B * DT' - W*(X*sparse(1:n, 1:n, sum(DT, 2))))*X;
-  // TODO: Fix this, dont automatically cast to dense
-  SparseMatrixuf XMiddle = X.middleCols(begin, end - begin);
-  VectorXf colMult = T.rowwise().sum();
+  MatrixXuf& colMult = scope.matrix(end - begin, 1);
+  colMult = T.rowwise().sum();
 
 #ifdef ROWMAJOR
   LOG_INFO("Warning: Column-scaling in gradL_W may be slow in rowmajor\n");
 #endif
-  // TODO: pfor (or map) and saxpy
-  temp = MatrixXuf::Zero(W.rows(), end - begin);
-  mm(temp, W, CblasNoTrans, XMiddle, CblasNoTrans, 1.0, 0.0L);
-  timer.nextTime("computing temp = W * XMiddle");
-
   pfor(Eigen::Index i = 0; i < end - begin; ++i)
-    temp.col(i).noalias() = temp.col(i) * colMult(i);
-  timer.nextTime("multiplying columns of temp");
+    WXMiddle.col(i).noalias() = WXMiddle.col(i) * colMult(i, 0);
+  timer.nextTime("multiplying columns of WXMiddle");
+
+  mm(WXMiddle, B, CblasNoTrans, T, CblasTrans, -1.0, 1.0);
+  timer.nextTime("computing WXMiddle -= B * T'");
+}
+
+void EdgeML::gradL_WInto(
+  MatrixXuf& grad,
+  const BMatType& B, const LabelMatType& Y, const ZMatType& Z,
+  const WMatType& W, const SparseMatrixuf& X, const MatrixXuf& D,
+  const FP_TYPE gamma,
+  const Eigen::Index begin, const Eigen::Index end)
+{
+  assert(end - begin == D.rows());
+  Timer timer("gradL_W");
+  Workspace::Scope scope;
+
+  // Columns [begin, end) of X are passed to mm as a range, not copied out
+  MatrixXuf& WXMiddle = scope.matrix(W.rows(), end - begin);
+  WXMiddle.setZero();
+  mm(WXMiddle, W, CblasNoTrans, X, CblasNoTrans, 1.0, 0.0L, begin, end);
+  timer.nextTime("computing WXMiddle = W * XMiddle");
+
+  weightProjectedPoints(WXMiddle, B, Y, Z, D, gamma, begin, end, timer);
+
+  grad.resize(W.rows(), W.cols());
+  grad.setZero();
+
+  mm(grad,
+    WXMiddle, CblasNoTrans,
+    X, CblasTrans,
+    1.0, 0.0L,
+    begin, end);
 
-  mm(temp, B, CblasNoTrans, T, CblasTrans, -1.0, 1.0);
-  timer.nextTime("computing temp -= B * T'");
+  //grad = WXMiddle * XMiddle.transpose();
+  timer.nextTime("computing grad_W = WXMiddle * X'");
 
-  MatrixXuf ret = MatrixXuf::Zero(W.rows(), W.cols());
+  grad /= D.rows();
+}
 
-  mm(ret,
-    temp, CblasNoTrans,
-    XMiddle, CblasTrans,
-    1.0, 0.0L);
+void EdgeML::batchColumns(
+  std::vector<Eigen::Index>& columns,
+  const SparseMatrixuf& X,
+  const Eigen::Index begin, const Eigen::Index end)
+{
+#ifdef ROWMAJOR
+  assert(false && "batchColumns reads the points of X as its outer dimension");
+#endif
+  columns.clear();
+  for (Eigen::Index k = begin; k < end; ++k)
+    for (SparseMatrixuf::InnerIterator it(X, k); it; ++it)
+      columns.push_back(it.row());
+  std::sort(columns.begin(), columns.end());
+  columns.erase(std::unique(columns.begin(), columns.end()), columns.end());
+}
 
-  //ret = temp * XMiddle.transpose();
-  timer.nextTime("computing grad_W = temp * X'");
+void EdgeML::gradL_WColumnsInto(
+  ColumnSparseMatrix& grad,
+  const BMatType& B, const LabelMatType& Y, const ZMatType& Z,
+  MatrixXuf& WX, const SparseMatrixuf& X, const MatrixXuf& D,
+  const FP_TYPE gamma,
+  const Eigen::Index begin, const Eigen::Index end)
+{
+  assert(end - begin == D.rows() && end - begin == WX.cols());
+  Timer timer("gradL_WColumns");
+
+  // The projection the kernel was computed from becomes WXMiddle, without a copy
+  MatrixXuf& WXMiddle = WX;
+  weightProjectedPoints(WXMiddle, B, Y, Z, D, gamma, begin, end, timer);
+
+  // grad = WXMiddle * XMiddle.transpose(), one nonzero of X at a time
+  const std::vector<Eigen::Index>& columns = grad.columns;
+  grad.values.resize(WX.rows(), columns.size());
+  grad.values.setZero();
+  for (Eigen::Index k = begin; k < end; ++k)
+    for (SparseMatrixuf::InnerIterator it(X, k); it; ++it) {
+      const Eigen::Index c = std::lower_bound(columns.begin(), columns.end(), (Eigen::Index)it.row()) - columns.begin();
+      assert(c < (Eigen::Index)columns.size() && columns[c] == it.row());
+      grad.values.col(c) += it.value() * WXMiddle.col(k - begin);
+    }
+  timer.nextTime("computing the touched columns of grad_W = WXMiddle * X'");
 
-  return ret / (D.rows());
+  grad.values /= D.rows();
 }
 
 MatrixXuf EdgeML::gradL_W(
@@ -501,15 +680,12 @@ MatrixXuf EdgeML::gradL_W(
   return gradL_W(B, Y, Z, W, X, D, gamma, 0, X.cols());
 }
 
-void EdgeML::hardThrsd(
-  MatrixXuf& mat,
+FP_TYPE EdgeML::hardThrsdLevel(
+  const MatrixXuf& mat,
   FP_TYPE sparsity)
 {
-  Timer timer("hardThrsd");
+  Timer timer("hardThrsdLevel");
   assert(sparsity >= 0.0 && sparsity <= 1.0);
-  if (sparsity >= 0.999)
-    return;
-  else;
 
   const float eps = (FP_TYPE)1e-8;
 
@@ -521,7 +697,7 @@ void EdgeML::hardThrsd(
   FP_TYPE *data = new FP_TYPE[sampleSize];
 
   if (sampleSize == matSize) {
-    memcpy((void *)data, (void *)mat.data(), sizeof(FP_TYPE)*matSize);
+    memcpy((void *)data, (const void *)mat.data(), sizeof(FP_TYPE)*matSize);
     pfor(std::ptrdiff_t i = 0; i < (std::ptrdiff_t)matSize; ++i) {
       data[i] = std::abs(data[i]);
     }
@@ -530,7 +706,7 @@ void EdgeML::hardThrsd(
     unsigned long long prime = 990377764891511ull;
     assert(prime > matSize);
     unsigned long long seed = (rand() % 100000);
-    FP_TYPE* mat_data = mat.data();
+    const FP_TYPE* mat_data = mat.data();
     size_t pick;
     for (dataCount_t i = 0; i < sampleSize; ++i) {
       pick = (prime*(i + seed)) % matSize;
@@ -546,9 +722,23 @@ void EdgeML::hardThrsd(
   if (thresh <= eps)thresh = eps;
   delete[] data;
   timer.nextTime("ending threshold computation");
+  return thresh;
+}
+
+void EdgeML::hardThrsd(
+  MatrixXuf& mat,
+  FP_TYPE sparsity)
+{
+  Timer timer("hardThrsd");
+  assert(sparsity >= 0.0 && sparsity <= 1.0);
+  if (sparsity >= 0.999)
+    return;
+
+  const FP_TYPE thresh = hardThrsdLevel(mat, sparsity);
+  size_t matSize = ((size_t)mat.rows()) * ((size_t)mat.cols());
 
   assert(sizeof(std::ptrdiff_t) == sizeof(size_t));
-  data = mat.data();
+  FP_TYPE *const data = mat.data();
 
 #ifdef CILK
   cilk::reducer< cilk::op_add<size_t> > nnz(0);
@@ -572,15 +762,172 @@ void EdgeML::hardThrsd(
 #endif
 }
 
+// Averages @A over the data-parallel workers. Local batches all have the same size, so this
+// is the loss or gradient on the union of the batches.
+static void averageOverWorkers(SharedMemoryAllReduce *const allReduce, MatrixXuf& A)
+{
+  if (allReduce == NULL || allReduce->size() == 1)
+    return;
+  allReduce->sum(A.data(), A.size());
+  A /= (FP_TYPE)allReduce->size();
+}
+
+static FP_TYPE averageOverWorkers(SharedMemoryAllReduce *const allReduce, FP_TYPE value)
+{
+  if (allReduce == NULL || allReduce->size() == 1)
+    return value;
+  allReduce->sum(&value, 1);
+  return value / allReduce->size();
+}
+
+EdgeML::ValidationPipeline::ValidationPipeline(
+  const SparseMatrixuf& X_,
+  const SparseMatrixuf& Y_,
+  const EdgeML::ProblemFormat problemType_,
+  SharedMemoryAllReduce *const allReduce_,
+  const dataCount_t numPoints_)
+  : X(X_),
+    Y(Y_),
+    problemType(problemType_),
+    allReduce(allReduce_),
+    pointWeight(numPoints_ == 0 || X_.cols() == 0 ? (FP_TYPE)1.0 : (FP_TYPE)numPoints_ / X_.cols()),
+    gamma(0),
+    isWChanged(false),
+    isSubmitted(false),
+    isEvaluated(false),
+    isStopping(false),
+    accuracySum(0),
+    pendingStats(NULL)
+{
+  assert(X.cols() == Y.cols());
+  evaluatorThread = std::thread(&ValidationPipeline::evaluatorLoop, this);
+}
+
+EdgeML::ValidationPipeline::~ValidationPipeline()
+{
+  {
+    std::lock_guard<std::mutex> lock(evaluatorMutex);
+    isStopping = true;
+  }
+  evaluatorCondition.notify_all();
+  evaluatorThread.join();
+}
+
+void EdgeML::ValidationPipeline::evaluatorLoop()
+{
+  // The MKL threads are for training; evaluation takes one core
+  mkl_set_num_threads_local(1);
+
+  std::unique_lock<std::mutex> lock(evaluatorMutex);
+  while (true) {
+    evaluatorCondition.wait(lock, [this] { return isStopping || isSubmitted; });
+    if (!isSubmitted)
+      return;
+
+    lock.unlock();
+    const FP_TYPE sum = evaluate();
+    lock.lock();
+    accuracySum = sum;
+    isSubmitted = false;
+    isEvaluated = true;
+    evaluatorCondition.notify_all();
+  }
+}
+
+FP_TYPE EdgeML::ValidationPipeline::evaluate()
+{
+  Timer timer("ValidationPipeline::evaluate");
+  const dataCount_t n = X.cols();
+  if (n == 0)
+    return 0;
+
+  if (isWChanged) {
+    WX.resize(W.rows(), n);
+    mm(WX, W, CblasNoTrans, X, CblasNoTrans, 1.0, 0.0L);
+  }
+
+  // Blocks of points as in batchEvaluate
+  const Eigen::Index bs = 10000;
+  FP_TYPE sum = 0;
+  for (Eigen::Index begin = 0; begin < (Eigen::Index)n; begin += bs) {
+    const Eigen::Index end = std::min(begin + bs, (Eigen::Index)n);
+    Workspace::Scope scope;
+    MatrixXuf& D = scope.matrix(end - begin, B.cols());
+    gaussianKernelInto(D, B, WX, gamma, begin, end);
+    LabelMatType YBatch = Y.middleCols(begin, end - begin);
+    sum += (end - begin) * accuracy(Z, YBatch, D, problemType);
+  }
+  return sum;
+}
+
+void EdgeML::ValidationPipeline::submit(
+  const EdgeML::ProtoNN::ProtoNNModel& model,
+  const bool isWChanged_,
+  FP_TYPE *const stats,
+  const std::string& tag)
+{
+  deliver();
+  assert(isWChanged_ || W.size() > 0);
+
+  // The evaluator is idle until isSubmitted is set
+  isWChanged = isWChanged_;
+  if (isWChanged)
+    W = model.params.W;
+  Z = model.params.Z;
+  B = model.params.B;
+  gamma = model.hyperParams.gamma;
+  pendingStats = stats;
+  pendingTag = tag;
+
+  {
+    std::lock_guard<std::mutex> lock(evaluatorMutex);
+    isSubmitted = true;
+  }
+  evaluatorCondition.notify_all();
+}
+
+void EdgeML::ValidationPipeline::deliver()
+{
+  if (pendingStats == NULL)
+    return;
+
+  // Each worker's accuracy counts as much as the points it validates on, sampled or not
+  FP_TYPE totals[2];
+  {
+    std::unique_lock<std::mutex> lock(evaluatorMutex);
+    evaluatorCondition.wait(lock, [this] { return isEvaluated; });
+    isEvaluated = false;
+    totals[0] = accuracySum * pointWeight;
+  }
+  totals[1] = (FP_TYPE)X.cols() * pointWeight;
+  if (allReduce != NULL)
+    allReduce->sum(totals, 2);
+
+  if (totals[1] > 0) {
+    pendingStats[2] = totals[0] / totals[1];
+    if (problemType == EdgeML::ProblemFormat::binary || problemType == EdgeML::ProblemFormat::multiclass)
+      LOG_INFO("Validation accuracy (" + pendingTag + "): " + std::to_string(pendingStats[2]));
+    else if (problemType == EdgeML::ProblemFormat::multilabel)
+      LOG_INFO("Validation prec@1 (" + pendingTag + "): " + std::to_string(pendingStats[2]));
+  }
+  else
+    pendingStats[2] = 0.0; // No testing takes place
+  pendingStats = NULL;
+}
+
 void EdgeML::altMinSGD(
   const EdgeML::Data& data,
   EdgeML::ProtoNN::ProtoNNModel& model,
   FP_TYPE *const stats,
-  const std::string& outDir)
+  const std::string& outDir,
+  const bool optimizeW,
+  SharedMemoryAllReduce *const allReduce,
+  const bool allowColumnSparseW)
 {
   // This allows us to make mkl-blas calls on Eigen matrices   
   assert(sizeof(MKL_INT) == sizeof(Eigen::Index));
   Timer timer("altMinSGD");
+  retainFreedMemory();
   assert(sizeof(Eigen::Index) == sizeof(dataCount_t));
 
   /*
@@ -601,7 +948,12 @@ void EdgeML::altMinSGD(
   dataCount_t n = data.Xtrain.cols();
   int         epochs = model.hyperParams.epochs;
   FP_TYPE     sgdTol = (FP_TYPE) 0.02;
-  dataCount_t bs = std::min((dataCount_t)model.hyperParams.batchSize, (dataCount_t)n);
+  const int numWorkers = allReduce == NULL ? 1 : allReduce->size();
+  assert(model.hyperParams.batchSize >= (dataCount_t)numWorkers);
+  dataCount_t bs = std::min((dataCount_t)model.hyperParams.batchSize / numWorkers, (dataCount_t)n);
+  if (numWorkers > 1)
+    LOG_INFO("Data-parallel training on " + std::to_string(numWorkers) + " workers, each with "
+      + std::to_string(n) + " points and batches of " + std::to_string(bs));
 #ifdef XML
   dataCount_t hessianbs = std::min((dataCount_t)(1 << 10), bs);
 #else
@@ -615,14 +967,11 @@ void EdgeML::altMinSGD(
   LOG_INFO("\nComputing model size assuming 4 bytes per entry for matrices with sparsity > 0.5 and 8 bytes per entry for matrices with sparsity <= 0.5 (to store sparse matrices, we require about 4 bytes for the index information)...");
   LOG_INFO("Model size in kB = " + std::to_string(computeModelSizeInkB(model.hyperParams.lambdaW, model.hyperParams.lambdaZ, model.hyperParams.lambdaB, model.params.W, model.params.Z, model.params.B)));
 
+  // Cache of the projected data, read in random batches by the Z and B phases
   MatrixXuf WX(model.params.W.rows(), data.Xtrain.cols());
+  adviseHugePages(WX);
   mm(WX, model.params.W, CblasNoTrans, data.Xtrain, CblasNoTrans, 1.0, 0.0L);
 
-  MatrixXuf WXvalidation(model.params.W.rows(), data.Xvalidation.cols());
-  if (data.Xvalidation.cols() > 0) {
-    mm(WXvalidation, model.params.W, CblasNoTrans, data.Xvalidation, CblasNoTrans, 1.0, 0.0L);
-  }
-
 #ifdef XML
   dataCount_t numEvalTrain = std::min((dataCount_t)20000, (dataCount_t)data.Xtrain.cols());
   MatrixXuf WX_sub(WX.rows(), numEvalTrain);
@@ -634,29 +983,55 @@ void EdgeML::altMinSGD(
   mm(WX_sub, model.params.W, CblasNoTrans, X_sub, CblasNoTrans, 1.0, 0.0L);
 
   dataCount_t numEvalValidation= std::min((dataCount_t)10000, (dataCount_t)data.Xvalidation.cols());
-  MatrixXuf WXvalidation_sub(WX.rows(), numEvalValidation);
   SparseMatrixuf Yvalidation_sub(data.Yvalidation.rows(), numEvalValidation);
   SparseMatrixuf Xvalidation_sub(data.Xvalidation.rows(), numEvalValidation);
   if (data.Xvalidation.cols() > 0) {
     randPick(data.Xvalidation, Xvalidation_sub);
     randPick(data.Yvalidation, Yvalidation_sub);
-    mm(WXvalidation_sub, model.params.W, CblasNoTrans, Xvalidation_sub, CblasNoTrans, 1.0, 0.0L);
   }
+  ValidationPipeline validation(Xvalidation_sub, Yvalidation_sub, model.hyperParams.problemType, allReduce,
+    data.Xvalidation.cols());
+#else
+  ValidationPipeline validation(data.Xvalidation, data.Yvalidation, model.hyperParams.problemType, allReduce);
 #endif
+  // Training objective and accuracy are computed in place, as the step sizes depend on them;
+  // validation accuracy is computed by the pipeline, alongside the next phase
+  const LabelMatType noYvalidation(data.Yvalidation.rows(), 0);
+  const MatrixXuf noWXvalidation(WX.rows(), 0);
 
   timer.nextTime("starting evaluation");
 
 
   LOG_INFO("\nInitial stats...");
 #ifdef XML
-  fNew = batchEvaluate(model.params.Z, Y_sub, Yvalidation_sub, model.params.B, WX_sub, WXvalidation_sub, model.hyperParams.gamma, model.hyperParams.problemType, stats);
+  fNew = batchEvaluate(model.params.Z, Y_sub, noYvalidation, model.params.B, WX_sub, noWXvalidation, model.hyperParams.gamma, model.hyperParams.problemType, stats, allReduce);
 #else 
-  fNew = batchEvaluate(model.params.Z, data.Ytrain, data.Yvalidation, model.params.B, WX, WXvalidation, model.hyperParams.gamma, model.hyperParams.problemType, stats);
+  fNew = batchEvaluate(model.params.Z, data.Ytrain, noYvalidation, model.params.B, WX, noWXvalidation, model.hyperParams.gamma, model.hyperParams.problemType, stats, allReduce);
 #endif 
+  validation.submit(model, true, stats, "initial model");
   timer.nextTime("evaluating");
 
   VectorXf eta = VectorXf::Zero(10, 1);
 
+#if !defined(SPARSE_W_PROTONN) && !defined(ROWMAJOR)
+  // When allowed and a batch touches few features, W is optimized a column at a time.
+  // Workers touch different columns, whose gradients could not be summed.
+  bool columnSparseW = false;
+  if (allowColumnSparseW && optimizeW && numWorkers == 1) {
+    std::vector<Eigen::Index> batchFeatures;
+    batchColumns(batchFeatures, data.Xtrain, 0, bs);
+    columnSparseW = 2 * batchFeatures.size() < (size_t)data.Xtrain.rows();
+    if (columnSparseW)
+      LOG_INFO("A batch touches " + std::to_string(batchFeatures.size()) + " of " + std::to_string(data.Xtrain.rows())
+        + " features: W is updated column-sparse");
+  }
+  else if (allowColumnSparseW && optimizeW)
+    LOG_INFO("Column-sparse W updates are not supported in data-parallel training: W is updated dense");
+#else
+  // No column-sparse path for a sparse or row-major W
+  (void)allowColumnSparseW;
+#endif
+
   MatrixXuf gtmpW(model.params.W.rows(), model.params.W.cols());
   WMatType  Wtmp(model.params.W.rows(), model.params.W.cols());
 
@@ -673,154 +1048,170 @@ void EdgeML::altMinSGD(
 #endif
 
   LOG_INFO("\nStarting optimization. Number of outer iterations (altMinSGD) = " + std::to_string(model.hyperParams.iters));
+  AllocationStats iterStart = readAllocationStats();
   // for i = 1 : iters
   for (int i = 0; i < model.hyperParams.iters; ++i) {
     LOG_INFO(
       "\n=========================== " + std::to_string(i) + "\n"
       + "On iter " + std::to_string(i) + "\n" +
       +"=========================== " + std::to_string(i));
-    timer.nextTime("starting optimization w.r.t. W");
-    LOG_INFO("Optimizing w.r.t. projection matrix (W)...");
+    if (optimizeW) {
+      timer.nextTime("starting optimization w.r.t. W");
+      LOG_INFO("Optimizing w.r.t. projection matrix (W)...");
+
+      // The loss and gradient on points [begin, end) take their temporaries from the workspace
+      std::function<FP_TYPE(const WMatType&, const Eigen::Index, const Eigen::Index)> lossW =
+        [&model, &data, allReduce](const WMatType& W, const Eigen::Index begin, const Eigen::Index end)
+        ->FP_TYPE {
+        Workspace::Scope scope;
+        MatrixXuf& WX = scope.matrix(W.rows(), end - begin);
+        WX.setZero();
+        mm(WX, W, CblasNoTrans, data.Xtrain, CblasNoTrans, 1.0, 0.0L, begin, end);
+        MatrixXuf& D = scope.matrix(end - begin, model.params.B.cols());
+        gaussianKernelInto(D, model.params.B, WX, model.hyperParams.gamma, 0, end - begin);
+        return averageOverWorkers(allReduce, L(model.params.Z, data.Ytrain, D, begin, end));
+      };
+      std::function<void(MatrixXuf&, const WMatType&, const Eigen::Index, const Eigen::Index)> gradW =
+        [&model, &data, allReduce](MatrixXuf& grad, const WMatType& W, const Eigen::Index begin, const Eigen::Index end) {
+        Workspace::Scope scope;
+        MatrixXuf& WX = scope.matrix(W.rows(), end - begin);
+        WX.setZero();
+        mm(WX, W, CblasNoTrans, data.Xtrain, CblasNoTrans, 1.0, 0.0L, begin, end);
+        MatrixXuf& D = scope.matrix(end - begin, model.params.B.cols());
+        gaussianKernelInto(D, model.params.B, WX, model.hyperParams.gamma, 0, end - begin);
+        gradL_WInto(grad, model.params.B, data.Ytrain, model.params.Z, W, data.Xtrain, D,
+          model.hyperParams.gamma, begin, end);
+        averageOverWorkers(allReduce, grad);
+      };
 
 #ifdef BTLS
-    etaW = armijoW * btls<WMatType>
-      ([&model, &data] (const WMatType& W, const Eigen::Index begin, const Eigen::Index end) ->FP_TYPE {
-	MatrixXuf WX = MatrixXuf::Zero(W.rows(), end - begin);
-	SparseMatrixuf XMiddle = data.Xtrain.middleCols(begin, end - begin);
-	mm(WX, W, CblasNoTrans, XMiddle,
-	   CblasNoTrans, 1.0, 0.0L);
-	return L(model.params.Z, data.Ytrain,
-		 gaussianKernel(model.params.B, WX, model.hyperParams.gamma),
-		 begin, end);
-      },
-	[&model, &data]
-	(const WMatType& W, const Eigen::Index begin, const Eigen::Index end)
-	->MatrixXuf {
-	MatrixXuf WX = MatrixXuf::Zero(W.rows(), end - begin);
-	SparseMatrixuf XMiddle = data.Xtrain.middleCols(begin, end - begin);
-	mm(WX, W, CblasNoTrans,
-	   XMiddle,
-	   CblasNoTrans, 1.0, 0.0L);
-	return gradL_W(model.params.B, data.Ytrain, model.params.Z, W, data.Xtrain,
-		       gaussianKernel(model.params.B, WX, model.hyperParams.gamma),
-		       model.hyperParams.gamma, begin, end);
-      },
-	std::bind(hardThrsd, std::placeholders::_1, model.hyperParams.lambdaW),
-	model.params.W, n, bs, (etaW/armijoW)*2);
+      etaW = armijoW * btls<WMatType>(lossW, gradW,
+        std::bind(hardThrsd, std::placeholders::_1, model.hyperParams.lambdaW),
+        model.params.W, n, bs, (etaW/armijoW)*2);
 #else
-    for (auto j = 0; j < eta.size(); ++j) {
-      Eigen::Index idx1 = (j*(Eigen::Index)hessianbs) % n;
-      Eigen::Index idx2 = ((j + 1)*(Eigen::Index)hessianbs) % n;
-      //assert (((j+1)*(Eigen::Index)hessianbs) < n);
-
-      if (idx2 <= idx1) idx2 = n;
-
-      gtmpW = gradL_W(model.params.B, data.Ytrain, model.params.Z, model.params.W, data.Xtrain,
-        gaussianKernel(model.params.B, WX, model.hyperParams.gamma, idx1, idx2),
-        model.hyperParams.gamma, idx1, idx2);
-
-      MatrixXuf gtmpWThresh = gtmpW;
-      hardThrsd(gtmpWThresh, model.hyperParams.lambdaW);
-
-      Wtmp = model.params.W
-        - 0.001*safeDiv(model.params.W.cwiseAbs().maxCoeff(), gtmpW.cwiseAbs().maxCoeff()) * gtmpWThresh;
-      gtmpW -= gradL_W(model.params.B, data.Ytrain, model.params.Z, Wtmp, data.Xtrain,
-        gaussianKernel(model.params.B, Wtmp*data.Xtrain.middleCols(idx1, idx2 - idx1), model.hyperParams.gamma),
-        model.hyperParams.gamma, idx1, idx2);
-
-      if (gtmpW.norm() <= 1e-20L) {
-        LOG_WARNING("Difference between consecutive gradients of W has become really low.");
-        eta(j) = 1.0;
+      for (auto j = 0; j < eta.size(); ++j) {
+        Eigen::Index idx1 = (j*(Eigen::Index)hessianbs) % n;
+        Eigen::Index idx2 = ((j + 1)*(Eigen::Index)hessianbs) % n;
+        //assert (((j+1)*(Eigen::Index)hessianbs) < n);
+
+        if (idx2 <= idx1) idx2 = n;
+
+        gtmpW = gradL_W(model.params.B, data.Ytrain, model.params.Z, model.params.W, data.Xtrain,
+          gaussianKernel(model.params.B, WX, model.hyperParams.gamma, idx1, idx2),
+          model.hyperParams.gamma, idx1, idx2);
+        averageOverWorkers(allReduce, gtmpW);
+
+        MatrixXuf gtmpWThresh = gtmpW;
+        hardThrsd(gtmpWThresh, model.hyperParams.lambdaW);
+
+        Wtmp = model.params.W
+          - 0.001*safeDiv(model.params.W.cwiseAbs().maxCoeff(), gtmpW.cwiseAbs().maxCoeff()) * gtmpWThresh;
+        MatrixXuf gradAtWtmp = gradL_W(model.params.B, data.Ytrain, model.params.Z, Wtmp, data.Xtrain,
+          gaussianKernel(model.params.B, Wtmp*data.Xtrain.middleCols(idx1, idx2 - idx1), model.hyperParams.gamma),
+          model.hyperParams.gamma, idx1, idx2);
+        averageOverWorkers(allReduce, gradAtWtmp);
+        gtmpW -= gradAtWtmp;
+
+        if (gtmpW.norm() <= 1e-20L) {
+          LOG_WARNING("Difference between consecutive gradients of W has become really low.");
+          eta(j) = 1.0;
+        }
+        else
+          eta(j) = safeDiv((Wtmp - model.params.W).norm(), gtmpW.norm());
+      }
+      std::sort(eta.data(), eta.data() + eta.size());
+      etaW = armijoW * eta(4);
+#endif
+      //LOG_INFO("Step-length estimate for gradW = " + std::to_string(etaW));
+
+#if !defined(SPARSE_W_PROTONN) && !defined(ROWMAJOR)
+      if (columnSparseW) {
+        std::function<void(std::vector<Eigen::Index>&, const Eigen::Index, const Eigen::Index)> columnsW =
+          [&data](std::vector<Eigen::Index>& columns, const Eigen::Index begin, const Eigen::Index end) {
+          batchColumns(columns, data.Xtrain, begin, end);
+        };
+        // The projection of the batch serves both the kernel and the gradient
+        std::function<void(ColumnSparseMatrix&, const MatrixXuf&, const Eigen::Index, const Eigen::Index)> gradWColumns =
+          [&model, &data](ColumnSparseMatrix& grad, const MatrixXuf& W, const Eigen::Index begin, const Eigen::Index end) {
+          Workspace::Scope scope;
+          // mm would transpose all of W; the product over the nonzeros reads only the touched columns
+          MatrixXuf& WX = scope.matrix(W.rows(), end - begin);
+          WX.noalias() = W * data.Xtrain.middleCols(begin, end - begin);
+          MatrixXuf& D = scope.matrix(end - begin, model.params.B.cols());
+          gaussianKernelInto(D, model.params.B, WX, model.hyperParams.gamma, 0, end - begin);
+          gradL_WColumnsInto(grad, model.params.B, data.Ytrain, model.params.Z, WX, data.Xtrain, D,
+            model.hyperParams.gamma, begin, end);
+        };
+        accProxSGDColumnSparse(columnsW, gradWColumns, model.hyperParams.lambdaW,
+          model.params.W, epochs, n, bs, etaW, etaUpdate);
       }
       else
-        eta(j) = safeDiv((Wtmp - model.params.W).norm(), gtmpW.norm());
-    }
-    std::sort(eta.data(), eta.data() + eta.size());
-    etaW = armijoW * eta(4);
 #endif
-    //LOG_INFO("Step-length estimate for gradW = " + std::to_string(etaW));
+      accProxSGD<WMatType>(lossW, gradW,
+        std::bind(hardThrsd, std::placeholders::_1, model.hyperParams.lambdaW),
+        model.params.W, epochs, n, bs, etaW, etaUpdate);
+      timer.nextTime("ending gradW");
+      //LOG_INFO("Final step-length for gradW = " + std::to_string(etaW));
 
-    accProxSGD<WMatType>
-      (//[&model.params.Z, &data.Ytrain, &model.params.B, &data.Xtrain, &model.hyperParams] TODO: Figure out the elegant way of getting this to work
-        [&model, &data]
-    (const WMatType& W, const Eigen::Index begin, const Eigen::Index end)
-      ->FP_TYPE {
-      MatrixXuf WX = MatrixXuf::Zero(W.rows(), end - begin);
-      SparseMatrixuf XMiddle = data.Xtrain.middleCols(begin, end - begin);
-      mm(WX, W, CblasNoTrans,
-        XMiddle,
-        CblasNoTrans, 1.0, 0.0L);
-      return L(model.params.Z, data.Ytrain, gaussianKernel(model.params.B, WX, model.hyperParams.gamma), begin, end);
-    },
-      // [&(model.params.B), &(data.Ytrain), &(model.params.Z), &(data.Xtrain), &(model.hyperParams)]
-      [&model, &data]
-    (const WMatType& W, const Eigen::Index begin, const Eigen::Index end)
-      ->MatrixXuf {
-      MatrixXuf WX = MatrixXuf::Zero(W.rows(), end - begin);
-      SparseMatrixuf XMiddle = data.Xtrain.middleCols(begin, end - begin);
-      mm(WX, W, CblasNoTrans,
-        XMiddle,
-        CblasNoTrans, 1.0, 0.0L);
-      return gradL_W(model.params.B, data.Ytrain, model.params.Z, W, data.Xtrain,
-        gaussianKernel(model.params.B, WX, model.hyperParams.gamma),
-        model.hyperParams.gamma, begin, end);
-    },
-      std::bind(hardThrsd, std::placeholders::_1, model.hyperParams.lambdaW),
-      model.params.W, epochs, n, bs, etaW, etaUpdate);
-    timer.nextTime("ending gradW");
-    //LOG_INFO("Final step-length for gradW = " + std::to_string(etaW));
-
-    mm(WX, model.params.W, CblasNoTrans, data.Xtrain, CblasNoTrans, 1.0, 0.0L);
-    if (data.Xvalidation.cols() > 0) {
-      mm(WXvalidation, model.params.W, CblasNoTrans, data.Xvalidation, CblasNoTrans, 1.0, 0.0L);
-    }
+      mm(WX, model.params.W, CblasNoTrans, data.Xtrain, CblasNoTrans, 1.0, 0.0L);
 
-    fOld = fNew;
+      fOld = fNew;
 #ifdef XML
-    mm(WX_sub, model.params.W, CblasNoTrans, X_sub, CblasNoTrans, 1.0, 0.0L);
-    if (data.Xvalidation.cols() > 0) {
-      mm(WXvalidation_sub, model.params.W, CblasNoTrans, Xvalidation_sub, CblasNoTrans, 1.0, 0.0L);
-    }
-    fNew = batchEvaluate(model.params.Z, Y_sub, Yvalidation_sub, model.params.B, WX_sub, WXvalidation_sub, model.hyperParams.gamma, model.hyperParams.problemType, stats + 9 * i + 3);
+      mm(WX_sub, model.params.W, CblasNoTrans, X_sub, CblasNoTrans, 1.0, 0.0L);
+      fNew = batchEvaluate(model.params.Z, Y_sub, noYvalidation, model.params.B, WX_sub, noWXvalidation, model.hyperParams.gamma, model.hyperParams.problemType, stats + 9 * i + 3, allReduce);
 #else 
-    fNew = batchEvaluate(model.params.Z, data.Ytrain, data.Yvalidation, model.params.B, WX, WXvalidation, model.hyperParams.gamma, model.hyperParams.problemType, stats + 9 * i + 3);
+      fNew = batchEvaluate(model.params.Z, data.Ytrain, noYvalidation, model.params.B, WX, noWXvalidation, model.hyperParams.gamma, model.hyperParams.problemType, stats + 9 * i + 3, allReduce);
 #endif 
+      validation.submit(model, true, stats + 9 * i + 3, "iteration " + std::to_string(i) + ", after W");
 
-    if (fNew >= fOld * (1 + safeDiv(sgdTol*(FP_TYPE)log(3), (FP_TYPE)log(2 + i))))
-      armijoW *= (FP_TYPE)0.7;
-    else if (fNew <= fOld * (1 - safeDiv(3 * sgdTol*(FP_TYPE)log(3), (FP_TYPE)log(2 + i))))
-      armijoW *= (FP_TYPE)1.1;
-    else;
+      if (fNew >= fOld * (1 + safeDiv(sgdTol*(FP_TYPE)log(3), (FP_TYPE)log(2 + i))))
+        armijoW *= (FP_TYPE)0.7;
+      else if (fNew <= fOld * (1 - safeDiv(3 * sgdTol*(FP_TYPE)log(3), (FP_TYPE)log(2 + i))))
+        armijoW *= (FP_TYPE)1.1;
 
 #ifdef VERIFY
-    fileName = outDir + "/verify/W" + std::to_string(i);
-    f.open(fileName);
-    f << "W_check = [" << model.params.W << "];" << std::endl;
-    f.close();
+      fileName = outDir + "/verify/W" + std::to_string(i);
+      f.open(fileName);
+      f << "W_check = [" << model.params.W << "];" << std::endl;
+      f.close();
 #endif 
 #ifdef DUMP 
-    fileName = outDir + "/dump/W" + std::to_string(i);
-    f.open(fileName);
-    f << model.params.W.format(eigen_tsv);
-    f.close();
+      fileName = outDir + "/dump/W" + std::to_string(i);
+      f.open(fileName);
+      f << model.params.W.format(eigen_tsv);
+      f.close();
 #endif 
+    }
+    else {
+      // W is held fixed, so are WX and the objective
+      validation.deliver();
+      std::copy(stats + 9 * i, stats + 9 * i + 3, stats + 9 * i + 3);
+    }
 
     timer.nextTime("starting optimization w.r.t. Z");
     LOG_INFO("Optimizing w.r.t. prototype-label matrix (Z)...");
 
+    std::function<FP_TYPE(const ZMatType&, const Eigen::Index, const Eigen::Index)> lossZ =
+      [&model, &data, &WX, allReduce](const ZMatType& Z, const Eigen::Index begin, const Eigen::Index end)
+      ->FP_TYPE {
+      Workspace::Scope scope;
+      MatrixXuf& D = scope.matrix(end - begin, model.params.B.cols());
+      gaussianKernelInto(D, model.params.B, WX, model.hyperParams.gamma, begin, end);
+      return averageOverWorkers(allReduce, L(Z, data.Ytrain, D, begin, end));
+    };
+    std::function<void(MatrixXuf&, const ZMatType&, const Eigen::Index, const Eigen::Index)> gradZ =
+      [&model, &data, &WX, allReduce](MatrixXuf& grad, const ZMatType& Z, const Eigen::Index begin, const Eigen::Index end) {
+      Workspace::Scope scope;
+      MatrixXuf& D = scope.matrix(end - begin, model.params.B.cols());
+      gaussianKernelInto(D, model.params.B, WX, model.hyperParams.gamma, begin, end);
+      gradL_ZInto(grad, Z, data.Ytrain, D, begin, end);
+      averageOverWorkers(allReduce, grad);
+    };
+
 #ifdef BTLS
-    etaZ = armijoZ * btls<ZMatType>
-      ([&model, &data, &WX]
-	(const ZMatType& Z, const Eigen::Index begin, const Eigen::Index end)
-	->FP_TYPE {return L(Z, data.Ytrain, gaussianKernel(model.params.B, WX, model.hyperParams.gamma, begin, end), begin, end); },
-	[&model, &data, &WX]
-	(const ZMatType& Z, const Eigen::Index begin, const Eigen::Index end)
-	->MatrixXuf
-      {return gradL_Z(Z, data.Ytrain,
-		      gaussianKernel(model.params.B, WX, model.hyperParams.gamma, begin, end),
-		      begin, end); },
-	std::bind(hardThrsd, std::placeholders::_1, model.hyperParams.lambdaZ),
-       model.params.Z, n, bs, (etaZ/armijoZ)*2);
+    etaZ = armijoZ * btls<ZMatType>(lossZ, gradZ,
+      std::bind(hardThrsd, std::placeholders::_1, model.hyperParams.lambdaZ),
+      model.params.Z, n, bs, (etaZ/armijoZ)*2);
 #else
     for (auto j = 0; j < eta.size(); ++j) { //eta.size(); ++j) {
       Eigen::Index idx1 = (j*(Eigen::Index)hessianbs) % n;
@@ -830,6 +1221,7 @@ void EdgeML::altMinSGD(
       gtmpZ = gradL_Z(model.params.Z, data.Ytrain,
         gaussianKernel(model.params.B, WX, model.hyperParams.gamma, idx1, idx2),
         idx1, idx2);
+      averageOverWorkers(allReduce, gtmpZ);
 
       MatrixXuf gtmpZThresh = gtmpZ;
       hardThrsd(gtmpZThresh, model.hyperParams.lambdaZ);
@@ -839,9 +1231,11 @@ void EdgeML::altMinSGD(
       typeMismatchAssign(Ztmp, gtmpZThresh);
       Ztmp += model.params.Z;
 
-      gtmpZ -= gradL_Z(Ztmp, data.Ytrain,
+      MatrixXuf gradAtZtmp = gradL_Z(Ztmp, data.Ytrain,
         gaussianKernel(model.params.B, WX, model.hyperParams.gamma, idx1, idx2),
         idx1, idx2);
+      averageOverWorkers(allReduce, gradAtZtmp);
+      gtmpZ -= gradAtZtmp;
 
       if (gtmpZ.norm() <= 1e-20L) {
         LOG_WARNING("Difference between consecutive gradients of Z has become really low.");
@@ -855,18 +1249,7 @@ void EdgeML::altMinSGD(
 #endif
     //LOG_INFO("Step-length estimate for gradZ = " + std::to_string(etaZ));
     
-    accProxSGD<ZMatType>
-      (//[&model.params.B, &data.Ytrain, &WX, &model.hyperParams] 
-        [&model, &data, &WX]
-    (const ZMatType& Z, const Eigen::Index begin, const Eigen::Index end)
-      ->FP_TYPE {return L(Z, data.Ytrain, gaussianKernel(model.params.B, WX, model.hyperParams.gamma, begin, end), begin, end); },
-      //[&WX, &data.Ytrain, &model.params.B, &model.hyperParams]
-      [&model, &data, &WX]
-    (const ZMatType& Z, const Eigen::Index begin, const Eigen::Index end)
-      ->MatrixXuf
-    {return gradL_Z(Z, data.Ytrain,
-      gaussianKernel(model.params.B, WX, model.hyperParams.gamma, begin, end),
-      begin, end); },
+    accProxSGD<ZMatType>(lossZ, gradZ,
       std::bind(hardThrsd, std::placeholders::_1, model.hyperParams.lambdaZ),
       model.params.Z, epochs, n, bs, etaZ, etaUpdate);
     timer.nextTime("ending gradZ");
@@ -874,10 +1257,11 @@ void EdgeML::altMinSGD(
 
     fOld = fNew;
 #ifdef XML
-    fNew = batchEvaluate(model.params.Z, Y_sub, Yvalidation_sub, model.params.B, WX_sub, WXvalidation_sub, model.hyperParams.gamma, model.hyperParams.problemType, stats + 9 * i + 6);
+    fNew = batchEvaluate(model.params.Z, Y_sub, noYvalidation, model.params.B, WX_sub, noWXvalidation, model.hyperParams.gamma, model.hyperParams.problemType, stats + 9 * i + 6, allReduce);
 #else 
-    fNew = batchEvaluate(model.params.Z, data.Ytrain, data.Yvalidation, model.params.B, WX, WXvalidation, model.hyperParams.gamma, model.hyperParams.problemType, stats + 9 * i + 6);
+    fNew = batchEvaluate(model.params.Z, data.Ytrain, noYvalidation, model.params.B, WX, noWXvalidation, model.hyperParams.gamma, model.hyperParams.problemType, stats + 9 * i + 6, allReduce);
 #endif
+    validation.submit(model, false, stats + 9 * i + 6, "iteration " + std::to_string(i) + ", after Z");
 
     if (fNew >= fOld * (1 + safeDiv(sgdTol*(FP_TYPE)log(3), (FP_TYPE)log(2 + i))))
       armijoZ *= (FP_TYPE)0.7;
@@ -901,19 +1285,27 @@ void EdgeML::altMinSGD(
     timer.nextTime("starting optimization w.r.t. B");
     LOG_INFO("Optimizing w.r.t. prototype matrix (B)...");
 
+    std::function<FP_TYPE(const BMatType&, const Eigen::Index, const Eigen::Index)> lossB =
+      [&model, &data, &WX, allReduce](const BMatType& B, const Eigen::Index begin, const Eigen::Index end)
+      ->FP_TYPE {
+      Workspace::Scope scope;
+      MatrixXuf& D = scope.matrix(end - begin, B.cols());
+      gaussianKernelInto(D, B, WX, model.hyperParams.gamma, begin, end);
+      return averageOverWorkers(allReduce, L(model.params.Z, data.Ytrain, D, begin, end));
+    };
+    std::function<void(MatrixXuf&, const BMatType&, const Eigen::Index, const Eigen::Index)> gradB =
+      [&model, &data, &WX, allReduce](MatrixXuf& grad, const BMatType& B, const Eigen::Index begin, const Eigen::Index end) {
+      Workspace::Scope scope;
+      MatrixXuf& D = scope.matrix(end - begin, B.cols());
+      gaussianKernelInto(D, B, WX, model.hyperParams.gamma, begin, end);
+      gradL_BInto(grad, B, data.Ytrain, model.params.Z, WX, D, model.hyperParams.gamma, begin, end);
+      averageOverWorkers(allReduce, grad);
+    };
+
 #ifdef BTLS
-    etaB = armijoB * btls<BMatType>
-      ([&model, &data, &WX]
-       (const BMatType& B, const Eigen::Index begin, const Eigen::Index end)
-       ->FP_TYPE {return L(model.params.Z, data.Ytrain, gaussianKernel(B, WX, model.hyperParams.gamma, begin, end), begin, end); },
-       [&model, &data, &WX]
-       (const BMatType& B, const Eigen::Index begin, const Eigen::Index end)
-       ->MatrixXuf
-      {return gradL_B(B, data.Ytrain, model.params.Z, WX,
-		      gaussianKernel(B, WX, model.hyperParams.gamma, begin, end),
-		      model.hyperParams.gamma, begin, end); },
-       std::bind(hardThrsd, std::placeholders::_1, model.hyperParams.lambdaB),
-       model.params.B, n, bs, (etaB/armijoB)*2);
+    etaB = armijoB * btls<BMatType>(lossB, gradB,
+      std::bind(hardThrsd, std::placeholders::_1, model.hyperParams.lambdaB),
+      model.params.B, n, bs, (etaB/armijoB)*2);
 #else    
     for (auto j = 0; j < eta.size(); ++j) {
       Eigen::Index idx1 = (j*(Eigen::Index)hessianbs) % n;
@@ -923,15 +1315,18 @@ void EdgeML::altMinSGD(
       gtmpB = gradL_B(model.params.B, data.Ytrain, model.params.Z, WX,
         gaussianKernel(model.params.B, WX, model.hyperParams.gamma, idx1, idx2),
         model.hyperParams.gamma, idx1, idx2);
+      averageOverWorkers(allReduce, gtmpB);
 
       MatrixXuf gtmpBThresh = gtmpB;
       hardThrsd(gtmpBThresh, model.hyperParams.lambdaB);
 
       Btmp = model.params.B - 0.001*safeDiv(model.params.B.cwiseAbs().maxCoeff(), gtmpB.cwiseAbs().maxCoeff())*gtmpBThresh;
 
-      gtmpB -= gradL_B(Btmp, data.Ytrain, model.params.Z, WX,
+      MatrixXuf gradAtBtmp = gradL_B(Btmp, data.Ytrain, model.params.Z, WX,
         gaussianKernel(Btmp, WX, model.hyperParams.gamma, idx1, idx2),
         model.hyperParams.gamma, idx1, idx2);
+      averageOverWorkers(allReduce, gradAtBtmp);
+      gtmpB -= gradAtBtmp;
 
       if (gtmpB.norm() <= 1e-20L) {
         LOG_WARNING("Difference between consecutive gradients of B has become really low.");
@@ -946,18 +1341,7 @@ void EdgeML::altMinSGD(
 #endif
     //LOG_INFO("Step-length estimate for gradB = " + std::to_string(etaB));
 
-    accProxSGD<BMatType>
-      (//[&model.params.Z, &data.Ytrain, &WX, &model.hyperParams] 
-        [&model, &data, &WX]
-    (const BMatType& B, const Eigen::Index begin, const Eigen::Index end)
-      ->FP_TYPE {return L(model.params.Z, data.Ytrain, gaussianKernel(B, WX, model.hyperParams.gamma, begin, end), begin, end); },
-      //[&WX, &data.Ytrain, &model.params.Z, &model.hyperParams]
-      [&model, &data, &WX]
-    (const BMatType& B, const Eigen::Index begin, const Eigen::Index end)
-      ->MatrixXuf
-    {return gradL_B(B, data.Ytrain, model.params.Z, WX,
-      gaussianKernel(B, WX, model.hyperParams.gamma, begin, end),
-      model.hyperParams.gamma, begin, end); },
+    accProxSGD<BMatType>(lossB, gradB,
       std::bind(hardThrsd, std::placeholders::_1, model.hyperParams.lambdaB),
       model.params.B, epochs, n, bs, etaB, etaUpdate);
     timer.nextTime("ending gradB");
@@ -965,10 +1349,11 @@ void EdgeML::altMinSGD(
 
     fOld = fNew;
 #ifdef XML
-    fNew = batchEvaluate(model.params.Z, Y_sub, Yvalidation_sub, model.params.B, WX_sub, WXvalidation_sub, model.hyperParams.gamma, model.hyperParams.problemType, stats + 9 * i + 9);
+    fNew = batchEvaluate(model.params.Z, Y_sub, noYvalidation, model.params.B, WX_sub, noWXvalidation, model.hyperParams.gamma, model.hyperParams.problemType, stats + 9 * i + 9, allReduce);
 #else 
-    fNew = batchEvaluate(model.params.Z, data.Ytrain, data.Yvalidation, model.params.B, WX, WXvalidation, model.hyperParams.gamma, model.hyperParams.problemType, stats + 9 * i + 9);
+    fNew = batchEvaluate(model.params.Z, data.Ytrain, noYvalidation, model.params.B, WX, noWXvalidation, model.hyperParams.gamma, model.hyperParams.problemType, stats + 9 * i + 9, allReduce);
 #endif
+    validation.submit(model, false, stats + 9 * i + 9, "iteration " + std::to_string(i) + ", after B");
 
     if (fNew >= fOld * (1 + safeDiv(sgdTol*(FP_TYPE)log(3), (FP_TYPE)log(2 + i))))
       armijoB *= (FP_TYPE)0.7;
@@ -988,12 +1373,170 @@ void EdgeML::altMinSGD(
     f << model.params.B.format(eigen_tsv);
     f.close();
 #endif 
+
+    // Zero workspace allocations and page faults once the shapes of all phases have been seen
+    const AllocationStats iterEnd = readAllocationStats();
+    LOG_INFO("Memory in iteration " + std::to_string(i) + ": " + allocationStatsDelta(iterStart, iterEnd));
+    iterStart = iterEnd;
+  }
+  // Accuracy of the final model
+  validation.deliver();
+}
+
+//
+// Keeps, in order of decreasing @contribution, each prototype that contributes at least
+// @deadFraction of the average and absorbs into it the remaining prototypes within
+// gamma^2 * ||b_i - b_j||^2 <= @mergeRadius. Merged prototypes have nearly equal kernel
+// values everywhere, so summing their columns of Z keeps the scores.
+// @B (d X m) and @Z (L X m) are replaced by the kept prototypes; returns how many.
+//
+static labelCount_t mergePrototypes(
+  MatrixXuf& B,
+  MatrixXuf& Z,
+  const std::vector<FP_TYPE>& contribution,
+  const FP_TYPE gamma,
+  const FP_TYPE deadFraction,
+  const FP_TYPE mergeRadius)
+{
+  const Eigen::Index m = B.cols();
+  assert(Z.cols() == m && (Eigen::Index)contribution.size() == m);
+
+  FP_TYPE total = 0;
+  for (Eigen::Index j = 0; j < m; ++j)
+    total += contribution[j];
+  const FP_TYPE deadBelow = deadFraction * total / (FP_TYPE)m;
+  const FP_TYPE radiusSq = mergeRadius / (gamma * gamma);
+
+  std::vector<Eigen::Index> order(m);
+  for (Eigen::Index j = 0; j < m; ++j)
+    order[j] = j;
+  std::stable_sort(order.begin(), order.end(),
+    [&contribution](const Eigen::Index a, const Eigen::Index b) { return contribution[a] > contribution[b]; });
+
+  std::vector<bool> taken(m, false);
+  MatrixXuf keptB(B.rows(), m), keptZ(Z.rows(), m);
+  labelCount_t kept = 0;
+  for (Eigen::Index i = 0; i < m; ++i) {
+    const Eigen::Index a = order[i];
+    if (taken[a] || contribution[a] < deadBelow)
+      continue;
+    taken[a] = true;
+
+    FP_TYPE weight = contribution[a];
+    keptB.col(kept) = contribution[a] * B.col(a);
+    keptZ.col(kept) = Z.col(a);
+    for (Eigen::Index j = i + 1; j < m; ++j) {
+      const Eigen::Index b = order[j];
+      if (taken[b] || (B.col(a) - B.col(b)).squaredNorm() > radiusSq)
+        continue;
+      taken[b] = true;
+      weight += contribution[b];
+      keptB.col(kept) += contribution[b] * B.col(b);
+      keptZ.col(kept) += Z.col(b);
+    }
+    if (weight > (FP_TYPE)0.0)
+      keptB.col(kept) /= weight;
+    else
+      keptB.col(kept) = B.col(a);
+    ++kept;
+  }
+
+  B = keptB.leftCols(kept);
+  Z = keptZ.leftCols(kept);
+  return kept;
+}
+
+labelCount_t EdgeML::compactPrototypes(
+  const EdgeML::Data& data,
+  EdgeML::ProtoNN::ProtoNNModel& model,
+  const FP_TYPE accuracyBudget,
+  const std::string& outDir)
+{
+  Timer timer("compactPrototypes");
+  assert(accuracyBudget >= (FP_TYPE)0.0);
+
+  // From the most to the least aggressive
+  const FP_TYPE deadFractions[] = { (FP_TYPE)0.25, (FP_TYPE)0.1, (FP_TYPE)0.03 };
+  const FP_TYPE mergeRadii[] = { (FP_TYPE)0.5, (FP_TYPE)0.2, (FP_TYPE)0.05 };
+  const int numSettings = sizeof(mergeRadii) / sizeof(mergeRadii[0]);
+  const int refitIters = 2;
+
+  const labelCount_t m = model.hyperParams.m;
+  const FP_TYPE gamma = model.hyperParams.gamma;
+  const dataCount_t n = data.Xtrain.cols();
+
+  MatrixXuf WX(model.params.W.rows(), n);
+  mm(WX, model.params.W, CblasNoTrans, data.Xtrain, CblasNoTrans, 1.0, 0.0L);
+
+  const bool onValidation = data.Xvalidation.cols() > 0;
+  MatrixXuf WXvalidation;
+  if (onValidation) {
+    WXvalidation.resize(model.params.W.rows(), data.Xvalidation.cols());
+    mm(WXvalidation, model.params.W, CblasNoTrans, data.Xvalidation, CblasNoTrans, 1.0, 0.0L);
+  }
+  const MatrixXuf& WXcheck = onValidation ? WXvalidation : WX;
+  const SparseMatrixuf& Ycheck = onValidation ? data.Yvalidation : data.Ytrain;
+  const std::string checkedOn = onValidation ? "validation" : "training";
+
+  const FP_TYPE accuracyBefore = accuracy(model.params.Z, Ycheck,
+    gaussianKernel(model.params.B, WXcheck, gamma), model.hyperParams.problemType);
+
+  // Contribution of prototype j: its kernel mass over the training data times ||Z(:, j)||
+  const MatrixXuf originalB(model.params.B);
+  const MatrixXuf originalZ(model.params.Z);
+  MatrixXuf mass = MatrixXuf::Zero(1, m);
+  const dataCount_t chunk = 1 << 14;
+  for (dataCount_t begin = 0; begin < n; begin += chunk) {
+    const dataCount_t end = std::min(begin + chunk, n);
+    mass += gaussianKernel(model.params.B, WX, gamma, begin, end).colwise().sum();
   }
+  std::vector<FP_TYPE> contribution(m);
+  for (labelCount_t j = 0; j < m; ++j)
+    contribution[j] = mass(0, j) * originalZ.col(j).norm();
+  timer.nextTime("computing prototype contributions");
+
+  const BMatType savedB = model.params.B;
+  const ZMatType savedZ = model.params.Z;
+  const int savedIters = model.hyperParams.iters;
+
+  for (int s = 0; s < numSettings; ++s) {
+    MatrixXuf B = originalB, Z = originalZ;
+    const labelCount_t kept = mergePrototypes(B, Z, contribution, gamma, deadFractions[s], mergeRadii[s]);
+    if (kept == m)
+      break; // Milder settings would not compact either
+
+    typeMismatchAssign(model.params.B, B);
+    typeMismatchAssign(model.params.Z, Z);
+    model.hyperParams.m = kept;
+    model.hyperParams.iters = refitIters;
+    LOG_INFO("Prototype compaction: " + std::to_string(m) + " -> " + std::to_string(kept)
+      + " prototypes, refitting Z and B");
+
+    FP_TYPE* stats = new FP_TYPE[refitIters * 9 + 3];
+    altMinSGD(data, model, stats, outDir, false);
+    delete[] stats;
+    model.hyperParams.iters = savedIters;
+
+    const FP_TYPE accuracyAfter = accuracy(model.params.Z, Ycheck,
+      gaussianKernel(model.params.B, WXcheck, gamma), model.hyperParams.problemType);
+    LOG_INFO("Prototype compaction: " + checkedOn + " accuracy " + std::to_string(accuracyBefore)
+      + " -> " + std::to_string(accuracyAfter) + " with " + std::to_string(kept) + " prototypes");
+    timer.nextTime("compacting and refitting");
+
+    if (accuracyBefore - accuracyAfter <= accuracyBudget)
+      return kept;
+  }
+
+  LOG_INFO("Prototype compaction: keeping all " + std::to_string(m) + " prototypes");
+  model.params.B = savedB;
+  model.params.Z = savedZ;
+  model.hyperParams.m = m;
+  return m;
 }
 
 // function v = accuracy(Ytrue, D, Z, k)
 // We have set k = inf permanently
-// computes accuracy for binary/multiclass datasets, and prec1, prec3, prec5 for multilabel datasets
+// computes accuracy for binary/multiclass datasets, and prec1 for multilabel datasets
 FP_TYPE EdgeML::accuracy(
   const ZMatType& Z, const LabelMatType& Y, const MatrixXuf& D,
   const EdgeML::ProblemFormat& problemType)
@@ -1001,88 +1544,27 @@ FP_TYPE EdgeML::accuracy(
   Timer timer("accuracy");
   assert(Y.cols() == D.rows());
   //Ypred = Z*D';
-  MatrixXuf Ytrue(Y);
-  MatrixXuf Yscore(Ytrue.rows(), Ytrue.cols());
+  Workspace::Scope scope;
+  MatrixXuf& Yscore = scope.matrix(Y.rows(), Y.cols());
   mm(Yscore, Z, CblasNoTrans, D, CblasTrans, 1.0, 0.0L);
   timer.nextTime("computing Yscore");
-  FP_TYPE ret = 0;
 
-  if (problemType == EdgeML::ProblemFormat::binary || problemType == EdgeML::ProblemFormat::multiclass) {
-    //[~,Ytrue] = max(Ytrue);
-    //[~,Ypred] = max(Ypred);
-    dataCount_t Ytrue_, Ypred_;
-
-    //v = numel(find(Ypred == Ytrue))/numel(Ypred);
-    for (Eigen::Index i = 0; i < Ytrue.cols(); ++i) {
-      Ytrue.col(i).maxCoeff(&Ytrue_);
-      Yscore.col(i).maxCoeff(&Ypred_);
-
-      if (Ytrue_ == Ypred_)
-        ret += 1;
-    }
-
-    assert(Y.cols() != 0);
-    ret = safeDiv(ret, (FP_TYPE)Y.cols());
-  }
-  else if (problemType == EdgeML::ProblemFormat::multilabel) {
-    FP_TYPE prec1(0), prec3(0), prec5(0);
-    const labelCount_t k = 5;
-
-    assert(k * Yscore.cols() < 3e9);
-    std::vector<labelCount_t> topInd(k * Yscore.cols());
-    pfor(Eigen::Index i = 0; i < Ytrue.cols(); ++i) {
-      for (Eigen::Index j = 0; j < Ytrue.rows(); ++j) {
-        FP_TYPE val = Yscore(j, i);
-        if (j >= k && (val < Yscore(topInd[i*k + (k - 1)], i)))
-          continue;
-        size_t top = std::min(j, (Eigen::Index)k - 1);
-        while (top > 0 && (Yscore(topInd[i*k + (top - 1)], i) < val)) {
-          topInd[i*k + (top)] = topInd[i*k + (top - 1)];
-          top--;
-        }
-        topInd[i*k + top] = j;
-      }
-    }
-
-    timer.nextTime("finding max values");
-
-    assert(k >= 5);
-    for (Eigen::Index i = 0; i < Ytrue.cols(); ++i) {
-      for (labelCount_t j = 0; j < 1; ++j) {
-        if (Ytrue(topInd[i*k + j], i) == 1)
-          prec1++;
-      }
-      for (labelCount_t j = 0; j < 3; ++j) {
-        if (Ytrue(topInd[i*k + j], i) == 1)
-          prec3++;
-      }
-      for (labelCount_t j = 0; j < 5; ++j) {
-        if (Ytrue(topInd[i*k + j], i) == 1)
-          prec5++;
-      }
-    }
-
-    timer.nextTime("precision computation");
-
-    dataCount_t totLabel = Y.cols();
-    assert(totLabel != 0);
-    ret = prec1;
-    ret = safeDiv(ret, (FP_TYPE)totLabel);
-
-    /*LOG_INFO("prec@1: " + std::to_string(safeDiv(prec1, (FP_TYPE) totLabel))
-      + "  prec@3: " + std::to_string(safeDiv(prec3, 3 * (FP_TYPE)totLabel))
-      + "  prec@5: " + std::to_string(safeDiv(prec5, 5 * (FP_TYPE)totLabel)));
-    */
-  }
+  // Works on the labels as they are, so sparse labels are never densified
+  EvaluationAccumulator evaluation(problemType);
+  evaluation.add(Yscore, Y);
+  const ResultStruct res = evaluation.result();
+  timer.nextTime("evaluating Yscore");
 
-  return ret;
+  if (problemType == EdgeML::ProblemFormat::multilabel)
+    return res.precision1;
+  return res.accuracy;
 }
 
 
 template<class ParamType>
 FP_TYPE EdgeML::btls(std::function<FP_TYPE(const ParamType&,
   const Eigen::Index, const Eigen::Index)> f,
-  std::function<MatrixXuf(const ParamType&,
+  std::function<void(MatrixXuf&, const ParamType&,
     const Eigen::Index, const Eigen::Index)> gradf,
   std::function<void(MatrixXuf&)> prox,
   ParamType& param,
@@ -1114,7 +1596,8 @@ FP_TYPE EdgeML::btls(std::function<FP_TYPE(const ParamType&,
     randStartIndex = 0;
   
   Eigen::Index randEndIndex = randStartIndex + bs; 
-  MatrixXuf gradParam = gradf(param, randStartIndex, randEndIndex);
+  MatrixXuf gradParam;
+  gradf(gradParam, param, randStartIndex, randEndIndex);
   FP_TYPE fParam = f(param, randStartIndex, randEndIndex); 
 
   while (true){
@@ -1139,7 +1622,7 @@ FP_TYPE EdgeML::btls(std::function<FP_TYPE(const ParamType&,
 template<class ParamType>
 void EdgeML::accProxSGD(std::function<FP_TYPE(const ParamType&,
   const Eigen::Index, const Eigen::Index)> f,
-  std::function<MatrixXuf(const ParamType&,
+  std::function<void(MatrixXuf&, const ParamType&,
     const Eigen::Index, const Eigen::Index)> gradf,
   std::function<void(MatrixXuf&)> prox,
   ParamType& param,
@@ -1153,7 +1636,7 @@ void EdgeML::accProxSGD(std::function<FP_TYPE(const ParamType&,
   Logger logger("accProxSGD ");
 
   ParamType paramTailAverage = param;                              // Stores the tail averaged gradient that is finally returned 
-  MatrixXuf temp = MatrixXuf::Zero(param.rows(), param.cols());    // A dense matrix to hold intermediate param-sized matrices
+  MatrixXuf temp = MatrixXuf::Zero(param.rows(), param.cols());    // A dense matrix to hold intermediate param-sized matrices; gradf writes into it
   ParamType currentUpdate;                                         // Stores momentum term for accProxSGD; corresponds to vanilla gradient 
                                                                    // descent update for current iterate
   ParamType prevUpdate = param;                                    // A matrix to hold previous update (ie, currentUpdate value of last iteration)
@@ -1189,7 +1672,8 @@ void EdgeML::accProxSGD(std::function<FP_TYPE(const ParamType&,
     gamma = (FP_TYPE)0.5 + (FP_TYPE)0.5 * pow(1 + 4 * gamma0*gamma0, (FP_TYPE)0.5);
     alpha = safeDiv((1 - gamma0), gamma);
 
-    temp = (-stepSize) * gradf(param, idx1, idx2);
+    gradf(temp, param, idx1, idx2);
+    temp *= -stepSize;
     // Store (gradient * step size) in temporary matrix
     timer.nextTime("taking gradient");
 
@@ -1228,18 +1712,169 @@ void EdgeML::accProxSGD(std::function<FP_TYPE(const ParamType&,
 #ifdef CILK
     cilk::reducer< cilk::op_add<size_t> > nnz(0);
 #else
-    int *nnz = new int;
-    *nnz = 0;
+    size_t nnzCount = 0;
+    size_t *nnz = &nnzCount;
 #endif
-    pfor(std::ptrdiff_t i = 0; i < param.rows()*param.cols(); ++i) {
-      if (std::abs(param.data()[i]) > eps)
+    const FP_TYPE* values = storedValues(param);
+    pfor(std::ptrdiff_t i = 0; i < storedValueCount(param); ++i) {
+      if (std::abs(values[i]) > eps)
         *nnz += 1;
     }
-#ifndef CILK
-    delete nnz;
-#endif
   }
 
   param = paramTailAverage;
   eta = stepSize;
 }
+
+void EdgeML::accProxSGDColumnSparse(
+  std::function<void(std::vector<Eigen::Index>&,
+    const Eigen::Index, const Eigen::Index)> columnsf,
+  std::function<void(ColumnSparseMatrix&, const MatrixXuf&,
+    const Eigen::Index, const Eigen::Index)> gradf,
+  const FP_TYPE sparsity,
+  MatrixXuf& param,
+  const int& epochs,
+  const dataCount_t& n,
+  const dataCount_t& bs,
+  FP_TYPE eta,
+  const int& etaUpdate)
+{
+  Timer timer("accProxSGDColumnSparse");
+  // How one iteration moves a column that its batch does not touch, as a map of
+  // (param, prevUpdate, paramTailAverage) of the column
+  typedef Eigen::Matrix<FP_TYPE, 3, 3> LazyStep;
+
+  MatrixXuf paramTailAverage = param;
+  MatrixXuf prevUpdate = param;
+  ColumnSparseMatrix grad;
+
+  // The L0 projection keeps the entries above a level set by all of param. The level is
+  // computed when all columns are current, at the start and at each flush, when all of
+  // param is projected; in between, the destinations of the touched columns are projected
+  // with it at every step, as accProxSGD does. Projected entries are dropped from
+  // prevUpdate as well, or the momentum would bring them back.
+  const bool project = sparsity < 0.999;
+  FP_TYPE level = 0;
+  auto projectAll = [&]() {
+    level = hardThrsdLevel(param, sparsity);
+    FP_TYPE *const data = param.data();
+    FP_TYPE *const prevData = prevUpdate.data();
+    pfor(std::ptrdiff_t j = 0; j < (std::ptrdiff_t)param.size(); ++j)
+      if (std::abs(data[j]) <= level)
+        data[j] = prevData[j] = 0;
+  };
+
+  // Column c is current as of iteration lastStep[c], and pending[lastStep[c] - flushedAt]
+  // brings it to the current iteration. pending grows by one map per iteration until a
+  // flush brings every column up to date; without projection, flushing about every
+  // sqrt(param.size()) iterations keeps the cost of both at a fraction of a dense step.
+  const size_t flushPeriod = project ? 16 : std::max((size_t)16, (size_t)std::sqrt((double)param.size()));
+  std::vector<int> lastStep(param.cols(), -1);
+  std::vector<LazyStep> pending(1, LazyStep::Identity());
+  int flushedAt = -1;
+
+  int burnPeriod = 50;
+  FP_TYPE gamma0 = 1;
+  FP_TYPE stepSize, gamma, alpha;
+  timer.nextTime("creating matrices");
+
+  auto catchUp = [&](const Eigen::Index c) {
+    const size_t k = lastStep[c] - flushedAt;
+    if (k + 1 == pending.size())
+      return;
+    const LazyStep& r = pending[k];
+    for (Eigen::Index j = 0; j < param.rows(); ++j) {
+      const FP_TYPE p = param(j, c), q = prevUpdate(j, c), v = paramTailAverage(j, c);
+      param(j, c) = r(0, 0) * p + r(0, 1) * q + r(0, 2) * v;
+      prevUpdate(j, c) = r(1, 0) * p + r(1, 1) * q + r(1, 2) * v;
+      paramTailAverage(j, c) = r(2, 0) * p + r(2, 1) * q + r(2, 2) * v;
+    }
+  };
+
+  auto flush = [&](const int i) {
+    pfor(Eigen::Index c = 0; c < param.cols(); ++c)
+      catchUp(c);
+    std::fill(lastStep.begin(), lastStep.end(), i);
+    pending.assign(1, LazyStep::Identity());
+    flushedAt = i;
+  };
+
+  if (bs > n) {
+    LOG_INFO("accelerated proximal gradient descent called with batch-size more than #train points.");
+    assert(bs <= n);
+  }
+
+  uint64_t iters_ = ((uint64_t)n*(uint64_t)epochs) / (uint64_t)bs;
+  assert(iters_ < 0x7fffffff);
+  const int iters = (int)iters_;
+
+  if (project && iters > 0) {
+    projectAll();
+    timer.nextTime("L0 projection of all columns");
+  }
+
+  for (int i = 0; i < iters; ++i) {
+    Eigen::Index idx1 = (i*(Eigen::Index)bs) % n;
+    Eigen::Index idx2 = ((i + 1)*(Eigen::Index)bs) % n;
+    if (idx2 <= idx1) idx2 = n;
+
+    switch (etaUpdate) {
+    case -1:
+      stepSize = safeDiv(eta, (1 + (FP_TYPE)0.2 * ((FP_TYPE)i + (FP_TYPE)1.0)));
+      break;
+    case 0:
+      stepSize = safeDiv(eta, pow((FP_TYPE)i + (FP_TYPE)1.0, (FP_TYPE)0.5));
+      break;
+    }
+
+    gamma = (FP_TYPE)0.5 + (FP_TYPE)0.5 * pow(1 + 4 * gamma0*gamma0, (FP_TYPE)0.5);
+    alpha = safeDiv((1 - gamma0), gamma);
+    FP_TYPE tmp = ((i - burnPeriod) > 1) ? (i - burnPeriod) : (FP_TYPE)1.0;
+    assert(tmp >= 0.999999);
+    const FP_TYPE keep = safeDiv(tmp - (FP_TYPE)1.0, tmp), fresh = safeDiv(1.0, tmp);
+
+    columnsf(grad.columns, idx1, idx2);
+    const std::vector<Eigen::Index>& columns = grad.columns;
+    pfor(std::ptrdiff_t k = 0; k < (std::ptrdiff_t)columns.size(); ++k)
+      catchUp(columns[k]);
+    timer.nextTime("bringing the touched columns up to date");
+
+    gradf(grad, param, idx1, idx2);
+    timer.nextTime("taking gradient");
+
+    // The steps of accProxSGD, on the touched columns only
+    pfor(std::ptrdiff_t k = 0; k < (std::ptrdiff_t)columns.size(); ++k) {
+      const Eigen::Index c = columns[k];
+      for (Eigen::Index j = 0; j < param.rows(); ++j) {
+        FP_TYPE destination = param(j, c) - stepSize * grad.values(j, k);
+        if (project && std::abs(destination) <= level)
+          destination = 0;
+        param(j, c) = (1 - alpha) * destination + alpha * prevUpdate(j, c);
+        prevUpdate(j, c) = destination;
+        paramTailAverage(j, c) = keep * paramTailAverage(j, c) + fresh * param(j, c);
+      }
+      lastStep[c] = i;
+    }
+    timer.nextTime("updating and projecting the touched columns");
+
+    LazyStep step;
+    step << 1 - alpha, alpha, 0,
+      1, 0, 0,
+      fresh * (1 - alpha), fresh * alpha, keep;
+    for (size_t k = 0; k < pending.size(); ++k)
+      pending[k] = step * pending[k];
+    pending.push_back(LazyStep::Identity());
+    gamma0 = gamma;
+
+    if (pending.size() > flushPeriod) {
+      flush(i);
+      // The columns left alone since the last flush, and a fresh level
+      if (project)
+        projectAll();
+      timer.nextTime("bringing all columns up to date");
+    }
+  }
+  flush(iters - 1);
+
+  param = paramTailAverage;
+}
@@ -9,6 +9,11 @@
 #include "par_utils.h"
 #include "cluster.h"
 #include "ProtoNN.h"
+#include "workspace.h"
+#include "shm_allreduce.h"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 namespace EdgeML
 {
@@ -17,6 +22,7 @@ namespace EdgeML
     MatrixXuf WX,
     FP_TYPE multiplier);
 
+  // With @allReduce, the objective and accuracies are over the data of all workers
   FP_TYPE batchEvaluate(
     const ZMatType& Z,
     const LabelMatType& Y,
@@ -26,7 +32,8 @@ namespace EdgeML
     const MatrixXuf& WXval,
     const FP_TYPE& gamma,
     const EdgeML::ProblemFormat& problemType,
-    FP_TYPE * const stats);
+    FP_TYPE * const stats,
+    SharedMemoryAllReduce *const allReduce = NULL);
 
   FP_TYPE batchEvaluate(
     const ZMatType& Z,
@@ -93,6 +100,40 @@ namespace EdgeML
     const MatrixXuf& WX,
     const FP_TYPE gamma);
 
+  //
+  // Same as gaussianKernel, with the squared column norms of @B precomputed in @BColSum (1 X m).
+  // Use this when B is fixed across calls, e.g., at prediction time.
+  //
+  MatrixXuf gaussianKernel(
+    const BMatType& B,
+    const MatrixXuf& BColSum,
+    const MatrixXuf& WX,
+    const FP_TYPE gamma,
+    const Eigen::Index begin,
+    const Eigen::Index end);
+
+  //
+  // The *Into variants below write their result into @out, which is resized if needed,
+  // and take their temporaries from the calling thread's Workspace. Pass a workspace
+  // matrix or a matrix that lives across iterations to allocate nothing in steady state.
+  //
+  void gaussianKernelInto(
+    MatrixXuf& D,
+    const BMatType& B,
+    const MatrixXuf& WX,
+    const FP_TYPE gamma,
+    const Eigen::Index begin,
+    const Eigen::Index end);
+
+  void gaussianKernelInto(
+    MatrixXuf& D,
+    const BMatType& B,
+    const MatrixXuf& BColSum,
+    const MatrixXuf& WX,
+    const FP_TYPE gamma,
+    const Eigen::Index begin,
+    const Eigen::Index end);
+
   //
   // Returns the gradient of @B
   // Input: @B, @Y, @Z can be CSR or CSC
@@ -116,6 +157,17 @@ namespace EdgeML
     const MatrixXuf& D,
     const FP_TYPE gamma);
 
+  void gradL_BInto(
+    MatrixXuf& grad,
+    const BMatType& B,
+    const LabelMatType& Y,
+    const ZMatType& Z,
+    const MatrixXuf& WX,
+    const MatrixXuf& D,
+    const FP_TYPE gamma,
+    const Eigen::Index begin,
+    const Eigen::Index end);
+
   //
   // Returns the gradient of @Z
   // Input: @D=gaussianKernel
@@ -133,6 +185,14 @@ namespace EdgeML
     const LabelMatType& Y,
     const MatrixXuf& D);
 
+  void gradL_ZInto(
+    MatrixXuf& grad,
+    const ZMatType& Z,
+    const LabelMatType& Y,
+    const MatrixXuf& D,
+    const Eigen::Index begin,
+    const Eigen::Index end);
+
   //
   // Returns the gradient of @B
   // Input: @B, @Y, @Z, @X, @W can be CSR or CSC
@@ -158,6 +218,54 @@ namespace EdgeML
     const MatrixXuf& D,
     const FP_TYPE gamma);
 
+  void gradL_WInto(
+    MatrixXuf& grad,
+    const BMatType& B,
+    const LabelMatType& Y,
+    const ZMatType& Z,
+    const WMatType& W,
+    const SparseMatrixuf& X,
+    const MatrixXuf& D,
+    const FP_TYPE gamma,
+    const Eigen::Index begin,
+    const Eigen::Index end);
+
+  //
+  // A matrix that is zero outside a few columns:
+  // column k of @values is column @columns[k], and @columns is sorted
+  //
+  struct ColumnSparseMatrix
+  {
+    std::vector<Eigen::Index> columns;
+    MatrixXuf values;
+  };
+
+  // Sorted indices of the features that are nonzero in some point of [begin, end) of @X
+  void batchColumns(
+    std::vector<Eigen::Index>& columns,
+    const SparseMatrixuf& X,
+    const Eigen::Index begin,
+    const Eigen::Index end);
+
+  //
+  // The gradient of @W on points [begin, end), restricted to grad.columns, which must be
+  // batchColumns(X, begin, end): W has no gradient outside them. Costs O(d nnz) beyond the
+  // kernel terms, against O(d D) for gradL_WInto.
+  // Input: @WX is W * X on the points, the projection @D was computed from. It is
+  // overwritten, as the gradient is built in its place.
+  //
+  void gradL_WColumnsInto(
+    ColumnSparseMatrix& grad,
+    const BMatType& B,
+    const LabelMatType& Y,
+    const ZMatType& Z,
+    MatrixXuf& WX,
+    const SparseMatrixuf& X,
+    const MatrixXuf& D,
+    const FP_TYPE gamma,
+    const Eigen::Index begin,
+    const Eigen::Index end);
+
   //
   // Returns sparsified version of @mat, retaining only the top sparsity-many values
   // @mat: Matrix to be thresholded and returned
@@ -165,20 +273,116 @@ namespace EdgeML
   //
   void hardThrsd(MatrixXuf& mat, FP_TYPE sparsity);
 
+  // Magnitude at or below which hardThrsd(@mat, @sparsity) zeroes entries
+  FP_TYPE hardThrsdLevel(const MatrixXuf& mat, FP_TYPE sparsity);
+
+  //
+  // Computes the validation accuracy (prec@1 for multilabel problems) of the model after each
+  // training phase on a thread of its own, while the next phase runs. submit() copies Z and B,
+  // and W when it has changed; the evaluator projects the validation data with its copy of W
+  // only then. One evaluation is in flight at a time: it is delivered, i.e., logged and written
+  // to the stats it was submitted with, by the next submit() or by deliver().
+  // With @allReduce, accuracies are over the validation data of all workers, and all workers
+  // must submit and deliver at the same points. If @X is a sample of a worker's
+  // @numPoints validation points, its accuracy counts as much as that many points.
+  // @X and @Y must outlive the pipeline; labels are converted to LabelMatType one block at a time.
+  //
+  class ValidationPipeline
+  {
+    const SparseMatrixuf& X;
+    const SparseMatrixuf& Y;
+    EdgeML::ProblemFormat problemType;
+    SharedMemoryAllReduce *allReduce;
+    FP_TYPE pointWeight;      // Validation points each column of X stands for
+
+    // Owned by the evaluator from submit() until the evaluation is done
+    WMatType W;
+    ZMatType Z;
+    BMatType B;
+    FP_TYPE gamma;
+    bool isWChanged;
+    MatrixXuf WX;             // X projected by the last W copied
+
+    std::mutex evaluatorMutex;
+    std::condition_variable evaluatorCondition;
+    std::thread evaluatorThread;
+    bool isSubmitted, isEvaluated, isStopping;
+    FP_TYPE accuracySum;      // Of the points, once isEvaluated
+
+    FP_TYPE *pendingStats;    // NULL when nothing is in flight
+    std::string pendingTag;
+
+    void evaluatorLoop();
+    FP_TYPE evaluate();
+
+    ValidationPipeline(const ValidationPipeline&);
+    ValidationPipeline& operator=(const ValidationPipeline&);
+
+  public:
+    ValidationPipeline(
+      const SparseMatrixuf& X,
+      const SparseMatrixuf& Y,
+      const EdgeML::ProblemFormat problemType,
+      SharedMemoryAllReduce *const allReduce = NULL,
+      const dataCount_t numPoints = 0);   // 0 for X.cols()
+
+    ~ValidationPipeline();
+
+    // Evaluates @model, to write its accuracy to @stats[2]; @tag names the model in the log
+    void submit(
+      const EdgeML::ProtoNN::ProtoNNModel& model,
+      const bool isWChanged,
+      FP_TYPE *const stats,
+      const std::string& tag);
+
+    // Waits for the evaluation in flight, if any, and delivers it
+    void deliver();
+  };
+
 
   // uses accelerated proximal stochastic gradient descent
+  // With @optimizeW false, W is held fixed and only Z and B are optimized
+  // With @allReduce, this is one of allReduce->size() data-parallel workers and @data is its
+  // shard of the training data; all shards must have the same number of points. Each worker
+  // takes batches of batchSize / size() points of its shard, and losses and gradients are
+  // averaged over the workers, so all of them take the same steps and end with the same model.
+  // The objective and accuracies are computed over all shards.
+  // With @allowColumnSparseW, W is updated with accProxSGDColumnSparse when a batch touches
+  // at most half of the features. Its L0 projection uses a level recomputed every 16
+  // iterations, and reaches untouched columns only then, so the model differs slightly
+  // from that of accProxSGD unless lambdaW is 1.
   void altMinSGD(
     const EdgeML::Data& data,
     EdgeML::ProtoNN::ProtoNNModel& model,
     FP_TYPE *const stats,
+    const std::string& outDir,
+    const bool optimizeW = true,
+    SharedMemoryAllReduce *const allReduce = NULL,
+    const bool allowColumnSparseW = false);
+
+  //
+  // Post-training compaction of the prototypes. Prototypes whose kernel-weighted
+  // contribution to the scores of the training data is negligible are dropped, and
+  // prototypes close to each other under the RBF kernel are merged into one (their
+  // contribution-weighted mean, with the sum of their label vectors). Z and B are then
+  // refit with a few altMinSGD iterations with W fixed.
+  // Compaction backs off to milder settings while accuracy (on the validation data if
+  // there is any, else on the training data) drops by more than @accuracyBudget, and
+  // leaves the model unchanged if no setting fits. Returns the number of prototypes kept.
+  //
+  labelCount_t compactPrototypes(
+    const EdgeML::Data& data,
+    EdgeML::ProtoNN::ProtoNNModel& model,
+    const FP_TYPE accuracyBudget,
     const std::string& outDir);
 
   // ParamType is either MatrixXuf or SparseMatrixuf
+  // @gradf(grad, param, begin, end) writes the gradient on points [begin, end) into grad
   template <class ParamType>
   void accProxSGD(
     std::function<FP_TYPE(const ParamType&,
       const Eigen::Index, const Eigen::Index)> f,
-    std::function<MatrixXuf(const ParamType&,
+    std::function<void(MatrixXuf&, const ParamType&,
       const Eigen::Index, const Eigen::Index)> gradf,
     std::function<void(MatrixXuf&)> prox,
     ParamType& param,
@@ -188,10 +392,36 @@ namespace EdgeML
     FP_TYPE eta,
     const int& etaUpdate);
 
+  //
+  // accProxSGD for a dense @param whose gradient on a batch is column-sparse, as that of W
+  // is on sparse data. @columnsf(columns, begin, end) lists the columns the batch touches,
+  // and @gradf(grad, param, begin, end) fills grad.values for grad.columns; only these
+  // columns of @param are up to date when @gradf is called.
+  // The columns a batch leaves alone only follow the momentum and the tail average, which
+  // are linear, so they are brought up to date lazily, when a batch next touches them and
+  // at periodic flushes. With @sparsity 1 the iterates are those of accProxSGD. Otherwise
+  // the touched columns are projected onto a fraction @sparsity of nonzeros at every
+  // iteration, but with the magnitude level of the last flush, every 16 iterations, when
+  // the untouched columns are projected too. The iterates then differ slightly from those
+  // of accProxSGD, which recomputes the level and projects all of @param every iteration.
+  //
+  void accProxSGDColumnSparse(
+    std::function<void(std::vector<Eigen::Index>&,
+      const Eigen::Index, const Eigen::Index)> columnsf,
+    std::function<void(ColumnSparseMatrix&, const MatrixXuf&,
+      const Eigen::Index, const Eigen::Index)> gradf,
+    const FP_TYPE sparsity,
+    MatrixXuf& param,
+    const int& epochs,
+    const dataCount_t& n,
+    const dataCount_t& bs,
+    FP_TYPE eta,
+    const int& etaUpdate);
+
   template<class ParamType>
     FP_TYPE btls(std::function<FP_TYPE(const ParamType&,
       const Eigen::Index, const Eigen::Index)> f,
-    std::function<MatrixXuf(const ParamType&,
+    std::function<void(MatrixXuf&, const ParamType&,
       const Eigen::Index, const Eigen::Index)> gradf,
     std::function<void(MatrixXuf&)> prox,
     ParamType& param,
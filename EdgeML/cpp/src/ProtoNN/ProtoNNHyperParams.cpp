@@ -189,6 +189,10 @@ void ProtoNNModel::ProtoNNHyperParams::setHyperParamsFromArgs(const int argc, co
       case 'O':
       case 'F':
       case 'M':
+      case 'p':
+      case 'c':
+      case 'w':
+      case 'L':
         break;
 
       default:
@@ -228,5 +232,10 @@ void ProtoNNModel::ProtoNNHyperParams::exitWithHelp()
   LOG_INFO("-E    : [Optional] Number of epochs (complete see-through's) of the data for each iteration, and each parameter. [Default:  20]");
   LOG_INFO("-N    : [Optional] Normalization. Default: 0 (No Normalization), 1 (Min-Max Normalization), 2 (L2-Normalization)\n");
 
+  LOG_INFO("-p    : [Optional] Precision of the stored model. Default: 0 (Full), 1 (fp16), 2 (bf16). Training is always in full precision.");
+  LOG_INFO("-c    : [Optional] Compact the prototypes after training, merging close ones and dropping negligible ones, and refit Z and B. The value is the accuracy drop allowed, e.g. 0.005.");
+  LOG_INFO("-w    : [Optional] Number of data-parallel training processes, each on an equal shard of the training data, with gradients summed in shared memory. The batch size is split among them. Linux only. [Default:  1]");
+  LOG_INFO("-L    : [Optional] 1 to update W only in the columns a batch touches when batches touch at most half of the features, as on sparse data. Faster. The touched columns are hard-thresholded every step, but with a threshold recomputed (and applied to the other columns) every 16 steps, so results differ slightly unless -W is 1. Single process only. [Default:  0]\n");
+
   exit(1);
 }
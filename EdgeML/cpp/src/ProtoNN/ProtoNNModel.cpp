@@ -9,23 +9,11 @@ using namespace EdgeML::ProtoNN;
 ProtoNNModel::ProtoNNModel(
   std::string modelFile)
 {
-  std::ifstream infile(modelFile, std::ios::in|std::ios::binary);
-  assert(infile.is_open());
-  
-  // Read the size of the model
-  size_t modelSize;
-  infile.read((char*)&modelSize, sizeof(modelSize));
-
-  // Allocate buffer
-  char* buff = new char[modelSize];
-
-  //Load model from model file
-  infile.read((char*)buff, modelSize);
-  infile.close();
-
-  importModel(modelSize, (char *const) buff);
+  std::vector<char> model;
+  const bool isModelRead = readModelFile(modelFile, model);
+  assert(isModelRead && "Model file is missing, truncated or corrupt");
 
-  delete[] buff;
+  importModel(model.size(), model.data());
 }
 
 ProtoNNModel::ProtoNNModel()
@@ -55,24 +43,153 @@ ProtoNNModel::ProtoNNModel(const ProtoNNModel::ProtoNNHyperParams& hyperParams_)
 }
 ProtoNNModel::~ProtoNNModel() {}
 
+//
+// The model is stored as the hyperparameters, one byte of flags telling which of Z, W and B
+// follow in compressed (exportSparseMatrix) form, and then Z, W and B. A parameter is
+// compressed whenever that is smaller than its raw dense form, whatever the type it has in
+// this build, so sparse models shrink even from dense builds and load into any build.
+// Models written before the flags existed hold a false bool there, i.e. all dense.
+// With fp16Params or bf16Params set, the parameters stored dense hold 16-bit values
+// (paramPrecision); compressed ones always hold FP_TYPE values.
+//
+enum SparseParamFlags : unsigned char
+{
+  sparseZ = 1,
+  sparseW = 2,
+  sparseB = 4,
+  fp16Params = 8,
+  bf16Params = 16
+};
+
+static Eigen::Index countNonZeros(const MatrixXuf& A)
+{
+  return (A.array() != (FP_TYPE)0.0).count();
+}
+
+#if defined(SPARSE_Z_PROTONN) || defined(SPARSE_W_PROTONN) || defined(SPARSE_B_PROTONN)
+static Eigen::Index countNonZeros(const SparseMatrixuf& A)
+{
+  return A.nonZeros();
+}
+#endif
+
+static size_t denseBytes(const Eigen::Index rows, const Eigen::Index cols, const ParamPrecision precision)
+{
+  return (precision == fullPrecision ? sizeof(FP_TYPE) : sizeof(halfBits_t)) * rows * cols;
+}
+
+static size_t sparseBytes(const Eigen::Index cols, const Eigen::Index nnz)
+{
+  return sparseMatrixMetaData::structStat()
+    + (sizeof(FP_TYPE) + sizeof(storedSparseIndex_t)) * nnz
+    + sizeof(storedSparseIndex_t) * (cols + 1);
+}
+
+template<class MatType>
+static bool isStoredSparse(const MatType& A, const ParamPrecision precision)
+{
+  return sparseBytes(A.cols(), countNonZeros(A)) < denseBytes(A.rows(), A.cols(), precision);
+}
+
+template<class MatType>
+static size_t storedBytes(const MatType& A, const ParamPrecision precision)
+{
+  return isStoredSparse(A, precision) ? sparseBytes(A.cols(), countNonZeros(A))
+    : denseBytes(A.rows(), A.cols(), precision);
+}
+
+static size_t exportParam(const MatrixXuf& A, const bool sparse, const ParamPrecision precision, char *const toModel)
+{
+  if (sparse) {
+    SparseMatrixuf sparseA = A.sparseView();
+    return exportSparseMatrix(sparseA, sparseExportStat(sparseA), toModel);
+  }
+  if (precision == fullPrecision) {
+    memcpy(toModel, A.data(), denseBytes(A.rows(), A.cols(), precision));
+  }
+  else {
+    std::vector<halfBits_t> halfA(A.size());
+    narrowToHalf(halfA.data(), A.data(), A.size(), precision);
+    memcpy(toModel, halfA.data(), denseBytes(A.rows(), A.cols(), precision));
+  }
+  return denseBytes(A.rows(), A.cols(), precision);
+}
+
+#if defined(SPARSE_Z_PROTONN) || defined(SPARSE_W_PROTONN) || defined(SPARSE_B_PROTONN)
+static size_t exportParam(const SparseMatrixuf& A, const bool sparse, const ParamPrecision precision, char *const toModel)
+{
+  if (sparse) {
+    if (A.isCompressed())
+      return exportSparseMatrix(A, sparseExportStat(A), toModel);
+    SparseMatrixuf compressedA = A;
+    compressedA.makeCompressed();
+    return exportSparseMatrix(compressedA, sparseExportStat(compressedA), toModel);
+  }
+  MatrixXuf denseA = A;
+  return exportParam(denseA, false, precision, toModel);
+}
+#endif
+
+// @A must already have its shape
+static size_t importParam(MatrixXuf& A, const bool sparse, const ParamPrecision precision, const char *const fromModel)
+{
+  if (sparse) {
+    SparseMatrixuf sparseA;
+    size_t bytes = importSparseMatrix(sparseA, fromModel);
+    assert(sparseA.rows() == A.rows() && sparseA.cols() == A.cols());
+    A = sparseA;
+    return bytes;
+  }
+  if (precision == fullPrecision) {
+    memcpy(A.data(), fromModel, denseBytes(A.rows(), A.cols(), precision));
+  }
+  else {
+    std::vector<halfBits_t> halfA(A.size());
+    memcpy(halfA.data(), fromModel, denseBytes(A.rows(), A.cols(), precision));
+    widenHalf(A.data(), halfA.data(), A.size(), precision);
+  }
+  return denseBytes(A.rows(), A.cols(), precision);
+}
+
+#if defined(SPARSE_Z_PROTONN) || defined(SPARSE_W_PROTONN) || defined(SPARSE_B_PROTONN)
+static size_t importParam(SparseMatrixuf& A, const bool sparse, const ParamPrecision precision, const char *const fromModel)
+{
+  if (sparse) {
+    const Eigen::Index rows = A.rows(), cols = A.cols();
+    size_t bytes = importSparseMatrix(A, fromModel);
+    assert(A.rows() == rows && A.cols() == cols);
+    return bytes;
+  }
+  MatrixXuf denseA(A.rows(), A.cols());
+  size_t bytes = importParam(denseA, false, precision, fromModel);
+  A = denseA.sparseView();
+  return bytes;
+}
+#endif
+
+// Bytes importParam reads for a @rows x @cols parameter, or 0 if they run past @numBytes
+static size_t checkParam(
+  const char *const fromModel,
+  const size_t numBytes,
+  const Eigen::Index rows,
+  const Eigen::Index cols,
+  const bool sparse,
+  const ParamPrecision precision)
+{
+  if (sparse)
+    return checkSparseMatrixBuffer(fromModel, numBytes, rows, cols);
+  const size_t elementBytes = precision == fullPrecision ? sizeof(FP_TYPE) : sizeof(halfBits_t);
+  return fitsInBuffer(rows, cols, elementBytes, numBytes) ? denseBytes(rows, cols, precision) : 0;
+}
+
 size_t ProtoNNModel::modelStat()
 {
   size_t offset = 0;
   offset += sizeof(hyperParams);
-#ifdef SPARSE_Z_PROTONN
-  offset += sizeof(bool);
-  offset += sizeof(Eigen::Index);
-  Eigen::Index nnz = params.Z.outerIndexPtr()[params.Z.cols()]
-    - params.Z.outerIndexPtr()[0];
-  offset += sizeof(FP_TYPE) * nnz;
-  offset += sizeof(sparseIndex_t) * nnz;
-  offset += sizeof(sparseIndex_t) * (params.Z.cols() + 1);
-#else
-  offset += sizeof(bool);
-  offset += sizeof(FP_TYPE) * params.Z.rows() * params.Z.cols();
-#endif
-  offset += sizeof(FP_TYPE) * params.W.rows() * params.W.cols();
-  offset += sizeof(FP_TYPE) * params.B.rows() * params.B.cols();
+  offset += sizeof(unsigned char);
+  offset += storedBytes(params.Z, paramPrecision);
+  offset += storedBytes(params.W, paramPrecision);
+  offset += storedBytes(params.B, paramPrecision);
   return offset;
 }
 
@@ -83,37 +200,24 @@ void ProtoNNModel::exportModel(
   assert(modelSize == modelStat());
 
   size_t offset(0);
-#ifdef Z_SPARSE
-  bool isZSparse(true);
-#else
-  bool isZSparse(false);
-#endif
+  unsigned char flags = 0;
+  if (isStoredSparse(params.Z, paramPrecision)) flags |= sparseZ;
+  if (isStoredSparse(params.W, paramPrecision)) flags |= sparseW;
+  if (isStoredSparse(params.B, paramPrecision)) flags |= sparseB;
+  if (paramPrecision == fp16Precision) flags |= fp16Params;
+  if (paramPrecision == bf16Precision) flags |= bf16Params;
 
   memcpy(toModel + offset, (void *)&hyperParams, sizeof(hyperParams));
   offset += sizeof(hyperParams);
 
-#ifdef SPARSE_Z_PROTONN
-  memcpy(toModel + offset, (void *)&isZSparse, sizeof(bool));
-  offset += sizeof(bool);
-  offset += sizeof(Eigen::Index);
-  Eigen::Index nnz = params.Z.outerIndexPtr()[params.Z.cols()]
-    - params.Z.outerIndexPtr()[0];
-  offset += sizeof(FP_TYPE) * nnz;
-  offset += sizeof(sparseIndex_t) * nnz;
-  offset += sizeof(sparseIndex_t) * (params.Z.cols() + 1);
-  ///// Resume from here . 
-#else
-  memcpy(toModel + offset, (void *)&isZSparse, sizeof(bool));
-  offset += sizeof(bool);
-  memcpy(toModel + offset, params.Z.data(), sizeof(FP_TYPE) * params.Z.rows() * params.Z.cols());
-  offset += sizeof(FP_TYPE) * params.Z.rows() * params.Z.cols();
-#endif
+  memcpy(toModel + offset, (void *)&flags, sizeof(flags));
+  offset += sizeof(flags);
 
-  memcpy(toModel + offset, params.W.data(), sizeof(FP_TYPE) * params.W.rows() * params.W.cols());
-  offset += sizeof(FP_TYPE) * params.W.rows() * params.W.cols();
+  offset += exportParam(params.Z, (flags & sparseZ) != 0, paramPrecision, toModel + offset);
+  offset += exportParam(params.W, (flags & sparseW) != 0, paramPrecision, toModel + offset);
+  offset += exportParam(params.B, (flags & sparseB) != 0, paramPrecision, toModel + offset);
 
-  memcpy(toModel + offset, params.B.data(), sizeof(FP_TYPE) * params.B.rows() * params.B.cols());
-  offset += sizeof(FP_TYPE) * params.B.rows() * params.B.cols();
+  assert(offset == modelSize);
 }
 
 void ProtoNNModel::importModel(const size_t numBytes, const char *const fromModel)
@@ -124,20 +228,76 @@ void ProtoNNModel::importModel(const size_t numBytes, const char *const fromMode
   offset += sizeof(hyperParams);
   params.resizeParamsFromHyperParams(hyperParams, false); // No need to set to zero.
 
-  bool isZSparse(true);
-#ifdef SPARSE_Z_PROTONN
-#else
-  memcpy((void *)&isZSparse, fromModel + offset, sizeof(bool));
-  offset += sizeof(bool);
-  assert(isZSparse == false);
-  memcpy(params.Z.data(), fromModel + offset, sizeof(FP_TYPE) * params.Z.rows() * params.Z.cols());
-  offset += sizeof(FP_TYPE) * params.Z.rows() * params.Z.cols();
-#endif
+  unsigned char flags;
+  memcpy((void *)&flags, fromModel + offset, sizeof(flags));
+  offset += sizeof(flags);
+  assert((flags & ~(sparseZ | sparseW | sparseB | fp16Params | bf16Params)) == 0);
+  assert(!((flags & fp16Params) && (flags & bf16Params)));
+  paramPrecision = (flags & fp16Params) ? fp16Precision
+    : (flags & bf16Params) ? bf16Precision : fullPrecision;
+
+  offset += importParam(params.Z, (flags & sparseZ) != 0, paramPrecision, fromModel + offset);
+  offset += importParam(params.W, (flags & sparseW) != 0, paramPrecision, fromModel + offset);
+  offset += importParam(params.B, (flags & sparseB) != 0, paramPrecision, fromModel + offset);
+
+  assert(offset == numBytes);
+}
 
-  memcpy(params.W.data(), fromModel + offset, sizeof(FP_TYPE) * params.W.rows() * params.W.cols());
-  offset += sizeof(FP_TYPE) * params.W.rows() * params.W.cols();
+bool ProtoNNModel::isModelBufferValid(const size_t numBytes, const char *const fromModel)
+{
+  ProtoNNHyperParams storedHyperParams;
+  unsigned char flags;
+  size_t offset = sizeof(storedHyperParams) + sizeof(flags);
+  if (numBytes < offset) return false;
+
+  memcpy((void *)&storedHyperParams, fromModel, sizeof(storedHyperParams));
+  memcpy((void *)&flags, fromModel + sizeof(storedHyperParams), sizeof(flags));
+  if (!storedHyperParams.isHyperParamInitialized) return false;
+  if (storedHyperParams.D == 0 || storedHyperParams.d == 0
+    || storedHyperParams.m == 0 || storedHyperParams.l == 0) return false;
+  if ((flags & ~(sparseZ | sparseW | sparseB | fp16Params | bf16Params)) != 0) return false;
+  if ((flags & fp16Params) && (flags & bf16Params)) return false;
+  const ParamPrecision precision = (flags & fp16Params) ? fp16Precision
+    : (flags & bf16Params) ? bf16Precision : fullPrecision;
 
-  memcpy(params.B.data(), fromModel + offset, sizeof(FP_TYPE) * params.B.rows() * params.B.cols());
-  offset += sizeof(FP_TYPE) * params.B.rows() * params.B.cols();
+  // Same order and shapes as resizeParamsFromHyperParams and importModel
+  const Eigen::Index shapes[3][2] = {
+    { (Eigen::Index)storedHyperParams.l, (Eigen::Index)storedHyperParams.m },
+    { (Eigen::Index)storedHyperParams.d, (Eigen::Index)storedHyperParams.D },
+    { (Eigen::Index)storedHyperParams.d, (Eigen::Index)storedHyperParams.m } };
+  const unsigned char sparseFlags[3] = { sparseZ, sparseW, sparseB };
+  for (int param = 0; param < 3; ++param) {
+    const size_t bytes = checkParam(fromModel + offset, numBytes - offset,
+      shapes[param][0], shapes[param][1], (flags & sparseFlags[param]) != 0, precision);
+    if (bytes == 0) return false;
+    offset += bytes;
+  }
+  return offset == numBytes;
 }
 
+bool ProtoNNModel::readModelFile(const std::string& modelFile, std::vector<char>& model)
+{
+  std::ifstream infile(modelFile, std::ios::in|std::ios::binary|std::ios::ate);
+  if (!infile.is_open()) {
+    LOG_WARNING("Cannot open model file " + modelFile);
+    return false;
+  }
+  const std::streamoff fileSize = infile.tellg();
+  infile.seekg(0);
+
+  // The file holds the size of the model and then the model
+  size_t modelSize;
+  if (fileSize < (std::streamoff)sizeof(modelSize)
+    || !infile.read((char*)&modelSize, sizeof(modelSize))
+    || modelSize != (size_t)fileSize - sizeof(modelSize)) {
+    LOG_WARNING("Model file " + modelFile + " is truncated or does not match its size header");
+    return false;
+  }
+
+  model.resize(modelSize);
+  if (!infile.read(model.data(), modelSize) || !isModelBufferValid(modelSize, model.data())) {
+    LOG_WARNING("Model file " + modelFile + " is corrupt");
+    return false;
+  }
+  return true;
+}
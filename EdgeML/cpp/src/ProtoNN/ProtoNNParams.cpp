@@ -19,9 +19,10 @@ void ProtoNNModel::ProtoNNParams::resizeParamsFromHyperParams(
 
   // The following non-sense is because Eigen does not document whether resize should set the data to 0
   if (setMemory) {
-    memset(Z.data(), 0, sizeof(FP_TYPE)*Z.rows()*Z.cols());
-    memset(W.data(), 0, sizeof(FP_TYPE)*W.rows()*W.cols());
-    memset(B.data(), 0, sizeof(FP_TYPE)*B.rows()*B.cols());
+    // setZero works for both the dense and the sparse (SPARSE_*_PROTONN) parameter types
+    Z.setZero();
+    W.setZero();
+    B.setZero();
   }
 }
 
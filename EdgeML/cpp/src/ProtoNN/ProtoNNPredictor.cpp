@@ -3,7 +3,10 @@
 
 #include "blas_routines.h"
 #include "Data.h"
+#include "numa_utils.h"
 #include "ProtoNNFunctions.h"
+#include <chrono>
+#include <limits>
 
 
 using namespace EdgeML;
@@ -18,6 +21,12 @@ ProtoNNPredictor::ProtoNNPredictor(
   ntest = 0;
   dataformatType = undefinedData; 
   dataPoint = NULL;
+  isPrecisionOverridden = false;
+  ncalibration = 0;
+  quantScaleMode = perRowScale;
+  indexCutoff = 0;
+  predictionFormat = textOutput;
+  chunkPoints = 0;
   
   commandLine = "";
   for (int i = 0; i < argc; ++i)
@@ -27,8 +36,11 @@ ProtoNNPredictor::ProtoNNPredictor(
   LOG_INFO("Attempting to load a model from the file: " + modelFile + "\n");
   model = ProtoNNModel(modelFile);
   model.hyperParams.ntest = ntest;
+  if (isPrecisionOverridden)
+    model.paramPrecision = overriddenPrecision;
 
-  assert(ntest > 0);
+  // A streamed test file is read by testStreaming, up to ntest points if given
+  assert(ntest > 0 || chunkPoints > 0);
   
   testData = Data(FileIngest,
                   DataFormatParams{
@@ -51,47 +63,78 @@ ProtoNNPredictor::ProtoNNPredictor(
   //Assert that the trainFile is properly assigned
   assert(!testFile.empty()); 
 
-  // Pass empty string as train and validation file, since we do not need to load those
-  std::string trainFile = "";
-  std::string validationFile = "";
-  testData.loadDataFromFile(dataformatType,
-                trainFile,
-                validationFile,
-        testFile);
-  testData.finalizeData();
-
-  normalize();
-
-  // if batchSize is not set, then we want to do point-wise prediction
-  if (batchSize == 0){
-    WX = MatrixXuf::Zero(model.hyperParams.d, 1);
-    WXColSum = MatrixXuf::Zero(1, 1);
-    D = MatrixXuf::Zero(1, model.hyperParams.m);
+  if (chunkPoints == 0) {
+    // Pass empty string as train and validation file, since we do not need to load those
+    std::string trainFile = "";
+    std::string validationFile = "";
+    testData.loadDataFromFile(dataformatType,
+                  trainFile,
+                  validationFile,
+          testFile);
+    testData.finalizeData();
+
+    normalize();
+  }
+  else if (model.hyperParams.normalizationType == minMax) {
+    // Chunks are normalized with normalizeBatch as they are read
+    assert(!normParamFile.empty() && "Normalization parameteres file for min-max normalization needs to be provided");
+    importMinMax(normParamFile);
+  }
 
-    BColSum = MatrixXuf::Zero(1, model.hyperParams.m);
-    BAccumulator = MatrixXuf::Constant(1, model.hyperParams.d, 1.0);
-    B_B = model.params.B.cwiseProduct(model.params.B);
-    mm(BColSum, BAccumulator, CblasNoTrans, B_B, CblasNoTrans, 1.0, 0.0L);
+  // Precomputes the prototype norms and gamma terms used by every scoring path
+  initializePointScoring();
 
-    gammaSq = model.hyperParams.gamma * model.hyperParams.gamma;
-    gammaSqRow = MatrixXuf::Constant(1, model.hyperParams.m, -gammaSq);
-    gammaSqCol = MatrixXuf::Constant(WX.cols(), 1, -gammaSq);
+  if (!calibrationFile.empty()) {
+    assert(ncalibration > 0);
+    Data calibrationData(FileIngest,
+      DataFormatParams{ ncalibration, 0, 0, model.hyperParams.l, model.hyperParams.D });
+    calibrationData.loadDataFromFile(dataformatType, calibrationFile, "", "");
+    normalizeBatch(calibrationData.Xtrain);
+    quantize(calibrationData.Xtrain, quantScaleMode);
+  }
 
-    dataPoint = new FP_TYPE[model.hyperParams.D];
+  if (indexCutoff > 0) {
+    if (isQuantized)
+      LOG_WARNING("Scoring in int8: the prototype index (-r) is not used");
+    else
+      indexPrototypes(indexCutoff, chunkPoints == 0 ? testData.Xtest : SparseMatrixuf(model.hyperParams.D, 0));
   }
-  
-#ifdef SPARSE_Z_PROTONN
-  ZRows = model.params.Z.rows();
-  ZCols = model.params.Z.cols();
-  alpha = 1.0;
-  beta = 0.0;
-#endif
 }
 
 ProtoNNPredictor::ProtoNNPredictor(
   const size_t numBytes,
   const char *const fromModel)
   : model(numBytes, fromModel)
+{
+  batchSize = 0;
+  ntest = 0;
+  dataformatType = undefinedData;
+  isPrecisionOverridden = false;
+  ncalibration = 0;
+  quantScaleMode = perRowScale;
+  indexCutoff = 0;
+  predictionFormat = textOutput;
+  chunkPoints = 0;
+  initializePointScoring();
+}
+
+ProtoNNPredictor::ProtoNNPredictor(
+  const std::string& modelFile)
+  : model(modelFile)
+{
+  batchSize = 0;
+  ntest = 0;
+  dataformatType = undefinedData;
+  isPrecisionOverridden = false;
+  ncalibration = 0;
+  quantScaleMode = perRowScale;
+  indexCutoff = 0;
+  predictionFormat = textOutput;
+  chunkPoints = 0;
+  initializePointScoring();
+}
+
+void ProtoNNPredictor::initializePointScoring()
 {
   // Set to 0 and use in scoring function 
   WX = MatrixXuf::Zero(model.hyperParams.d, 1);
@@ -109,12 +152,215 @@ ProtoNNPredictor::ProtoNNPredictor(
 
   dataPoint = new FP_TYPE[model.hyperParams.D];
 
-#ifdef SPARSE_Z_PROTONN
-  ZRows = model.params.Z.rows();
-  ZCols = model.params.Z.cols();
-  alpha = 1.0;
-  beta = 0.0;
-#endif
+  paramW.set(model.params.W, ParamMatrix::defaultMaxSparseDensity, model.paramPrecision);
+  paramZ.set(model.params.Z, ParamMatrix::defaultMaxSparseDensity, model.paramPrecision);
+  LOG_INFO("Scoring with W " + paramW.description() + " and Z " + paramZ.description());
+
+  isQuantized = false;
+  isIndexed = false;
+}
+
+void ProtoNNPredictor::copyScoringSetup(ProtoNNPredictor& replica) const
+{
+  // The exported bytes hold the parameters in the scoring precision; the values scored here
+  // may not have been rounded to it
+  replica.isPrecisionOverridden = isPrecisionOverridden;
+  replica.overriddenPrecision = overriddenPrecision;
+  replica.model.paramPrecision = model.paramPrecision;
+  replica.model.params = model.params;
+  replica.B_B = B_B;
+  replica.BColSum = BColSum;
+  replica.paramW = paramW;
+  replica.paramZ = paramZ;
+
+  replica.isQuantized = isQuantized;
+  replica.quantW = quantW;
+  replica.quantZ = quantZ;
+  replica.quantB = quantB;
+  replica.quantBNormSq = quantBNormSq;
+  replica.quantWXScale = quantWXScale;
+  replica.quantKernelTable = quantKernelTable;
+  replica.quantKernelShift = quantKernelShift;
+  replica.quantScaleMode = quantScaleMode;
+
+  replica.isIndexed = isIndexed;
+  replica.prototypeIndex = prototypeIndex;
+  replica.indexRadius = indexRadius;
+  replica.indexCutoff = indexCutoff;
+}
+
+void ProtoNNPredictor::quantize(
+  const SparseMatrixuf& calibrationX,
+  const QuantScaleMode mode)
+{
+  const ProtoNNModel::ProtoNNHyperParams& hyperParams = model.hyperParams;
+  assert(calibrationX.rows() == (Eigen::Index)hyperParams.D);
+  assert(calibrationX.cols() > 0);
+
+  isQuantized = false;
+  quantW.quantize(model.params.W, mode);
+  quantZ.quantize(model.params.Z, mode);
+
+  // WX and B are compared coordinate by coordinate, so they share a scale: one that covers
+  // the prototypes and all but the largest 0.1% of the projected held-out points
+  MatrixXuf calibrationWX(hyperParams.d, calibrationX.cols());
+  mm(calibrationWX, paramW, CblasNoTrans, calibrationX, CblasNoTrans, 1.0, 0.0L);
+  std::vector<FP_TYPE> magnitudes(calibrationWX.size());
+  for (Eigen::Index i = 0; i < calibrationWX.size(); ++i)
+    magnitudes[i] = std::abs(calibrationWX.data()[i]);
+  const MatrixXuf prototypes = model.params.B;
+  quantWXScale = calibrateScale(magnitudes, (FP_TYPE)0.999, prototypes.cwiseAbs().maxCoeff());
+
+  quantB.quantize(MatrixXuf(prototypes.transpose()), quantWXScale);
+  quantBNormSq.resize(hyperParams.m);
+  for (labelCount_t j = 0; j < hyperParams.m; ++j)
+    quantBNormSq[j] = dotInt8(quantB.row(j), quantB.row(j), hyperParams.d);
+
+  // The table spans the distance differences whose relative kernel is at least 0.5/127,
+  // in at most kernelTableSize entries
+  const size_t kernelTableSize = 4096;
+  const double distanceScale = (double)gammaSq * quantWXScale * quantWXScale;
+  assert(distanceScale > 0);
+  const double span = std::log(254.0) / distanceScale;
+  quantKernelShift = 0;
+  while (quantKernelShift < 48 && span > (double)((int64_t)kernelTableSize << quantKernelShift))
+    ++quantKernelShift;
+  quantKernelTable.resize(std::min(kernelTableSize, (size_t)(span / (double)((int64_t)1 << quantKernelShift)) + 1));
+  for (size_t k = 0; k < quantKernelTable.size(); ++k)
+    quantKernelTable[k] = (int8_t)std::nearbyint(127.0 * std::exp(-distanceScale * (double)((int64_t)k << quantKernelShift)));
+
+  MatrixXuf floatScores(hyperParams.l, calibrationX.cols());
+  scoreBatch(floatScores, calibrationX);
+  isQuantized = true;
+  MatrixXuf quantizedScores(hyperParams.l, calibrationX.cols());
+  scoreBatch(quantizedScores, calibrationX);
+
+  dataCount_t agreeing = 0;
+  for (Eigen::Index i = 0; i < calibrationX.cols(); ++i) {
+    Eigen::Index floatTop, quantizedTop;
+    floatScores.col(i).maxCoeff(&floatTop);
+    quantizedScores.col(i).maxCoeff(&quantizedTop);
+    if (floatTop == quantizedTop)
+      ++agreeing;
+  }
+
+  LOG_INFO("Scoring in int8 with " + std::string(mode == perRowScale ? "per-row" : "per-tensor")
+    + " scales: W, Z and B take " + std::to_string(quantW.memoryBytes() + quantZ.memoryBytes() + quantB.memoryBytes())
+    + " bytes, against " + std::to_string(paramW.memoryBytes() + paramZ.memoryBytes() + sizeof(FP_TYPE) * prototypes.size())
+    + " for scoring in float");
+  LOG_INFO("Top label agrees with float scoring on " + std::to_string(agreeing) + " of "
+    + std::to_string(calibrationX.cols()) + " calibration points");
+}
+
+void ProtoNNPredictor::scoreQuantized(
+  FP_TYPE *const scores,
+  const FP_TYPE *const values) const
+{
+  const ProtoNNModel::ProtoNNHyperParams& hyperParams = model.hyperParams;
+  thread_local std::vector<int8_t> xq, wxq, kernelq;
+  thread_local std::vector<FP_TYPE> wx;
+  thread_local std::vector<int64_t> distances;
+  xq.resize(hyperParams.D);
+  wx.resize(hyperParams.d);
+  wxq.resize(hyperParams.d);
+  distances.resize(hyperParams.m);
+  kernelq.resize(hyperParams.m);
+
+  const FP_TYPE xScale = quantizeVector(xq.data(), values, hyperParams.D);
+  quantW.rowsTimes(wx.data(), 0, hyperParams.d, xq.data(), xScale);
+  quantizeVector(wxq.data(), wx.data(), hyperParams.d, quantWXScale);
+
+  // ||wx - b_j||^2 = ||wx||^2 + ||b_j||^2 - 2 wx.b_j, exactly, in units of quantWXScale^2
+  const int64_t wxNormSq = dotInt8(wxq.data(), wxq.data(), hyperParams.d);
+  int64_t minDistance = std::numeric_limits<int64_t>::max();
+  for (labelCount_t j = 0; j < hyperParams.m; ++j) {
+    distances[j] = wxNormSq + quantBNormSq[j] - 2 * quantB.rowDot(j, wxq.data());
+    minDistance = std::min(minDistance, distances[j]);
+  }
+
+  // Kernels relative to the largest one come from the table, already in int8; only the
+  // largest one, which sets their scale, is computed in floating point
+  const int64_t half = ((int64_t)1 << quantKernelShift) >> 1;
+  for (labelCount_t j = 0; j < hyperParams.m; ++j) {
+    const int64_t k = (distances[j] - minDistance + half) >> quantKernelShift;
+    kernelq[j] = k < (int64_t)quantKernelTable.size() ? quantKernelTable[k] : 0;
+  }
+
+  const FP_TYPE kernelScale = std::exp(-gammaSq * quantWXScale * quantWXScale * (FP_TYPE)minDistance) / (FP_TYPE)127.0;
+  quantZ.rowsTimes(scores, 0, hyperParams.l, kernelq.data(), kernelScale);
+}
+
+void ProtoNNPredictor::indexPrototypes(
+  const FP_TYPE cutoff,
+  const SparseMatrixuf& checkX)
+{
+  const ProtoNNModel::ProtoNNHyperParams& hyperParams = model.hyperParams;
+  assert(cutoff > 0);
+  assert(checkX.rows() == (Eigen::Index)hyperParams.D);
+
+  isIndexed = false;
+  prototypeIndex.build(MatrixXuf(model.params.B));
+  indexRadius = cutoff / hyperParams.gamma;
+  char cutoffKernel[32];
+  snprintf(cutoffKernel, sizeof(cutoffKernel), "%.2g", std::exp(-(double)cutoff * cutoff));
+  LOG_INFO("Indexed " + std::to_string(hyperParams.m) + " prototypes in a k-d tree of "
+    + std::to_string(prototypeIndex.memoryBytes()) + " bytes; kernel values below "
+    + cutoffKernel + " are dropped");
+  if (checkX.cols() == 0) {
+    isIndexed = true;
+    return;
+  }
+
+  typedef std::chrono::steady_clock Clock;
+  MatrixXuf exactScores(hyperParams.l, checkX.cols());
+  Clock::time_point start = Clock::now();
+  scoreBatch(exactScores, checkX);
+  const double exactSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  isIndexed = true;
+  MatrixXuf indexedScores(hyperParams.l, checkX.cols());
+  std::vector<size_t> visited(checkX.cols());
+  start = Clock::now();
+  MatrixXuf checkWX(paramW.rows(), checkX.cols());
+  mm(checkWX, paramW, CblasNoTrans, checkX, CblasNoTrans, 1.0, 0.0L);
+  pfor (Eigen::Index i = 0; i < checkX.cols(); ++i)
+    visited[i] = scoreIndexed(indexedScores.col(i).data(), checkWX.col(i).data());
+  const double indexedSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  dataCount_t agreeing = 0;
+  size_t totalVisited = 0;
+  for (Eigen::Index i = 0; i < checkX.cols(); ++i) {
+    Eigen::Index exactTop, indexedTop;
+    exactScores.col(i).maxCoeff(&exactTop);
+    indexedScores.col(i).maxCoeff(&indexedTop);
+    if (exactTop == indexedTop)
+      ++agreeing;
+    totalVisited += visited[i];
+  }
+  const MatrixXuf error = (exactScores - indexedScores).cwiseAbs();
+
+  LOG_INFO("Prototypes visited per point: " + std::to_string((double)totalVisited / checkX.cols())
+    + " of " + std::to_string(hyperParams.m));
+  LOG_INFO("Score error against exact scoring: max " + std::to_string(error.maxCoeff())
+    + ", mean " + std::to_string(error.mean()) + ", relative to the largest score "
+    + std::to_string(error.maxCoeff() / std::max(exactScores.cwiseAbs().maxCoeff(), std::numeric_limits<FP_TYPE>::min())));
+  LOG_INFO("Top label agrees with exact scoring on " + std::to_string(agreeing) + " of "
+    + std::to_string(checkX.cols()) + " points; scoring took " + std::to_string(indexedSeconds)
+    + " s, against " + std::to_string(exactSeconds) + " s exactly");
+}
+
+size_t ProtoNNPredictor::scoreIndexed(
+  FP_TYPE *const scores,
+  const FP_TYPE *const wx) const
+{
+  thread_local std::vector<KdTree::Neighbor> neighbors;
+  neighbors.clear();
+  const size_t visited = prototypeIndex.radiusSearch(neighbors, wx, indexRadius);
+
+  memset(scores, 0, sizeof(FP_TYPE) * model.hyperParams.l);
+  for (size_t k = 0; k < neighbors.size(); ++k)
+    paramZ.columnAxpy(scores, neighbors[k].index, std::exp(-gammaSq * neighbors[k].distanceSq));
+  return visited;
 }
 
 void ProtoNNPredictor::createOutputDirs()
@@ -228,6 +474,42 @@ void ProtoNNPredictor::setFromArgs(const int argc, const char** argv)
           batchSize = strtol(argv[i], NULL, 0);
           break;
 
+        case 'Q':
+          calibrationFile = argv[i];
+          break;
+
+        case 'q':
+          ncalibration = strtol(argv[i], NULL, 0);
+          break;
+
+        case 's':
+          if (argv[i][0] == '0') quantScaleMode = perTensorScale;
+          else if (argv[i][0] == '1') quantScaleMode = perRowScale;
+          else assert(false); //Scale mode unknown
+          break;
+
+        case 'r':
+          indexCutoff = (FP_TYPE)strtod(argv[i], NULL);
+          break;
+
+        case 'c':
+          chunkPoints = strtol(argv[i], NULL, 0);
+          break;
+
+        case 'o':
+          if (argv[i][0] == '0') predictionFormat = textOutput;
+          else if (argv[i][0] == '1') predictionFormat = binaryOutput;
+          else assert(false); //Output format unknown
+          break;
+
+        case 'p':
+          isPrecisionOverridden = true;
+          if (argv[i][0] == '0') overriddenPrecision = fullPrecision;
+          else if (argv[i][0] == '1') overriddenPrecision = fp16Precision;
+          else if (argv[i][0] == '2') overriddenPrecision = bf16Precision;
+          else assert(false); //Precision unknown
+          break;
+
 /*
         case 'P':
         case 'C':
@@ -288,8 +570,8 @@ FP_TYPE ProtoNNPredictor::testDenseDataPoint(
 
   // compute matrix to be passed to accuracy function 
   SparseMatrixuf Yval = Ytest.sparseView();
-  MatrixXuf WX = MatrixXuf::Zero(model.params.W.rows(), Xtest.cols());
-  mm(WX, model.params.W, CblasNoTrans, Xtest, CblasNoTrans, 1.0, 0.0L);
+  MatrixXuf WX = MatrixXuf::Zero(paramW.rows(), Xtest.cols());
+  mm(WX, paramW, CblasNoTrans, Xtest, CblasNoTrans, 1.0, 0.0L);
 
   return accuracy(model.params.Z, Yval,
     gaussianKernel(model.params.B, WX, model.hyperParams.gamma),
@@ -314,30 +596,23 @@ void ProtoNNPredictor::scoreDenseDataPoint(
   FP_TYPE* scores,
   const FP_TYPE *const values)
 {
+  if (isQuantized) {
+    scoreQuantized(scores, values);
+    return;
+  }
+
   //  mm(WX, model.params.W, CblasNoTrans, Xtest, CblasNoTrans, 1.0, 0.0L);
-  gemv(CblasColMajor, CblasNoTrans,
-    model.params.W.rows(), model.params.W.cols(),
-    1.0, model.params.W.data(), model.params.W.rows(),
-    values, 1, 0.0, WX.data(), 1);
+  paramW.timesVector(WX.data(), values);
+  if (isIndexed) {
+    scoreIndexed(scores, WX.data());
+    return;
+  }
 
   //  MatrixXuf D = gaussianKernel(model.params.B, WX, model.hyperParams.gamma);
   RBF();
 
   //  mm(scoresMat, model.params.Z, CblasNoTrans, D, CblasTrans, 1.0, 0.0L);
-#ifdef SPARSE_Z_PROTONN
-  cscmv(&transa,
-    &ZRows, &ZCols,
-    &alpha, matdescra, model.params.Z.valuePtr(),
-    model.params.Z.innerIndexPtr(),
-    model.params.Z.outerIndexPtr(),
-    model.nnnparams.Z.outerIndexPtr() + 1,
-    D.data(), &beta, scores);
-#else
-  gemv(CblasColMajor, CblasNoTrans,
-    model.params.Z.rows(), model.params.Z.cols(),
-    1.0, model.params.Z.data(), model.params.Z.rows(),
-    D.data(), 1, 0.0, scores, 1);
-#endif
+  paramZ.timesVector(scores, D.data());
 }
 
 void ProtoNNPredictor::scoreSparseDataPoint(
@@ -354,29 +629,22 @@ void ProtoNNPredictor::scoreSparseDataPoint(
     dataPoint[indices[i]] = values[i];
   }
 
-  gemv(CblasColMajor, CblasNoTrans,
-    model.params.W.rows(), model.params.W.cols(),
-    1.0, model.params.W.data(), model.params.W.rows(),
-    dataPoint, 1, 0.0, WX.data(), 1);
+  if (isQuantized) {
+    scoreQuantized(scores, dataPoint);
+    return;
+  }
+
+  paramW.timesVector(WX.data(), dataPoint);
+  if (isIndexed) {
+    scoreIndexed(scores, WX.data());
+    return;
+  }
 
   //  MatrixXuf D = gaussianKernel(model.params.B, WX, model.hyperParams.gamma);
   RBF();
 
   //  mm(scoresMat, model.params.Z, CblasNoTrans, D, CblasTrans, 1.0, 0.0L);
-#ifdef SPARSE_Z_PROTONN
-  cscmv(&transa,
-    &ZRows, &ZCols,
-    &alpha, matdescra, model.params.Z.valuePtr(),
-    model.params.Z.innerIndexPtr(),
-    model.params.Z.outerIndexPtr(),
-    model.params.Z.outerIndexPtr() + 1,
-    D.data(), &beta, scores);
-#else
-  gemv(CblasColMajor, CblasNoTrans,
-    model.params.Z.rows(), model.params.Z.cols(),
-    1.0, model.params.Z.data(), model.params.Z.rows(),
-    D.data(), 1, 0.0, scores, 1);
-#endif
+  paramZ.timesVector(scores, D.data());
 }
 
 void ProtoNNPredictor::scoreBatch(
@@ -386,17 +654,176 @@ void ProtoNNPredictor::scoreBatch(
 {
   dataCount_t ntest = testData.Xtest.cols();
   assert(ntest > 0);
-  assert(startIdx >= 0);
+  assert(startIdx < ntest);
   assert(batchSize > 0);
   assert(startIdx + batchSize <= ntest);
 
-  MatrixXuf curWX = MatrixXuf(model.params.W.rows(), batchSize);
   SparseMatrixuf curTestData = testData.Xtest.middleCols(startIdx, batchSize);
-  mm(curWX, model.params.W, CblasNoTrans, curTestData, CblasNoTrans, 1.0, 0.0L);
-  
-  MatrixXuf curD = gaussianKernel(model.params.B, curWX, model.hyperParams.gamma);
+  scoreBatch(Yscores, curTestData);
+}
+
+void ProtoNNPredictor::scoreBatch(
+  MatrixXuf& Yscores,
+  const SparseMatrixuf& X) const
+{
+  assert(X.rows() == (Eigen::Index)model.hyperParams.D);
+  assert(Yscores.rows() == (Eigen::Index)model.hyperParams.l);
+  assert(Yscores.cols() == X.cols());
+
+  if (isQuantized) {
+    pfor (Eigen::Index i = 0; i < X.cols(); ++i) {
+      thread_local MatrixXuf point;
+      point = X.col(i);
+      scoreQuantized(Yscores.col(i).data(), point.data());
+    }
+    return;
+  }
 
-  mm(Yscores, model.params.Z, CblasNoTrans, curD, CblasTrans, 1.0, 0.0L);
+  MatrixXuf curWX = MatrixXuf(paramW.rows(), X.cols());
+  mm(curWX, paramW, CblasNoTrans, X, CblasNoTrans, 1.0, 0.0L);
+
+  if (isIndexed) {
+    pfor (Eigen::Index i = 0; i < X.cols(); ++i)
+      scoreIndexed(Yscores.col(i).data(), curWX.col(i).data());
+    return;
+  }
+
+  MatrixXuf curD = gaussianKernel(model.params.B, BColSum, curWX, model.hyperParams.gamma, 0, X.cols());
+
+  mm(Yscores, paramZ, CblasNoTrans, curD, CblasTrans, 1.0, 0.0L);
+}
+
+void ProtoNNPredictor::topKBatch(
+  MatrixXlabel& topKLabels,
+  MatrixXuf& topKScores,
+  const SparseMatrixuf& X,
+  const labelCount_t k) const
+{
+  assert(X.rows() == (Eigen::Index)model.hyperParams.D);
+  const Eigen::Index l = model.hyperParams.l;
+
+  if (isQuantized || isIndexed) {
+    // Points are scored one by one here, so the scores of a chunk of points are reduced at a time
+    const labelCount_t topK = std::min(k, (labelCount_t)l);
+    const Eigen::Index chunkCols = std::max((Eigen::Index)1, (Eigen::Index)(1 << 18) / l);
+    topKLabels.resize(topK, X.cols());
+    topKScores.resize(topK, X.cols());
+    for (Eigen::Index first = 0; first < X.cols(); first += chunkCols) {
+      const Eigen::Index cols = std::min(chunkCols, X.cols() - first);
+      MatrixXuf chunkScores(l, cols);
+      scoreBatch(chunkScores, SparseMatrixuf(X.middleCols(first, cols)));
+      TopKSelector selector(topK, cols);
+      selector.add(chunkScores, 0);
+      MatrixXlabel chunkLabels;
+      MatrixXuf chunkTopScores;
+      selector.result(chunkLabels, chunkTopScores);
+      topKLabels.middleCols(first, cols) = chunkLabels;
+      topKScores.middleCols(first, cols) = chunkTopScores;
+    }
+    return;
+  }
+
+  Workspace::Scope scope;
+  MatrixXuf& curWX = scope.matrix(paramW.rows(), X.cols());
+  mm(curWX, paramW, CblasNoTrans, X, CblasNoTrans, 1.0, 0.0L);
+  MatrixXuf& curD = scope.matrix(X.cols(), model.params.B.cols());
+  gaussianKernelInto(curD, model.params.B, BColSum, curWX, model.hyperParams.gamma, 0, X.cols());
+
+  TopKSelector selector(std::min(k, (labelCount_t)l), X.cols());
+  if (paramZ.isSparse()) {
+    // Each point only visits the labels its prototypes list, so the cost follows nnz(Z), not l
+    selector.addProduct(paramZ.sparse(), curD);
+  }
+  else {
+    // Blocks of about 1 MB of scores, reduced to the top k before the next block is computed
+    const Eigen::Index blockRows = std::max((Eigen::Index)64, (Eigen::Index)(1 << 18) / std::max((Eigen::Index)1, X.cols()));
+    for (Eigen::Index first = 0; first < l; first += blockRows) {
+      const Eigen::Index rows = std::min(blockRows, l - first);
+      Workspace::Scope blockScope;
+      MatrixXuf& blockScores = blockScope.matrix(rows, X.cols());
+      paramZ.rowsTimes(blockScores, first, rows, curD, CblasTrans);
+      selector.add(blockScores, (labelCount_t)first);
+    }
+  }
+  selector.result(topKLabels, topKScores);
+}
+
+static bool allFinite(const MatrixXuf& A)
+{
+  return A.allFinite();
+}
+
+#if defined(SPARSE_Z_PROTONN) || defined(SPARSE_W_PROTONN) || defined(SPARSE_B_PROTONN)
+static bool allFinite(const SparseMatrixuf& A)
+{
+  for (Eigen::Index j = 0; j < A.outerSize(); ++j)
+    for (SparseMatrixuf::InnerIterator it(A, j); it; ++it)
+      if (!std::isfinite(it.value()))
+        return false;
+  return true;
+}
+#endif
+
+bool ProtoNNPredictor::isModelValid() const
+{
+  const ProtoNNModel::ProtoNNHyperParams& hyperParams = model.hyperParams;
+
+  if (hyperParams.D == 0 || hyperParams.d == 0 || hyperParams.m == 0 || hyperParams.l == 0) {
+    LOG_WARNING("Model has an empty dimension");
+    return false;
+  }
+  if (model.params.W.rows() != (Eigen::Index)hyperParams.d || model.params.W.cols() != (Eigen::Index)hyperParams.D
+    || model.params.B.rows() != (Eigen::Index)hyperParams.d || model.params.B.cols() != (Eigen::Index)hyperParams.m
+    || model.params.Z.rows() != (Eigen::Index)hyperParams.l || model.params.Z.cols() != (Eigen::Index)hyperParams.m) {
+    LOG_WARNING("Model parameter shapes do not match its hyperparameters");
+    return false;
+  }
+  if (!std::isfinite(hyperParams.gamma) || hyperParams.gamma <= 0) {
+    LOG_WARNING("Model has an invalid gamma: " + std::to_string(hyperParams.gamma));
+    return false;
+  }
+  if (!allFinite(model.params.W) || !allFinite(model.params.B) || !allFinite(model.params.Z)) {
+    LOG_WARNING("Model parameters contain non-finite values");
+    return false;
+  }
+  if (!BColSum.allFinite()) {
+    LOG_WARNING("Squared prototype norms overflow");
+    return false;
+  }
+  if (hyperParams.normalizationType == minMax && testData.min.rows() == (Eigen::Index)hyperParams.D
+    && (!testData.min.allFinite() || !testData.max.allFinite())) {
+    LOG_WARNING("Min-max normalization parameters contain non-finite values");
+    return false;
+  }
+  return true;
+}
+
+void ProtoNNPredictor::importMinMax(std::string normParamFile_)
+{
+  normParamFile = normParamFile_;
+  testData.min.resize(0, 0);
+  testData.max.resize(0, 0);
+  loadMinMax(testData.min, testData.max, model.hyperParams.D, normParamFile);
+}
+
+void ProtoNNPredictor::normalizeBatch(SparseMatrixuf& X) const
+{
+  switch (model.hyperParams.normalizationType) {
+    case minMax:
+      assert(testData.min.rows() == X.rows() && "Min-max parameters need to be loaded with importMinMax");
+      minMaxNormalize(X, testData.min, testData.max);
+      break;
+
+    case l2:
+      l2Normalize(X);
+      break;
+
+    case none:
+      break;
+
+    default:
+      assert(false);
+  }
 }
 
 void ProtoNNPredictor::normalize()
@@ -441,26 +868,54 @@ EdgeML::ResultStruct ProtoNNPredictor::testBatchWise()
 
   dataCount_t nBatches = (n + batchSize - 1)/ batchSize;
 
-  EdgeML::ResultStruct res, tempRes;
+#ifdef NUMA
+  // Score one partition of the test points per node, each against a copy of the model on its node
+  MatrixXuf allScores;
+  if (NumaTopology::host().numNodes() > 1) {
+    size_t modelSize = model.modelStat();
+    char *modelBuffer = new char[modelSize];
+    model.exportModel(modelSize, modelBuffer);
+    NumaReplicated<ProtoNNPredictor> replicas([&]() {
+        ProtoNNPredictor *const replica = new ProtoNNPredictor(modelSize, modelBuffer);
+        copyScoringSetup(*replica);
+        return replica;
+      });
+    delete[] modelBuffer;
+
+    allScores = MatrixXuf::Zero(model.hyperParams.l, n);
+    numaPartitionedScore(testData.Xtest, allScores, batchSize,
+      [&replicas](const int node, MatrixXuf& Yscores, const SparseMatrixuf& X) {
+        replicas.onNode(node).scoreBatch(Yscores, X);
+      });
+  }
+#endif
+
+  EdgeML::EvaluationAccumulator evaluation(model.hyperParams.problemType);
+  MatrixXlabel topKLabels;
+  MatrixXuf topKScores;
   for (dataCount_t i = 0; i < nBatches; ++i) {
     Eigen::Index startIdx =  i * batchSize;
     dataCount_t curBatchSize = (batchSize < n - startIdx)? batchSize : n - startIdx;
-    MatrixXuf Yscores = MatrixXuf::Zero(model.hyperParams.l, curBatchSize);
-    scoreBatch(Yscores, startIdx, curBatchSize); 
-    
-    tempRes = evaluate(Yscores, testData.Ytest.middleCols(startIdx, curBatchSize), model.hyperParams.problemType);
-    
-    res.scaleAndAdd(tempRes, curBatchSize);
+#ifdef NUMA
+    if (allScores.cols() == (Eigen::Index)n) {
+      evaluation.add(allScores.middleCols(startIdx, curBatchSize), testData.Ytest.middleCols(startIdx, curBatchSize));
+      continue;
+    }
+#endif
+    // Only the labels the metrics look at are kept, never the full l x batch scores
+    SparseMatrixuf curTestData = testData.Xtest.middleCols(startIdx, curBatchSize);
+    topKBatch(topKLabels, topKScores, curTestData, evaluation.topKNeeded(model.hyperParams.l));
+    evaluation.addTopK(topKLabels, testData.Ytest.middleCols(startIdx, curBatchSize));
   }
-  res.scale(1/(FP_TYPE)n);
-  return res;
+  return evaluation.result();
 }
 
 EdgeML::ResultStruct ProtoNNPredictor::testPointWise()
 {  
   dataCount_t n;
-  FP_TYPE *scores, *featureValues;
-  featureCount_t *featureIndices, numIndices;
+  FP_TYPE *scores;
+  // Sparse indices need not have the width of featureCount_t (SPARSE_INDEX_32), so they are copied
+  std::vector<featureCount_t> featureIndices;
 
   n = testData.Xtest.cols();
   assert(n > 0);
@@ -468,21 +923,61 @@ EdgeML::ResultStruct ProtoNNPredictor::testPointWise()
   scores = new FP_TYPE[model.hyperParams.l];
   Map<MatrixXuf> Yscores(scores, model.hyperParams.l, 1);
 
-  EdgeML::ResultStruct res, tempRes;
+  EdgeML::EvaluationAccumulator evaluation(model.hyperParams.problemType);
   for (dataCount_t i = 0; i < n; ++i) {
-	scoreSparseDataPoint(scores,
-		(const FP_TYPE*) testData.Xtest.valuePtr() + testData.Xtest.outerIndexPtr()[i],
-		(const featureCount_t*) testData.Xtest.innerIndexPtr() + testData.Xtest.outerIndexPtr()[i],
-		(featureCount_t) testData.Xtest.outerIndexPtr()[i + 1] - testData.Xtest.outerIndexPtr()[i]);
-
-    tempRes = evaluate(Yscores, testData.Ytest.middleCols(i, 1), model.hyperParams.problemType);
-    res.scaleAndAdd(tempRes, 1);
+    const sparseIndex_t begin = testData.Xtest.outerIndexPtr()[i];
+    const sparseIndex_t end = testData.Xtest.outerIndexPtr()[i + 1];
+    featureIndices.assign(testData.Xtest.innerIndexPtr() + begin, testData.Xtest.innerIndexPtr() + end);
+    scoreSparseDataPoint(scores,
+      (const FP_TYPE*) testData.Xtest.valuePtr() + begin,
+      featureIndices.data(),
+      (featureCount_t)(end - begin));
+
+    evaluation.add(Yscores, testData.Ytest.middleCols(i, 1));
   }
-  res.scale(1/(FP_TYPE)n);
 
   delete[] scores;
   
-  return res;
+  return evaluation.result();
+}
+
+// Appends the records of saveTopKScores for a batch of points: the true labels of each column
+// of @Y, then the first @topk of its labels in @topKLabels with their scores
+static void writeTopKScores(
+  OutputWriter& outfile,
+  const MatrixXlabel& topKLabels,
+  const MatrixXuf& topKScores,
+  const SparseMatrixuf& Y,
+  const Eigen::Index topk)
+{
+  assert(topKLabels.cols() == Y.cols());
+  const Eigen::Index k = std::min(topk, (Eigen::Index)topKLabels.rows());
+
+  for (Eigen::Index j = 0; j < Y.cols(); j++) {
+    if (outfile.format() == binaryOutput) {
+      outfile.putUint32((uint32_t)(Y.outerIndexPtr()[j + 1] - Y.outerIndexPtr()[j]));
+      for (SparseMatrixuf::InnerIterator it(Y, j); it; ++it)
+        outfile.putUint32((uint32_t)it.row());
+      for (Eigen::Index r = 0; r < k; r++) {
+        outfile.putUint32((uint32_t)topKLabels(r, j));
+        outfile.putFloat32((float)topKScores(r, j));
+      }
+      continue;
+    }
+
+    for (SparseMatrixuf::InnerIterator it(Y, j); it; ++it) {
+      outfile.putInt(it.row());
+      outfile.put(",  ");
+    }
+    // Scores as ostream's default precision printed them
+    for (Eigen::Index r = 0; r < k; r++) {
+      outfile.putInt(topKLabels(r, j));
+      outfile.put(':');
+      outfile.putFloat(topKScores(r, j), 6);
+      outfile.put("  ");
+    }
+    outfile.put('\n');
+  }
 }
 
 void ProtoNNPredictor::saveTopKScores(std::string filename, int topk)
@@ -496,30 +991,73 @@ void ProtoNNPredictor::saveTopKScores(std::string filename, int topk)
   if (topk < 1)
     topk = 5;
 
+  const bool isBinary = predictionFormat == binaryOutput;
   if (filename.empty())
-      filename = outDir + "/detailedPrediction";
+      filename = outDir + (isBinary ? "/detailedPrediction.bin" : "/detailedPrediction");
   LOG_INFO("Attempting to open the following file for detailed prediction output: " + filename);
-  std::ofstream outfile(filename);
-  assert(outfile.is_open());
+  OutputWriter outfile(filename, predictionFormat);
+  assert(outfile.isOpen());
+  if (isBinary)
+    outfile.putUint32((uint32_t)std::min((labelCount_t)topk, model.hyperParams.l));
 
   dataCount_t nBatches = ((n + tempBatchSize - 1)/ tempBatchSize); 
-  MatrixXuf topKindices, topKscores;
+  MatrixXlabel topKindices;
+  MatrixXuf topKscores;
   for (dataCount_t i = 0; i < nBatches; ++i) {
     Eigen::Index startIdx =  i * tempBatchSize;
     dataCount_t curBatchSize = (tempBatchSize < n - startIdx)? tempBatchSize : n - startIdx;
-    MatrixXuf Yscores = MatrixXuf::Zero(model.hyperParams.l, curBatchSize);
-    scoreBatch(Yscores, startIdx, curBatchSize); 
-    getTopKScoresBatch(Yscores, topKindices, topKscores, topk); 
-
-    for (Eigen::Index j = 0; j < topKindices.cols(); j++) {
-      for (SparseMatrixuf::InnerIterator it(testData.Ytest, i*tempBatchSize+j); it; ++it)
-        outfile << it.row() << ",  ";
-      for (Eigen::Index k = 0; k < topKindices.rows(); k++) {
-        outfile << topKindices(k, j) << ":" << topKscores(k, j) << "  ";
-      }
-      outfile << std::endl;
+    SparseMatrixuf curTestData = testData.Xtest.middleCols(startIdx, curBatchSize);
+    topKBatch(topKindices, topKscores, curTestData, topk);
+    writeTopKScores(outfile, topKindices, topKscores, testData.Ytest.middleCols(startIdx, curBatchSize), topk);
+  }
+
+  if (!outfile.close())
+    LOG_WARNING("Error in writing " + filename);
+}
+
+EdgeML::ResultStruct ProtoNNPredictor::testStreaming(std::string filename, int topk)
+{
+  assert(chunkPoints > 0);
+  const labelCount_t l = model.hyperParams.l;
+
+  if (topk < 1)
+    topk = 5;
+
+  const bool isBinary = predictionFormat == binaryOutput;
+  if (filename.empty())
+      filename = outDir + (isBinary ? "/detailedPrediction.bin" : "/detailedPrediction");
+  LOG_INFO("Attempting to open the following file for detailed prediction output: " + filename);
+  OutputWriter outfile(filename, predictionFormat);
+  assert(outfile.isOpen());
+  if (isBinary)
+    outfile.putUint32((uint32_t)std::min((labelCount_t)topk, l));
+
+  LOG_INFO("Streaming the test data in chunks of " + std::to_string(chunkPoints) + " points");
+  DataStream stream(testFile, dataformatType, model.hyperParams.D, l, chunkPoints, ntest);
+  assert(stream.isOpen());
+
+  // One selection serves both the metrics and the file
+  EdgeML::EvaluationAccumulator evaluation(model.hyperParams.problemType);
+  const labelCount_t k = std::max((labelCount_t)topk, evaluation.topKNeeded(l));
+  const dataCount_t scoringBatchSize = batchSize > 0 ? batchSize : chunkPoints;
+
+  SparseMatrixuf X, Y;
+  MatrixXlabel topKLabels;
+  MatrixXuf topKScores;
+  while (stream.next(X, Y)) {
+    normalizeBatch(X);
+    for (Eigen::Index startIdx = 0; startIdx < X.cols(); startIdx += scoringBatchSize) {
+      const Eigen::Index curBatchSize = std::min((Eigen::Index)scoringBatchSize, X.cols() - startIdx);
+      const SparseMatrixuf curY = Y.middleCols(startIdx, curBatchSize);
+      topKBatch(topKLabels, topKScores, SparseMatrixuf(X.middleCols(startIdx, curBatchSize)), k);
+      evaluation.addTopK(topKLabels, curY);
+      writeTopKScores(outfile, topKLabels, topKScores, curY, topk);
     }
+    outfile.flush();
   }
+  LOG_INFO("Scored " + std::to_string(stream.count()) + " streamed points");
 
-  outfile.close();
+  if (!outfile.close())
+    LOG_WARNING("Error in writing " + filename);
+  return evaluation.result();
 }
@@ -4,6 +4,7 @@
 #include "ProtoNNFunctions.h"
 
 #include "mmaped.h"
+#include "numa_utils.h"
 
 #ifdef LINUX
 #include <dirent.h>
@@ -187,6 +188,13 @@ void ProtoNNTrainer::finalizeData()
   assert(model.hyperParams.ntrain > 0);
   assert(model.hyperParams.m <= model.hyperParams.ntrain);
 
+#ifdef NUMA
+  // Every minibatch reads a different slice of the training data from all workers.
+  // Spread its pages over the nodes so that no single memory controller serves all reads.
+  pinParallelWorkers();
+  interleaveMatrix(data.Xtrain);
+  interleaveMatrix(data.Ytrain);
+#endif
 }
 
 void ProtoNNTrainer::train()
@@ -194,10 +202,25 @@ void ProtoNNTrainer::train()
   assert(data.isDataLoaded == true);
   assert(model.hyperParams.isHyperParamInitialized == true);
 
-  initializeModel();
-
   FP_TYPE* stats = new FP_TYPE[model.hyperParams.iters * 9 + 3]; // store output of this run
-  altMinSGD(data, model, stats, outDir);
+  if (numWorkers > 1) {
+    // Initializes the model itself, after forking
+    trainDataParallel(stats);
+  }
+  else {
+    initializeModel();
+
+#ifdef NUMA
+    // Parameters are updated by all workers, so they are interleaved rather than replicated
+    interleaveMatrix(model.params.W);
+    interleaveMatrix(model.params.B);
+    interleaveMatrix(model.params.Z);
+#endif
+
+    altMinSGD(data, model, stats, outDir, true, NULL, allowColumnSparseW);
+  }
+  if (compactionBudget >= 0)
+    compactPrototypes(data, model, compactionBudget, outDir);
 
   // Save the parameters of the model in separate files
   writeMatrixInASCII(model.params.W, outDir, "W");
@@ -217,6 +240,8 @@ void ProtoNNTrainer::train()
   fout.write((char *const)buffer, modelSize);
   fout.close();
   delete[] buffer;
+  if (model.paramPrecision != fullPrecision)
+    LOG_INFO("Stored the dense model parameters in " + std::string(precisionName(model.paramPrecision)));
 
   std::string outFile = outDir + "/runInfo";
   storeParams(commandLine, stats, outFile);
@@ -225,6 +250,82 @@ void ProtoNNTrainer::train()
   delete[] stats; // currently, stats are not being stored anywhere
 }
 
+static void discardLog(const char*) {}
+
+// Gives every worker the parameter of rank 0, which has the same shape in all of them
+static void broadcastParam(SharedMemoryAllReduce& allReduce, MatrixXuf& A)
+{
+  allReduce.broadcast(A.data(), A.size());
+}
+
+#if defined(SPARSE_Z_PROTONN) || defined(SPARSE_W_PROTONN) || defined(SPARSE_B_PROTONN)
+static void broadcastParam(SharedMemoryAllReduce& allReduce, SparseMatrixuf& A)
+{
+  MatrixXuf dense = A;
+  allReduce.broadcast(dense.data(), dense.size());
+  A = dense.sparseView();
+}
+#endif
+
+void ProtoNNTrainer::trainDataParallel(FP_TYPE *const stats)
+{
+  SharedMemoryAllReduce allReduce(numWorkers);
+  const int size = allReduce.size();
+
+  // Every worker must take the same number of steps
+  const dataCount_t numPoints = data.Xtrain.cols();
+  const dataCount_t shardSize = numPoints / size;
+  assert(shardSize > 0);
+  if (shardSize * size < numPoints)
+    LOG_INFO("Leaving out the last " + std::to_string(numPoints - shardSize * size)
+      + " training points so that all workers have " + std::to_string(shardSize));
+
+  const int rank = allReduce.forkWorkers();
+  if (rank > 0)
+    LOG_SET_INFO_FUNC(discardLog);
+
+  // Workers are spread over the nodes, and split the CPUs of their node
+  const NumaTopology& topology = NumaTopology::host();
+  const int node = rank % topology.numNodes();
+  const int workersOnNode = (size - 1 - node) / topology.numNodes() + 1;
+  if (topology.numNodes() > 1 && !pinThreadToNode(node))
+    LOG_WARNING("Could not pin worker " + std::to_string(rank) + " to NUMA node " + std::to_string(topology.nodeIds[node]));
+  mkl_set_num_threads_local(std::max(1, (int)topology.nodeCpus[node].size() / workersOnNode));
+
+  // The workers are forked before the first BLAS call, as forkWorkers requires, so the model
+  // is initialized in rank 0 only and copied to the others
+  if (rank == 0)
+    initializeModel();
+  allReduce.broadcast(&model.hyperParams.gamma, 1);
+  broadcastParam(allReduce, model.params.W);
+  broadcastParam(allReduce, model.params.B);
+  broadcastParam(allReduce, model.params.Z);
+
+  // Copied after pinning, so that the shard is in the memory of the worker's node
+  Data shard;
+  shard.Xtrain = data.Xtrain.middleCols(rank * shardSize, shardSize);
+  shard.Ytrain = data.Ytrain.middleCols(rank * shardSize, shardSize);
+  const dataCount_t nvalidation = data.Xvalidation.cols();
+  const dataCount_t validationBegin = nvalidation * rank / size;
+  const dataCount_t validationEnd = nvalidation * (rank + 1) / size;
+  shard.Xvalidation = data.Xvalidation.middleCols(validationBegin, validationEnd - validationBegin);
+  shard.Yvalidation = data.Yvalidation.middleCols(validationBegin, validationEnd - validationBegin);
+  shard.isDataLoaded = true;
+
+  altMinSGD(shard, model, stats, outDir, true, &allReduce, allowColumnSparseW);
+
+#ifdef LINUX
+  // All workers end with the same model, which the calling process saves
+  if (rank > 0)
+    _exit(0);
+#endif
+  mkl_set_num_threads_local(0);
+  if (!allReduce.joinWorkers()) {
+    LOG_ERROR("A training worker failed");
+    exit(1);
+  }
+}
+
 size_t ProtoNNTrainer::getModelSize()
 {
   size_t modelSize = model.modelStat();
@@ -338,9 +439,17 @@ void ProtoNNTrainer::initializeModel()
       model.hyperParams.D, model.hyperParams.D, 0, format);
 
     infile = modelDir + "/Z";
+#ifdef SPARSE_Z_PROTONN
+    MatrixXuf Z;
+    FileIO::Data Z_(infile,
+      Z, voidMat, model.hyperParams.l, -1, 0,
+      model.hyperParams.m, model.hyperParams.m, 0, format);
+    model.params.Z = Z.sparseView();
+#else
     FileIO::Data Z_(infile,
       model.params.Z, voidMat, model.hyperParams.l, -1, 0,
       model.hyperParams.m, model.hyperParams.m, 0, format);
+#endif
 
     infile = modelDir + "/B";
     FileIO::Data B_(infile,
@@ -488,6 +597,29 @@ void ProtoNNTrainer::setFromArgs(const int argc, const char** argv)
         else assert(false); //Format unknown
         break;
 
+      case 'p':
+        if (argv[i][0] == '0') model.paramPrecision = fullPrecision;
+        else if (argv[i][0] == '1') model.paramPrecision = fp16Precision;
+        else if (argv[i][0] == '2') model.paramPrecision = bf16Precision;
+        else assert(false); //Precision unknown
+        break;
+
+      case 'c':
+        compactionBudget = (FP_TYPE)strtod(argv[i], NULL);
+        assert(compactionBudget >= 0);
+        break;
+
+      case 'w':
+        numWorkers = (int)strtol(argv[i], NULL, 0);
+        assert(numWorkers >= 1);
+        break;
+
+      case 'L':
+        if (argv[i][0] == '0') allowColumnSparseW = false;
+        else if (argv[i][0] == '1') allowColumnSparseW = true;
+        else assert(false); //Column-sparse W flag unknown
+        break;
+
       case 'P':
       case 'C':
       case 'R':
@@ -2,6 +2,7 @@
 // Licensed under the MIT license.
 
 #include "cluster.h"
+#include "blas_routines.h"
 
 using namespace EdgeML;
 
@@ -78,11 +79,18 @@ void sparsekmeans::distsqAllpointsToCenters(
   const char matdescra[6] = { 'G',0,0,'C',0,0 };
   FP_TYPE alpha = -2.0; FP_TYPE beta = 0.0;
 
+#ifdef SPARSE_INDEX_32
+  csrTimesDense(m, n, alpha,
+    valsCSC, rowsCSC, offsetsCSC, offsetsCSC + 1,
+    centersTranspose, n,
+    beta, distMatrix, n);
+#else
   csrmm(&transa, &m, &n, &k, &alpha, matdescra,
     valsCSC, (const sparseIndex_t*)rowsCSC,
     (const sparseIndex_t*)offsetsCSC, (const sparseIndex_t*)(offsetsCSC + 1),
     centersTranspose, &n,
     &beta, distMatrix, &n);
+#endif
   gemm(CblasRowMajor, CblasTrans, CblasNoTrans,
     numPoints, numCenters, 1,
     (FP_TYPE)1.0, onesVec, numPoints, centersL2Sq, numCenters,
@@ -4,6 +4,7 @@
 #include "mmaped.h"
 #include "Data.h"
 #include "blas_routines.h"
+#include <limits>
 
 using namespace EdgeML;
 
@@ -220,6 +221,9 @@ void Data::finalizeData()
         denseDataHolder.resize(0);
         denseDataHolder.shrink_to_fit();
       }
+      // With SPARSE_INDEX_32, a matrix can hold at most 2^31-1 non-zeros
+      assert(sparseDataHolder.size() <= (size_t)std::numeric_limits<sparseIndex_t>::max());
+      assert(sparseLabelHolder.size() <= (size_t)std::numeric_limits<sparseIndex_t>::max());
       Xtrain = SparseMatrixuf(formatParams.dimension, numPointsIngested);
       Xtrain.setFromTriplets(sparseDataHolder.begin(), sparseDataHolder.end());
       sparseDataHolder.resize(0);
@@ -236,6 +240,7 @@ void Data::finalizeData()
       denseDataHolder.resize(0);
       denseDataHolder.shrink_to_fit();
 
+      assert(sparseLabelHolder.size() <= (size_t)std::numeric_limits<sparseIndex_t>::max());
       Ytrain = SparseMatrixuf(formatParams.numLabels, numPointsIngested);
       Ytrain.setFromTriplets(sparseLabelHolder.begin(), sparseLabelHolder.end());
       sparseLabelHolder.resize(0);
@@ -280,6 +285,12 @@ void Data::finalizeData()
     validationLabel.resize(0, 0);
   }
 
+  // Minibatches and scoring gather columns all over the data, so back it with huge pages
+  // when the policy asks for them. The arrays are already populated, hence collapse.
+  collapseHugePages(Xtrain);
+  collapseHugePages(Xvalidation);
+  collapseHugePages(Xtest);
+
   min = MatrixXuf::Zero(0, 0);
   max = MatrixXuf::Zero(0, 0);
 
@@ -5,6 +5,7 @@
 #define __DATA_H__
 
 #include "pre_processor.h"
+#include "hugepages.h"
 
 namespace EdgeML
 {
@@ -64,9 +65,9 @@ namespace EdgeML
     DataFormatParams formatParams;
     DataIngestType ingestType;
 
-    std::vector<Trip> sparseDataHolder;
+    std::vector<Trip, HugePageAllocator<Trip> > sparseDataHolder;
     std::vector<Trip> sparseLabelHolder;
-    std::vector<FP_TYPE> denseDataHolder;
+    std::vector<FP_TYPE, HugePageAllocator<FP_TYPE> > denseDataHolder;
     dataCount_t numPointsIngested;
 
   public:
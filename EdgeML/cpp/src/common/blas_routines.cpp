@@ -2,6 +2,7 @@
 // Licensed under the MIT license.
 
 #include "blas_routines.h"
+#include "workspace.h"
 
 using namespace EdgeML;
 
@@ -84,16 +85,22 @@ void EdgeML::mm(
 
   // MKL assumes row-major dense matrix for both out and input2 in calls ?cscmm and ?csrmm
   assert(sizeof(MKL_INT) == sizeof(Eigen::Index));
-  assert(in1ColsBegin == -1 && in1ColsEnd == -1);
+  if (in1ColsBegin == -1) assert(in1ColsEnd == -1);
+  if (in1ColsEnd == -1) assert(in1ColsBegin == -1);
+
+  // Columns [in1ColsBegin, in1ColsEnd) of in1 are used without copying them out
+  const Eigen::Index colsBegin = (in1ColsBegin == -1) ? 0 : in1ColsBegin;
+  const Eigen::Index in1Cols = ((in1ColsBegin == -1) ? in1.cols() : (in1ColsEnd - in1ColsBegin));
 
 #ifdef LINUX
 #pragma GCC diagnostic ignored "-Wenum-compare"  // suppresses single warning
 #endif
   //in1.IsRowMajor checks if in1 is in csr
   assert(in1.IsRowMajor == in2.IsRowMajor);
-  assert(out.rows() == ((t1 == CblasTrans) ? in1.cols() : in1.rows()));
+  assert(!in1.IsRowMajor || in1ColsBegin == -1);
+  assert(out.rows() == ((t1 == CblasTrans) ? in1Cols : in1.rows()));
   assert(out.cols() == ((t2 == CblasTrans) ? in2.rows() : in2.cols()));
-  assert(((t1 == CblasTrans) ? in1.rows() : in1.cols())
+  assert(((t1 == CblasTrans) ? in1.rows() : in1Cols)
     == ((t2 == CblasTrans) ? in2.cols() : in2.rows()));
 
   std::string inputCharacteristics =
@@ -109,9 +116,10 @@ void EdgeML::mm(
   MKL_INT ldOut = out.cols();
   MKL_INT m = in1.rows();
   MKL_INT n = out.cols();
-  MKL_INT k = in1.cols();
+  MKL_INT k = in1Cols;
 
-  FP_TYPE *in2Transpose = new FP_TYPE[in2.rows()*in2.cols()];
+  Workspace::Scope scope;
+  FP_TYPE *in2Transpose = scope.buffer(in2.rows()*in2.cols());
   omatcopy(in2.IsRowMajor ? 'R' : 'C', 't',
     in2.rows(), in2.cols(),
     1.0,
@@ -119,7 +127,7 @@ void EdgeML::mm(
     in2Transpose, in2.IsRowMajor ? in2.rows() : in2.cols());
   timer.nextTime("transposing the dense input matrix");
 
-  Matrix<FP_TYPE, Dynamic, Dynamic, RowMajor> out_(out.rows(), out.cols());
+  Map<Matrix<FP_TYPE, Dynamic, Dynamic, RowMajor>> out_(scope.buffer(out.rows()*out.cols()), out.rows(), out.cols());
   timer.nextTime("creating a dense output matrix that stores the rowmajor version");
 
   omatcopy('C', 't',
@@ -129,32 +137,50 @@ void EdgeML::mm(
     out_.data(), out_.cols());
   timer.nextTime("converting the dense output matrix from colmajor to rowmajor");
 
-  const char matdescra[6] = { 'G', 'X', 'X', 'C', 'X', 'X' }; // 'X' means unused
-
   // If the sparse matrix is not transposed, and the sparse matrix is in csc format, ...
   // cscmm is quite slow. Instead, we convert the sparse matrix to csr format (using eigen's call), ...
   // and then call csrmm
   if (t1 == CblasTrans) {
-    char transa = 't';
     assert(in1.IsRowMajor == false);
 
+    // Column j of A starts at val[pntrb[j] - pntrb[0]]
+    const sparseIndex_t first = in1.outerIndexPtr()[colsBegin];
+#ifdef SPARSE_INDEX_32
+    csrTimesDense(k, n, alpha,
+      in1.valuePtr() + first, in1.innerIndexPtr() + first,
+      in1.outerIndexPtr() + colsBegin, in1.outerIndexPtr() + colsBegin + 1,
+      (in2.IsRowMajor ^ (t2 == CblasTrans)) ? in2.data() : in2Transpose, ldIn2,
+      beta,
+      out_.data(), ldOut);
+#else
+    const char matdescra[6] = { 'G', 'X', 'X', 'C', 'X', 'X' }; // 'X' means unused
+    char transa = 't';
     cscmm(&transa,
       &m, &n, &k,
       &alpha,
       matdescra,
-      in1.valuePtr(), in1.innerIndexPtr(),
-      in1.outerIndexPtr(), in1.outerIndexPtr() + 1,
+      in1.valuePtr() + first, in1.innerIndexPtr() + first,
+      in1.outerIndexPtr() + colsBegin, in1.outerIndexPtr() + colsBegin + 1,
       (in2.IsRowMajor ^ (t2 == CblasTrans)) ? in2.data() : in2Transpose, &ldIn2,
       &beta,
       out_.data(), &ldOut);
+#endif
     timer.nextTime("cscmm");
   }
   else {
-    char transa = 'n';
     // Irrespective of what in1 originally was, this will create an sp that IS row major
-    SparseMatrix<FP_TYPE, RowMajor, sparseIndex_t> sp(in1);
+    SparseMatrix<FP_TYPE, RowMajor, sparseIndex_t> sp(in1.middleCols(colsBegin, in1Cols));
     timer.nextTime("creating a rowmajor in1");
 
+#ifdef SPARSE_INDEX_32
+    csrTimesDense(m, n, alpha,
+      sp.valuePtr(), sp.innerIndexPtr(), sp.outerIndexPtr(), sp.outerIndexPtr() + 1,
+      (in2.IsRowMajor ^ (t2 == CblasTrans)) ? in2.data() : in2Transpose, ldIn2,
+      beta,
+      out_.data(), ldOut);
+#else
+    const char matdescra[6] = { 'G', 'X', 'X', 'C', 'X', 'X' }; // 'X' means unused
+    char transa = 'n';
     csrmm(&transa,
       &m, &n, &k,
       &alpha,
@@ -163,6 +189,7 @@ void EdgeML::mm(
       (in2.IsRowMajor ^ (t2 == CblasTrans)) ? in2.data() : in2Transpose, &ldIn2,
       &beta,
       out_.data(), &ldOut);
+#endif
     timer.nextTime("csrmm");
   }
 
@@ -175,7 +202,6 @@ void EdgeML::mm(
     out.rows());
   timer.nextTime("converting the computed output matrix from rowmajor to columnmajor");
 
-  delete[] in2Transpose;
 #endif
   LOG_DIAGNOSTIC(out);
 }
@@ -201,16 +227,22 @@ void mm(
 
   // MKL assumes row-major dense matrix for both out and input2 in calls ?cscmm and ?csrmm
   assert(sizeof(MKL_INT) == sizeof(Eigen::Index));
-  assert(in1ColsBegin == -1 && in1ColsEnd == -1);
+  if (in1ColsBegin == -1) assert(in1ColsEnd == -1);
+  if (in1ColsEnd == -1) assert(in1ColsBegin == -1);
+
+  // Columns [in1ColsBegin, in1ColsEnd) of in1 are used without copying them out
+  const Eigen::Index colsBegin = (in1ColsBegin == -1) ? 0 : in1ColsBegin;
+  const Eigen::Index in1Cols = ((in1ColsBegin == -1) ? in1.cols() : (in1ColsEnd - in1ColsBegin));
 
 #ifdef LINUX
 #pragma GCC diagnostic ignored "-Wenum-compare"  // suppresses single warning
 #endif  
   //in1.IsRowMajor checks if in1 is in csr
   assert(in1.IsRowMajor == in2.IsRowMajor);
-  assert(out.rows() == ((t1 == CblasTrans) ? in1.cols() : in1.rows()));
+  assert(!in1.IsRowMajor || in1ColsBegin == -1);
+  assert(out.rows() == ((t1 == CblasTrans) ? in1Cols : in1.rows()));
   assert(out.cols() == ((t2 == CblasTrans) ? in2.rows() : in2.cols()));
-  assert(((t1 == CblasTrans) ? in1.rows() : in1.cols())
+  assert(((t1 == CblasTrans) ? in1.rows() : in1Cols)
     == ((t2 == CblasTrans) ? in2.cols() : in2.rows()));
 
   std::string input_characteristics
@@ -226,9 +258,10 @@ void mm(
   MKL_INT ldOut = out.cols();
   MKL_INT m = in1.rows();
   MKL_INT n = out.cols();
-  MKL_INT k = in1.cols();
+  MKL_INT k = in1Cols;
 
-  FP_TYPE *in2Transpose = new FP_TYPE[in2.rows()*in2.cols()];
+  Workspace::Scope scope;
+  FP_TYPE *in2Transpose = scope.buffer(in2.rows()*in2.cols());
   omatcopy(in2.IsRowMajor ? 'R' : 'C', 't',
     in2.rows(), in2.cols(),
     1.0,
@@ -236,35 +269,53 @@ void mm(
     in2Transpose, in2.IsRowMajor ? in2.rows() : in2.cols());
   timer.nextTime("transposing the dense input matrix");
 
-  const char matdescra[6] = { 'G', 'X', 'X', 'C', 'X', 'X' }; // 'X' means unused
-
   // If the sparse matrix is not transposed, and the sparse matrix is in csc format, ...
   // cscmm is quite slow. Instead, we convert the sparse matrix to csr format (using eigen's call), ...
   // and then call csrmm
   if (t1 == CblasTrans) {
-    char transa = 't';
     assert(in1.IsRowMajor == false);
 
+    // Column j of A starts at val[pntrb[j] - pntrb[0]]
+    const sparseIndex_t first = in1.outerIndexPtr()[colsBegin];
+#ifdef SPARSE_INDEX_32
+    csrTimesDense(k, n, alpha,
+      in1.valuePtr() + first, in1.innerIndexPtr() + first,
+      in1.outerIndexPtr() + colsBegin, in1.outerIndexPtr() + colsBegin + 1,
+      (in2.IsRowMajor ^ (t2 == CblasTrans)) ? in2.data() : in2Transpose, ldIn2,
+      beta,
+      out.data(), ldOut);
+#else
+    const char matdescra[6] = { 'G', 'X', 'X', 'C', 'X', 'X' }; // 'X' means unused
+    char transa = 't';
     cscmm(&transa,
       &m, &n, &k,
       &alpha,
       matdescra,
-      in1.valuePtr(), in1.innerIndexPtr(),
-      in1.outerIndexPtr(), in1.outerIndexPtr() + 1,
+      in1.valuePtr() + first, in1.innerIndexPtr() + first,
+      in1.outerIndexPtr() + colsBegin, in1.outerIndexPtr() + colsBegin + 1,
       (in2.IsRowMajor ^ (t2 == CblasTrans)) ? in2.data() : in2Transpose, &ldIn2,
       &beta,
       out.data(), &ldOut);
+#endif
 
     assert(t1 == CblasTrans && t2 == CblasTrans);
     //out = in1.transpose() * in2.transpose();
     timer.nextTime("cscmm");
   }
   else {
-    char transa = 'n';
     // Irrespective of what in1 originally was, this will create an sp that IS row major
-    SparseMatrix<FP_TYPE, RowMajor, sparseIndex_t> sp(in1);
+    SparseMatrix<FP_TYPE, RowMajor, sparseIndex_t> sp(in1.middleCols(colsBegin, in1Cols));
     timer.nextTime("creating a rowmajor in1");
 
+#ifdef SPARSE_INDEX_32
+    csrTimesDense(m, n, alpha,
+      sp.valuePtr(), sp.innerIndexPtr(), sp.outerIndexPtr(), sp.outerIndexPtr() + 1,
+      (in2.IsRowMajor ^ (t2 == CblasTrans)) ? in2.data() : in2Transpose, ldIn2,
+      beta,
+      out.data(), ldOut);
+#else
+    const char matdescra[6] = { 'G', 'X', 'X', 'C', 'X', 'X' }; // 'X' means unused
+    char transa = 'n';
     csrmm(&transa,
       &m, &n, &k,
       &alpha,
@@ -273,10 +324,10 @@ void mm(
       (in2.IsRowMajor ^ (t2 == CblasTrans)) ? in2.data() : in2Transpose, &ldIn2,
       &beta,
       out.data(), &ldOut);
+#endif
     timer.nextTime("csrmm");
   }
 
-  delete[] in2Transpose;
 #endif
   // Calling LOG_DIAGNOSTIC(out) creates a conversion from Map<Matrix> to Matrix which brings a huge overhead with it!
   // LOG_DIAGNOSTIC(out); 
@@ -354,6 +405,38 @@ void EdgeML::mm(
 }
 
 
+void EdgeML::csrTimesDense(
+  const Eigen::Index m,
+  const Eigen::Index n,
+  const FP_TYPE alpha,
+  const FP_TYPE *const val,
+  const sparseIndex_t *const col,
+  const sparseIndex_t *const rowBegin,
+  const sparseIndex_t *const rowEnd,
+  const FP_TYPE *const B,
+  const Eigen::Index ldB,
+  const FP_TYPE beta,
+  FP_TYPE *const out,
+  const Eigen::Index ldOut)
+{
+  const sparseIndex_t base = rowBegin[0];
+  pfor(Eigen::Index r = 0; r < m; ++r) {
+    FP_TYPE *const outRow = out + r * ldOut;
+    if (beta == (FP_TYPE)0.0)
+      std::fill_n(outRow, n, (FP_TYPE)0.0);
+    else if (beta != (FP_TYPE)1.0)
+      for (Eigen::Index c = 0; c < n; ++c)
+        outRow[c] *= beta;
+
+    for (sparseIndex_t p = rowBegin[r] - base; p < rowEnd[r] - base; ++p) {
+      const FP_TYPE a = alpha * val[p];
+      const FP_TYPE *const BRow = B + (Eigen::Index)col[p] * ldB;
+      for (Eigen::Index c = 0; c < n; ++c)
+        outRow[c] += a * BRow[c];
+    }
+  }
+}
+
 Eigen::Index EdgeML::getnnzs(const SparseMatrixuf& A)
 {
 #ifdef ROWMAJOR
@@ -38,6 +38,26 @@ namespace EdgeML
     Eigen::Index in2ColsBegin = -1,
     Eigen::Index in2ColsEnd = -1);
 
+  //
+  // out = alpha*A*B + beta*out for an m x k CSR matrix A given by its arrays as for ?csrmm
+  // (zero-based; row r at val[rowBegin[r] - rowBegin[0]]) and row-major B (k x n) and out (m x n).
+  // A CSC matrix is the CSR form of its transpose, so this also stands in for ?cscmm.
+  // Used instead of MKL's sparse BLAS when sparseIndex_t is not MKL_INT (SPARSE_INDEX_32).
+  //
+  void csrTimesDense(
+    const Eigen::Index m,
+    const Eigen::Index n,
+    const FP_TYPE alpha,
+    const FP_TYPE *const val,
+    const sparseIndex_t *const col,
+    const sparseIndex_t *const rowBegin,
+    const sparseIndex_t *const rowEnd,
+    const FP_TYPE *const B,
+    const Eigen::Index ldB,
+    const FP_TYPE beta,
+    FP_TYPE *const out,
+    const Eigen::Index ldOut);
+
   Eigen::Index getnnzs(const SparseMatrixuf& A);
 
   FP_TYPE maxAbsVal(const MatrixXuf& A);
@@ -0,0 +1,185 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "c_codegen.h"
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+using namespace EdgeML;
+
+std::string EdgeML::cFloatLiteral(const FP_TYPE value)
+{
+  assert(std::isfinite(value));
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.9g", (double)(float)value);
+  std::string literal(buffer);
+  if (literal.find_first_of(".e") == std::string::npos)
+    literal += ".0";
+  return literal + "f";
+}
+
+const char* EdgeML::cIndexType(const size_t maxValue)
+{
+  if (maxValue <= 0xff) return "uint8_t";
+  if (maxValue <= 0xffff) return "uint16_t";
+  assert(maxValue <= 0xffffffffull);
+  return "uint32_t";
+}
+
+static size_t cIndexBytes(const size_t maxValue)
+{
+  return maxValue <= 0xff ? 1 : maxValue <= 0xffff ? 2 : 4;
+}
+
+// Eight values per line, each line starting with @indent
+template<class T, class Format>
+static void emitCValues(std::ostream& out, const std::vector<T>& values, Format format, const char *const indent = "  ")
+{
+  for (size_t i = 0; i < values.size(); ++i) {
+    out << (i % 8 == 0 ? indent : " ") << format(values[i]) << (i + 1 < values.size() ? "," : "");
+    if (i % 8 == 7 || i + 1 == values.size())
+      out << "\n";
+  }
+}
+
+void EdgeML::emitCArray(
+  std::ostream& out,
+  const std::string& name,
+  const FP_TYPE *const values,
+  const size_t n)
+{
+  assert(n > 0);
+  out << "static const float " << name << "[" << n << "] = {\n";
+  emitCValues(out, std::vector<FP_TYPE>(values, values + n), cFloatLiteral);
+  out << "};\n\n";
+}
+
+bool EdgeML::emitCRows(
+  std::ostream& out,
+  const std::string& name,
+  const MatrixXuf& A,
+  size_t *const bytes)
+{
+  const size_t rows = A.rows(), cols = A.cols();
+  assert(rows > 0 && cols > 0);
+
+  std::vector<size_t> start(1, 0), index;
+  std::vector<FP_TYPE> value;
+  for (size_t i = 0; i < rows; ++i) {
+    for (size_t j = 0; j < cols; ++j)
+      if (A(i, j) != (FP_TYPE)0.0) {
+        index.push_back(j);
+        value.push_back(A(i, j));
+      }
+    start.push_back(value.size());
+  }
+
+  const size_t nnz = value.size();
+  const size_t denseBytes = sizeof(float) * rows * cols;
+  const size_t sparseBytes = (sizeof(float) + cIndexBytes(cols - 1)) * nnz + cIndexBytes(nnz) * (rows + 1);
+  const bool isDense = denseBytes <= sparseBytes;
+  if (bytes != NULL)
+    *bytes = isDense ? denseBytes : sparseBytes;
+
+  if (isDense) {
+    out << "static const float " << name << "[" << rows << "][" << cols << "] = {\n";
+    for (size_t i = 0; i < rows; ++i) {
+      out << "  {\n";
+      std::vector<FP_TYPE> row(cols);
+      for (size_t j = 0; j < cols; ++j)
+        row[j] = A(i, j);
+      emitCValues(out, row, cFloatLiteral, "    ");
+      out << (i + 1 < rows ? "  },\n" : "  }\n");
+    }
+    out << "};\n\n";
+
+    out << "static inline float " << name << "_dot(const unsigned row, const float *v)\n"
+        << "{\n"
+        << "  float s = 0.0f;\n"
+        << "  unsigned j;\n"
+        << "  for (j = 0; j < " << cols << "; ++j)\n"
+        << "    s += " << name << "[row][j] * v[j];\n"
+        << "  return s;\n"
+        << "}\n\n";
+    out << "static inline void " << name << "_axpy(const unsigned row, const float a, float *y)\n"
+        << "{\n"
+        << "  unsigned j;\n"
+        << "  for (j = 0; j < " << cols << "; ++j)\n"
+        << "    y[j] += a * " << name << "[row][j];\n"
+        << "}\n\n";
+    return true;
+  }
+
+  // C has no empty arrays, so an all-zero matrix keeps one unused entry
+  if (nnz == 0) {
+    index.push_back(0);
+    value.push_back((FP_TYPE)0.0);
+  }
+  const char *const startType = cIndexType(nnz);
+  out << "/* " << nnz << " nonzeros of " << rows << " x " << cols << ", row by row */\n";
+  out << "static const " << startType << " " << name << "_start[" << rows + 1 << "] = {\n";
+  emitCValues(out, start, [](const size_t v) { return std::to_string(v); });
+  out << "};\n\n";
+  out << "static const " << cIndexType(cols - 1) << " " << name << "_index[" << index.size() << "] = {\n";
+  emitCValues(out, index, [](const size_t v) { return std::to_string(v); });
+  out << "};\n\n";
+  out << "static const float " << name << "_value[" << value.size() << "] = {\n";
+  emitCValues(out, value, cFloatLiteral);
+  out << "};\n\n";
+
+  out << "static inline float " << name << "_dot(const unsigned row, const float *v)\n"
+      << "{\n"
+      << "  float s = 0.0f;\n"
+      << "  " << startType << " k;\n"
+      << "  for (k = " << name << "_start[row]; k < " << name << "_start[row + 1]; ++k)\n"
+      << "    s += " << name << "_value[k] * v[" << name << "_index[k]];\n"
+      << "  return s;\n"
+      << "}\n\n";
+  out << "static inline void " << name << "_axpy(const unsigned row, const float a, float *y)\n"
+      << "{\n"
+      << "  " << startType << " k;\n"
+      << "  for (k = " << name << "_start[row]; k < " << name << "_start[row + 1]; ++k)\n"
+      << "    y[" << name << "_index[k]] += a * " << name << "_value[k];\n"
+      << "}\n\n";
+  return false;
+}
+
+void EdgeML::emitCBenchmark(
+  std::ostream& out,
+  const std::string& guard,
+  const std::string& scoreFunction,
+  const size_t inputDim,
+  const size_t outputDim)
+{
+  out << "#ifdef " << guard << "\n"
+      << "#include <stdio.h>\n"
+      << "#include <stdlib.h>\n"
+      << "#include <time.h>\n\n"
+      << "int main(int argc, char **argv)\n"
+      << "{\n"
+      << "  static float x[" << inputDim << "];\n"
+      << "  float scores[" << outputDim << "];\n"
+      << "  const long calls = argc > 1 ? atol(argv[1]) : 100000;\n"
+      << "  unsigned long seed = 1;\n"
+      << "  double checksum = 0.0;\n"
+      << "  clock_t start;\n"
+      << "  long i;\n"
+      << "  unsigned j;\n\n"
+      << "  for (j = 0; j < " << inputDim << "; ++j) {\n"
+      << "    seed = (seed * 1103515245ul + 12345ul) & 0x7ffffffful;\n"
+      << "    x[j] = (float)(seed >> 16) / 32768.0f;\n"
+      << "  }\n\n"
+      << "  start = clock();\n"
+      << "  for (i = 0; i < calls; ++i) {\n"
+      << "    /* A different input each call, so that no call can be hoisted out of the loop */\n"
+      << "    x[i % " << inputDim << "] += 1.0e-3f;\n"
+      << "    " << scoreFunction << "(x, scores);\n"
+      << "    checksum += scores[i % " << outputDim << "];\n"
+      << "  }\n"
+      << "  printf(\"" << scoreFunction << ": %.3f us per call, checksum %g\\n\",\n"
+      << "    1.0e6 * (double)(clock() - start) / CLOCKS_PER_SEC / (double)calls, checksum);\n"
+      << "  return 0;\n"
+      << "}\n"
+      << "#endif\n";
+}
@@ -0,0 +1,58 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#ifndef __C_CODEGEN_H__
+#define __C_CODEGEN_H__
+
+#include "pre_processor.h"
+#include <ostream>
+
+//
+// Helpers for emitting self-contained C sources that specialise a trained model for
+// deployment: dimensions become compile-time constants, so that every loop has a fixed
+// trip count, and parameters become static const arrays, which compilers place in
+// read-only memory (flash on microcontrollers). Generated code computes in float.
+//
+namespace EdgeML
+{
+  // A C float literal that reads back to the same float
+  std::string cFloatLiteral(const FP_TYPE value);
+
+  // Smallest unsigned C type that holds @maxValue
+  const char* cIndexType(const size_t maxValue);
+
+  // static const float @name[n] = { ... };
+  void emitCArray(
+    std::ostream& out,
+    const std::string& name,
+    const FP_TYPE *const values,
+    const size_t n);
+
+  //
+  // Emits the rows of @A as static const storage named @name, and
+  //   static inline float @name_dot(const unsigned row, const float *v)          row . v
+  //   static inline void @name_axpy(const unsigned row, const float a, float *y)  y += a row
+  // Rows are stored dense, or row-compressed without their zeros when that takes less
+  // memory. Returns true for dense storage, which is then a float @name[rows][cols].
+  // @bytes, if given, receives the size of the storage.
+  //
+  bool emitCRows(
+    std::ostream& out,
+    const std::string& name,
+    const MatrixXuf& A,
+    size_t *const bytes = NULL);
+
+  //
+  // Emits, under #ifdef @guard, a main() that times @scoreFunction(const float *x, float *scores)
+  // on pseudo-random inputs of @inputDim and prints the time per call and a checksum of the
+  // scores. The number of calls is the first argument, 100000 by default.
+  //
+  void emitCBenchmark(
+    std::ostream& out,
+    const std::string& guard,
+    const std::string& scoreFunction,
+    const size_t inputDim,
+    const size_t outputDim);
+}
+
+#endif
@@ -0,0 +1,224 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "cascade.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <limits>
+
+using namespace EdgeML;
+
+void EdgeML::scoreMargins(
+  std::vector<FP_TYPE>& margins,
+  const MatrixXuf& Yscores)
+{
+  const dataCount_t n = Yscores.cols();
+  margins.resize(n);
+  if (Yscores.rows() < 2) {
+    std::fill(margins.begin(), margins.end(), std::numeric_limits<FP_TYPE>::infinity());
+    return;
+  }
+
+  MatrixXlabel topKLabels;
+  MatrixXuf topKScores;
+  getTopKScoresBatch(Yscores, topKLabels, topKScores, 2);
+  for (dataCount_t i = 0; i < n; ++i)
+    margins[i] = topKScores(0, i) - topKScores(1, i);
+}
+
+// Copies the columns @cols of @X, in that order, into @out
+static void gatherColumns(
+  SparseMatrixuf& out,
+  const SparseMatrixuf& X,
+  const std::vector<dataCount_t>& cols)
+{
+  Eigen::Index nnz = 0;
+  for (size_t j = 0; j < cols.size(); ++j)
+    nnz += X.outerIndexPtr()[cols[j] + 1] - X.outerIndexPtr()[cols[j]];
+
+  out = SparseMatrixuf(X.rows(), cols.size());
+  out.reserve(nnz);
+  for (size_t j = 0; j < cols.size(); ++j) {
+    out.startVec(j);
+    for (SparseMatrixuf::InnerIterator it(X, cols[j]); it; ++it)
+      out.insertBack(it.row(), j) = it.value();
+  }
+  out.finalize();
+}
+
+static FP_TYPE primaryMetric(const ResultStruct& result)
+{
+  return result.problemType == multilabel ? result.precision1 : result.accuracy;
+}
+
+// Scores @X with @stage in batches of @batchSize. Returns the seconds spent in @stage.
+static double scoreInBatches(
+  const CascadeStageFunction& stage,
+  MatrixXuf& Yscores,
+  const SparseMatrixuf& X,
+  const dataCount_t batchSize)
+{
+  double seconds = 0;
+  for (dataCount_t begin = 0; begin < (dataCount_t)X.cols(); begin += batchSize) {
+    const dataCount_t curBatchSize = std::min(batchSize, (dataCount_t)X.cols() - begin);
+    const SparseMatrixuf batch = X.middleCols(begin, curBatchSize);
+    MatrixXuf batchScores = MatrixXuf::Zero(Yscores.rows(), curBatchSize);
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    stage(batchScores, batch);
+    seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    Yscores.middleCols(begin, curBatchSize) = batchScores;
+  }
+  return seconds;
+}
+
+static std::string operatingPointToString(const CascadeOperatingPoint& point)
+{
+  char line[128];
+  snprintf(line, sizeof(line), "%12.6g %10.2f%% %10.4f %12.3f",
+    (double)point.threshold, 100.0 * point.forwardedFraction,
+    (double)primaryMetric(point.result), point.microsPerPoint);
+  return line;
+}
+
+ModelCascade::ModelCascade(
+  const CascadeStageFunction& small_,
+  const CascadeStageFunction& large_,
+  const labelCount_t numLabels_)
+  : small(small_),
+    large(large_),
+    numLabels(numLabels_),
+    threshold(0)
+{
+  assert(numLabels > 0);
+}
+
+dataCount_t ModelCascade::scoreBatch(
+  MatrixXuf& Yscores,
+  const SparseMatrixuf& X) const
+{
+  assert((labelCount_t)Yscores.rows() == numLabels && Yscores.cols() == X.cols());
+  small(Yscores, X);
+
+  std::vector<FP_TYPE> margins;
+  scoreMargins(margins, Yscores);
+  std::vector<dataCount_t> forwarded;
+  for (dataCount_t i = 0; i < (dataCount_t)margins.size(); ++i)
+    if (margins[i] < threshold)
+      forwarded.push_back(i);
+  if (forwarded.empty())
+    return 0;
+
+  // One batch for the large model, so it keeps the throughput of its GEMMs
+  SparseMatrixuf forwardedX;
+  gatherColumns(forwardedX, X, forwarded);
+  MatrixXuf forwardedScores = MatrixXuf::Zero(numLabels, forwarded.size());
+  large(forwardedScores, forwardedX);
+  for (size_t j = 0; j < forwarded.size(); ++j)
+    Yscores.col(forwarded[j]) = forwardedScores.col(j);
+
+  return forwarded.size();
+}
+
+std::vector<CascadeOperatingPoint> ModelCascade::calibrate(
+  const SparseMatrixuf& X,
+  const SparseMatrixuf& Y,
+  const ProblemFormat problemType,
+  const FP_TYPE maxLoss,
+  const dataCount_t batchSize)
+{
+  const dataCount_t n = X.cols();
+  assert(n > 0 && (dataCount_t)Y.cols() == n && (labelCount_t)Y.rows() == numLabels);
+  assert(batchSize > 0);
+
+  MatrixXuf smallScores(numLabels, n);
+  MatrixXuf largeScores(numLabels, n);
+  const double smallMicros = 1e6 * scoreInBatches(small, smallScores, X, batchSize) / n;
+  const double largeMicros = 1e6 * scoreInBatches(large, largeScores, X, batchSize) / n;
+
+  std::vector<FP_TYPE> margins;
+  scoreMargins(margins, smallScores);
+  std::vector<FP_TYPE> sortedMargins(margins);
+  std::sort(sortedMargins.begin(), sortedMargins.end());
+
+  const FP_TYPE largeMetric = primaryMetric(evaluate(largeScores, Y, problemType));
+  const int numSteps = 20;
+  std::vector<CascadeOperatingPoint> points;
+  for (int s = 0; s <= numSteps; ++s) {
+    // Forwards the (n s / numSteps) points of smallest margin, ties aside
+    const dataCount_t numBelow = (dataCount_t)((double)n * s / numSteps + 0.5);
+    CascadeOperatingPoint point;
+    point.threshold = numBelow < n ? sortedMargins[numBelow] : std::numeric_limits<FP_TYPE>::infinity();
+
+    MatrixXuf scores(smallScores);
+    dataCount_t numForwarded = 0;
+    for (dataCount_t i = 0; i < n; ++i)
+      if (margins[i] < point.threshold) {
+        scores.col(i) = largeScores.col(i);
+        ++numForwarded;
+      }
+    point.forwardedFraction = (double)numForwarded / n;
+    point.result = evaluate(scores, Y, problemType);
+    point.microsPerPoint = smallMicros + point.forwardedFraction * largeMicros;
+    points.push_back(point);
+  }
+
+  size_t chosen = points.size() - 1;
+  for (size_t p = 0; p < points.size(); ++p)
+    if (primaryMetric(points[p].result) >= largeMetric - maxLoss) {
+      chosen = p;
+      break;
+    }
+  threshold = points[chosen].threshold;
+
+  const std::string metricName = problemType == multilabel ? "prec@1" : "accuracy";
+  LOG_INFO("Cascade calibration on " + std::to_string(n) + " points: small model "
+    + std::to_string(smallMicros) + " us/point, large model " + std::to_string(largeMicros)
+    + " us/point, large model " + metricName + " " + std::to_string(largeMetric));
+  LOG_INFO("   threshold  forwarded   " + metricName + "     us/point");
+  for (size_t p = 0; p < points.size(); ++p)
+    LOG_INFO(operatingPointToString(points[p]) + (p == chosen ? "  <- chosen" : ""));
+
+  return points;
+}
+
+CascadeOperatingPoint ModelCascade::test(
+  const SparseMatrixuf& X,
+  const SparseMatrixuf& Y,
+  const ProblemFormat problemType,
+  const dataCount_t batchSize) const
+{
+  const dataCount_t n = X.cols();
+  assert(n > 0 && (dataCount_t)Y.cols() == n && (labelCount_t)Y.rows() == numLabels);
+  assert(batchSize > 0);
+
+  MatrixXuf largeScores(numLabels, n);
+  const double largeMicros = 1e6 * scoreInBatches(large, largeScores, X, batchSize) / n;
+  const FP_TYPE largeMetric = primaryMetric(evaluate(largeScores, Y, problemType));
+
+  dataCount_t numForwarded = 0;
+  MatrixXuf scores(numLabels, n);
+  const double cascadeSeconds = scoreInBatches(
+    [this, &numForwarded](MatrixXuf& Yscores, const SparseMatrixuf& batch) {
+      numForwarded += scoreBatch(Yscores, batch);
+    },
+    scores, X, batchSize);
+
+  CascadeOperatingPoint point;
+  point.threshold = threshold;
+  point.forwardedFraction = (double)numForwarded / n;
+  point.result = evaluate(scores, Y, problemType);
+  point.microsPerPoint = 1e6 * cascadeSeconds / n;
+
+  const std::string metricName = problemType == multilabel ? "prec@1" : "accuracy";
+  LOG_INFO("Cascade at threshold " + std::to_string(threshold) + " on " + std::to_string(n) + " points: "
+    + std::to_string(100.0 * point.forwardedFraction) + "% forwarded, " + metricName + " "
+    + std::to_string(primaryMetric(point.result)) + ", " + std::to_string(point.microsPerPoint) + " us/point");
+  LOG_INFO("Large model alone: " + metricName + " " + std::to_string(largeMetric) + ", "
+    + std::to_string(largeMicros) + " us/point (" + std::to_string(largeMicros / point.microsPerPoint)
+    + "x the time of the cascade)");
+
+  return point;
+}
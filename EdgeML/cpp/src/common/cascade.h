@@ -0,0 +1,89 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#ifndef __CASCADE_H__
+#define __CASCADE_H__
+
+#include "metrics.h"
+#include <functional>
+
+namespace EdgeML
+{
+  //
+  // Scores the columns of the raw (unnormalized) batch @X into the columns of @Yscores
+  // (numLabels x X.cols()). A stage that normalizes does so on its own copy.
+  //
+  typedef std::function<void(MatrixXuf& Yscores, const SparseMatrixuf& X)> CascadeStageFunction;
+
+  // Margin between the best and the second best score of each column of @Yscores
+  void scoreMargins(
+    std::vector<FP_TYPE>& margins,
+    const MatrixXuf& Yscores);
+
+  struct CascadeOperatingPoint
+  {
+    FP_TYPE threshold;          // Points with a margin below it go to the large model
+    double forwardedFraction;
+    ResultStruct result;
+    double microsPerPoint;      // Small model on all points plus large model on the forwarded ones
+  };
+
+  //
+  // Two-stage cascade of a small and a large model over the same labels. Every point is scored
+  // by the small model; those whose top-1/top-2 margin is below the threshold are gathered into
+  // one batch and rescored by the large model, whose scores replace the small model's.
+  // Confident points, usually most of them, never reach the large model.
+  //
+  class ModelCascade
+  {
+    CascadeStageFunction small;
+    CascadeStageFunction large;
+    labelCount_t numLabels;
+    FP_TYPE threshold;
+
+  public:
+    // Starts with a threshold of 0, which forwards no point
+    ModelCascade(
+      const CascadeStageFunction& small,
+      const CascadeStageFunction& large,
+      const labelCount_t numLabels);
+
+    FP_TYPE getThreshold() const { return threshold; }
+    void setThreshold(const FP_TYPE threshold_) { threshold = threshold_; }
+
+    //
+    // Scores the columns of @X into @Yscores (numLabels x X.cols()).
+    // Returns the number of points forwarded to the large model.
+    //
+    dataCount_t scoreBatch(
+      MatrixXuf& Yscores,
+      const SparseMatrixuf& X) const;
+
+    //
+    // Scores the held-out points @X, @Y with both models in batches of @batchSize, and evaluates
+    // the cascade at the thresholds forwarding 0%, 5%, ..., 100% of the points. The metric is
+    // accuracy, or prec@1 for multilabel problems; time per point is estimated from the measured
+    // time per point of each model. Logs the trade-off, sets the smallest threshold whose metric
+    // is within @maxLoss of the large model's, and returns the operating points.
+    //
+    std::vector<CascadeOperatingPoint> calibrate(
+      const SparseMatrixuf& X,
+      const SparseMatrixuf& Y,
+      const ProblemFormat problemType,
+      const FP_TYPE maxLoss,
+      const dataCount_t batchSize);
+
+    //
+    // Scores @X, @Y in batches of @batchSize with the cascade at the current threshold and with
+    // the large model alone, and logs the forwarding rate, metric and measured time per point
+    // of both. Returns the operating point of the cascade.
+    //
+    CascadeOperatingPoint test(
+      const SparseMatrixuf& X,
+      const SparseMatrixuf& Y,
+      const ProblemFormat problemType,
+      const dataCount_t batchSize) const;
+  };
+}
+
+#endif
@@ -0,0 +1,180 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "data_stream.h"
+#include "mmaped.h"
+#include <cctype>
+#include <cstring>
+
+using namespace EdgeML;
+
+DataStream::DataStream(
+  const std::string& fileName,
+  const DataFormat format_,
+  const featureCount_t dimension_,
+  const labelCount_t numLabels_,
+  const dataCount_t chunkPoints_,
+  const dataCount_t maxPoints_)
+  : file(NULL),
+    format(format_),
+    dimension(dimension_),
+    numLabels(numLabels_),
+    chunkPoints(chunkPoints_),
+    maxPoints(maxPoints_),
+    numPointsRead(0),
+    numPointsParsed(0),
+    isAtEnd(false)
+{
+  assert(chunkPoints > 0);
+  assert(format == libsvmFormat || format == tsvFormat || format == interfaceIngestFormat);
+
+  file = fopen(fileName.c_str(), "rb");
+  if (file == NULL) {
+    LOG_WARNING("Could not open " + fileName + " for reading");
+    return;
+  }
+  nextChunk = std::async(std::launch::async, &DataStream::parseChunk, this);
+}
+
+DataStream::~DataStream()
+{
+  if (nextChunk.valid())
+    nextChunk.wait();
+  if (file != NULL)
+    fclose(file);
+}
+
+bool DataStream::next(
+  SparseMatrixuf& X,
+  SparseMatrixuf& Y)
+{
+  if (!nextChunk.valid()) {
+    X = SparseMatrixuf(dimension, 0);
+    Y = SparseMatrixuf(numLabels, 0);
+    return false;
+  }
+
+  Chunk chunk = nextChunk.get();
+  X.swap(chunk.X);
+  Y.swap(chunk.Y);
+  if (X.cols() == 0)
+    return false;
+
+  numPointsRead += X.cols();
+  nextChunk = std::async(std::launch::async, &DataStream::parseChunk, this);
+  return true;
+}
+
+dataCount_t DataStream::readLines(const dataCount_t maxLines)
+{
+  const size_t blockBytes = (size_t)1 << 20;
+
+  lines.clear();
+  dataCount_t numLines = 0;
+  size_t begin = 0;       // First byte of pending not yet moved to lines
+  size_t searchFrom = 0;  // No newline in [begin, searchFrom)
+  while (numLines < maxLines) {
+    const void *const newline = memchr(pending.data() + searchFrom, '\n', pending.size() - searchFrom);
+    size_t end;
+    if (newline != NULL)
+      end = (const char*)newline - pending.data() + 1;
+    else if (!isAtEnd) {
+      searchFrom = pending.size();
+      pending.resize(searchFrom + blockBytes);
+      const size_t bytesRead = fread(pending.data() + searchFrom, 1, blockBytes, file);
+      pending.resize(searchFrom + bytesRead);
+      if (bytesRead < blockBytes) {
+        if (ferror(file))
+          LOG_WARNING("Error in reading the data file; the points after it are dropped");
+        isAtEnd = true;
+      }
+      continue;
+    }
+    else if (begin < pending.size())
+      end = pending.size();
+    else
+      break;
+
+    bool isEmpty = true;
+    for (size_t i = begin; i < end && isEmpty; ++i)
+      isEmpty = isspace((unsigned char)pending[i]) != 0;
+    if (!isEmpty) {
+      lines.insert(lines.end(), pending.begin() + begin, pending.begin() + end);
+      // The parsers finish a point at its newline
+      if (lines.back() != '\n')
+        lines.push_back('\n');
+      ++numLines;
+    }
+    begin = end;
+    searchFrom = end;
+  }
+
+  pending.erase(pending.begin(), pending.begin() + begin);
+  return numLines;
+}
+
+DataStream::Chunk DataStream::parseChunk()
+{
+  Chunk chunk;
+  while (true) {
+    dataCount_t numLines = chunkPoints;
+    if (maxPoints > 0)
+      numLines = std::min(numLines, maxPoints - numPointsParsed);
+    if (numLines > 0)
+      numLines = readLines(numLines);
+    if (numLines == 0) {
+      chunk.X = SparseMatrixuf(dimension, 0);
+      chunk.Y = SparseMatrixuf(numLabels, 0);
+      return chunk;
+    }
+
+    DataFormat lineFormat = format;
+    if (format == libsvmFormat) {
+      FileIO::Data parser(-1, -1, -1, dimension, numLabels);
+      parser.libsvmFillEntries(lines.data(), chunk.X, chunk.Y,
+        numLines, -1, lines.size(), lineFormat);
+    }
+    else if (format == tsvFormat) {
+      FileIO::Data parser(0, 1, dimension + 1, dimension, numLabels);
+      MatrixXuf denseX, denseY;
+      parser.fillEntries(lines.data(), denseX, denseY,
+        numLines, dimension + 1, lines.size(), lineFormat);
+      chunk.X = denseX.sparseView();
+      chunk.Y = denseY.sparseView();
+    }
+    else {
+      // As Data::loadDataFromFile reads it: a label, then all features but the last, a constant 1
+      FileIO::membuf buffer(lines.data(), lines.data() + lines.size());
+      std::istream reader(&buffer);
+      MatrixXuf denseX = MatrixXuf::Zero(dimension, numLines);
+      MatrixXuf denseY = MatrixXuf::Zero(numLabels, numLines);
+      FP_TYPE readLbl;
+      FP_TYPE readFeat;
+      for (dataCount_t i = 0; i < numLines; ++i) {
+        reader >> readLbl;
+#ifdef ZERO_BASED_IO
+        assert(readLbl >= 0);
+        const labelCount_t label = (labelCount_t)readLbl;
+#else
+        assert(readLbl >= 1);
+        const labelCount_t label = (labelCount_t)readLbl - 1;
+#endif
+        assert(label < numLabels);
+        denseY(label, i) = 1;
+
+        for (featureCount_t f = 0; f < dimension - 1; ++f) {
+          reader >> readFeat;
+          denseX(f, i) = readFeat;
+        }
+        denseX(dimension - 1, i) = 1.0;
+      }
+      chunk.X = denseX.sparseView();
+      chunk.Y = denseY.sparseView();
+    }
+
+    // A chunk of malformed lines only is skipped rather than taken for the end of the file
+    numPointsParsed += chunk.X.cols();
+    if (chunk.X.cols() > 0)
+      return chunk;
+  }
+}
@@ -0,0 +1,78 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#ifndef __DATA_STREAM_H__
+#define __DATA_STREAM_H__
+
+#include "Data.h"
+#include <cstdio>
+#include <future>
+
+namespace EdgeML
+{
+  //
+  // Reads a data file a chunk of points at a time, for scoring files that do not fit in memory.
+  //
+  // Points are parsed as Data::loadDataFromFile parses them (libsvm, tsv and the Bonsai
+  // space-separated format), so a chunk holds the same columns the whole file would. While the
+  // caller works on one chunk, the next one is read and parsed on a background thread, so
+  // memory stays at about two chunks whatever the size of the file.
+  // Empty lines are skipped, and the last line of the file needs no newline.
+  //
+  class DataStream
+  {
+    struct Chunk
+    {
+      SparseMatrixuf X, Y;
+    };
+
+    FILE* file;
+    DataFormat format;
+    featureCount_t dimension;
+    labelCount_t numLabels;
+    dataCount_t chunkPoints;
+    dataCount_t maxPoints;
+    dataCount_t numPointsRead;      // Handed out by next()
+    dataCount_t numPointsParsed;    // Including the chunk being parsed
+
+    std::vector<char> pending;      // Bytes read from the file past the last parsed line
+    bool isAtEnd;
+    std::vector<char> lines;        // Text of the chunk being parsed
+    std::future<Chunk> nextChunk;
+
+    // Reads and parses up to chunkPoints more points. Runs on the background thread.
+    Chunk parseChunk();
+
+    // Moves the next non-empty lines of the file into @lines. Returns their number.
+    dataCount_t readLines(const dataCount_t maxLines);
+
+  public:
+    //
+    // Opens @fileName, of points with @dimension features and @numLabels labels, and starts
+    // parsing the first chunk of @chunkPoints points. Reads at most @maxPoints points, or the
+    // whole file if it is 0. A failure to open is logged and leaves the stream empty.
+    //
+    DataStream(
+      const std::string& fileName,
+      const DataFormat format,
+      const featureCount_t dimension,
+      const labelCount_t numLabels,
+      const dataCount_t chunkPoints,
+      const dataCount_t maxPoints = 0);
+
+    ~DataStream();
+
+    bool isOpen() const { return file != NULL; }
+
+    //
+    // Moves the next chunk into @X (dimension x n) and @Y (numLabels x n) and starts parsing
+    // the one after. Returns false, with empty matrices, once the file is exhausted.
+    //
+    bool next(SparseMatrixuf& X, SparseMatrixuf& Y);
+
+    // Points handed out by next() so far
+    dataCount_t count() const { return numPointsRead; }
+  };
+}
+
+#endif
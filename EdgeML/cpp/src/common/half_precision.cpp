@@ -0,0 +1,133 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "half_precision.h"
+#include <cmath>
+#include <cstring>
+
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+using namespace EdgeML;
+
+static uint32_t floatBits(const float f)
+{
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  return x;
+}
+
+static float bitsFloat(const uint32_t x)
+{
+  float f;
+  memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+static halfBits_t floatToFp16(const float f)
+{
+  const uint32_t x = floatBits(f);
+  const halfBits_t sign = (halfBits_t)((x >> 16) & 0x8000);
+  const uint32_t absX = x & 0x7fffffff;
+
+  if (absX >= 0x7f800000)                 // Inf stays inf, NaN stays a quiet NaN
+    return sign | 0x7c00 | (absX > 0x7f800000 ? 0x200 : 0);
+  if (absX >= 0x477ff000)                 // 65520 and up round to inf
+    return sign | 0x7c00;
+  if (absX < 0x38800000)                  // Below the smallest normal half: multiples of 2^-24
+    return sign | (halfBits_t)std::nearbyint(bitsFloat(absX) * 16777216.0f);
+
+  uint32_t h = (absX >> 13) - (112 << 10); // Rebias the exponent from 127 to 15
+  const uint32_t rest = absX & 0x1fff;
+  if (rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+    ++h;
+  return sign | (halfBits_t)h;
+}
+
+// Branch free, so that widening loops vectorize: the half's exponent and mantissa bits,
+// placed where a float has them, are a float 2^-112 times the half (normal or subnormal).
+static float fp16ToFloat(const halfBits_t h)
+{
+  const uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  const uint32_t shifted = (uint32_t)(h & 0x7fff) << 13;
+  const uint32_t scaled = floatBits(bitsFloat(shifted) * 5.192296858534828e+33f); // 2^112
+  const uint32_t isInfOrNaN = 0u - (uint32_t)((shifted & 0x0f800000) == 0x0f800000);
+  return bitsFloat(sign | (scaled & ~isInfOrNaN) | ((shifted | 0x7f800000) & isInfOrNaN));
+}
+
+static halfBits_t floatToBf16(const float f)
+{
+  const uint32_t x = floatBits(f);
+  if ((x & 0x7fffffff) > 0x7f800000)
+    return (halfBits_t)((x >> 16) | 0x40);
+  return (halfBits_t)((x + 0x7fff + ((x >> 16) & 1)) >> 16);
+}
+
+static float bf16ToFloat(const halfBits_t h)
+{
+  return bitsFloat((uint32_t)h << 16);
+}
+
+halfBits_t EdgeML::narrowToHalf(
+  const FP_TYPE x,
+  const ParamPrecision precision)
+{
+  assert(precision != fullPrecision);
+  return precision == fp16Precision ? floatToFp16((float)x) : floatToBf16((float)x);
+}
+
+FP_TYPE EdgeML::widenHalf(
+  const halfBits_t h,
+  const ParamPrecision precision)
+{
+  assert(precision != fullPrecision);
+  return (FP_TYPE)(precision == fp16Precision ? fp16ToFloat(h) : bf16ToFloat(h));
+}
+
+void EdgeML::narrowToHalf(
+  halfBits_t *const out,
+  const FP_TYPE *const in,
+  const size_t n,
+  const ParamPrecision precision)
+{
+  assert(precision != fullPrecision);
+  if (precision == bf16Precision) {
+    for (size_t i = 0; i < n; ++i)
+      out[i] = floatToBf16((float)in[i]);
+    return;
+  }
+  for (size_t i = 0; i < n; ++i)
+    out[i] = floatToFp16((float)in[i]);
+}
+
+void EdgeML::widenHalf(
+  FP_TYPE *const out,
+  const halfBits_t *const in,
+  const size_t n,
+  const ParamPrecision precision)
+{
+  assert(precision != fullPrecision);
+  size_t i = 0;
+  if (precision == bf16Precision) {
+    // A shift per element, which the compiler vectorizes
+    for (; i < n; ++i)
+      out[i] = (FP_TYPE)bf16ToFloat(in[i]);
+    return;
+  }
+#if defined(__F16C__) && defined(SINGLE)
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(in + i))));
+#endif
+  for (; i < n; ++i)
+    out[i] = (FP_TYPE)fp16ToFloat(in[i]);
+}
+
+const char* EdgeML::precisionName(const ParamPrecision precision)
+{
+  switch (precision) {
+  case fp16Precision: return "fp16";
+  case bf16Precision: return "bf16";
+  default: return "full";
+  }
+}
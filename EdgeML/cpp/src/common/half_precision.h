@@ -0,0 +1,36 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#ifndef __HALF_PRECISION_H__
+#define __HALF_PRECISION_H__
+
+#include "pre_processor.h"
+
+namespace EdgeML
+{
+  //
+  // Precision in which model parameters are stored. Reduced precision halves the storage and
+  // the memory traffic of a parameter; its values are widened back to FP_TYPE on the fly, so
+  // all arithmetic and accumulation still happen in FP_TYPE.
+  //   fp16: IEEE half. 11-bit significand, range up to 65504.
+  //   bf16: upper half of an IEEE single. 8-bit significand, the full range of float.
+  //
+  enum ParamPrecision
+  {
+    fullPrecision, fp16Precision, bf16Precision
+  };
+
+  typedef uint16_t halfBits_t;
+
+  // Rounds to nearest even. fp16 overflows to infinity beyond 65504.
+  halfBits_t narrowToHalf(const FP_TYPE x, const ParamPrecision precision);
+  FP_TYPE widenHalf(const halfBits_t h, const ParamPrecision precision);
+
+  void narrowToHalf(halfBits_t *const out, const FP_TYPE *const in, const size_t n, const ParamPrecision precision);
+  void widenHalf(FP_TYPE *const out, const halfBits_t *const in, const size_t n, const ParamPrecision precision);
+
+  // "full", "fp16" or "bf16", for logs
+  const char* precisionName(const ParamPrecision precision);
+}
+
+#endif
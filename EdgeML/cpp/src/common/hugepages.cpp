@@ -0,0 +1,170 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "hugepages.h"
+#include <atomic>
+
+#ifdef LINUX
+#include <sys/mman.h>
+#endif
+
+using namespace EdgeML;
+
+#ifdef HUGEPAGES
+static std::atomic<int> policy(transparentHugePages);
+#else
+static std::atomic<int> policy(defaultPages);
+#endif
+
+#ifdef LINUX
+// From <linux/mman.h> of Linux 6.1, which is not installed everywhere
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE 25
+#endif
+
+static uintptr_t roundDown(const uintptr_t x) { return x & ~(uintptr_t)(hugePageBytes - 1); }
+static uintptr_t roundUp(const uintptr_t x) { return roundDown(x + hugePageBytes - 1); }
+
+// Applies @current to a range of whole huge pages
+static bool advise(void *const ptr, const size_t bytes, const HugePagePolicy current)
+{
+  switch (current) {
+    case smallPages:
+      return madvise(ptr, bytes, MADV_NOHUGEPAGE) == 0;
+    case transparentHugePages:
+    case reservedHugePages:
+      return madvise(ptr, bytes, MADV_HUGEPAGE) == 0;
+    default:
+      return false;
+  }
+}
+#endif
+
+void EdgeML::setHugePagePolicy(const HugePagePolicy newPolicy)
+{
+  policy = newPolicy;
+}
+
+HugePagePolicy EdgeML::getHugePagePolicy()
+{
+  return (HugePagePolicy)policy.load();
+}
+
+std::string EdgeML::hugePagePolicyName(const HugePagePolicy p)
+{
+  switch (p) {
+    case smallPages: return "small pages";
+    case transparentHugePages: return "transparent huge pages";
+    case reservedHugePages: return "reserved huge pages";
+    default: return "system default pages";
+  }
+}
+
+void* EdgeML::allocatePages(const size_t bytes)
+{
+  void *ptr = NULL;
+#ifdef LINUX
+  if (bytes >= hugePageBytes) {
+    const HugePagePolicy current = getHugePagePolicy();
+    const size_t length = roundUp(bytes);
+
+    if (current == reservedHugePages) {
+      ptr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (ptr != MAP_FAILED)
+        return ptr;
+    }
+
+    // Map one huge page more and trim the ends, so that the buffer starts on a huge page
+    const size_t slack = (current == defaultPages) ? 0 : hugePageBytes;
+    ptr = mmap(NULL, length + slack, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+      LOG_ERROR("Could not map " + std::to_string(length) + " bytes");
+      assert(false);
+      return NULL;
+    }
+    if (slack != 0) {
+      const uintptr_t begin = roundUp((uintptr_t)ptr);
+      if (begin != (uintptr_t)ptr)
+        munmap(ptr, begin - (uintptr_t)ptr);
+      if ((uintptr_t)ptr + slack != begin)
+        munmap((void*)(begin + length), (uintptr_t)ptr + slack - begin);
+      ptr = (void*)begin;
+      advise(ptr, length, current);
+    }
+    return ptr;
+  }
+#endif
+  if (posix_memalign(&ptr, 64, bytes) != 0) {
+    LOG_ERROR("Could not allocate " + std::to_string(bytes) + " bytes");
+    assert(false);
+    return NULL;
+  }
+  return ptr;
+}
+
+void EdgeML::freePages(void *const ptr, const size_t bytes)
+{
+#ifdef LINUX
+  if (bytes >= hugePageBytes) {
+    munmap(ptr, roundUp(bytes));
+    return;
+  }
+#endif
+  free(ptr);
+}
+
+bool EdgeML::adviseHugePages(const void *const ptr, const size_t bytes)
+{
+#ifdef LINUX
+  const HugePagePolicy current = getHugePagePolicy();
+  const uintptr_t begin = roundUp((uintptr_t)ptr);
+  const uintptr_t end = roundDown((uintptr_t)ptr + bytes);
+  if (current == defaultPages || end <= begin)
+    return false;
+  return advise((void*)begin, end - begin, current);
+#else
+  return false;
+#endif
+}
+
+bool EdgeML::collapseHugePages(const void *const ptr, const size_t bytes)
+{
+  if (!adviseHugePages(ptr, bytes))
+    return false;
+#ifdef LINUX
+  if (getHugePagePolicy() != smallPages) {
+    const uintptr_t begin = roundUp((uintptr_t)ptr);
+    const uintptr_t end = roundDown((uintptr_t)ptr + bytes);
+    // Best effort: fails on older kernels and when no 2 MB of memory is free
+    madvise((void*)begin, end - begin, MADV_COLLAPSE);
+  }
+#endif
+  return true;
+}
+
+bool EdgeML::adviseHugePages(const MatrixXuf& A)
+{
+  return adviseHugePages(A.data(), sizeof(FP_TYPE) * A.size());
+}
+
+bool EdgeML::collapseHugePages(const SparseMatrixuf& A)
+{
+  // The outer index has one entry per column and is too short to matter
+  const bool values = collapseHugePages(A.valuePtr(), sizeof(FP_TYPE) * A.data().allocatedSize());
+  const bool indices = collapseHugePages(A.innerIndexPtr(), sizeof(sparseIndex_t) * A.data().allocatedSize());
+  return values || indices;
+}
+
+size_t EdgeML::transparentHugePageBytes()
+{
+#ifdef LINUX
+  std::ifstream in("/proc/self/smaps_rollup");
+  std::string line;
+  while (std::getline(in, line)) {
+    size_t kB;
+    if (sscanf(line.c_str(), "AnonHugePages: %zu kB", &kB) == 1)
+      return kB << 10;
+  }
+#endif
+  return 0;
+}
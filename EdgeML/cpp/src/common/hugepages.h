@@ -0,0 +1,81 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#ifndef __HUGEPAGES_H__
+#define __HUGEPAGES_H__
+
+#include "pre_processor.h"
+
+//
+// Allocation policy for the large buffers of datasets and models (Linux only; the helpers
+// fall back to malloc and do nothing elsewhere).
+//
+// The sparse column gathers of mm and the random minibatches of training touch the data
+// matrices all over, so with 4 KB pages most of those reads miss the TLB. Backing the large
+// buffers with 2 MB pages cuts the number of TLB entries they need by a factor of 512.
+// The default policy leaves pages to the system; build with -DHUGEPAGES to start with
+// transparentHugePages instead.
+//
+namespace EdgeML
+{
+  enum HugePagePolicy
+  {
+    defaultPages,         // Whatever /sys/kernel/mm/transparent_hugepage/enabled says
+    smallPages,           // 4 KB pages (MADV_NOHUGEPAGE); the baseline of benchmarks
+    transparentHugePages, // MADV_HUGEPAGE, served by the kernel when 2 MB of memory is free
+    reservedHugePages     // MAP_HUGETLB from the pool in /proc/sys/vm/nr_hugepages,
+                          // then transparentHugePages when the pool runs out
+  };
+
+  const size_t hugePageBytes = (size_t)2 << 20;
+
+  // Applies to buffers allocated or advised after the call, on all threads
+  void setHugePagePolicy(const HugePagePolicy policy);
+  HugePagePolicy getHugePagePolicy();
+  std::string hugePagePolicyName(const HugePagePolicy policy);
+
+  //
+  // Buffers of at least hugePageBytes are mapped on their own, 2 MB aligned and backed as the
+  // policy says; smaller ones come from malloc, aligned to a cache line. Contents are undefined.
+  // freePages must be passed the same @bytes as allocatePages.
+  //
+  void* allocatePages(const size_t bytes);
+  void freePages(void *const ptr, const size_t bytes);
+
+  //
+  // For storage that something else allocated (e.g., the arrays of an Eigen matrix).
+  // adviseHugePages applies the policy to the whole 2 MB pages inside [ptr, ptr+bytes); call it
+  // before the first write, so that the pages are faulted in as huge pages.
+  // collapseHugePages also asks the kernel to collapse pages that are already populated
+  // (MADV_COLLAPSE, Linux 6.1 and later; earlier kernels leave it to khugepaged).
+  // Both return false if the policy is defaultPages or the kernel refused.
+  //
+  bool adviseHugePages(const void *const ptr, const size_t bytes);
+  bool collapseHugePages(const void *const ptr, const size_t bytes);
+
+  bool adviseHugePages(const MatrixXuf& A);
+  bool collapseHugePages(const SparseMatrixuf& A);
+
+  //
+  // std allocator over allocatePages, for the vectors that hold data while it is read
+  //
+  template<class T>
+  struct HugePageAllocator
+  {
+    typedef T value_type;
+
+    HugePageAllocator() {}
+    template<class U> HugePageAllocator(const HugePageAllocator<U>&) {}
+
+    T* allocate(const size_t n) { return (T*)allocatePages(n * sizeof(T)); }
+    void deallocate(T *const ptr, const size_t n) { freePages(ptr, n * sizeof(T)); }
+
+    template<class U> bool operator==(const HugePageAllocator<U>&) const { return true; }
+    template<class U> bool operator!=(const HugePageAllocator<U>&) const { return false; }
+  };
+
+  // AnonHugePages of /proc/self/smaps_rollup: bytes of the process backed by transparent huge pages
+  size_t transparentHugePageBytes();
+}
+
+#endif
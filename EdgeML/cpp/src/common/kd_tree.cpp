@@ -0,0 +1,116 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "kd_tree.h"
+#include <algorithm>
+
+using namespace EdgeML;
+
+KdTree::KdTree()
+  : dim(0)
+{}
+
+void KdTree::build(
+  const MatrixXuf& A,
+  const Eigen::Index leafSize)
+{
+  assert(A.rows() > 0 && A.cols() > 0);
+  assert(leafSize > 0);
+
+  dim = A.rows();
+  points = A;
+  order.resize(A.cols());
+  for (Eigen::Index i = 0; i < A.cols(); ++i)
+    order[i] = i;
+
+  // Both halves of a split node have more than leafSize/2 points, so there are fewer than
+  // 2n/leafSize leaves and 4n/leafSize nodes
+  const Eigen::Index maxNodes = 4 * A.cols() / leafSize + 1;
+  nodes.clear();
+  nodes.reserve(maxNodes);
+  lower.resize(dim, maxNodes);
+  upper.resize(dim, maxNodes);
+
+  buildNode(0, A.cols(), leafSize);
+
+  // order was permuted while building; lay the points out in it
+  for (Eigen::Index i = 0; i < A.cols(); ++i)
+    points.col(i) = A.col(order[i]);
+  lower.conservativeResize(dim, nodes.size());
+  upper.conservativeResize(dim, nodes.size());
+}
+
+Eigen::Index KdTree::buildNode(
+  const Eigen::Index begin,
+  const Eigen::Index end,
+  const Eigen::Index leafSize)
+{
+  const Eigen::Index id = nodes.size();
+  assert(id < lower.cols());
+  nodes.push_back(Node{ begin, end, -1, -1 });
+
+  lower.col(id) = points.col(order[begin]);
+  upper.col(id) = points.col(order[begin]);
+  for (Eigen::Index i = begin + 1; i < end; ++i) {
+    lower.col(id) = lower.col(id).cwiseMin(points.col(order[i]));
+    upper.col(id) = upper.col(id).cwiseMax(points.col(order[i]));
+  }
+
+  Eigen::Index splitDim, col;
+  const FP_TYPE spread = (upper.col(id) - lower.col(id)).maxCoeff(&splitDim, &col);
+  if (end - begin <= leafSize || spread <= (FP_TYPE)0.0)
+    return id;
+
+  const Eigen::Index middle = begin + (end - begin) / 2;
+  std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end,
+    [this, splitDim](const Eigen::Index a, const Eigen::Index b) { return points(splitDim, a) < points(splitDim, b); });
+
+  const Eigen::Index left = buildNode(begin, middle, leafSize);
+  const Eigen::Index right = buildNode(middle, end, leafSize);
+  nodes[id].left = left;
+  nodes[id].right = right;
+  return id;
+}
+
+size_t KdTree::radiusSearch(
+  std::vector<Neighbor>& neighbors,
+  const FP_TYPE *const query,
+  const FP_TYPE radius) const
+{
+  assert(!nodes.empty());
+  const Map<const MatrixXuf> q(query, dim, 1);
+  const FP_TYPE radiusSq = radius * radius;
+  size_t visited = 0;
+
+  thread_local std::vector<Eigen::Index> stack;
+  stack.assign(1, 0);
+  while (!stack.empty()) {
+    const Eigen::Index id = stack.back();
+    const Node& node = nodes[id];
+    stack.pop_back();
+
+    // Squared distance from the query to the bounding box
+    if ((lower.col(id) - q).cwiseMax(q - upper.col(id)).cwiseMax((FP_TYPE)0.0).squaredNorm() > radiusSq)
+      continue;
+
+    if (node.left < 0) {
+      for (Eigen::Index i = node.begin; i < node.end; ++i) {
+        const FP_TYPE distanceSq = (q - points.col(i)).squaredNorm();
+        if (distanceSq <= radiusSq)
+          neighbors.push_back(Neighbor{ order[i], distanceSq });
+      }
+      visited += node.end - node.begin;
+    }
+    else {
+      stack.push_back(node.right);
+      stack.push_back(node.left);
+    }
+  }
+  return visited;
+}
+
+size_t KdTree::memoryBytes() const
+{
+  return sizeof(FP_TYPE) * (points.size() + lower.size() + upper.size())
+    + sizeof(Eigen::Index) * order.size() + sizeof(Node) * nodes.size();
+}
@@ -0,0 +1,67 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#ifndef __KD_TREE_H__
+#define __KD_TREE_H__
+
+#include "pre_processor.h"
+
+namespace EdgeML
+{
+  //
+  // k-d tree over the columns of a small dense matrix, for fixed-radius neighbor queries,
+  // e.g., of a projected point against the prototypes of a model.
+  //
+  // Each node splits its points at the median of the coordinate with the widest spread and
+  // keeps their bounding box. A query skips every node whose box is farther than the search
+  // radius, so in low dimensions the cost follows the number of neighbors and the depth of
+  // the tree rather than the number of points. Bounding boxes prune far better than bounding
+  // balls here, at the same cost per node. Points are stored in tree order, so that the
+  // points of a leaf are contiguous.
+  //
+  class KdTree
+  {
+  public:
+    struct Neighbor
+    {
+      Eigen::Index index;     // Column of the matrix the tree was built from
+      FP_TYPE distanceSq;
+    };
+
+  private:
+    struct Node
+    {
+      Eigen::Index begin, end;  // Points [begin, end) in tree order
+      Eigen::Index left, right; // Children, or -1 at a leaf
+    };
+
+    Eigen::Index dim;
+    MatrixXuf points;                 // dim x n, in tree order
+    MatrixXuf lower, upper;           // dim x nodes, corners of the bounding boxes
+    std::vector<Eigen::Index> order;  // Original column of each point in tree order
+    std::vector<Node> nodes;
+
+    Eigen::Index buildNode(const Eigen::Index begin, const Eigen::Index end, const Eigen::Index leafSize);
+
+  public:
+    KdTree();
+
+    // Indexes the columns of @A. Nodes of at most @leafSize points are not split.
+    void build(const MatrixXuf& A, const Eigen::Index leafSize = 8);
+
+    bool empty() const { return nodes.empty(); }
+
+    //
+    // Appends to @neighbors the points within @radius of @query (dim entries), in no particular
+    // order. Returns the number of points whose distance was computed. Thread safe.
+    //
+    size_t radiusSearch(
+      std::vector<Neighbor>& neighbors,
+      const FP_TYPE *const query,
+      const FP_TYPE radius) const;
+
+    size_t memoryBytes() const;
+  };
+}
+
+#endif
@@ -2,6 +2,8 @@
 // Licensed under the MIT license.
 
 #include "metrics.h"
+#include <algorithm>
+#include <cmath>
 
 using namespace EdgeML;
 
@@ -11,7 +13,10 @@ EdgeML::ResultStruct::ResultStruct()
   accuracy(0),
   precision1(0),
   precision3(0),
-  precision5(0)
+  precision5(0),
+  ndcg1(0),
+  ndcg3(0),
+  ndcg5(0)
 {}
 
 void EdgeML::ResultStruct::scaleAndAdd(ResultStruct& results, FP_TYPE scale)
@@ -24,6 +29,9 @@ void EdgeML::ResultStruct::scaleAndAdd(ResultStruct& results, FP_TYPE scale)
   precision1 += scale * results.precision1;
   precision3 += scale * results.precision3;
   precision5 += scale * results.precision5;
+  ndcg1 += scale * results.ndcg1;
+  ndcg3 += scale * results.ndcg3;
+  ndcg5 += scale * results.ndcg5;
 }
 
 void EdgeML::ResultStruct::scale(FP_TYPE scale)
@@ -32,123 +40,211 @@ void EdgeML::ResultStruct::scale(FP_TYPE scale)
   precision1 *= scale;
   precision3 *= scale;
   precision5 *= scale;
+  ndcg1 *= scale;
+  ndcg3 *= scale;
+  ndcg5 *= scale;
 }
 
 
-// computes accuracy for binary/multiclass datasets, and prec1, prec3, prec5 for multilabel datasets
-EdgeML::ResultStruct EdgeML::evaluate(
-  const MatrixXuf& Yscores, 
-  const SparseMatrixuf& Y,
-  const ProblemFormat problemType)
+namespace
 {
-  assert(Yscores.cols() == Y.cols());
-  assert(Yscores.rows() == Y.rows());
-  MatrixXuf Ytrue(Y);
-  MatrixXuf Ypred = Yscores;
-
-  FP_TYPE acc = 0;
-  FP_TYPE prec1 = 0;
-  FP_TYPE prec3 = 0;
-  FP_TYPE prec5 = 0;
-  
-  EdgeML::ResultStruct res;
-  res.problemType = problemType;
+  // Labels of point @i of a CSC label matrix; the row indices of a column must be sorted
+  struct SparseLabelColumn
+  {
+    const sparseIndex_t *first, *last;
+    const FP_TYPE *values;
+
+    SparseLabelColumn(const SparseMatrixuf& Y, const Eigen::Index i)
+    {
+      const sparseIndex_t begin = Y.outerIndexPtr()[i];
+      const sparseIndex_t end = Y.isCompressed() ? Y.outerIndexPtr()[i + 1] : begin + Y.innerNonZeroPtr()[i];
+      first = Y.innerIndexPtr() + begin;
+      last = Y.innerIndexPtr() + end;
+      values = Y.valuePtr() + begin;
+    }
 
-  if (problemType == EdgeML::ProblemFormat::binary || problemType == EdgeML::ProblemFormat::multiclass) {
-    dataCount_t Ytrue_, Ypred_;
+    labelCount_t size() const { return (labelCount_t)(last - first); }
 
-    for (Eigen::Index i = 0; i < Ytrue.cols(); ++i) {
-      Ytrue.col(i).maxCoeff(&Ytrue_);
-      Ypred.col(i).maxCoeff(&Ypred_);
+    bool contains(const Eigen::Index label) const
+    {
+      const sparseIndex_t *const it = std::lower_bound(first, last, (sparseIndex_t)label);
+      return it != last && *it == label && values[it - first] != 0;
+    }
 
-      if (Ytrue_ == Ypred_)
-        acc += 1;
+    // First row with the largest label, as maxCoeff on the dense column
+    Eigen::Index argmax() const
+    {
+      if (first == last)
+        return 0;
+      const sparseIndex_t *best = first;
+      for (const sparseIndex_t *it = first + 1; it != last; ++it)
+        if (values[it - first] > values[best - first])
+          best = it;
+      return *best;
     }
+  };
 
-    assert(Y.cols() != 0);
-    res.accuracy = acc = safeDiv(acc, (FP_TYPE)Y.cols());
-  }
-  else if (problemType == EdgeML::ProblemFormat::multilabel) {
-    const labelCount_t k = 5;
-
-    assert(k * Ypred.cols() < 3e9);
-    std::vector<labelCount_t> topInd(k * Ypred.cols());
-    pfor(Eigen::Index i = 0; i < Ytrue.cols(); ++i) {
-      for (Eigen::Index j = 0; j < Ytrue.rows(); ++j) {
-        FP_TYPE val = Ypred(j, i);
-        if (j >= k && (val < Ypred(topInd[i*k + (k - 1)], i)))
-          continue;
-        size_t top = std::min(j, (Eigen::Index)k - 1);
-        while (top > 0 && (Ypred(topInd[i*k + (top - 1)], i) < val)) {
-          topInd[i*k + (top)] = topInd[i*k + (top - 1)];
-          top--;
+  struct DenseLabelColumn
+  {
+    const MatrixXuf& Y;
+    const Eigen::Index i;
+
+    DenseLabelColumn(const MatrixXuf& Y_, const Eigen::Index i_) : Y(Y_), i(i_) {}
+
+    labelCount_t size() const { return (labelCount_t)(Y.col(i).array() != 0).count(); }
+    bool contains(const Eigen::Index label) const { return Y(label, i) != 0; }
+
+    Eigen::Index argmax() const
+    {
+      Eigen::Index best;
+      Y.col(i).maxCoeff(&best);
+      return best;
+    }
+  };
+
+  // Metrics of one point, summed up after the parallel loop
+  struct PointMetrics
+  {
+    FP_TYPE correct;
+    FP_TYPE precision[3], ndcg[3];
+  };
+
+  const labelCount_t cutoffs[3] = { 1, 3, 5 };
+  const labelCount_t maxCutoff = 5;
+
+  // @topKLabels holds the best labels of each point, best first (1 row suffices for accuracy)
+  template<class LabelColumn, class LabelMatrix>
+  void evaluateBlock(
+    const MatrixXlabel& topKLabels,
+    const LabelMatrix& Y,
+    const ProblemFormat problemType,
+    double *const totals)
+  {
+    assert(topKLabels.cols() == Y.cols());
+    assert(topKLabels.rows() > 0);
+    std::vector<PointMetrics> points(Y.cols(), PointMetrics());
+
+    if (problemType == binary || problemType == multiclass) {
+      pfor(Eigen::Index i = 0; i < Y.cols(); ++i)
+        points[i].correct = (LabelColumn(Y, i).argmax() == (Eigen::Index)topKLabels(0, i)) ? 1 : 0;
+    }
+    else if (problemType == multilabel) {
+      const labelCount_t k = (labelCount_t)std::min((Eigen::Index)maxCutoff, topKLabels.rows());
+      pfor(Eigen::Index i = 0; i < Y.cols(); ++i) {
+        const LabelColumn labels(Y, i);
+        FP_TYPE hits = 0, dcg = 0, idcg = 0;
+        const labelCount_t numLabels = labels.size();
+        labelCount_t c = 0;
+        for (labelCount_t j = 0; j < maxCutoff; ++j) {
+          const FP_TYPE discount = (FP_TYPE)(1.0 / std::log2(j + 2.0));
+          if (j < k && labels.contains(topKLabels(j, i))) {
+            hits += 1;
+            dcg += discount;
+          }
+          if (j < numLabels)
+            idcg += discount;
+          if (j + 1 == cutoffs[c]) {
+            points[i].precision[c] = hits / cutoffs[c];
+            points[i].ndcg[c] = (idcg > 0) ? dcg / idcg : 0;
+            ++c;
+          }
         }
-        topInd[i*k + top] = j;
       }
     }
 
-    assert(k >= 5);
-    for (Eigen::Index i = 0; i < Ytrue.cols(); ++i) {
-      for (labelCount_t j = 0; j < 1; ++j) {
-        if (Ytrue(topInd[i*k + j], i) == 1)
-          prec1++;
-      }
-      for (labelCount_t j = 0; j < 3; ++j) {
-        if (Ytrue(topInd[i*k + j], i) == 1)
-          prec3++;
-      }
-      for (labelCount_t j = 0; j < 5; ++j) {
-        if (Ytrue(topInd[i*k + j], i) == 1)
-          prec5++;
+    for (size_t i = 0; i < points.size(); ++i) {
+      totals[0] += points[i].correct;
+      for (int c = 0; c < 3; ++c) {
+        totals[1 + c] += points[i].precision[c];
+        totals[4 + c] += points[i].ndcg[c];
       }
     }
-
-    dataCount_t totalCount = Y.cols();
-    assert(totalCount != 0);
-    res.precision1 = (prec1 /= (FP_TYPE)totalCount);
-    res.precision3 = (prec3 /= ((FP_TYPE)totalCount)*3);
-    res.precision5 = (prec5 /= ((FP_TYPE)totalCount)*5);
   }
+}
+
+EdgeML::EvaluationAccumulator::EvaluationAccumulator(const ProblemFormat problemType_)
+  : problemType(problemType_),
+  numPoints(0)
+{
+  for (int t = 0; t < 7; ++t)
+    totals[t] = 0;
+}
 
+labelCount_t EdgeML::EvaluationAccumulator::topKNeeded(const labelCount_t numLabels) const
+{
+  const labelCount_t k = (problemType == multilabel) ? maxCutoff : 1;
+  return std::min(k, numLabels);
+}
+
+void EdgeML::EvaluationAccumulator::add(const MatrixXuf& Yscores, const SparseMatrixuf& Y)
+{
+  assert(Yscores.rows() == Y.rows());
+  MatrixXlabel topKLabels;
+  MatrixXuf topKScores;
+  getTopKScoresBatch(Yscores, topKLabels, topKScores, topKNeeded(Y.rows()));
+  addTopK(topKLabels, Y);
+}
+
+void EdgeML::EvaluationAccumulator::add(const MatrixXuf& Yscores, const MatrixXuf& Y)
+{
+  assert(Yscores.rows() == Y.rows());
+  MatrixXlabel topKLabels;
+  MatrixXuf topKScores;
+  getTopKScoresBatch(Yscores, topKLabels, topKScores, topKNeeded(Y.rows()));
+  evaluateBlock<DenseLabelColumn>(topKLabels, Y, problemType, totals);
+  numPoints += Y.cols();
+}
+
+void EdgeML::EvaluationAccumulator::addTopK(const MatrixXlabel& topKLabels, const SparseMatrixuf& Y)
+{
+  evaluateBlock<SparseLabelColumn>(topKLabels, Y, problemType, totals);
+  numPoints += Y.cols();
+}
+
+EdgeML::ResultStruct EdgeML::EvaluationAccumulator::result() const
+{
+  assert(numPoints != 0);
+  ResultStruct res;
+  res.problemType = problemType;
+
+  if (problemType == binary || problemType == multiclass) {
+    res.accuracy = (FP_TYPE)(totals[0] / numPoints);
+  }
+  else if (problemType == multilabel) {
+    res.precision1 = (FP_TYPE)(totals[1] / numPoints);
+    res.precision3 = (FP_TYPE)(totals[2] / numPoints);
+    res.precision5 = (FP_TYPE)(totals[3] / numPoints);
+    res.ndcg1 = (FP_TYPE)(totals[4] / numPoints);
+    res.ndcg3 = (FP_TYPE)(totals[5] / numPoints);
+    res.ndcg5 = (FP_TYPE)(totals[6] / numPoints);
+  }
   return res;
 }
 
+// computes accuracy for binary/multiclass datasets, and prec1, prec3, prec5, ndcg1, ndcg3, ndcg5 for multilabel datasets
+EdgeML::ResultStruct EdgeML::evaluate(
+  const MatrixXuf& Yscores, 
+  const SparseMatrixuf& Y,
+  const ProblemFormat problemType)
+{
+  EvaluationAccumulator accumulator(problemType);
+  accumulator.add(Yscores, Y);
+  return accumulator.result();
+}
+
 
 void EdgeML::getTopKScoresBatch(
   const MatrixXuf& Yscores,
-  MatrixXuf& topKindices,
-  MatrixXuf& topKscores,
+  MatrixXlabel& topKLabels,
+  MatrixXuf& topKScores,
   int k)
 {
-  dataCount_t totalCount = Yscores.cols();
-  dataCount_t totalLabels = Yscores.rows();
-
   if (k < 1)
     k = 5;
+  if (Yscores.rows() < k)
+    k = (int)Yscores.rows();
 
-  if (totalLabels < k)
-    k = totalLabels;
-
-  topKindices = MatrixXuf::Zero(k, totalCount);
-  topKscores = MatrixXuf::Zero(k, totalCount);
-
-  pfor(Eigen::Index i = 0; i < Yscores.cols(); ++i) {
-    for (Eigen::Index j = 0; j < Yscores.rows(); ++j) {
-      FP_TYPE val = Yscores(j, i);
-      if (j >= k && (val < Yscores(topKindices(k-1, i), i)))
-        continue;
-      size_t top = std::min(j, (Eigen::Index)k - 1);
-      while (top > 0 && (Yscores(topKindices(top-1, i), i) < val)) {
-        topKindices(top, i) = topKindices(top - 1, i);
-        top--;
-      }
-      topKindices(top, i) = j;
-    }
-  }
-  
-  pfor(Eigen::Index i = 0; i < topKindices.cols(); ++i)
-    for (Eigen::Index j = 0; j < topKindices.rows(); ++j)
-      topKscores(j, i) = Yscores(topKindices(j, i), i);
+  TopKSelector selector((labelCount_t)k, Yscores.cols());
+  selector.add(Yscores, 0);
+  selector.result(topKLabels, topKScores);
 }
-
-
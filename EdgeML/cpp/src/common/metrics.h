@@ -6,6 +6,7 @@
 
 #include "Data.h"
 #include "utils.h"
+#include "topk.h"
 
 namespace EdgeML
 {
@@ -15,6 +16,9 @@ namespace EdgeML
     FP_TYPE precision1;
     FP_TYPE precision3;
     FP_TYPE precision5;
+    FP_TYPE ndcg1;
+    FP_TYPE ndcg3;
+    FP_TYPE ndcg5;
     
     ResultStruct();
     void scaleAndAdd(ResultStruct& a, FP_TYPE scale);
@@ -22,15 +26,60 @@ namespace EdgeML
   };
 
 
+  //
+  // Accumulates accuracy (binary/multiclass), or prec@1,3,5 and nDCG@1,3,5 (multilabel)
+  // over blocks of points, without densifying the labels.
+  // Each call to add takes the scores (L x b) and the labels (L x b) of the next block.
+  // Sparse labels are tested for membership by binary search over the sorted row indices of
+  // their column, which is how setFromTriplets and Eigen products leave them.
+  // result() averages over all points added so far.
+  //
+  class EvaluationAccumulator
+  {
+    ProblemFormat problemType;
+    dataCount_t numPoints;
+    double totals[7];  // Sums over the points of: correct, prec@1,3,5, nDCG@1,3,5
+
+  public:
+    explicit EvaluationAccumulator(const ProblemFormat problemType);
+
+    void add(const MatrixXuf& Yscores, const SparseMatrixuf& Y);
+    void add(const MatrixXuf& Yscores, const MatrixXuf& Y);
+
+    // Blocks of sparse labels, e.g., Y.middleCols(begin, size); copies only the block
+    template<class Derived>
+    void add(const MatrixXuf& Yscores, const Eigen::SparseMatrixBase<Derived>& Y)
+    {
+      add(Yscores, SparseMatrixuf(Y));
+    }
+
+    //
+    // For scores that were reduced to their top labels on the fly (see TopKSelector):
+    // @topKLabels must hold at least topKNeeded(Y.rows()) labels per point, best first.
+    //
+    labelCount_t topKNeeded(const labelCount_t numLabels) const;
+    void addTopK(const MatrixXlabel& topKLabels, const SparseMatrixuf& Y);
+
+    template<class Derived>
+    void addTopK(const MatrixXlabel& topKLabels, const Eigen::SparseMatrixBase<Derived>& Y)
+    {
+      addTopK(topKLabels, SparseMatrixuf(Y));
+    }
+
+    dataCount_t count() const { return numPoints; }
+    ResultStruct result() const;
+  };
+
   ResultStruct evaluate(
     const MatrixXuf& Yscores,
     const SparseMatrixuf& Y,
     const ProblemFormat problemType);
   
 
+  // Top @k labels of each column of @Yscores and their scores, best first (k x n)
   void getTopKScoresBatch(
     const MatrixXuf& Yscores,
-    MatrixXuf& topKIndices,
+    MatrixXlabel& topKLabels,
     MatrixXuf& topKScores,
     int k = 5);
 };
@@ -6,6 +6,7 @@
 #include <fstream>
 #include <vector>
 #include <string>
+#include <limits>
 
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -27,6 +28,20 @@
 
 using namespace EdgeML::FileIO;
 
+Data::Data(
+  featureCount_t _COL_LABEL,
+  featureCount_t _COL_FEATURE,
+  featureCount_t _NUM_COLS,
+  featureCount_t _NUM_FEATURES,
+  featureCount_t _NUM_LABELS)
+  : COL_LABEL(_COL_LABEL),
+    COL_FEATURE(_COL_FEATURE),
+    NUM_COLS(_NUM_COLS),
+    NUM_FEATURES(_NUM_FEATURES),
+    NUM_LABELS(_NUM_LABELS),
+    isVerbose(false)
+{}
+
 Data::Data(
   std::string filename,
   MatrixXuf& data,
@@ -44,6 +59,7 @@ Data::Data(
   NUM_COLS = _NUM_COLS;
   NUM_FEATURES = _NUM_FEATURES;
   NUM_LABELS = _NUM_LABELS;
+  isVerbose = true;
 
   if (formatType != EdgeML::libsvmFormat) {
     assert(NUM_FEATURES <= NUM_COLS);
@@ -130,6 +146,7 @@ Data::Data(
   NUM_COLS = _NUM_COLS;
   NUM_FEATURES = _NUM_FEATURES;
   NUM_LABELS = _NUM_LABELS;
+  isVerbose = true;
   if (filename.empty()) { data = SparseMatrixuf(0, 0); label = SparseMatrixuf(0, 0); return;  }
 
 #ifdef LINUX 
@@ -212,7 +229,9 @@ size_t Data::fillEntries(
   uint64_t fileSize,
   EdgeML::DataFormat& formatType)
 {
-  data = MatrixXuf::Zero(NUM_FEATURES, max_entries);
+  data.resize(NUM_FEATURES, max_entries);
+  adviseHugePages(data);
+  data.setZero();
   label = MatrixXuf::Zero(NUM_LABELS, max_entries);
 
   FP_TYPE value = 0;
@@ -371,7 +390,8 @@ size_t Data::fillEntries(
   data.conservativeResize(NUM_FEATURES, nRead);
   label.conservativeResize(NUM_LABELS, nRead);
 
-  LOG_INFO("#Lines of data read: " + std::to_string(nRead));
+  if (isVerbose)
+    LOG_INFO("#Lines of data read: " + std::to_string(nRead));
   return nRead;
 }
 
@@ -565,7 +585,8 @@ size_t Data::libsvmFillEntries(char*buf,
   data.conservativeResize(NUM_FEATURES, nRead);
   label.conservativeResize(NUM_LABELS, nRead);
 
-  LOG_INFO("#Lines of data read: " + std::to_string(nRead) + "\n");
+  if (isVerbose)
+    LOG_INFO("#Lines of data read: " + std::to_string(nRead) + "\n");
   return nRead;
 }
 
@@ -582,7 +603,8 @@ size_t Data::libsvmFillEntries(char*buf,
   uint64_t fileSize,
   EdgeML::DataFormat& format_type)
 {
-  std::vector <Trip> data_triplet;
+  // Grows to 16 bytes (12 with SPARSE_INDEX_32) per non-zero of the file, and is read all over by setFromTriplets
+  std::vector <Trip, HugePageAllocator<Trip> > data_triplet;
   std::vector <Trip> label_triplet;
 
   FP_TYPE value = 0;
@@ -758,12 +780,18 @@ size_t Data::libsvmFillEntries(char*buf,
 
   data = SparseMatrixuf(NUM_FEATURES, nRead);
   label = SparseMatrixuf(NUM_LABELS, nRead);
-  LOG_INFO("Number of non-zero entries in data-matrix = " + std::to_string(data_triplet.size()));
-  LOG_INFO("Number of non-zero entries in label-matrix = " + std::to_string(label_triplet.size()));
+  if (isVerbose) {
+    LOG_INFO("Number of non-zero entries in data-matrix = " + std::to_string(data_triplet.size()));
+    LOG_INFO("Number of non-zero entries in label-matrix = " + std::to_string(label_triplet.size()));
+  }
 
+  // With SPARSE_INDEX_32, a matrix can hold at most 2^31-1 non-zeros
+  assert(data_triplet.size() <= (size_t)std::numeric_limits<sparseIndex_t>::max());
+  assert(label_triplet.size() <= (size_t)std::numeric_limits<sparseIndex_t>::max());
   data.setFromTriplets(data_triplet.begin(), data_triplet.end());
   label.setFromTriplets(label_triplet.begin(), label_triplet.end());
 
-  LOG_INFO("#Lines of data read: " + std::to_string(nRead) + "\n");
+  if (isVerbose)
+    LOG_INFO("#Lines of data read: " + std::to_string(nRead) + "\n");
   return nRead;
 }
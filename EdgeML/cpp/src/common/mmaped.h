@@ -2,6 +2,7 @@
 // Licensed under the MIT license.
 
 #include "Data.h"
+#include "hugepages.h"
 
 namespace EdgeML
 {
@@ -10,6 +11,16 @@ namespace EdgeML
     struct Data
     {
       int COL_LABEL, COL_FEATURE, NUM_COLS, NUM_FEATURES, NUM_LABELS;
+      bool isVerbose; // Log the number of lines and non-zeros read
+
+      // Parser for buffers handed to the fill functions by the caller, e.g., chunks of a
+      // stream; reads no file and logs nothing
+      Data(
+        featureCount_t _COL_LABEL,
+        featureCount_t _COL_FEATURE,
+        featureCount_t _NUM_COLS,
+        featureCount_t _NUM_FEATURES,
+        featureCount_t _NUM_LABELS);
 
       Data(
         std::string filename,
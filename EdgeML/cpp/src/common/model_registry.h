@@ -0,0 +1,301 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#ifndef __MODEL_REGISTRY_H__
+#define __MODEL_REGISTRY_H__
+
+#include "logger.h"
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace EdgeML
+{
+  //
+  // Holds the live version of a model for long-running predictors and swaps in new versions
+  // without blocking scoring.
+  //
+  // Readers take a Snapshot, which pins the version that was live at that moment. Taking and
+  // releasing a snapshot costs one compare-and-swap and two stores on a per-reader epoch slot;
+  // no lock is shared with other readers or with the writer.
+  // A new version is loaded, validated and fully constructed (including all derived state the
+  // model precomputes in its constructor) before it is published with a single pointer swap.
+  // Superseded versions are freed once every reader that could still hold them has released
+  // its snapshot (epoch based reclamation), so in-flight scoring finishes on the old version.
+  //
+  // Model must be usable through a const reference from many threads at once.
+  //
+  template <class Model>
+  class ModelRegistry
+  {
+  public:
+    // Returns a newly allocated model read from @source, or NULL if it cannot be read.
+    typedef std::function<Model*(const std::string& source)> LoadFunction;
+
+    // Returns false if the model must not be published.
+    typedef std::function<bool(const Model& model)> ValidateFunction;
+
+  private:
+    // Maximum number of snapshots held at the same time across all threads
+    static const size_t numSlots = 256;
+
+    struct Version
+    {
+      Model* model;
+      uint64_t id;
+      uint64_t retireEpoch;  // Value of globalEpoch just before this version was unpublished
+    };
+
+    // 0 if idle, otherwise the global epoch observed when the snapshot was taken.
+    // Padded to a cache line so that readers on different cores do not share lines.
+    struct alignas(64) ReaderSlot
+    {
+      std::atomic<uint64_t> epoch;
+    };
+
+    LoadFunction loadModel;
+    ValidateFunction validateModel;
+
+    std::atomic<Version*> current;
+    std::atomic<uint64_t> globalEpoch;
+    ReaderSlot slots[numSlots];
+
+    // Serializes writers. Never taken by readers.
+    std::mutex writerMutex;
+    std::list<Version*> retired;
+    uint64_t lastId;
+
+    // Background loading
+    std::mutex loaderMutex;
+    std::condition_variable loaderCondition;
+    std::thread loaderThread;
+    std::list<std::string> pendingSources;
+    bool isStopping;
+
+    uint64_t minActiveEpoch() const
+    {
+      uint64_t minEpoch = UINT64_MAX;
+      for (size_t s = 0; s < numSlots; ++s) {
+        const uint64_t e = slots[s].epoch.load();
+        if (e != 0 && e < minEpoch)
+          minEpoch = e;
+      }
+      return minEpoch;
+    }
+
+    // Call with writerMutex held
+    size_t reclaimLocked()
+    {
+      const uint64_t minEpoch = minActiveEpoch();
+      for (typename std::list<Version*>::iterator it = retired.begin(); it != retired.end();) {
+        // Readers that pinned an epoch > retireEpoch loaded the pointer after the swap
+        if ((*it)->retireEpoch < minEpoch) {
+          delete (*it)->model;
+          delete *it;
+          it = retired.erase(it);
+        }
+        else
+          ++it;
+      }
+      return retired.size();
+    }
+
+    void loaderLoop()
+    {
+      std::unique_lock<std::mutex> lock(loaderMutex);
+      while (true) {
+        loaderCondition.wait(lock, [this] { return isStopping || !pendingSources.empty(); });
+        if (isStopping)
+          return;
+        std::string source = pendingSources.front();
+        pendingSources.pop_front();
+
+        lock.unlock();
+        load(source);
+        lock.lock();
+      }
+    }
+
+  public:
+    //
+    // Snapshot of the model version that was live when it was taken.
+    // Hold it for the duration of one scoring call; it keeps that version alive.
+    //
+    class Snapshot
+    {
+      friend class ModelRegistry;
+
+      ModelRegistry* registry;
+      size_t slot;
+      Version* version;
+
+      Snapshot(ModelRegistry* registry_, size_t slot_, Version* version_)
+        : registry(registry_), slot(slot_), version(version_) {}
+
+      Snapshot(const Snapshot&);
+      Snapshot& operator=(const Snapshot&);
+
+    public:
+      Snapshot(Snapshot&& other)
+        : registry(other.registry), slot(other.slot), version(other.version)
+      {
+        other.registry = NULL;
+      }
+
+      ~Snapshot()
+      {
+        if (registry)
+          registry->slots[slot].epoch.store(0, std::memory_order_release);
+      }
+
+      // False if nothing was published yet
+      bool isValid() const { return version != NULL; }
+      uint64_t id() const { return version ? version->id : 0; }
+
+      const Model& operator*() const { assert(version); return *version->model; }
+      const Model* operator->() const { assert(version); return version->model; }
+    };
+
+    ModelRegistry(
+      LoadFunction loadModel_,
+      ValidateFunction validateModel_)
+      : loadModel(loadModel_),
+      validateModel(validateModel_),
+      current(NULL),
+      globalEpoch(1),
+      lastId(0),
+      isStopping(false)
+    {
+      for (size_t s = 0; s < numSlots; ++s)
+        slots[s].epoch.store(0);
+    }
+
+    //
+    // All snapshots must have been released.
+    //
+    ~ModelRegistry()
+    {
+      {
+        std::lock_guard<std::mutex> lock(loaderMutex);
+        isStopping = true;
+      }
+      loaderCondition.notify_all();
+      if (loaderThread.joinable())
+        loaderThread.join();
+
+      std::lock_guard<std::mutex> lock(writerMutex);
+      assert(minActiveEpoch() == UINT64_MAX && "ModelRegistry destroyed while snapshots are held");
+      for (typename std::list<Version*>::iterator it = retired.begin(); it != retired.end(); ++it) {
+        delete (*it)->model;
+        delete *it;
+      }
+      Version* live = current.load();
+      if (live) {
+        delete live->model;
+        delete live;
+      }
+    }
+
+    //
+    // Pins the live version. Wait-free unless more than numSlots snapshots are held at once.
+    //
+    Snapshot acquire()
+    {
+      const size_t start = std::hash<std::thread::id>()(std::this_thread::get_id()) % numSlots;
+      size_t slot = start;
+      while (true) {
+        uint64_t idle = 0;
+        // Publish the epoch before reading the pointer: a writer that swaps after this point
+        // sees the slot and keeps the version we are about to read alive.
+        if (slots[slot].epoch.compare_exchange_strong(idle, globalEpoch.load()))
+          break;
+        slot = (slot + 1) % numSlots;
+        if (slot == start)
+          std::this_thread::yield();
+      }
+      return Snapshot(this, slot, current.load());
+    }
+
+    //
+    // Takes ownership of @model and makes it the live version.
+    // Returns the id of the new version (ids start at 1 and increase by 1 per publish).
+    //
+    uint64_t publish(Model* model)
+    {
+      assert(model != NULL);
+      std::lock_guard<std::mutex> lock(writerMutex);
+
+      Version* version = new Version;
+      version->model = model;
+      version->id = ++lastId;
+      version->retireEpoch = 0;
+
+      Version* old = current.exchange(version);
+      if (old) {
+        old->retireEpoch = globalEpoch.fetch_add(1);
+        retired.push_back(old);
+      }
+      reclaimLocked();
+      return version->id;
+    }
+
+    //
+    // Reads, validates and publishes the model at @source on the calling thread.
+    // On failure the live version is left untouched and false is returned.
+    //
+    bool load(const std::string& source)
+    {
+      Model* model = loadModel(source);
+      if (model == NULL) {
+        LOG_WARNING("Could not load a model from " + source + "; keeping the live version");
+        return false;
+      }
+      if (!validateModel(*model)) {
+        LOG_WARNING("Model from " + source + " failed validation; keeping the live version");
+        delete model;
+        return false;
+      }
+
+      const uint64_t id = publish(model);
+      LOG_INFO("Published model version " + std::to_string(id) + " from " + source);
+      return true;
+    }
+
+    //
+    // Queues @source to be loaded by the background loader thread and returns immediately.
+    //
+    void loadAsync(const std::string& source)
+    {
+      std::lock_guard<std::mutex> lock(loaderMutex);
+      if (!loaderThread.joinable())
+        loaderThread = std::thread(&ModelRegistry::loaderLoop, this);
+      pendingSources.push_back(source);
+      loaderCondition.notify_one();
+    }
+
+    //
+    // Frees superseded versions that no snapshot can reach any more.
+    // Returns the number of superseded versions still pinned by readers.
+    //
+    size_t reclaim()
+    {
+      std::lock_guard<std::mutex> lock(writerMutex);
+      return reclaimLocked();
+    }
+
+    // Id of the live version, 0 if nothing was published yet
+    uint64_t liveId()
+    {
+      std::lock_guard<std::mutex> lock(writerMutex);
+      Version* live = current.load();
+      return live ? live->id : 0;
+    }
+  };
+}
+
+#endif
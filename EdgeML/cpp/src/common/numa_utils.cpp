@@ -0,0 +1,429 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "numa_utils.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <thread>
+
+#ifdef LINUX
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace EdgeML;
+
+#ifdef LINUX
+// From <numaif.h>, which is not installed everywhere
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#define MPOL_INTERLEAVE 3
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+
+// "0-3,8,10-11" -> {0,1,2,3,8,10,11}
+static std::vector<int> parseCpuList(const std::string& list)
+{
+  std::vector<int> cpus;
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    if (range.empty() || range[0] == '\n')
+      continue;
+    int first, last;
+    if (sscanf(range.c_str(), "%d-%d", &first, &last) == 2)
+      for (int c = first; c <= last; ++c)
+        cpus.push_back(c);
+    else if (sscanf(range.c_str(), "%d", &first) == 1)
+      cpus.push_back(first);
+  }
+  return cpus;
+}
+
+static std::string readSysfs(const std::string& path)
+{
+  std::ifstream in(path);
+  std::string contents;
+  std::getline(in, contents);
+  return contents;
+}
+
+static bool setAffinity(const std::vector<int>& cpus)
+{
+  cpu_set_t mask;
+  CPU_ZERO(&mask);
+  for (size_t i = 0; i < cpus.size(); ++i)
+    CPU_SET(cpus[i], &mask);
+  return sched_setaffinity(0, sizeof(mask), &mask) == 0;
+}
+
+static long pageSize()
+{
+  static const long size = sysconf(_SC_PAGESIZE);
+  return size;
+}
+
+// Binds the whole pages inside [ptr, ptr+bytes); the partial pages at the ends are left alone
+static bool mbindRange(const void *const ptr, const size_t bytes, const int mode, const std::vector<int>& kernelNodes)
+{
+  const uintptr_t begin = ((uintptr_t)ptr + pageSize() - 1) & ~(uintptr_t)(pageSize() - 1);
+  const uintptr_t end = ((uintptr_t)ptr + bytes) & ~(uintptr_t)(pageSize() - 1);
+  if (end <= begin)
+    return true;
+
+  const int maxNode = 1024;
+  unsigned long nodemask[maxNode / (8 * sizeof(unsigned long))] = { 0 };
+  for (size_t i = 0; i < kernelNodes.size(); ++i)
+    nodemask[kernelNodes[i] / (8 * sizeof(unsigned long))] |= 1UL << (kernelNodes[i] % (8 * sizeof(unsigned long)));
+
+  return syscall(SYS_mbind, begin, end - begin, mode, nodemask, maxNode + 1, MPOL_MF_MOVE) == 0;
+}
+#endif
+
+std::vector<int> NumaTopology::spreadCpus() const
+{
+  std::vector<int> cpus;
+  for (size_t i = 0; ; ++i) {
+    bool added = false;
+    for (int n = 0; n < numNodes(); ++n)
+      if (i < nodeCpus[n].size()) {
+        cpus.push_back(nodeCpus[n][i]);
+        added = true;
+      }
+    if (!added)
+      break;
+  }
+  return cpus;
+}
+
+const NumaTopology& NumaTopology::host()
+{
+  static const NumaTopology topology = []() {
+    NumaTopology t;
+#ifdef LINUX
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+
+    std::vector<int> nodes = parseCpuList(readSysfs("/sys/devices/system/node/online"));
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      std::vector<int> cpus = parseCpuList(
+        readSysfs("/sys/devices/system/node/node" + std::to_string(nodes[i]) + "/cpulist"));
+      std::vector<int> usable;
+      for (size_t c = 0; c < cpus.size(); ++c)
+        if (CPU_ISSET(cpus[c], &allowed))
+          usable.push_back(cpus[c]);
+      if (!usable.empty()) {
+        t.nodeCpus.push_back(usable);
+        t.nodeIds.push_back(nodes[i]);
+      }
+    }
+
+    if (t.nodeCpus.empty()) {
+      // No sysfs topology: one node with every CPU we may run on
+      std::vector<int> usable;
+      for (int c = 0; c < CPU_SETSIZE; ++c)
+        if (CPU_ISSET(c, &allowed))
+          usable.push_back(c);
+      t.nodeCpus.push_back(usable);
+      t.nodeIds.push_back(0);
+    }
+#else
+    t.nodeCpus.push_back(std::vector<int>(1, 0));
+    t.nodeIds.push_back(0);
+#endif
+
+    std::string summary = "NUMA topology: " + std::to_string(t.numNodes()) + " node(s), CPUs per node:";
+    for (int n = 0; n < t.numNodes(); ++n)
+      summary += " " + std::to_string(t.nodeCpus[n].size());
+    LOG_INFO(summary);
+    return t;
+  }();
+  return topology;
+}
+
+bool EdgeML::pinThreadToNode(const int node)
+{
+  assert(node >= 0 && node < NumaTopology::host().numNodes());
+#ifdef LINUX
+  return setAffinity(NumaTopology::host().nodeCpus[node]);
+#else
+  return false;
+#endif
+}
+
+bool EdgeML::pinThreadToCpu(const int cpu)
+{
+#ifdef LINUX
+  return setAffinity(std::vector<int>(1, cpu));
+#else
+  return false;
+#endif
+}
+
+void EdgeML::pinParallelWorkers()
+{
+  const std::vector<int> cpus = NumaTopology::host().spreadCpus();
+
+#ifdef CILK
+  const int numWorkers = __cilkrts_get_nworkers();
+  std::atomic<int> arrived(0);
+  std::atomic<int> pinned(0);
+
+  // Each iteration holds its worker until all workers hold one, so every worker runs exactly
+  // one iteration. The deadline keeps this from hanging if a worker never steals.
+  #pragma cilk grainsize = 1
+  cilk_for (int w = 0; w < numWorkers; ++w) {
+    arrived++;
+    const std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    while (arrived < numWorkers && std::chrono::steady_clock::now() < deadline)
+      std::this_thread::yield();
+    if (pinThreadToCpu(cpus[__cilkrts_get_worker_number() % cpus.size()]))
+      pinned++;
+  }
+  LOG_INFO("Pinned " + std::to_string(pinned) + " of " + std::to_string(numWorkers)
+    + " workers over " + std::to_string(NumaTopology::host().numNodes()) + " node(s)");
+#else
+  // pfor is sequential: keep the calling thread free to move, only report the topology
+  (void)cpus;
+#endif
+
+  if (getenv("OMP_PROC_BIND") == NULL)
+    LOG_INFO("Set OMP_PROC_BIND=spread OMP_PLACES=cores to also pin MKL's threads over the nodes");
+}
+
+bool EdgeML::interleaveMemory(const void *const ptr, const size_t bytes)
+{
+#ifdef LINUX
+  if (NumaTopology::host().numNodes() < 2)
+    return true;
+  return mbindRange(ptr, bytes, MPOL_INTERLEAVE, NumaTopology::host().nodeIds);
+#else
+  return false;
+#endif
+}
+
+bool EdgeML::bindMemoryToNode(const void *const ptr, const size_t bytes, const int node)
+{
+#ifdef LINUX
+  if (NumaTopology::host().numNodes() < 2)
+    return true;
+  return mbindRange(ptr, bytes, MPOL_BIND, std::vector<int>(1, NumaTopology::host().nodeIds[node]));
+#else
+  return false;
+#endif
+}
+
+bool EdgeML::interleaveMatrix(const MatrixXuf& A)
+{
+  return interleaveMemory(A.data(), sizeof(FP_TYPE) * A.size());
+}
+
+bool EdgeML::interleaveMatrix(const SparseMatrixuf& A)
+{
+  assert(A.isCompressed());
+  return interleaveMemory(A.valuePtr(), sizeof(FP_TYPE) * A.nonZeros())
+    && interleaveMemory(A.innerIndexPtr(), sizeof(sparseIndex_t) * A.nonZeros())
+    && interleaveMemory(A.outerIndexPtr(), sizeof(sparseIndex_t) * (A.outerSize() + 1));
+}
+
+void* EdgeML::allocatePagesOnNode(const size_t bytes, const int node)
+{
+  void *ptr = NULL;
+#ifdef LINUX
+  // Pages of its own, so that binding them moves nothing else
+  const size_t length = std::max((size_t)1, (bytes + pageSize() - 1) / pageSize()) * pageSize();
+  ptr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED) {
+    LOG_ERROR("Could not map " + std::to_string(length) + " bytes");
+    assert(false);
+    return NULL;
+  }
+  if (NumaTopology::host().numNodes() > 1
+    && !mbindRange(ptr, length, MPOL_BIND, std::vector<int>(1, NumaTopology::host().nodeIds[node])))
+    LOG_WARNING("Could not bind memory to NUMA node " + std::to_string(NumaTopology::host().nodeIds[node]));
+#else
+  (void)node;
+  ptr = malloc(std::max((size_t)1, bytes));
+  assert(ptr != NULL);
+#endif
+  return ptr;
+}
+
+void EdgeML::freeNodePages(void *const ptr, const size_t bytes)
+{
+#ifdef LINUX
+  munmap(ptr, std::max((size_t)1, (bytes + pageSize() - 1) / pageSize()) * pageSize());
+#else
+  (void)bytes;
+  free(ptr);
+#endif
+}
+
+std::vector<size_t> EdgeML::residentPagesPerNode(const void *const ptr, const size_t bytes)
+{
+  const NumaTopology& topology = NumaTopology::host();
+  std::vector<size_t> pagesPerNode(topology.numNodes(), 0);
+#ifdef LINUX
+  const uintptr_t begin = (uintptr_t)ptr & ~(uintptr_t)(pageSize() - 1);
+  const size_t numPages = ((uintptr_t)ptr + bytes - begin + pageSize() - 1) / pageSize();
+
+  std::vector<void*> pages(numPages);
+  std::vector<int> status(numPages, -1);
+  for (size_t p = 0; p < numPages; ++p)
+    pages[p] = (void*)(begin + p * pageSize());
+
+  // With a NULL node list, move_pages only reports where each page lives
+  if (syscall(SYS_move_pages, 0, numPages, pages.data(), NULL, status.data(), 0) != 0)
+    return pagesPerNode;
+
+  for (size_t p = 0; p < numPages; ++p)
+    for (int n = 0; n < topology.numNodes(); ++n)
+      if (status[p] == topology.nodeIds[n])
+        pagesPerNode[n]++;
+#endif
+  return pagesPerNode;
+}
+
+void EdgeML::forEachNode(std::function<void(const int node)> f)
+{
+  const NumaTopology& topology = NumaTopology::host();
+  if (topology.numNodes() == 1) {
+    f(0);
+    return;
+  }
+
+  std::vector<std::thread> threads;
+  for (int node = 0; node < topology.numNodes(); ++node)
+    threads.push_back(std::thread([&f, &topology, node]() {
+      if (!pinThreadToNode(node))
+        LOG_WARNING("Could not pin a thread to NUMA node " + std::to_string(topology.nodeIds[node]));
+      mkl_set_num_threads_local((int)topology.nodeCpus[node].size());
+      f(node);
+      mkl_set_num_threads_local(0);
+    }));
+  for (size_t t = 0; t < threads.size(); ++t)
+    threads[t].join();
+}
+
+std::vector<Eigen::Index> EdgeML::nodePartition(const Eigen::Index n)
+{
+  const NumaTopology& topology = NumaTopology::host();
+  size_t totalCpus = 0;
+  for (int node = 0; node < topology.numNodes(); ++node)
+    totalCpus += topology.nodeCpus[node].size();
+
+  std::vector<Eigen::Index> bounds(1, 0);
+  size_t cpusSoFar = 0;
+  for (int node = 0; node < topology.numNodes(); ++node) {
+    cpusSoFar += topology.nodeCpus[node].size();
+    bounds.push_back((Eigen::Index)((double)n * cpusSoFar / totalCpus));
+  }
+  bounds.back() = n;
+  return bounds;
+}
+
+// Scores columns [begin, end) of @X, whose column 0 is column @offset of @Yscores
+template<class SparseMatType>
+static void scoreInBatches(
+  const SparseMatType& X,
+  const Eigen::Index offset,
+  MatrixXuf& Yscores,
+  const dataCount_t batchSize,
+  const int node,
+  std::function<void(const int node, MatrixXuf& Yscores, const SparseMatrixuf& X)>& scorer)
+{
+  for (Eigen::Index begin = 0; begin < X.cols(); begin += batchSize) {
+    const Eigen::Index curBatchSize = std::min((Eigen::Index)batchSize, X.cols() - begin);
+    // Both blocks are allocated and touched here, so they live on this node
+    SparseMatrixuf Xblock = X.middleCols(begin, curBatchSize);
+    MatrixXuf Yblock = MatrixXuf::Zero(Yscores.rows(), curBatchSize);
+    scorer(node, Yblock, Xblock);
+    Yscores.middleCols(offset + begin, curBatchSize) = Yblock;
+  }
+}
+
+static size_t roundUpToCacheLine(const size_t bytes)
+{
+  return (bytes + 63) & ~(size_t)63;
+}
+
+void EdgeML::numaPartitionedScore(
+  const SparseMatrixuf& X,
+  MatrixXuf& Yscores,
+  const dataCount_t batchSize,
+  std::function<void(const int node, MatrixXuf& Yscores, const SparseMatrixuf& X)> scorer)
+{
+  assert(Yscores.cols() == X.cols());
+  assert(batchSize > 0);
+  assert(X.isCompressed());
+  if (NumaTopology::host().numNodes() == 1) {
+    scoreInBatches(X, 0, Yscores, batchSize, 0, scorer);
+    return;
+  }
+  const std::vector<Eigen::Index> bounds = nodePartition(X.cols());
+
+  forEachNode([&](const int node) {
+    // Copy this node's columns into memory bound to the node: one remote read, then local ones
+    const Eigen::Index numCols = bounds[node + 1] - bounds[node];
+    const sparseIndex_t first = X.outerIndexPtr()[bounds[node]];
+    const sparseIndex_t nnz = X.outerIndexPtr()[bounds[node + 1]] - first;
+    const size_t outerBytes = roundUpToCacheLine(sizeof(sparseIndex_t) * (numCols + 1));
+    const size_t innerBytes = roundUpToCacheLine(sizeof(sparseIndex_t) * nnz);
+    const size_t shardBytes = outerBytes + innerBytes + sizeof(FP_TYPE) * nnz;
+    char *const shard = (char*)allocatePagesOnNode(shardBytes, node);
+
+    sparseIndex_t *const outer = (sparseIndex_t*)shard;
+    sparseIndex_t *const inner = (sparseIndex_t*)(shard + outerBytes);
+    FP_TYPE *const values = (FP_TYPE*)(shard + outerBytes + innerBytes);
+    for (Eigen::Index j = 0; j <= numCols; ++j)
+      outer[j] = X.outerIndexPtr()[bounds[node] + j] - first;
+    memcpy(inner, X.innerIndexPtr() + first, sizeof(sparseIndex_t) * nnz);
+    memcpy(values, X.valuePtr() + first, sizeof(FP_TYPE) * nnz);
+
+    const Eigen::Map<const SparseMatrixuf> Xshard(X.rows(), numCols, nnz, outer, inner, values);
+    scoreInBatches(Xshard, bounds[node], Yscores, batchSize, node, scorer);
+    freeNodePages(shard, shardBytes);
+  });
+}
+
+std::vector<NumaNodeStats> EdgeML::readNumaStats()
+{
+  const NumaTopology& topology = NumaTopology::host();
+  std::vector<NumaNodeStats> stats(topology.numNodes(), NumaNodeStats{ 0, 0, 0, 0 });
+#ifdef LINUX
+  for (int n = 0; n < topology.numNodes(); ++n) {
+    std::ifstream in("/sys/devices/system/node/node" + std::to_string(topology.nodeIds[n]) + "/numastat");
+    std::string key;
+    uint64_t value;
+    while (in >> key >> value) {
+      if (key == "numa_hit") stats[n].numaHit = value;
+      else if (key == "numa_miss") stats[n].numaMiss = value;
+      else if (key == "local_node") stats[n].localNode = value;
+      else if (key == "other_node") stats[n].otherNode = value;
+    }
+  }
+#endif
+  return stats;
+}
+
+std::string EdgeML::numaStatsDelta(
+  const std::vector<NumaNodeStats>& before,
+  const std::vector<NumaNodeStats>& after)
+{
+  assert(before.size() == after.size());
+  std::ostringstream out;
+  for (size_t n = 0; n < after.size(); ++n)
+    out << "node " << NumaTopology::host().nodeIds[n]
+      << ": numa_hit +" << after[n].numaHit - before[n].numaHit
+      << " numa_miss +" << after[n].numaMiss - before[n].numaMiss
+      << " local_node +" << after[n].localNode - before[n].localNode
+      << " other_node +" << after[n].otherNode - before[n].otherNode
+      << (n + 1 < after.size() ? "; " : "");
+  return out.str();
+}
@@ -0,0 +1,125 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#ifndef __NUMA_UTILS_H__
+#define __NUMA_UTILS_H__
+
+#include "pre_processor.h"
+#include <functional>
+#include <memory>
+
+//
+// NUMA placement helpers (Linux only; everything degrades to a single node elsewhere).
+// Topology comes from sysfs and placement from the mbind/move_pages system calls, so no
+// libnuma is needed. Training and batch prediction use these when built with -DNUMA.
+//
+namespace EdgeML
+{
+  struct NumaTopology
+  {
+    // CPUs of each node that this process may run on. Nodes without such CPUs are dropped,
+    // so node k in this library is kernel node nodeIds[k].
+    std::vector<std::vector<int> > nodeCpus;
+    std::vector<int> nodeIds;
+
+    int numNodes() const { return (int)nodeCpus.size(); }
+
+    // CPUs ordered round-robin over the nodes, so that the first k entries spread over all sockets
+    std::vector<int> spreadCpus() const;
+
+    // Read once on first use
+    static const NumaTopology& host();
+  };
+
+  // Restrict the calling thread to the CPUs of @node, or to one @cpu. Return false on failure.
+  bool pinThreadToNode(const int node);
+  bool pinThreadToCpu(const int cpu);
+
+  //
+  // Pins the pfor (cilk) workers one per CPU, round-robin over the nodes.
+  // MKL's OpenMP threads are created by MKL and must be pinned with OMP_PROC_BIND/OMP_PLACES.
+  //
+  void pinParallelWorkers();
+
+  //
+  // Page placement of storage that something else allocated. Only the whole pages inside
+  // [ptr, ptr+bytes) are placed, since the pages at the ends may hold other allocations of
+  // the heap; pages that were already touched are migrated. Return false if the kernel
+  // refused (e.g., no NUMA support).
+  //
+  bool interleaveMemory(const void *const ptr, const size_t bytes);
+  bool bindMemoryToNode(const void *const ptr, const size_t bytes, const int node);
+
+  bool interleaveMatrix(const MatrixXuf& A);
+  bool interleaveMatrix(const SparseMatrixuf& A);
+
+  //
+  // Memory of its own for @node: mapped page aligned, and bound to @node before it is first
+  // touched. Contents are undefined. freeNodePages must be passed the same @bytes.
+  //
+  void* allocatePagesOnNode(const size_t bytes, const int node);
+  void freeNodePages(void *const ptr, const size_t bytes);
+
+  // Number of resident pages of [ptr, ptr+bytes) on each node
+  std::vector<size_t> residentPagesPerNode(const void *const ptr, const size_t bytes);
+
+  //
+  // Runs @f(node) on one thread per node, pinned to that node, and waits for all of them.
+  // Memory that @f allocates and touches first is placed on its node.
+  // The threads limit MKL to the CPUs of their node so that the nodes do not oversubscribe.
+  //
+  void forEachNode(std::function<void(const int node)> f);
+
+  //
+  // Splits [0, n) into one contiguous range per node, proportional to the CPUs of the node
+  //
+  std::vector<Eigen::Index> nodePartition(const Eigen::Index n);
+
+  //
+  // One copy of a read-only object per node, each allocated by a thread pinned to its node.
+  // Use it for parameters that every node reads all the time (W, B, Z, mean and stdDev, ...).
+  //
+  template<class T>
+  class NumaReplicated
+  {
+    std::vector<std::unique_ptr<T> > replicas;
+
+  public:
+    explicit NumaReplicated(std::function<T*()> make)
+      : replicas(NumaTopology::host().numNodes())
+    {
+      forEachNode([this, &make](const int node) { replicas[node].reset(make()); });
+    }
+
+    const T& onNode(const int node) const { return *replicas[node]; }
+    T& onNode(const int node) { return *replicas[node]; }
+  };
+
+  //
+  // Scores the columns of @X into the columns of @Yscores with one pinned thread per node.
+  // Node k owns the k-th range of nodePartition(X.cols()): it copies its columns of @X into
+  // allocatePagesOnNode memory, and calls @scorer(node, Yblock, Xblock) on batches of at most
+  // @batchSize of them. The pages of @X itself are left where they are.
+  //
+  void numaPartitionedScore(
+    const SparseMatrixuf& X,
+    MatrixXuf& Yscores,
+    const dataCount_t batchSize,
+    std::function<void(const int node, MatrixXuf& Yscores, const SparseMatrixuf& X)> scorer);
+
+  //
+  // Per-node counters from /sys/devices/system/node/node<k>/numastat. They count page allocations
+  // (local vs. remote), not traffic, and are used to check placement in benchmarks.
+  //
+  struct NumaNodeStats
+  {
+    uint64_t numaHit, numaMiss, localNode, otherNode;
+  };
+
+  std::vector<NumaNodeStats> readNumaStats();
+  std::string numaStatsDelta(
+    const std::vector<NumaNodeStats>& before,
+    const std::vector<NumaNodeStats>& after);
+}
+
+#endif
@@ -0,0 +1,259 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "output_writer.h"
+#include "logger.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <mutex>
+
+using namespace EdgeML;
+
+// The digits of @value, written backwards ending at @end. Returns the first digit.
+static char* formatDigitsBackwards(char *end, uint64_t value)
+{
+  do {
+    *--end = (char)('0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+  return end;
+}
+
+// 10^k for k in [-powerBias, powerBias]: enough for all floats, the rest go to printf
+static const int powerBias = 300;
+
+static const double* powersOfTen()
+{
+  static std::vector<double> powers;
+  static std::once_flag once;
+  std::call_once(once, []() {
+    powers.resize(2 * powerBias + 1);
+    for (int k = -powerBias; k <= powerBias; ++k)
+      powers[k + powerBias] = std::pow(10.0, (double)k);
+  });
+  return powers.data() + powerBias;
+}
+
+size_t EdgeML::formatFloat(char *const out, double value, const int digits)
+{
+  assert(digits >= 1 && digits <= 17);
+  // Beyond 9 digits the double scaling below cannot tell how printf rounds
+  if (!std::isfinite(value) || digits > 9)
+    return (size_t)snprintf(out, 32, "%.*g", digits, value);
+
+  char *p = out;
+  if (std::signbit(value)) {
+    *p++ = '-';
+    value = -value;
+  }
+  if (value == 0.0) {
+    *p++ = '0';
+    return p - out;
+  }
+
+  // value = mantissa * 10^(exponent - digits + 1), with exactly @digits digits in mantissa.
+  // The exponent estimated from the binary exponent may be one too small, which the loop
+  // corrects. The scaled value is off by a few ulps at most, below 1e-6 for 9 digits, so
+  // it rounds as printf does unless it is within 1e-5 of a tie; those few values go to printf.
+  static const double *const powers = powersOfTen();
+  uint64_t lowest = 1;
+  for (int i = 1; i < digits; ++i)
+    lowest *= 10;
+  int binaryExponent;
+  frexp(value, &binaryExponent);
+  int exponent = (int)std::floor((binaryExponent - 1) * 0.30102999566398120);
+  uint64_t mantissa;
+  while (true) {
+    const int shift = digits - 1 - exponent;
+    if (shift > powerBias || shift < -powerBias)
+      return (p - out) + (size_t)snprintf(p, 31, "%.*g", digits, value);
+    const double scaled = value * powers[shift];
+    const double rounded = std::floor(scaled + 0.5);
+    if (std::abs(scaled - std::floor(scaled) - 0.5) < 1e-5)
+      return (p - out) + (size_t)snprintf(p, 31, "%.*g", digits, value);
+    mantissa = (uint64_t)rounded;
+    if (mantissa >= lowest * 10)
+      ++exponent;
+    else if (mantissa < lowest)
+      --exponent;
+    else
+      break;
+  }
+
+  char digitBuffer[24];
+  char *const digitsEnd = digitBuffer + sizeof(digitBuffer);
+  const char *const first = formatDigitsBackwards(digitsEnd, mantissa);
+  const char *last = digitsEnd;
+  while (last > first + 1 && last[-1] == '0')
+    --last;
+  const int significant = (int)(last - first);
+
+  if (exponent < -4 || exponent >= digits) {
+    *p++ = *first;
+    if (significant > 1) {
+      *p++ = '.';
+      memcpy(p, first + 1, significant - 1);
+      p += significant - 1;
+    }
+    *p++ = 'e';
+    *p++ = exponent < 0 ? '-' : '+';
+    const int magnitude = std::abs(exponent);
+    if (magnitude < 10)
+      *p++ = '0';
+    char exponentBuffer[8];
+    const char *const exponentDigits = formatDigitsBackwards(exponentBuffer + sizeof(exponentBuffer), magnitude);
+    memcpy(p, exponentDigits, exponentBuffer + sizeof(exponentBuffer) - exponentDigits);
+    p += exponentBuffer + sizeof(exponentBuffer) - exponentDigits;
+  }
+  else if (exponent >= 0) {
+    const int integerDigits = exponent + 1;
+    for (int i = 0; i < integerDigits; ++i)
+      *p++ = i < significant ? first[i] : '0';
+    if (significant > integerDigits) {
+      *p++ = '.';
+      memcpy(p, first + integerDigits, significant - integerDigits);
+      p += significant - integerDigits;
+    }
+  }
+  else {
+    *p++ = '0';
+    *p++ = '.';
+    for (int i = 0; i < -exponent - 1; ++i)
+      *p++ = '0';
+    memcpy(p, first, significant);
+    p += significant;
+  }
+  return p - out;
+}
+
+OutputWriter::OutputWriter(
+  const std::string& path,
+  const OutputFormat format,
+  const size_t bufferBytes)
+  : file(NULL),
+    format_(format),
+    filled(0),
+    current(0),
+    pendingBytes(0),
+    isStopping(false),
+    hasFailed(false)
+{
+  // Room for the longest formatted value
+  buffers[0].resize(std::max(bufferBytes, (size_t)64));
+  buffers[1].resize(buffers[0].size());
+
+  file = fopen(path.c_str(), format == binaryOutput ? "wb" : "w");
+  if (file == NULL) {
+    LOG_WARNING("Could not open " + path + " for writing; its output is dropped");
+    return;
+  }
+  flushThread = std::thread(&OutputWriter::flushLoop, this);
+}
+
+OutputWriter::~OutputWriter()
+{
+  close();
+}
+
+void OutputWriter::flushLoop()
+{
+  std::unique_lock<std::mutex> lock(flushMutex);
+  while (true) {
+    flushCondition.wait(lock, [this] { return isStopping || pendingBytes > 0; });
+    if (pendingBytes == 0)
+      return;
+
+    const char *const data = buffers[1 - current].data();
+    const size_t bytes = pendingBytes;
+    lock.unlock();
+    const bool isWritten = fwrite(data, 1, bytes, file) == bytes && fflush(file) == 0;
+    lock.lock();
+
+    if (!isWritten)
+      hasFailed = true;
+    pendingBytes = 0;
+    flushCondition.notify_all();
+  }
+}
+
+void OutputWriter::swapBuffers()
+{
+  if (file == NULL) {
+    filled = 0;
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(flushMutex);
+  flushCondition.wait(lock, [this] { return pendingBytes == 0; });
+  if (filled == 0)
+    return;
+  pendingBytes = filled;
+  current = 1 - current;
+  filled = 0;
+  flushCondition.notify_all();
+}
+
+void OutputWriter::put(const char *const s)
+{
+  putBytes(s, strlen(s));
+}
+
+void OutputWriter::put(const std::string& s)
+{
+  putBytes(s.data(), s.size());
+}
+
+void OutputWriter::putInt(const int64_t value)
+{
+  char *const out = reserve(24);
+  char *p = out;
+  if (value < 0)
+    *p++ = '-';
+  // Negating in unsigned arithmetic also covers INT64_MIN
+  const uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+  char digitBuffer[24];
+  const char *const first = formatDigitsBackwards(digitBuffer + sizeof(digitBuffer), magnitude);
+  const size_t length = digitBuffer + sizeof(digitBuffer) - first;
+  memcpy(p, first, length);
+  filled += (p - out) + length;
+}
+
+void OutputWriter::putFloat(const double value, const int digits)
+{
+  filled += formatFloat(reserve(32), value, digits);
+}
+
+void OutputWriter::putBytes(const void *const data, const size_t bytes)
+{
+  const char *source = (const char*)data;
+  size_t remaining = bytes;
+  while (remaining > 0) {
+    if (filled == buffers[current].size())
+      swapBuffers();
+    const size_t chunk = std::min(remaining, buffers[current].size() - filled);
+    memcpy(buffers[current].data() + filled, source, chunk);
+    filled += chunk;
+    source += chunk;
+    remaining -= chunk;
+  }
+}
+
+bool OutputWriter::close()
+{
+  if (file == NULL)
+    return false;
+
+  swapBuffers();
+  {
+    std::unique_lock<std::mutex> lock(flushMutex);
+    flushCondition.wait(lock, [this] { return pendingBytes == 0; });
+    isStopping = true;
+    flushCondition.notify_all();
+  }
+  flushThread.join();
+
+  const bool isClosed = fclose(file) == 0;
+  file = NULL;
+  return isClosed && !hasFailed;
+}
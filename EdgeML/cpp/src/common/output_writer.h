@@ -0,0 +1,115 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#ifndef __OUTPUT_WRITER_H__
+#define __OUTPUT_WRITER_H__
+
+#include "pre_processor.h"
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+namespace EdgeML
+{
+  //
+  // Format of prediction outputs. Binary files hold uint32 labels and float32 scores back to
+  // back, in native byte order, in the record layout documented by each writer that offers it.
+  //
+  enum OutputFormat
+  {
+    textOutput, binaryOutput
+  };
+
+  //
+  // Buffered file writer for large outputs such as per-point predictions.
+  //
+  // Values are formatted straight into a large buffer; integers and floats are formatted
+  // without iostreams or printf. A full buffer is handed to a background thread that writes
+  // it to the file while the caller fills the other buffer, so the caller only waits if the
+  // disk is slower than the formatting.
+  //
+  // Float text is that of printf("%.*g"), i.e., of an ostream with that precision.
+  //
+  class OutputWriter
+  {
+    FILE* file;
+    OutputFormat format_;
+
+    std::vector<char> buffers[2];
+    size_t filled;                  // Bytes used in buffers[current]
+    int current;
+
+    // Background flushing: buffers[1 - current] is written while pendingBytes > 0
+    std::mutex flushMutex;
+    std::condition_variable flushCondition;
+    std::thread flushThread;
+    size_t pendingBytes;
+    bool isStopping;
+    bool hasFailed;
+
+    void flushLoop();
+
+    // Hands the current buffer to the flushing thread, after the previous one was written
+    void swapBuffers();
+
+    char* reserve(const size_t bytes)
+    {
+      if (filled + bytes > buffers[current].size())
+        swapBuffers();
+      return buffers[current].data() + filled;
+    }
+
+  public:
+    //
+    // Creates or truncates @path. A failure to open is logged and leaves the writer closed;
+    // all writes to a closed writer are dropped.
+    // @bufferBytes is the size of each of the two buffers.
+    //
+    OutputWriter(
+      const std::string& path,
+      const OutputFormat format = textOutput,
+      const size_t bufferBytes = (size_t)1 << 22);
+
+    ~OutputWriter();
+
+    bool isOpen() const { return file != NULL; }
+    OutputFormat format() const { return format_; }
+
+    void put(const char c)
+    {
+      *reserve(1) = c;
+      ++filled;
+    }
+
+    void put(const char *const s);
+    void put(const std::string& s);
+
+    // Decimal text
+    void putInt(const int64_t value);
+
+    // Text as printf("%.*g", @digits, @value). @digits is at most 17.
+    void putFloat(const double value, const int digits);
+
+    // Raw bytes, e.g., binary records
+    void putBytes(const void *const data, const size_t bytes);
+
+    // Binary records
+    void putUint32(const uint32_t value) { putBytes(&value, sizeof(value)); }
+    void putFloat32(const float value) { putBytes(&value, sizeof(value)); }
+
+    // Hands what was put so far to the flushing thread, e.g., to make results visible early
+    void flush() { swapBuffers(); }
+
+    // Writes out everything and closes the file. Returns false if any write failed.
+    bool close();
+  };
+
+  //
+  // Formats @value as printf("%.*g", @digits, @value) into @out, which must hold 32 chars,
+  // and returns the length.
+  //
+  size_t formatFloat(char *const out, const double value, const int digits);
+}
+
+#endif
@@ -0,0 +1,294 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "param_matrix.h"
+#include "blas_routines.h"
+#include "workspace.h"
+#include <algorithm>
+#include <cstdio>
+
+using namespace EdgeML;
+
+const FP_TYPE ParamMatrix::defaultMaxSparseDensity = (FP_TYPE)0.1;
+
+ParamMatrix::ParamMatrix()
+  : isSparse_(false),
+    precision_(fullPrecision),
+    rows_(0),
+    cols_(0)
+{}
+
+void ParamMatrix::set(
+  const MatrixXuf& A,
+  const FP_TYPE maxSparseDensity,
+  const ParamPrecision precision)
+{
+  const Eigen::Index nnz = (A.array() != (FP_TYPE)0.0).count();
+  rows_ = A.rows();
+  cols_ = A.cols();
+  isSparse_ = A.size() > 0 && nnz <= maxSparseDensity * A.size();
+  precision_ = isSparse_ ? fullPrecision : precision;
+  denseMat = MatrixXuf();
+  sparseMat = SparseMatrixuf();
+  halfMat.clear();
+  halfMat.shrink_to_fit();
+
+  if (isSparse_) {
+    sparseMat = A.sparseView();
+    sparseMat.makeCompressed();
+  }
+  else if (isReduced()) {
+    halfMat.resize(A.size());
+    narrowToHalf(halfMat.data(), A.data(), A.size(), precision_);
+  }
+  else {
+    denseMat = A;
+  }
+}
+
+void ParamMatrix::set(
+  const SparseMatrixuf& A,
+  const FP_TYPE maxSparseDensity,
+  const ParamPrecision precision)
+{
+  if (A.size() > 0 && A.nonZeros() <= maxSparseDensity * A.size()) {
+    rows_ = A.rows();
+    cols_ = A.cols();
+    isSparse_ = true;
+    precision_ = fullPrecision;
+    denseMat = MatrixXuf();
+    halfMat.clear();
+    halfMat.shrink_to_fit();
+    sparseMat = A;
+    sparseMat.prune((FP_TYPE)0.0);
+    sparseMat.makeCompressed();
+  }
+  else {
+    set(MatrixXuf(A), maxSparseDensity, precision);
+  }
+}
+
+Eigen::Index ParamMatrix::nonZeros() const
+{
+  if (isSparse_)
+    return sparseMat.nonZeros();
+  if (isReduced())
+    // +0 and -0 are the only zeros, in both 16-bit formats
+    return std::count_if(halfMat.begin(), halfMat.end(), [](const halfBits_t h) { return (h & 0x7fff) != 0; });
+  return (denseMat.array() != (FP_TYPE)0.0).count();
+}
+
+FP_TYPE ParamMatrix::density() const
+{
+  const Eigen::Index size = rows() * cols();
+  return size > 0 ? (FP_TYPE)nonZeros() / size : (FP_TYPE)0.0;
+}
+
+void ParamMatrix::widenRows(
+  MatrixXuf& out,
+  const Eigen::Index firstRow,
+  const Eigen::Index numRows) const
+{
+  assert(isReduced());
+  out.resize(numRows, cols_);
+  for (Eigen::Index j = 0; j < cols_; ++j)
+    widenHalf(out.data() + j * numRows, halfMat.data() + j * rows_ + firstRow, numRows, precision_);
+}
+
+void ParamMatrix::widenCols(
+  MatrixXuf& out,
+  const Eigen::Index firstCol,
+  const Eigen::Index numCols) const
+{
+  assert(isReduced());
+  out.resize(rows_, numCols);
+  widenHalf(out.data(), halfMat.data() + firstCol * rows_, rows_ * numCols, precision_);
+}
+
+void ParamMatrix::timesVector(
+  FP_TYPE *const out,
+  const FP_TYPE *const in) const
+{
+  if (isSparse_) {
+    Map<MatrixXuf> outMap(out, sparseMat.rows(), 1);
+    outMap.noalias() = sparseMat * Map<const MatrixXuf>(in, sparseMat.cols(), 1);
+  }
+  else if (isReduced()) {
+    // Blocks of columns are widened into a cache-sized buffer and multiplied there, so
+    // the parameter is read from memory once, in 16 bits
+    const Eigen::Index blockCols = std::max((Eigen::Index)1, (Eigen::Index)(1 << 14) / std::max((Eigen::Index)1, rows_));
+    thread_local std::vector<FP_TYPE> block;
+    block.resize(rows_ * std::min(blockCols, cols_));
+    for (Eigen::Index first = 0; first < cols_; first += blockCols) {
+      const Eigen::Index numCols = std::min(blockCols, cols_ - first);
+      widenHalf(block.data(), halfMat.data() + first * rows_, rows_ * numCols, precision_);
+      gemv(CblasColMajor, CblasNoTrans,
+        rows_, numCols,
+        1.0, block.data(), rows_,
+        in + first, 1, first == 0 ? 0.0 : 1.0, out, 1);
+    }
+  }
+  else {
+    gemv(CblasColMajor, CblasNoTrans,
+      denseMat.rows(), denseMat.cols(),
+      1.0, denseMat.data(), denseMat.rows(),
+      in, 1, 0.0, out, 1);
+  }
+}
+
+void ParamMatrix::columnAxpy(
+  FP_TYPE *const out,
+  const Eigen::Index col,
+  const FP_TYPE a) const
+{
+  assert(col >= 0 && col < cols_);
+  Map<MatrixXuf> outMap(out, rows_, 1);
+  if (isSparse_) {
+    outMap += a * sparseMat.col(col);
+  }
+  else if (isReduced()) {
+    thread_local std::vector<FP_TYPE> column;
+    column.resize(rows_);
+    widenHalf(column.data(), halfMat.data() + col * rows_, rows_, precision_);
+    outMap += a * Map<const MatrixXuf>(column.data(), rows_, 1);
+  }
+  else {
+    outMap += a * denseMat.col(col);
+  }
+}
+
+void ParamMatrix::rowsTimes(
+  MatrixXuf& out,
+  const Eigen::Index firstRow,
+  const Eigen::Index numRows,
+  const MatrixXuf& in,
+  const CBLAS_TRANSPOSE t) const
+{
+  assert(firstRow >= 0 && firstRow + numRows <= rows());
+  assert((t == CblasNoTrans ? in.rows() : in.cols()) == cols());
+  out.resize(numRows, t == CblasNoTrans ? in.cols() : in.rows());
+  if (isSparse_) {
+    if (t == CblasNoTrans)
+      out.noalias() = sparseMat.middleRows(firstRow, numRows) * in;
+    else
+      out.noalias() = sparseMat.middleRows(firstRow, numRows) * in.transpose();
+  }
+  else if (isReduced()) {
+    Workspace::Scope scope;
+    MatrixXuf& rowBlock = scope.matrix(numRows, cols_);
+    widenRows(rowBlock, firstRow, numRows);
+    if (t == CblasNoTrans)
+      out.noalias() = rowBlock * in;
+    else
+      out.noalias() = rowBlock * in.transpose();
+  }
+  else {
+    if (t == CblasNoTrans)
+      out.noalias() = denseMat.middleRows(firstRow, numRows) * in;
+    else
+      out.noalias() = denseMat.middleRows(firstRow, numRows) * in.transpose();
+  }
+}
+
+size_t ParamMatrix::memoryBytes() const
+{
+  if (isSparse_)
+    return (sizeof(FP_TYPE) + sizeof(sparseIndex_t)) * sparseMat.nonZeros() + sizeof(sparseIndex_t) * (cols_ + 1);
+  if (isReduced())
+    return sizeof(halfBits_t) * halfMat.size();
+  return sizeof(FP_TYPE) * denseMat.size();
+}
+
+std::string ParamMatrix::description() const
+{
+  char densityString[32];
+  snprintf(densityString, sizeof(densityString), "%.1f%%", 100.0 * density());
+  std::string representation = isSparse_ ? "sparse, "
+    : isReduced() ? std::string("dense ") + precisionName(precision_) + ", " : "dense, ";
+  return representation + densityString + " nonzero";
+}
+
+//
+// out = alpha*t1(in1)*t2(in2) + beta*out for a parameter held in 16 bits. Blocks of output
+// rows are computed one at a time: the rows of in1 they need (its columns if t1 is CblasTrans)
+// are widened into a matrix of about reducedBlockSize coefficients and multiplied there, so
+// no FP_TYPE copy of the whole parameter is made.
+//
+static const Eigen::Index reducedBlockSize = (Eigen::Index)1 << 16;
+
+template<class In2>
+static void reducedTimes(
+  MatrixXuf& out,
+  const ParamMatrix& in1,
+  const CBLAS_TRANSPOSE t1,
+  const In2& in2,
+  const CBLAS_TRANSPOSE t2,
+  const FP_TYPE alpha,
+  const FP_TYPE beta)
+{
+  const Eigen::Index outRows = (t1 == CblasTrans) ? in1.cols() : in1.rows();
+  const Eigen::Index innerSize = (t1 == CblasTrans) ? in1.rows() : in1.cols();
+  assert(out.rows() == outRows);
+  const Eigen::Index blockRows = std::max((Eigen::Index)1, reducedBlockSize / std::max((Eigen::Index)1, innerSize));
+
+  for (Eigen::Index first = 0; first < outRows; first += blockRows) {
+    const Eigen::Index numRows = std::min(blockRows, outRows - first);
+    // Returns the block to the pool before the next one is taken
+    Workspace::Scope scope;
+    MatrixXuf& block = (t1 == CblasTrans) ? scope.matrix(innerSize, numRows) : scope.matrix(numRows, innerSize);
+    if (t1 == CblasTrans)
+      in1.widenCols(block, first, numRows);
+    else
+      in1.widenRows(block, first, numRows);
+
+    MatrixXuf& blockOut = scope.matrix(numRows, out.cols());
+    mm(blockOut, block, t1, in2, t2, alpha, 0.0);
+    if (beta == (FP_TYPE)0.0)
+      out.middleRows(first, numRows) = blockOut;
+    else
+      out.middleRows(first, numRows) = blockOut + beta * out.middleRows(first, numRows);
+  }
+}
+
+void EdgeML::mm(
+  MatrixXuf& out,
+  const ParamMatrix& in1,
+  const CBLAS_TRANSPOSE t1,
+  const MatrixXuf& in2,
+  const CBLAS_TRANSPOSE t2,
+  const FP_TYPE alpha,
+  const FP_TYPE beta)
+{
+  if (in1.isSparse())
+    mm(out, in1.sparse(), t1, in2, t2, alpha, beta);
+  else if (in1.isReduced())
+    reducedTimes(out, in1, t1, in2, t2, alpha, beta);
+  else
+    mm(out, in1.dense(), t1, in2, t2, alpha, beta);
+}
+
+void EdgeML::mm(
+  MatrixXuf& out,
+  const ParamMatrix& in1,
+  const CBLAS_TRANSPOSE t1,
+  const SparseMatrixuf& in2,
+  const CBLAS_TRANSPOSE t2,
+  const FP_TYPE alpha,
+  const FP_TYPE beta)
+{
+  if (in1.isReduced()) {
+    reducedTimes(out, in1, t1, in2, t2, alpha, beta);
+    return;
+  }
+  if (!in1.isSparse()) {
+    mm(out, in1.dense(), t1, in2, t2, alpha, beta);
+    return;
+  }
+
+  assert(t1 == CblasNoTrans && t2 == CblasNoTrans);
+  assert(out.rows() == in1.rows() && out.cols() == in2.cols());
+  if (beta == (FP_TYPE)0.0)
+    out = alpha * MatrixXuf(in1.sparse() * in2);
+  else
+    out = alpha * MatrixXuf(in1.sparse() * in2) + beta * out;
+}
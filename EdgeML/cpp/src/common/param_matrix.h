@@ -0,0 +1,107 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#ifndef __PARAM_MATRIX_H__
+#define __PARAM_MATRIX_H__
+
+#include "pre_processor.h"
+#include "half_precision.h"
+
+//
+// A model parameter whose dense or sparse representation is picked at run time, from the
+// density the trained matrix actually has, instead of by the SPARSE_*_PROTONN/BONSAI macros.
+// Predictors convert their parameters once after loading and then call the mm/rowsTimes
+// overloads below, which dispatch to the dense (BLAS) or sparse kernels.
+//
+// A dense parameter can also be held in 16 bits (fp16/bf16). It is then widened to FP_TYPE
+// one cache-sized block at a time in timesVector and mm, and the rows asked for in rowsTimes,
+// so products still accumulate in FP_TYPE.
+//
+namespace EdgeML
+{
+  class ParamMatrix
+  {
+    bool isSparse_;
+    ParamPrecision precision_;
+    Eigen::Index rows_, cols_;
+    MatrixXuf denseMat;
+    SparseMatrixuf sparseMat;
+    std::vector<halfBits_t> halfMat;   // Column major, when dense in reduced precision
+
+  public:
+    //
+    // Fraction of nonzeros up to which the sparse representation is used. Sparse times
+    // dense products overtook BLAS at roughly 5-10% density in our measurements.
+    //
+    static const FP_TYPE defaultMaxSparseDensity;
+
+    ParamMatrix();
+
+    // @precision only applies if the dense representation is picked; sparse values stay FP_TYPE
+    void set(const MatrixXuf& A,
+      const FP_TYPE maxSparseDensity = defaultMaxSparseDensity,
+      const ParamPrecision precision = fullPrecision);
+    void set(const SparseMatrixuf& A,
+      const FP_TYPE maxSparseDensity = defaultMaxSparseDensity,
+      const ParamPrecision precision = fullPrecision);
+
+    bool isSparse() const { return isSparse_; }
+    bool isReduced() const { return precision_ != fullPrecision; }
+    ParamPrecision precision() const { return precision_; }
+    Eigen::Index rows() const { return rows_; }
+    Eigen::Index cols() const { return cols_; }
+    Eigen::Index nonZeros() const;
+    FP_TYPE density() const;
+
+    // Only the one matching isSparse() holds the parameter; dense() is empty if isReduced()
+    const MatrixXuf& dense() const { assert(!isSparse_ && !isReduced()); return denseMat; }
+    const SparseMatrixuf& sparse() const { assert(isSparse_); return sparseMat; }
+
+    // If isReduced(), out = rows [firstRow, firstRow + numRows) of the 16-bit matrix, widened
+    void widenRows(MatrixXuf& out, const Eigen::Index firstRow, const Eigen::Index numRows) const;
+
+    // If isReduced(), out = columns [firstCol, firstCol + numCols) of the 16-bit matrix, widened
+    void widenCols(MatrixXuf& out, const Eigen::Index firstCol, const Eigen::Index numCols) const;
+
+    // @out (rows() entries) = this matrix times the dense vector @in (cols() entries)
+    void timesVector(FP_TYPE *const out, const FP_TYPE *const in) const;
+
+    // @out (rows() entries) += @a times column @col of this matrix
+    void columnAxpy(FP_TYPE *const out, const Eigen::Index col, const FP_TYPE a) const;
+
+    // out = rows [firstRow, firstRow + numRows) of this matrix, times t(@in).
+    // No copy of the rows is made, except to widen them if isReduced().
+    void rowsTimes(
+      MatrixXuf& out,
+      const Eigen::Index firstRow,
+      const Eigen::Index numRows,
+      const MatrixXuf& in,
+      const CBLAS_TRANSPOSE t = CblasNoTrans) const;
+
+    // Bytes taken by the parameter in its current representation
+    size_t memoryBytes() const;
+
+    // E.g. "sparse, 4.2% nonzero" or "dense fp16, 100.0% nonzero", for logs
+    std::string description() const;
+  };
+
+  // OUT = alpha*t1(in1)*t2(in2) + beta*out, as the mm routines of blas_routines.h
+  void mm(MatrixXuf& out,
+    const ParamMatrix& in1,
+    const CBLAS_TRANSPOSE t1,
+    const MatrixXuf& in2,
+    const CBLAS_TRANSPOSE t2,
+    const FP_TYPE alpha,
+    const FP_TYPE beta);
+
+  // A sparse parameter times sparse data supports no transposes
+  void mm(MatrixXuf& out,
+    const ParamMatrix& in1,
+    const CBLAS_TRANSPOSE t1,
+    const SparseMatrixuf& in2,
+    const CBLAS_TRANSPOSE t2,
+    const FP_TYPE alpha,
+    const FP_TYPE beta);
+}
+
+#endif
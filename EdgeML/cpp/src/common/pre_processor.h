@@ -16,6 +16,7 @@
 #include "goldfoil.h"
 #include "timer.h"
 #include <cfloat>
+#include <cstdint>
 #include <vector>
 #include <cmath>
 #include <string>
@@ -91,7 +92,14 @@ typedef float       LABEL_TYPE;
 typedef MKL_UINT dataCount_t;
 typedef MKL_UINT labelCount_t;
 typedef MKL_UINT featureCount_t;
+// Inner and outer indices of sparse matrices. SPARSE_INDEX_32 halves their memory and bandwidth,
+// limits a sparse matrix to 2^31 - 1 nonzeros, and replaces MKL's ILP64 sparse BLAS by native
+// kernels. Model files always store 64-bit indices.
+#ifdef SPARSE_INDEX_32
+typedef int32_t sparseIndex_t;
+#else
 typedef MKL_INT sparseIndex_t;
+#endif
 #define MIN_DEN 1e-8L
 
 //typedef unsigned long long ULL;
@@ -124,6 +132,7 @@ typedef MKL_INT sparseIndex_t;
 #endif
 
 #define MatrixXufINT MatrixXuf
+#define MatrixXlabel Matrix<labelCount_t,Dynamic,Dynamic,ColMajor>
 #define VectorXf Matrix<FP_TYPE,Dynamic,1>
 #define Trip Triplet<FP_TYPE,sparseIndex_t>
 
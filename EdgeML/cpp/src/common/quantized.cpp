@@ -0,0 +1,182 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "quantized.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+using namespace EdgeML;
+
+#if defined(__AVX2__)
+static int32_t horizontalSum(const __m256i v)
+{
+  __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(sum);
+}
+#endif
+
+static int32_t dotInt8Chunk(
+  const int8_t *const a,
+  const int8_t *const b,
+  const size_t n)
+{
+  size_t i = 0;
+  int32_t sum = 0;
+
+#if defined(__AVX2__)
+  __m256i acc = _mm256_setzero_si256();
+#if !defined(__AVXVNNI__) && !(defined(__AVX512VNNI__) && defined(__AVX512VL__))
+  const __m256i ones = _mm256_set1_epi16(1);
+#endif
+  for (; i + 32 <= n; i += 32) {
+    const __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+    const __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+    // |a| is unsigned and sign(a)*b signed, as the unsigned-by-signed products need
+    const __m256i absA = _mm256_abs_epi8(va);
+    const __m256i signedB = _mm256_sign_epi8(vb, va);
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+    acc = _mm256_dpbusd_epi32(acc, absA, signedB);
+#elif defined(__AVXVNNI__)
+    acc = _mm256_dpbusd_avx_epi32(acc, absA, signedB);
+#else
+    // Pairs sum to at most 2*127*127, so the 16-bit step cannot saturate
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(absA, signedB), ones));
+#endif
+  }
+  sum = horizontalSum(acc);
+#endif
+
+  for (; i < n; ++i)
+    sum += (int32_t)a[i] * (int32_t)b[i];
+  return sum;
+}
+
+// Products are at most 127*127 in magnitude, so 2^17 of them sum to less than 2^31
+static const size_t maxChunkTerms = (size_t)1 << 17;
+
+int64_t EdgeML::dotInt8(
+  const int8_t *const a,
+  const int8_t *const b,
+  const size_t n)
+{
+  int64_t sum = 0;
+  for (size_t first = 0; first < n; first += maxChunkTerms)
+    sum += dotInt8Chunk(a + first, b + first, std::min(maxChunkTerms, n - first));
+  return sum;
+}
+
+void EdgeML::quantizeVector(
+  int8_t *const q,
+  const FP_TYPE *const x,
+  const size_t n,
+  const FP_TYPE scale)
+{
+  assert(scale > (FP_TYPE)0.0);
+  const FP_TYPE inverse = (FP_TYPE)1.0 / scale;
+  for (size_t i = 0; i < n; ++i) {
+    const FP_TYPE v = std::nearbyint(x[i] * inverse);
+    q[i] = (int8_t)std::max((FP_TYPE)-127.0, std::min((FP_TYPE)127.0, v));
+  }
+}
+
+FP_TYPE EdgeML::quantizeVector(
+  int8_t *const q,
+  const FP_TYPE *const x,
+  const size_t n)
+{
+  FP_TYPE maxMagnitude = (FP_TYPE)0.0;
+  for (size_t i = 0; i < n; ++i)
+    maxMagnitude = std::max(maxMagnitude, std::abs(x[i]));
+  const FP_TYPE scale = maxMagnitude > (FP_TYPE)0.0 ? maxMagnitude / (FP_TYPE)127.0 : (FP_TYPE)1.0;
+  quantizeVector(q, x, n, scale);
+  return scale;
+}
+
+FP_TYPE EdgeML::calibrateScale(
+  std::vector<FP_TYPE>& magnitudes,
+  const FP_TYPE percentile,
+  const FP_TYPE minimumMagnitude)
+{
+  assert(percentile > (FP_TYPE)0.0 && percentile <= (FP_TYPE)1.0);
+  FP_TYPE covered = minimumMagnitude;
+  if (!magnitudes.empty()) {
+    const size_t k = std::min(magnitudes.size() - 1, (size_t)(percentile * (magnitudes.size() - 1) + (FP_TYPE)0.5));
+    std::nth_element(magnitudes.begin(), magnitudes.begin() + k, magnitudes.end());
+    covered = std::max(covered, magnitudes[k]);
+  }
+  return covered > (FP_TYPE)0.0 ? covered / (FP_TYPE)127.0 : (FP_TYPE)1.0;
+}
+
+QuantizedMatrix::QuantizedMatrix()
+  : rows_(0),
+    cols_(0)
+{}
+
+void QuantizedMatrix::quantize(
+  const MatrixXuf& A,
+  const QuantScaleMode mode)
+{
+  rows_ = A.rows();
+  cols_ = A.cols();
+  values.resize(rows_ * cols_);
+  scales.resize(rows_);
+
+  const MatrixXuf rowMax = A.cwiseAbs().rowwise().maxCoeff();
+  const FP_TYPE tensorMax = rowMax.size() > 0 ? rowMax.maxCoeff() : (FP_TYPE)0.0;
+
+  std::vector<FP_TYPE> rowValues(cols_);
+  for (Eigen::Index i = 0; i < rows_; ++i) {
+    const FP_TYPE maxMagnitude = mode == perRowScale ? rowMax(i, 0) : tensorMax;
+    scales[i] = maxMagnitude > (FP_TYPE)0.0 ? maxMagnitude / (FP_TYPE)127.0 : (FP_TYPE)1.0;
+    for (Eigen::Index j = 0; j < cols_; ++j)
+      rowValues[j] = A(i, j);
+    quantizeVector(values.data() + i * cols_, rowValues.data(), cols_, scales[i]);
+  }
+}
+
+void QuantizedMatrix::quantize(
+  const SparseMatrixuf& A,
+  const QuantScaleMode mode)
+{
+  quantize(MatrixXuf(A), mode);
+}
+
+void QuantizedMatrix::quantize(
+  const MatrixXuf& A,
+  const FP_TYPE scale)
+{
+  rows_ = A.rows();
+  cols_ = A.cols();
+  values.resize(rows_ * cols_);
+  scales.assign(rows_, scale);
+
+  std::vector<FP_TYPE> rowValues(cols_);
+  for (Eigen::Index i = 0; i < rows_; ++i) {
+    for (Eigen::Index j = 0; j < cols_; ++j)
+      rowValues[j] = A(i, j);
+    quantizeVector(values.data() + i * cols_, rowValues.data(), cols_, scale);
+  }
+}
+
+void QuantizedMatrix::rowsTimes(
+  FP_TYPE *const out,
+  const Eigen::Index firstRow,
+  const Eigen::Index numRows,
+  const int8_t *const xq,
+  const FP_TYPE xScale) const
+{
+  assert(firstRow >= 0 && firstRow + numRows <= rows_);
+  for (Eigen::Index i = 0; i < numRows; ++i)
+    out[i] = (FP_TYPE)rowDot(firstRow + i, xq) * scales[firstRow + i] * xScale;
+}
+
+size_t QuantizedMatrix::memoryBytes() const
+{
+  return sizeof(int8_t) * values.size() + sizeof(FP_TYPE) * scales.size();
+}
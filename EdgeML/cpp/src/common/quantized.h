@@ -0,0 +1,80 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#ifndef __QUANTIZED_H__
+#define __QUANTIZED_H__
+
+#include "pre_processor.h"
+
+//
+// Symmetric int8 quantization for post-training inference: a value x is held as
+// q = round(x / scale), clipped to [-127, 127], so that x ~ q * scale. Products of two
+// quantized vectors are exact integer dot products times the two scales.
+//
+// dotInt8 uses AVX-VNNI/AVX512-VNNI dot products or AVX2 multiply-adds when the compiler
+// targets them (e.g. -march=native), and plain loops otherwise. Keeping q off -128 lets
+// the AVX2 path multiply |a| by sign(a)*b without saturating.
+//
+namespace EdgeML
+{
+  enum QuantScaleMode
+  {
+    perTensorScale, perRowScale
+  };
+
+  // sum_i a[i]*b[i], summed in int32 over chunks short enough not to overflow
+  int64_t dotInt8(const int8_t *const a, const int8_t *const b, const size_t n);
+
+  // Quantizes @x with the given @scale, clipping values out of range; @scale must be positive
+  void quantizeVector(int8_t *const q, const FP_TYPE *const x, const size_t n, const FP_TYPE scale);
+
+  // Quantizes @x with the smallest scale that needs no clipping and returns the scale.
+  // An all-zero @x gets scale 1.
+  FP_TYPE quantizeVector(int8_t *const q, const FP_TYPE *const x, const size_t n);
+
+  //
+  // Scale that covers the @percentile fraction of @magnitudes (absolute values, reordered
+  // in place), and at least @minimumMagnitude. Clipping a few outliers keeps the resolution
+  // of the bulk of the values.
+  //
+  FP_TYPE calibrateScale(std::vector<FP_TYPE>& magnitudes, const FP_TYPE percentile, const FP_TYPE minimumMagnitude);
+
+  //
+  // A parameter matrix in int8, row major, with one scale per row or one for the whole matrix
+  //
+  class QuantizedMatrix
+  {
+    Eigen::Index rows_, cols_;
+    std::vector<int8_t> values;
+    std::vector<FP_TYPE> scales;   // One per row, equal in perTensorScale mode
+
+  public:
+    QuantizedMatrix();
+
+    void quantize(const MatrixXuf& A, const QuantScaleMode mode);
+    void quantize(const SparseMatrixuf& A, const QuantScaleMode mode);
+
+    // Quantizes with a @scale chosen by the caller, e.g. shared with the vectors A is compared to
+    void quantize(const MatrixXuf& A, const FP_TYPE scale);
+
+    Eigen::Index rows() const { return rows_; }
+    Eigen::Index cols() const { return cols_; }
+    FP_TYPE scale(const Eigen::Index row) const { return scales[row]; }
+    const int8_t* row(const Eigen::Index i) const { return values.data() + i * cols_; }
+
+    // Integer dot product of row @i with the quantized vector @xq
+    int64_t rowDot(const Eigen::Index i, const int8_t *const xq) const { return dotInt8(row(i), xq, cols_); }
+
+    // out[i] = row i times x, for rows [firstRow, firstRow + numRows), where x ~ xq * xScale
+    void rowsTimes(
+      FP_TYPE *const out,
+      const Eigen::Index firstRow,
+      const Eigen::Index numRows,
+      const int8_t *const xq,
+      const FP_TYPE xScale) const;
+
+    size_t memoryBytes() const;
+  };
+}
+
+#endif
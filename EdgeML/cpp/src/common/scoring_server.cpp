@@ -0,0 +1,681 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "scoring_server.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <map>
+#include <sstream>
+
+#ifdef LINUX
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace EdgeML;
+
+// Number of recent requests over which latency percentiles are reported
+#define LATENCY_WINDOW_SIZE 65536
+
+// A client is disconnected once this many bytes of its responses wait to be sent, or when
+// a send to it makes no progress for this long
+#define MAX_PENDING_RESPONSE_BYTES (4 << 20)
+#define SEND_TIMEOUT_SECONDS 10
+
+typedef std::chrono::steady_clock ServerClock;
+
+struct ScoringServer::Connection
+{
+  int fd;
+  uint64_t numRead;       // Sequence number of the next request, used by the reader only
+
+  // Workers finish the requests of a connection in any order and leave the responses here.
+  // The writer thread of the connection sends them in request order, so a client that is
+  // slow to read holds up its own writer only, never a worker.
+  std::mutex writeMutex;
+  std::condition_variable writeCondition;
+  uint64_t numWritten;
+  std::map<uint64_t, std::vector<char> > pendingFrames;
+  size_t pendingBytes;
+  bool isBroken;          // A write failed or the client fell behind; later responses are dropped
+  bool isReadDone;        // numRead is final
+
+  Connection(int fd_)
+    : fd(fd_), numRead(0), numWritten(0), pendingBytes(0), isBroken(false), isReadDone(false) {}
+
+  // Hands the response to the request with this sequence number to the writer, without
+  // waiting for it to be sent. Returns false if the client went away or fell behind.
+  bool respond(const uint64_t sequence, const FP_TYPE *const scores, const uint32_t numScores);
+
+  // Called by the reader once it will read no more requests
+  void finishReading();
+
+  // Drops the pending responses and shuts the socket down, which also ends the reader.
+  // Called with writeMutex held.
+  void breakConnection();
+
+  // Closed only once the reader and every queued request are done with it
+  ~Connection()
+  {
+#ifdef LINUX
+    close(fd);
+#endif
+  }
+};
+
+struct ScoringServer::Request
+{
+  std::shared_ptr<Connection> connection;
+  uint64_t sequence;
+  std::vector<uint32_t> indices;
+  std::vector<FP_TYPE> values;
+  ServerClock::time_point arrival;
+};
+
+#ifdef LINUX
+namespace
+{
+  bool readFully(int fd, void *const buffer, size_t numBytes)
+  {
+    char *dst = (char *)buffer;
+    while (numBytes > 0) {
+      ssize_t got = recv(fd, dst, numBytes, 0);
+      if (got < 0 && errno == EINTR) continue;
+      if (got <= 0) return false;
+      dst += got;
+      numBytes -= (size_t)got;
+    }
+    return true;
+  }
+
+  bool writeFully(int fd, const void *const buffer, size_t numBytes)
+  {
+    const char *src = (const char *)buffer;
+    while (numBytes > 0) {
+      ssize_t put = send(fd, src, numBytes, MSG_NOSIGNAL);
+      if (put < 0 && errno == EINTR) continue;
+      if (put <= 0) return false;
+      src += put;
+      numBytes -= (size_t)put;
+    }
+    return true;
+  }
+
+  std::vector<char> scoresFrame(const FP_TYPE *const scores, const uint32_t numScores)
+  {
+    std::vector<char> frame(sizeof(uint32_t) + sizeof(FP_TYPE) * numScores);
+    memcpy(frame.data(), &numScores, sizeof(uint32_t));
+    if (numScores > 0)
+      memcpy(frame.data() + sizeof(uint32_t), scores, sizeof(FP_TYPE) * numScores);
+    return frame;
+  }
+}
+#endif
+
+bool ScoringServer::Connection::respond(
+  const uint64_t sequence,
+  const FP_TYPE *const scores,
+  const uint32_t numScores)
+{
+#ifdef LINUX
+  std::lock_guard<std::mutex> lock(writeMutex);
+  if (isBroken)
+    return false;
+  std::vector<char>& frame = pendingFrames[sequence];
+  frame = scoresFrame(scores, numScores);
+  pendingBytes += frame.size();
+  if (pendingBytes > MAX_PENDING_RESPONSE_BYTES) {
+    LOG_WARNING("Dropping a scoring connection that does not read its responses");
+    breakConnection();
+    return false;
+  }
+  writeCondition.notify_one();
+  return true;
+#else
+  return false;
+#endif
+}
+
+void ScoringServer::Connection::finishReading()
+{
+  std::lock_guard<std::mutex> lock(writeMutex);
+  isReadDone = true;
+  writeCondition.notify_one();
+}
+
+void ScoringServer::Connection::breakConnection()
+{
+  isBroken = true;
+  pendingFrames.clear();
+  pendingBytes = 0;
+#ifdef LINUX
+  shutdown(fd, SHUT_RDWR);
+#endif
+  writeCondition.notify_one();
+}
+
+ScoringServerParams::ScoringServerParams()
+  : socketPath(""),
+  dimension(0),
+  numLabels(0),
+  maxBatchSize(64),
+  maxQueueDelayMicros(500),
+  numWorkers(1),
+  statsIntervalSeconds(10)
+{}
+
+ScoringServerStats::ScoringServerStats()
+  : numRequests(0), numRejected(0), numBatches(0),
+  queueDepth(0), maxQueueDepth(0),
+  latencyP50(0), latencyP90(0), latencyP99(0), latencyMax(0)
+{}
+
+std::string ScoringServerStats::toString() const
+{
+  std::stringstream ss;
+  ss << "requests: " << numRequests
+    << ", rejected: " << numRejected
+    << ", batches: " << numBatches
+    << ", mean batch size: " << (numBatches ? (double)numRequests / (double)numBatches : 0.0)
+    << ", queue depth: " << queueDepth << " (max " << maxQueueDepth << ")"
+    << ", latency us p50/p90/p99/max: "
+    << latencyP50 << "/" << latencyP90 << "/" << latencyP99 << "/" << latencyMax
+    << ", batch size histogram:";
+  for (size_t b = 0; b < batchSizeHistogram.size(); ++b) {
+    if (batchSizeHistogram[b] == 0) continue;
+    ss << " [" << (1ull << b) << "," << (1ull << (b + 1)) << "):" << batchSizeHistogram[b];
+  }
+  return ss.str();
+}
+
+ScoringServer::ScoringServer(
+  const ScoringServerParams& params_,
+  BatchScoringFunction scorer_)
+  : params(params_),
+  scorer(scorer_),
+  listenFd(-1),
+  stopRequested(false),
+  isDraining(false),
+  numReaders(0),
+  numWriters(0),
+  latencyWindowNext(0)
+{
+  assert(!params.socketPath.empty());
+  assert(params.dimension > 0);
+  assert(params.numLabels > 0);
+  assert(params.maxBatchSize > 0);
+  assert(params.numWorkers > 0);
+  assert(params.maxQueueDelayMicros >= 0);
+
+  latencyWindow.reserve(LATENCY_WINDOW_SIZE);
+}
+
+ScoringServer::~ScoringServer()
+{
+#ifdef LINUX
+  if (listenFd >= 0)
+    close(listenFd);
+#endif
+}
+
+void ScoringServer::stop()
+{
+  stopRequested.store(true);
+}
+
+void ScoringServer::openSocket()
+{
+#ifdef LINUX
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  assert(params.socketPath.size() < sizeof(address.sun_path));
+  strncpy(address.sun_path, params.socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+  listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  assert(listenFd >= 0);
+
+  // A stale socket file from a previous run would make bind fail
+  unlink(params.socketPath.c_str());
+  if (bind(listenFd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+    LOG_ERROR("Could not bind the scoring socket at: " + params.socketPath);
+    assert(false);
+  }
+  if (listen(listenFd, SOMAXCONN) != 0) {
+    LOG_ERROR("Could not listen on the scoring socket at: " + params.socketPath);
+    assert(false);
+  }
+#endif
+}
+
+void ScoringServer::enqueue(Request&& request)
+{
+  size_t depth;
+  {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    queue.push_back(std::move(request));
+    depth = queue.size();
+  }
+  // A full batch can be cut right away; otherwise one waiting worker is enough
+  if (depth >= params.maxBatchSize) queueCondition.notify_all();
+  else queueCondition.notify_one();
+
+  std::lock_guard<std::mutex> lock(statsMutex);
+  counters.maxQueueDepth = std::max(counters.maxQueueDepth, depth);
+}
+
+void ScoringServer::readRequests(std::shared_ptr<Connection> connection)
+{
+#ifdef LINUX
+  while (true) {
+    uint32_t numIndices;
+    if (!readFully(connection->fd, &numIndices, sizeof(numIndices)))
+      break;
+    // More indices than features cannot be a valid point, and the frame cannot be skipped
+    if (numIndices > params.dimension) {
+      LOG_WARNING("Dropping a scoring connection that sent a malformed request");
+      break;
+    }
+
+    Request request;
+    request.connection = connection;
+    request.indices.resize(numIndices);
+    request.values.resize(numIndices);
+    if (numIndices > 0) {
+      if (!readFully(connection->fd, request.indices.data(), sizeof(uint32_t) * numIndices))
+        break;
+      if (!readFully(connection->fd, request.values.data(), sizeof(FP_TYPE) * numIndices))
+        break;
+    }
+    // Numbered only once complete: the writer waits for a response to every number handed out
+    request.sequence = connection->numRead++;
+    request.arrival = ServerClock::now();
+
+    bool isValid = true;
+    for (uint32_t i = 0; isValid && i < numIndices; ++i)
+      isValid = (request.indices[i] < params.dimension);
+
+    if (!isValid) {
+      {
+        std::lock_guard<std::mutex> lock(statsMutex);
+        counters.numRejected++;
+      }
+      if (!connection->respond(request.sequence, NULL, 0))
+        break;
+      continue;
+    }
+
+    enqueue(std::move(request));
+  }
+#endif
+
+  connection->finishReading();
+
+  std::lock_guard<std::mutex> lock(connectionsMutex);
+  connections.erase(std::find(connections.begin(), connections.end(), connection));
+  numReaders--;
+  connectionThreadsDone.notify_all();
+}
+
+void ScoringServer::writeResponses(std::shared_ptr<Connection> connection)
+{
+#ifdef LINUX
+  Connection& c = *connection;
+  std::unique_lock<std::mutex> lock(c.writeMutex);
+  while (true) {
+    // Done once every request read has been answered
+    c.writeCondition.wait(lock, [&c] {
+      return c.isBroken || c.pendingFrames.count(c.numWritten) > 0 || (c.isReadDone && c.numWritten == c.numRead);
+    });
+    if (c.isBroken || c.pendingFrames.count(c.numWritten) == 0)
+      break;
+
+    std::vector<char> frame;
+    frame.swap(c.pendingFrames[c.numWritten]);
+    c.pendingFrames.erase(c.numWritten);
+    c.pendingBytes -= frame.size();
+
+    lock.unlock();
+    const bool isWritten = writeFully(c.fd, frame.data(), frame.size());
+    lock.lock();
+    if (!isWritten) {
+      c.breakConnection();
+      break;
+    }
+    c.numWritten++;
+  }
+  lock.unlock();
+#endif
+
+  std::lock_guard<std::mutex> connectionsLock(connectionsMutex);
+  numWriters--;
+  connectionThreadsDone.notify_all();
+}
+
+bool ScoringServer::nextBatch(std::vector<Request>& batch)
+{
+  batch.clear();
+  std::unique_lock<std::mutex> lock(queueMutex);
+
+  while (true) {
+    queueCondition.wait(lock, [this] { return isDraining || !queue.empty(); });
+    if (queue.empty())
+      return false; // draining, and nothing left to score
+
+    // Hold the batch open until it is full or its oldest request has waited long enough.
+    // The front of the queue may change under us if another worker cuts a batch.
+    while (!isDraining && !queue.empty() && queue.size() < params.maxBatchSize) {
+      ServerClock::time_point deadline
+        = queue.front().arrival + std::chrono::microseconds(params.maxQueueDelayMicros);
+      if (queueCondition.wait_until(lock, deadline) == std::cv_status::timeout)
+        break;
+    }
+    if (queue.empty())
+      continue;
+
+    dataCount_t batchSize = std::min((dataCount_t)queue.size(), params.maxBatchSize);
+    for (dataCount_t i = 0; i < batchSize; ++i) {
+      batch.push_back(std::move(queue.front()));
+      queue.pop_front();
+    }
+    return true;
+  }
+}
+
+void ScoringServer::scoreBatch(std::vector<Request>& batch)
+{
+  const dataCount_t batchSize = batch.size();
+
+  std::vector<Trip> triplets;
+  size_t nnz = 0;
+  for (dataCount_t j = 0; j < batchSize; ++j)
+    nnz += batch[j].indices.size();
+  triplets.reserve(nnz);
+  for (dataCount_t j = 0; j < batchSize; ++j)
+    for (size_t i = 0; i < batch[j].indices.size(); ++i)
+      triplets.push_back(Trip(batch[j].indices[i], j, batch[j].values[i]));
+
+  SparseMatrixuf X(params.dimension, batchSize);
+  X.setFromTriplets(triplets.begin(), triplets.end());
+  MatrixXuf Yscores = MatrixXuf::Zero(params.numLabels, batchSize);
+
+  scorer(Yscores, X);
+
+  std::vector<double> latencies(batchSize);
+  for (dataCount_t j = 0; j < batchSize; ++j) {
+    // A failed write means the client went away; its reader thread cleans up
+    batch[j].connection->respond(batch[j].sequence, Yscores.data() + j * params.numLabels,
+      (uint32_t)params.numLabels);
+    latencies[j] = std::chrono::duration<double, std::micro>(ServerClock::now() - batch[j].arrival).count();
+  }
+  recordBatch(latencies);
+}
+
+void ScoringServer::recordBatch(const std::vector<double>& latencies)
+{
+  std::lock_guard<std::mutex> lock(statsMutex);
+
+  counters.numBatches++;
+  counters.numRequests += latencies.size();
+
+  size_t bucket = 0;
+  while ((2ull << bucket) <= latencies.size()) bucket++;
+  if (counters.batchSizeHistogram.size() <= bucket)
+    counters.batchSizeHistogram.resize(bucket + 1, 0);
+  counters.batchSizeHistogram[bucket]++;
+
+  for (size_t i = 0; i < latencies.size(); ++i) {
+    if (latencyWindow.size() < LATENCY_WINDOW_SIZE)
+      latencyWindow.push_back(latencies[i]);
+    else
+      latencyWindow[latencyWindowNext] = latencies[i];
+    latencyWindowNext = (latencyWindowNext + 1) % LATENCY_WINDOW_SIZE;
+  }
+}
+
+void ScoringServer::workerLoop()
+{
+  std::vector<Request> batch;
+  while (nextBatch(batch))
+    scoreBatch(batch);
+}
+
+ScoringServerStats ScoringServer::stats()
+{
+  ScoringServerStats snapshot;
+  std::vector<double> window;
+  {
+    std::lock_guard<std::mutex> lock(statsMutex);
+    snapshot = counters;
+    window = latencyWindow;
+  }
+  {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    snapshot.queueDepth = queue.size();
+  }
+
+  if (!window.empty()) {
+    auto percentile = [&window](double p) {
+      size_t rank = std::min(window.size() - 1, (size_t)(p * (double)window.size()));
+      std::nth_element(window.begin(), window.begin() + rank, window.end());
+      return window[rank];
+    };
+    snapshot.latencyP50 = percentile(0.50);
+    snapshot.latencyP90 = percentile(0.90);
+    snapshot.latencyP99 = percentile(0.99);
+    snapshot.latencyMax = *std::max_element(window.begin(), window.end());
+  }
+  return snapshot;
+}
+
+void ScoringServer::serve()
+{
+#ifdef LINUX
+  openSocket();
+  LOG_INFO("Scoring server listening on " + params.socketPath
+    + " with " + std::to_string(params.numWorkers) + " workers, max batch size "
+    + std::to_string(params.maxBatchSize) + " and max queue delay "
+    + std::to_string(params.maxQueueDelayMicros) + "us");
+
+  std::vector<std::thread> workers;
+  for (int w = 0; w < params.numWorkers; ++w)
+    workers.push_back(std::thread(&ScoringServer::workerLoop, this));
+
+  ServerClock::time_point lastStats = ServerClock::now();
+  while (!stopRequested.load()) {
+    struct pollfd pfd;
+    pfd.fd = listenFd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    // Wake up periodically to notice stop requests and to log statistics
+    int ready = poll(&pfd, 1, 200);
+
+    if (ready > 0 && (pfd.revents & POLLIN)) {
+      int fd = accept(listenFd, NULL, NULL);
+      if (fd >= 0) {
+        // A send that makes no progress fails after the timeout instead of blocking the writer
+        struct timeval sendTimeout;
+        sendTimeout.tv_sec = SEND_TIMEOUT_SECONDS;
+        sendTimeout.tv_usec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+
+        std::shared_ptr<Connection> connection(new Connection(fd));
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        connections.push_back(connection);
+        numReaders++;
+        numWriters++;
+        std::thread(&ScoringServer::readRequests, this, connection).detach();
+        std::thread(&ScoringServer::writeResponses, this, connection).detach();
+      }
+    }
+
+    if (params.statsIntervalSeconds > 0
+      && ServerClock::now() - lastStats >= std::chrono::seconds(params.statsIntervalSeconds)) {
+      LOG_INFO("Scoring server stats: " + stats().toString());
+      lastStats = ServerClock::now();
+    }
+  }
+
+  // Stop accepting, stop reading, then let the workers drain what was already queued
+  close(listenFd);
+  listenFd = -1;
+  unlink(params.socketPath.c_str());
+
+  {
+    std::unique_lock<std::mutex> lock(connectionsMutex);
+    for (size_t i = 0; i < connections.size(); ++i)
+      shutdown(connections[i]->fd, SHUT_RD);
+    connectionThreadsDone.wait(lock, [this] { return numReaders == 0; });
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    isDraining = true;
+  }
+  queueCondition.notify_all();
+  for (size_t w = 0; w < workers.size(); ++w)
+    workers[w].join();
+
+  // Every request is answered now; wait for the responses to be sent
+  {
+    std::unique_lock<std::mutex> lock(connectionsMutex);
+    connectionThreadsDone.wait(lock, [this] { return numWriters == 0; });
+  }
+
+  LOG_INFO("Scoring server stopped. Final stats: " + stats().toString());
+#else
+  LOG_ERROR("The scoring server needs unix domain sockets and is only supported on Linux");
+  assert(false);
+#endif
+}
+
+ScoringClient::ScoringClient(const std::string& socketPath)
+  : fd(-1)
+{
+#ifdef LINUX
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  assert(socketPath.size() < sizeof(address.sun_path));
+  strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  assert(fd >= 0);
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+    LOG_ERROR("Could not connect to the scoring server at: " + socketPath);
+    assert(false);
+  }
+#else
+  LOG_ERROR("The scoring client needs unix domain sockets and is only supported on Linux");
+  assert(false);
+#endif
+}
+
+ScoringClient::~ScoringClient()
+{
+#ifdef LINUX
+  if (fd >= 0)
+    close(fd);
+#endif
+}
+
+bool ScoringClient::score(
+  const uint32_t *const indices,
+  const FP_TYPE *const values,
+  const uint32_t numIndices,
+  std::vector<FP_TYPE>& scores)
+{
+#ifdef LINUX
+  std::vector<char> frame(sizeof(uint32_t) + (sizeof(uint32_t) + sizeof(FP_TYPE)) * numIndices);
+  size_t offset = 0;
+  memcpy(frame.data() + offset, &numIndices, sizeof(uint32_t));
+  offset += sizeof(uint32_t);
+  memcpy(frame.data() + offset, indices, sizeof(uint32_t) * numIndices);
+  offset += sizeof(uint32_t) * numIndices;
+  memcpy(frame.data() + offset, values, sizeof(FP_TYPE) * numIndices);
+
+  if (!writeFully(fd, frame.data(), frame.size()))
+    return false;
+
+  uint32_t numScores;
+  if (!readFully(fd, &numScores, sizeof(numScores)))
+    return false;
+  scores.resize(numScores);
+  if (numScores > 0 && !readFully(fd, scores.data(), sizeof(FP_TYPE) * numScores))
+    return false;
+  return numScores > 0;
+#else
+  return false;
+#endif
+}
+
+void EdgeML::runScoringLoad(
+  const std::string& socketPath,
+  const SparseMatrixuf& X,
+  const int concurrency,
+  MatrixXuf& Yscores)
+{
+  assert(concurrency > 0);
+  assert(Yscores.cols() == X.cols());
+  assert(X.isCompressed());
+
+  std::vector<std::vector<double> > latencies(concurrency);
+  std::vector<dataCount_t> failures(concurrency, 0);
+
+  auto replay = [&](const int t) {
+    ScoringClient client(socketPath);
+    std::vector<uint32_t> indices;
+    std::vector<FP_TYPE> scores;
+    for (dataCount_t i = t; i < (dataCount_t)X.cols(); i += concurrency) {
+      const sparseIndex_t begin = X.outerIndexPtr()[i];
+      const sparseIndex_t end = X.outerIndexPtr()[i + 1];
+      indices.resize(end - begin);
+      for (sparseIndex_t j = begin; j < end; ++j)
+        indices[j - begin] = (uint32_t)X.innerIndexPtr()[j];
+
+      ServerClock::time_point sent = ServerClock::now();
+      if (!client.score(indices.data(), X.valuePtr() + begin, (uint32_t)(end - begin), scores)
+        || scores.size() != (size_t)Yscores.rows()) {
+        failures[t]++;
+        continue;
+      }
+      latencies[t].push_back(std::chrono::duration<double, std::micro>(ServerClock::now() - sent).count());
+      memcpy(Yscores.data() + i * Yscores.rows(), scores.data(), sizeof(FP_TYPE) * Yscores.rows());
+    }
+  };
+
+  ServerClock::time_point start = ServerClock::now();
+  std::vector<std::thread> clients;
+  for (int t = 0; t < concurrency; ++t)
+    clients.push_back(std::thread(replay, t));
+  for (int t = 0; t < concurrency; ++t)
+    clients[t].join();
+  double seconds = std::chrono::duration<double>(ServerClock::now() - start).count();
+
+  std::vector<double> all;
+  dataCount_t numFailures = 0;
+  for (int t = 0; t < concurrency; ++t) {
+    all.insert(all.end(), latencies[t].begin(), latencies[t].end());
+    numFailures += failures[t];
+  }
+  if (numFailures > 0)
+    LOG_WARNING(std::to_string(numFailures) + " scoring requests failed");
+  if (all.empty())
+    return;
+
+  std::sort(all.begin(), all.end());
+  auto percentile = [&all](double p) {
+    return all[std::min(all.size() - 1, (size_t)(p * (double)all.size()))];
+  };
+  LOG_INFO("Scored " + std::to_string(all.size()) + " points over " + std::to_string(concurrency)
+    + " connections in " + std::to_string(seconds) + "s ("
+    + std::to_string((double)all.size() / seconds) + " points/s)");
+  LOG_INFO("Client latency us p50/p90/p99/max: " + std::to_string(percentile(0.50)) + "/"
+    + std::to_string(percentile(0.90)) + "/" + std::to_string(percentile(0.99)) + "/"
+    + std::to_string(all.back()));
+}
@@ -0,0 +1,165 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#ifndef __SCORING_SERVER_H__
+#define __SCORING_SERVER_H__
+
+#include "pre_processor.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace EdgeML
+{
+  //
+  // Wire protocol spoken over the unix domain socket (host byte order):
+  //   request:  uint32_t numIndices, numIndices x uint32_t (0-based feature index),
+  //             numIndices x FP_TYPE (feature value)
+  //   response: uint32_t numScores, numScores x FP_TYPE
+  // A response with numScores == 0 means the request was rejected (bad feature index).
+  // A connection may pipeline any number of requests. Their micro-batches may be scored by
+  // different workers in any order, but the responses on a connection are written in the
+  // order its requests arrived, rejections included.
+  //
+
+  //
+  // Scores the columns of @X into the columns of @Yscores (numLabels x X.cols()).
+  // @X may be normalized in place. Called concurrently from all worker threads.
+  //
+  typedef std::function<void(MatrixXuf& Yscores, SparseMatrixuf& X)> BatchScoringFunction;
+
+  struct ScoringServerParams
+  {
+    std::string socketPath;
+    featureCount_t dimension;
+    labelCount_t numLabels;
+
+    dataCount_t maxBatchSize;     // Largest micro-batch handed to the scoring function
+    int64_t maxQueueDelayMicros;  // Longest the oldest queued request waits for its batch to fill
+    int numWorkers;               // Threads that form and score micro-batches
+    int statsIntervalSeconds;     // Period of the statistics log line, 0 to disable
+
+    ScoringServerParams();
+  };
+
+  struct ScoringServerStats
+  {
+    uint64_t numRequests;
+    uint64_t numRejected;
+    uint64_t numBatches;
+    size_t queueDepth;
+    size_t maxQueueDepth;
+
+    // batchSizeHistogram[b] counts batches with size in [2^b, 2^(b+1))
+    std::vector<uint64_t> batchSizeHistogram;
+
+    // Queueing plus scoring time of the most recent requests, in microseconds
+    double latencyP50, latencyP90, latencyP99, latencyMax;
+
+    ScoringServerStats();
+    std::string toString() const;
+  };
+
+  //
+  // Local scoring daemon with dynamic micro-batching.
+  // One reader thread per connection parses requests into a shared queue, and one writer
+  // thread per connection sends its responses, so a client that does not read its socket
+  // stalls only its own writer. Such a client is disconnected once its unsent responses
+  // pass a few MiB or a send to it makes no progress for a few seconds.
+  // Worker threads cut the queue into micro-batches of at most maxBatchSize points, waiting
+  // at most maxQueueDelayMicros after the oldest request arrived, and score each micro-batch
+  // with a single call to the batch scoring function (one GEMM path per batch instead of
+  // one GEMV path per point).
+  //
+  class ScoringServer
+  {
+    struct Connection;
+    struct Request;
+
+    ScoringServerParams params;
+    BatchScoringFunction scorer;
+
+    int listenFd;
+    std::atomic<bool> stopRequested;
+
+    std::mutex queueMutex;
+    std::condition_variable queueCondition;
+    std::deque<Request> queue;
+    bool isDraining;
+
+    std::mutex connectionsMutex;
+    std::condition_variable connectionThreadsDone;
+    std::vector<std::shared_ptr<Connection> > connections;
+    int numReaders;
+    int numWriters;
+
+    std::mutex statsMutex;
+    ScoringServerStats counters;
+    std::vector<double> latencyWindow;
+    size_t latencyWindowNext;
+
+    void openSocket();
+    void readRequests(std::shared_ptr<Connection> connection);
+    void writeResponses(std::shared_ptr<Connection> connection);
+    void enqueue(Request&& request);
+    bool nextBatch(std::vector<Request>& batch);
+    void scoreBatch(std::vector<Request>& batch);
+    void workerLoop();
+    void recordBatch(const std::vector<double>& latencies);
+
+  public:
+    ScoringServer(
+      const ScoringServerParams& params_,
+      BatchScoringFunction scorer_);
+    ~ScoringServer();
+
+    //
+    // Accepts connections and serves requests until stop() is called.
+    // Queued requests are scored and answered before serve() returns.
+    //
+    void serve();
+
+    //
+    // Only sets a flag, so it is safe to call from a signal handler.
+    //
+    void stop();
+
+    ScoringServerStats stats();
+  };
+
+  //
+  // Blocking client for ScoringServer, used by the drivers for load generation.
+  //
+  class ScoringClient
+  {
+    int fd;
+
+  public:
+    ScoringClient(const std::string& socketPath);
+    ~ScoringClient();
+
+    // Returns false if the server rejected the request or the connection broke.
+    bool score(
+      const uint32_t *const indices,
+      const FP_TYPE *const values,
+      const uint32_t numIndices,
+      std::vector<FP_TYPE>& scores);
+  };
+
+  //
+  // Replays the columns of @X against a running server over @concurrency connections,
+  // stores the returned scores in the columns of @Yscores (numLabels x X.cols()), and
+  // logs the throughput and end-to-end latency percentiles seen by the clients.
+  //
+  void runScoringLoad(
+    const std::string& socketPath,
+    const SparseMatrixuf& X,
+    const int concurrency,
+    MatrixXuf& Yscores);
+}
+
+#endif
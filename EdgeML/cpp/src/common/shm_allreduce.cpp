@@ -0,0 +1,226 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "shm_allreduce.h"
+#include <atomic>
+#include <cstring>
+#include <new>
+
+#ifdef LINUX
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace EdgeML;
+
+// Lives at the start of the segment. The atomics are lock-free, so they work across processes.
+struct SharedMemoryAllReduce::Control
+{
+  std::atomic<int> arrived;
+  std::atomic<int> generation;   // Number of completed barriers
+  std::atomic<int> failed;
+};
+
+SharedMemoryAllReduce::SharedMemoryAllReduce(
+  const int numWorkers_,
+  const size_t capacity_)
+  : numWorkers(numWorkers_),
+    myRank(0),
+    capacity(capacity_),
+    segmentBytes(0),
+    segment(NULL),
+    control(NULL),
+    result(NULL),
+    slots(NULL),
+    parentPid(0)
+{
+  assert(numWorkers >= 1);
+  assert(capacity > 0);
+#ifndef LINUX
+  if (numWorkers > 1) {
+    LOG_WARNING("Worker processes need Linux; running a single worker");
+    numWorkers = 1;
+  }
+#endif
+
+  // The control block takes a cache line of its own, and each slot starts on one
+  const size_t lineBytes = 64;
+  const size_t controlBytes = (sizeof(Control) + lineBytes - 1) / lineBytes * lineBytes;
+  capacity = (capacity * sizeof(FP_TYPE) + lineBytes - 1) / lineBytes * lineBytes / sizeof(FP_TYPE);
+  segmentBytes = controlBytes + (numWorkers + 1) * capacity * sizeof(FP_TYPE);
+
+#ifdef LINUX
+  segment = mmap(NULL, segmentBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (segment == MAP_FAILED) {
+    LOG_ERROR("Could not map " + std::to_string(segmentBytes >> 20) + " MiB of shared memory for the all-reduce");
+    exit(1);
+  }
+#else
+  segment = new char[segmentBytes];
+#endif
+
+  static_assert(ATOMIC_INT_LOCK_FREE == 2, "Barriers across processes need lock-free atomics");
+  control = new (segment) Control();
+  control->arrived.store(0);
+  control->generation.store(0);
+  control->failed.store(0);
+  result = (FP_TYPE*)((char*)segment + controlBytes);
+  slots = result + capacity;
+}
+
+SharedMemoryAllReduce::~SharedMemoryAllReduce()
+{
+  control->~Control();
+#ifdef LINUX
+  munmap(segment, segmentBytes);
+#else
+  delete[] (char*)segment;
+#endif
+}
+
+int SharedMemoryAllReduce::forkWorkers()
+{
+  myRank = 0;
+#ifdef LINUX
+  parentPid = (int)getpid();
+#ifdef CILK
+  // The runtime's workers are threads of this process only; the copies start their own
+  __cilkrts_end_cilk();
+#endif
+  // Or text buffered so far would be printed by every copy
+  fflush(stdout);
+  fflush(stderr);
+
+  for (int rank = 1; rank < numWorkers; ++rank) {
+    const pid_t pid = fork();
+    if (pid < 0) {
+      // The copies forked so far see that their parent is gone and exit
+      LOG_ERROR("Could not fork worker " + std::to_string(rank));
+      exit(1);
+    }
+    if (pid == 0) {
+      myRank = rank;
+      children.clear();
+      return myRank;
+    }
+    children.push_back((int)pid);
+  }
+#endif
+  return myRank;
+}
+
+bool SharedMemoryAllReduce::joinWorkers()
+{
+  assert(myRank == 0);
+  bool succeeded = true;
+#ifdef LINUX
+  for (size_t w = 0; w < children.size(); ++w) {
+    int status = 0;
+    if (waitpid((pid_t)children[w], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      LOG_WARNING("Worker " + std::to_string(w + 1) + " failed");
+      succeeded = false;
+    }
+  }
+#endif
+  children.clear();
+  return succeeded;
+}
+
+void SharedMemoryAllReduce::checkWorkers(const int generation) const
+{
+#ifdef LINUX
+  bool isOtherDead = false;
+  if (myRank == 0) {
+    // Only looks at the exit status, which joinWorkers collects later
+    for (size_t w = 0; w < children.size() && !isOtherDead; ++w) {
+      siginfo_t info;
+      info.si_pid = 0;
+      isOtherDead = waitid(P_PID, (id_t)children[w], &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid != 0;
+    }
+  }
+  else
+    isOtherDead = (int)getppid() != parentPid;
+
+  // A worker that passed the barrier may already have exited normally
+  if (isOtherDead && control->generation.load(std::memory_order_acquire) == generation)
+    control->failed.store(1, std::memory_order_release);
+  if (control->failed.load(std::memory_order_acquire) != 0) {
+    LOG_ERROR("Worker " + std::to_string(myRank) + ": another worker died, exiting");
+    _exit(1);
+  }
+#endif
+}
+
+void SharedMemoryAllReduce::barrier()
+{
+  if (numWorkers == 1)
+    return;
+
+  const int generation = control->generation.load(std::memory_order_acquire);
+  if (control->arrived.fetch_add(1, std::memory_order_acq_rel) == numWorkers - 1) {
+    control->arrived.store(0, std::memory_order_relaxed);
+    control->generation.fetch_add(1, std::memory_order_release);
+    return;
+  }
+
+  // Spins briefly, as barriers are frequent and short, then yields the CPU
+  for (size_t spins = 0; control->generation.load(std::memory_order_acquire) == generation; ++spins) {
+    if (spins < 4096)
+      continue;
+#ifdef LINUX
+    if (spins % 1024 == 0)
+      checkWorkers(generation);
+    sched_yield();
+#endif
+  }
+}
+
+void SharedMemoryAllReduce::sum(
+  FP_TYPE *const values,
+  const size_t count)
+{
+  if (numWorkers == 1)
+    return;
+
+  for (size_t offset = 0; offset < count; offset += capacity) {
+    const size_t piece = std::min(capacity, count - offset);
+    memcpy(slot(myRank), values + offset, piece * sizeof(FP_TYPE));
+    barrier();
+
+    // Reduce-scatter: this worker's chunk of the piece, summed in rank order
+    const size_t begin = piece * myRank / numWorkers;
+    const size_t end = piece * (myRank + 1) / numWorkers;
+    memcpy(result + begin, slot(0) + begin, (end - begin) * sizeof(FP_TYPE));
+    for (int rank = 1; rank < numWorkers; ++rank) {
+      const FP_TYPE *const other = slot(rank);
+      for (size_t j = begin; j < end; ++j)
+        result[j] += other[j];
+    }
+    barrier();
+
+    // All-gather. The next piece, sum or broadcast only writes result after a barrier that
+    // every worker reaches once it has copied this one.
+    memcpy(values + offset, result, piece * sizeof(FP_TYPE));
+  }
+}
+
+void SharedMemoryAllReduce::broadcast(
+  FP_TYPE *const values,
+  const size_t count)
+{
+  if (numWorkers == 1)
+    return;
+
+  for (size_t offset = 0; offset < count; offset += capacity) {
+    const size_t piece = std::min(capacity, count - offset);
+    // Others may still be copying result, from the previous piece or the all-gather of a sum
+    barrier();
+    if (myRank == 0)
+      memcpy(result, values + offset, piece * sizeof(FP_TYPE));
+    barrier();
+    if (myRank != 0)
+      memcpy(values + offset, result, piece * sizeof(FP_TYPE));
+  }
+}
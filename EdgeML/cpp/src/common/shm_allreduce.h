@@ -0,0 +1,78 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#ifndef __SHM_ALLREDUCE_H__
+#define __SHM_ALLREDUCE_H__
+
+#include "pre_processor.h"
+
+namespace EdgeML
+{
+  //
+  // Sum all-reduce among the worker processes of one machine, through a shared memory
+  // segment that is mapped before they are forked, so no network or MPI is involved.
+  //
+  // A sum runs the two phases of a ring all-reduce: in the reduce-scatter, worker r adds up
+  // the r-th chunk of the arrays of all workers, and in the all-gather every worker copies all
+  // the chunks back. As every worker can read the arrays of all others, a chunk is summed in
+  // one pass instead of travelling around the ring, so a sum costs two barriers whatever the
+  // number of workers, and each worker reads 1/n of the data of each. Chunks are summed in
+  // rank order: all workers get bitwise the same result, and so does every run.
+  //
+  // Forking needs Linux; elsewhere only a single worker is supported.
+  //
+  class SharedMemoryAllReduce
+  {
+    struct Control;
+
+    int numWorkers;
+    int myRank;
+    size_t capacity;      // Values per worker per step; longer arrays are summed in pieces
+    size_t segmentBytes;
+    void* segment;
+    Control* control;
+    FP_TYPE* result;
+    FP_TYPE* slots;       // numWorkers x capacity
+    int parentPid;
+    std::vector<int> children;  // Process ids, in rank 0
+
+    FP_TYPE* slot(const int rank) const { return slots + rank * capacity; }
+
+    // Exits if another worker died, so that the survivors do not wait for it forever
+    void checkWorkers(const int generation) const;
+
+  public:
+    SharedMemoryAllReduce(
+      const int numWorkers,
+      const size_t capacity = (size_t)1 << 18);
+
+    ~SharedMemoryAllReduce();
+
+    //
+    // Forks numWorkers - 1 copies of the calling process. Returns the rank of the caller:
+    // 0 in the calling process and 1 to numWorkers - 1 in the copies, which share all the
+    // memory of the caller copy-on-write.
+    // Call it before the first BLAS call. A copy only has the thread that forked it, and the
+    // OpenMP runtime of a threaded BLAS cannot rebuild its thread pool there: the first
+    // parallel call in the copy would wait for threads that do not exist.
+    //
+    int forkWorkers();
+
+    // In rank 0, waits for the other workers to exit. Returns false if one of them failed.
+    bool joinWorkers();
+
+    int rank() const { return myRank; }
+    int size() const { return numWorkers; }
+
+    // Replaces @values[0, count) in every worker with their sum over the workers
+    void sum(FP_TYPE *const values, const size_t count);
+
+    // Replaces @values[0, count) in every worker with those of rank 0
+    void broadcast(FP_TYPE *const values, const size_t count);
+
+    // Returns once all workers have called it
+    void barrier();
+  };
+}
+
+#endif
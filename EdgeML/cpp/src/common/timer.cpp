@@ -15,7 +15,7 @@ float thresh = -0.0001f;
 
 using namespace EdgeML;
 
-int Timer::level = 0;  // STATIC INITIALIZATION
+thread_local int Timer::level = 0;  // STATIC INITIALIZATION
 
 EdgeML::Timer::Timer(std::string fn_name)
 {
@@ -13,7 +13,7 @@ namespace EdgeML
 {
   class Timer
   {
-    static int level;
+    static thread_local int level; // Nesting depth of timers on the calling thread
     std::clock_t before, after;
     std::chrono::time_point<std::chrono::system_clock> beforeSysT, afterSysT;
     std::string fn;
@@ -0,0 +1,168 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "topk.h"
+#include <algorithm>
+
+using namespace EdgeML;
+
+// Rows of a score column examined per threshold test
+static const Eigen::Index chunkRows = 64;
+
+// std heap order with the worst entry on top
+static inline bool isBetter(const TopKSelector::Entry& a, const TopKSelector::Entry& b)
+{
+  return a.score > b.score || (a.score == b.score && a.label < b.label);
+}
+
+static inline void offer(
+  TopKSelector::Entry *const heap,
+  labelCount_t& size,
+  const labelCount_t k,
+  const TopKSelector::Entry& entry)
+{
+  if (size < k) {
+    heap[size++] = entry;
+    std::push_heap(heap, heap + size, isBetter);
+  }
+  else if (isBetter(entry, heap[0])) {
+    std::pop_heap(heap, heap + k, isBetter);
+    heap[k - 1] = entry;
+    std::push_heap(heap, heap + k, isBetter);
+  }
+}
+
+//
+// Dense label-indexed scratch that is all zero between points, so that a point pays only
+// for the labels it touches. One per thread, grown to the largest label count seen.
+//
+struct SparseAccumulator
+{
+  std::vector<FP_TYPE> scores;
+  std::vector<char> isTouched;
+  std::vector<labelCount_t> touched;
+
+  void reserve(const labelCount_t numLabels)
+  {
+    if (scores.size() < numLabels) {
+      scores.resize(numLabels, (FP_TYPE)0.0);
+      isTouched.resize(numLabels, 0);
+    }
+  }
+};
+
+static SparseAccumulator& localAccumulator()
+{
+  static thread_local SparseAccumulator accumulator;
+  return accumulator;
+}
+
+TopKSelector::TopKSelector(
+  const labelCount_t k_,
+  const dataCount_t numPoints_)
+  : k(k_),
+  numPoints(numPoints_),
+  heaps((size_t)k_ * numPoints_),
+  sizes(numPoints_, 0)
+{
+  assert(k > 0);
+}
+
+void TopKSelector::add(
+  const MatrixXuf& blockScores,
+  const labelCount_t firstLabel)
+{
+  assert((dataCount_t)blockScores.cols() == numPoints);
+  const Eigen::Index rows = blockScores.rows();
+
+  pfor(Eigen::Index i = 0; i < (Eigen::Index)numPoints; ++i) {
+    Entry *const heap = heaps.data() + (size_t)i * k;
+    labelCount_t& size = sizes[i];
+
+    for (Eigen::Index chunk = 0; chunk < rows; chunk += chunkRows) {
+      const Eigen::Index chunkEnd = std::min(chunk + chunkRows, rows);
+      if (size == k && blockScores.col(i).segment(chunk, chunkEnd - chunk).maxCoeff() < heap[0].score)
+        continue;
+
+      for (Eigen::Index j = chunk; j < chunkEnd; ++j) {
+        const Entry entry = { blockScores(j, i), firstLabel + (labelCount_t)j };
+        offer(heap, size, k, entry);
+      }
+    }
+  }
+}
+
+void TopKSelector::addProduct(
+  const SparseMatrixuf& Z,
+  const MatrixXuf& D)
+{
+  assert((dataCount_t)D.rows() == numPoints);
+  assert(Z.cols() == D.cols());
+  const labelCount_t numLabels = (labelCount_t)Z.rows();
+  const FP_TYPE *const values = Z.valuePtr();
+  const sparseIndex_t *const labels = Z.innerIndexPtr();
+  const sparseIndex_t *const offsets = Z.outerIndexPtr();
+  const sparseIndex_t *const ends = Z.innerNonZeroPtr();
+
+  pfor(Eigen::Index i = 0; i < (Eigen::Index)numPoints; ++i) {
+    Entry *const heap = heaps.data() + (size_t)i * k;
+    labelCount_t& size = sizes[i];
+    SparseAccumulator& acc = localAccumulator();
+    acc.reserve(numLabels);
+
+    for (Eigen::Index j = 0; j < Z.outerSize(); ++j) {
+      const FP_TYPE d = D(i, j);
+      if (d == (FP_TYPE)0.0)
+        continue;
+      const sparseIndex_t end = ends ? offsets[j] + ends[j] : offsets[j + 1];
+      for (sparseIndex_t p = offsets[j]; p < end; ++p) {
+        const labelCount_t label = (labelCount_t)labels[p];
+        if (!acc.isTouched[label]) {
+          acc.isTouched[label] = 1;
+          acc.touched.push_back(label);
+        }
+        acc.scores[label] += d * values[p];
+      }
+    }
+
+    for (size_t t = 0; t < acc.touched.size(); ++t) {
+      const Entry entry = { acc.scores[acc.touched[t]], acc.touched[t] };
+      offer(heap, size, k, entry);
+    }
+
+    // Every other label scores exactly 0; with ties going to the lower label, only the
+    // first k of them can ever make it into the heap
+    labelCount_t zeros = 0;
+    for (labelCount_t label = 0; label < numLabels && zeros < k
+      && !(size == k && heap[0].score > (FP_TYPE)0.0); ++label) {
+      if (acc.isTouched[label])
+        continue;
+      const Entry entry = { (FP_TYPE)0.0, label };
+      offer(heap, size, k, entry);
+      ++zeros;
+    }
+
+    for (size_t t = 0; t < acc.touched.size(); ++t) {
+      acc.scores[acc.touched[t]] = (FP_TYPE)0.0;
+      acc.isTouched[acc.touched[t]] = 0;
+    }
+    acc.touched.clear();
+  }
+}
+
+void TopKSelector::result(
+  MatrixXlabel& topKLabels,
+  MatrixXuf& topKScores) const
+{
+  topKLabels.setZero(k, numPoints);
+  topKScores.setConstant(k, numPoints, -FP_TYPE_MAX);
+
+  pfor(Eigen::Index i = 0; i < (Eigen::Index)numPoints; ++i) {
+    std::vector<Entry> sorted(heaps.begin() + (size_t)i * k, heaps.begin() + (size_t)i * k + sizes[i]);
+    std::sort(sorted.begin(), sorted.end(), isBetter);
+    for (size_t r = 0; r < sorted.size(); ++r) {
+      topKLabels(r, i) = sorted[r].label;
+      topKScores(r, i) = sorted[r].score;
+    }
+  }
+}
@@ -0,0 +1,64 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#ifndef __TOPK_H__
+#define __TOPK_H__
+
+#include "pre_processor.h"
+
+namespace EdgeML
+{
+  //
+  // Keeps the k best labels of each of n points while their scores arrive in blocks of labels,
+  // so that the full L x n score matrix never has to exist. Memory is O(k n).
+  //
+  // Each point has a k-entry heap whose worst entry is the threshold a new score must beat.
+  // Scores are scanned in chunks of 64 whose maximum is taken first, with Eigen's maxCoeff,
+  // and a chunk that cannot beat the threshold is skipped without offering its entries.
+  // The entries of the other chunks are offered one at a time.
+  // Ties are broken towards the lower label, as maxCoeff does.
+  //
+  class TopKSelector
+  {
+  public:
+    struct Entry
+    {
+      FP_TYPE score;
+      labelCount_t label;
+    };
+
+  private:
+    labelCount_t k;
+    dataCount_t numPoints;
+    std::vector<Entry> heaps;          // k entries per point
+    std::vector<labelCount_t> sizes;   // Entries of the heap of each point in use
+
+  public:
+    TopKSelector(const labelCount_t k, const dataCount_t numPoints);
+
+    //
+    // Offers the scores of labels [firstLabel, firstLabel + blockScores.rows()) of all points;
+    // column j of @blockScores belongs to point j. Blocks may come in any order.
+    //
+    void add(const MatrixXuf& blockScores, const labelCount_t firstLabel);
+
+    //
+    // Offers the scores Z * D' of all L labels, for an L x m sparse @Z and an n x m dense @D,
+    // without forming them: each point accumulates D(i, j) * Z(:, j) only into the labels that
+    // prototype j lists, in a per-thread sparse accumulator, and then offers just those labels
+    // plus as many zero-scored labels as the heap can still take. The cost of a point is
+    // O(nnz(Z) + touched labels * log k), independent of L. Use instead of add, not with it.
+    //
+    void addProduct(const SparseMatrixuf& Z, const MatrixXuf& D);
+
+    //
+    // k x n labels and scores, best first. Points that were offered fewer than k labels
+    // are padded with label 0 and score -FP_TYPE_MAX.
+    //
+    void result(MatrixXlabel& topKLabels, MatrixXuf& topKScores) const;
+
+    labelCount_t size() const { return k; }
+  };
+}
+
+#endif
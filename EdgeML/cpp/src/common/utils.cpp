@@ -2,6 +2,8 @@
 // Licensed under the MIT license.
 
 #include "utils.h"
+#include "output_writer.h"
+#include <limits>
 
 using namespace EdgeML;
 
@@ -45,8 +47,8 @@ size_t EdgeML::sparseMatrixMetaData::importFromBuffer(const char *const buffer)
 size_t EdgeML::sparseMatrixMetaData::importSparseMatrixStat()
 {
   return
-    sizeof(FP_TYPE)*nnzs + sizeof(sparseIndex_t)*nnzs
-    + sizeof(sparseIndex_t)*(nCols + 1);
+    sizeof(FP_TYPE)*nnzs + sizeof(storedSparseIndex_t)*nnzs
+    + sizeof(storedSparseIndex_t)*(nCols + 1);
 }
 
 
@@ -229,8 +231,8 @@ size_t EdgeML::sparseExportStat(const SparseMatrixuf& mat)
 {
   return sparseMatrixMetaData::structStat()
     + sizeof(FP_TYPE)*mat.nonZeros()
-    + sizeof(sparseIndex_t)*mat.nonZeros()
-    + sizeof(sparseIndex_t)*(mat.cols() + 1);
+    + sizeof(storedSparseIndex_t)*mat.nonZeros()
+    + sizeof(storedSparseIndex_t)*(mat.cols() + 1);
 }
 
 size_t EdgeML::sparseExportStat(const MatrixXuf& mat)
@@ -251,6 +253,43 @@ size_t EdgeML::denseExportStat(const SparseMatrixuf& mat)
     + sizeof(FP_TYPE)*mat.rows()*mat.cols();
 }
 
+// Sparse indices are widened to storedSparseIndex_t on export and narrowed back on import
+static size_t exportIndices(
+  char *const buffer,
+  const sparseIndex_t *const indices,
+  const size_t count)
+{
+  if (sizeof(sparseIndex_t) == sizeof(storedSparseIndex_t)) {
+    memcpy(buffer, indices, sizeof(storedSparseIndex_t) * count);
+  }
+  else {
+    for (size_t i = 0; i < count; ++i) {
+      const storedSparseIndex_t index = indices[i];
+      memcpy(buffer + sizeof(storedSparseIndex_t) * i, &index, sizeof(index));
+    }
+  }
+  return sizeof(storedSparseIndex_t) * count;
+}
+
+static size_t importIndices(
+  sparseIndex_t *const indices,
+  const char *const buffer,
+  const size_t count)
+{
+  if (sizeof(sparseIndex_t) == sizeof(storedSparseIndex_t)) {
+    memcpy(indices, buffer, sizeof(storedSparseIndex_t) * count);
+  }
+  else {
+    for (size_t i = 0; i < count; ++i) {
+      storedSparseIndex_t index;
+      memcpy(&index, buffer + sizeof(storedSparseIndex_t) * i, sizeof(index));
+      assert(index >= 0 && index <= std::numeric_limits<sparseIndex_t>::max());
+      indices[i] = (sparseIndex_t)index;
+    }
+  }
+  return sizeof(storedSparseIndex_t) * count;
+}
+
 size_t EdgeML::exportSparseMatrix(
   const SparseMatrixuf& mat,
   const size_t& bufferSize,
@@ -265,11 +304,8 @@ size_t EdgeML::exportSparseMatrix(
   memcpy(buffer + offset, mat.valuePtr(), sizeof(FP_TYPE) * mat.nonZeros());
   offset += sizeof(FP_TYPE) * mat.nonZeros();
 
-  memcpy(buffer + offset, mat.innerIndexPtr(), sizeof(sparseIndex_t) * mat.nonZeros());
-  offset += sizeof(sparseIndex_t) * mat.nonZeros();
-
-  memcpy(buffer + offset, mat.outerIndexPtr(), sizeof(sparseIndex_t) * (mat.cols() + 1));
-  offset += sizeof(sparseIndex_t) * (mat.cols() + 1);
+  offset += exportIndices(buffer + offset, mat.innerIndexPtr(), mat.nonZeros());
+  offset += exportIndices(buffer + offset, mat.outerIndexPtr(), mat.cols() + 1);
 
   assert(offset < (size_t)(1 << 31));
   assert(offset == bufferSize);
@@ -310,7 +346,7 @@ size_t EdgeML::exportDenseMatrix(
   char *const buffer)
 {
   MatrixXuf denseMat(mat);
-  return exportDenseMatrix(mat, bufferSize, buffer);
+  return exportDenseMatrix(denseMat, bufferSize, buffer);
 }
 
 
@@ -322,17 +358,15 @@ size_t EdgeML::importSparseMatrix(
   sparseMatrixMetaData metaData;
   offset += metaData.importFromBuffer(buffer);
 
+  // resize leaves a compressed, empty matrix whose outer index is overwritten below
   mat.resize(metaData.nRows, metaData.nCols);
-  mat.reserve(metaData.nnzs);
+  mat.resizeNonZeros(metaData.nnzs);
 
   memcpy(mat.valuePtr(), buffer + offset, sizeof(FP_TYPE) * metaData.nnzs);
   offset += sizeof(FP_TYPE) * metaData.nnzs;
 
-  memcpy(mat.innerIndexPtr(), buffer + offset, sizeof(sparseIndex_t) * metaData.nnzs);
-  offset += sizeof(sparseIndex_t) * metaData.nnzs;
-
-  memcpy(mat.outerIndexPtr(), buffer + offset, sizeof(sparseIndex_t) * (mat.cols() + 1));
-  offset += sizeof(sparseIndex_t) * (mat.cols() + 1);
+  offset += importIndices(mat.innerIndexPtr(), buffer + offset, metaData.nnzs);
+  offset += importIndices(mat.outerIndexPtr(), buffer + offset, mat.cols() + 1);
 
 
   assert(offset == sparseExportStat(mat));
@@ -358,14 +392,91 @@ size_t EdgeML::importDenseMatrix(
   return offset;
 }
 
+bool EdgeML::fitsInBuffer(
+  const size_t rows,
+  const size_t cols,
+  const size_t elementBytes,
+  const size_t bufferSize)
+{
+  // Divides instead of multiplying, so that corrupt shapes cannot overflow
+  if (rows == 0 || cols == 0) return true;
+  return cols <= bufferSize / elementBytes / rows;
+}
+
+size_t EdgeML::checkDenseMatrixBuffer(
+  const char *const buffer,
+  const size_t bufferSize,
+  const Eigen::Index nRows,
+  const Eigen::Index nCols)
+{
+  if (bufferSize < denseMatrixMetaData::structStat()) return 0;
+  denseMatrixMetaData metaData;
+  size_t offset = metaData.importFromBuffer(buffer);
+  if ((Eigen::Index)metaData.nRows != nRows || (Eigen::Index)metaData.nCols != nCols) return 0;
+
+  if (!fitsInBuffer(nRows, nCols, sizeof(FP_TYPE), bufferSize - offset)) return 0;
+  return offset + sizeof(FP_TYPE) * nRows * nCols;
+}
+
+size_t EdgeML::checkSparseMatrixBuffer(
+  const char *const buffer,
+  const size_t bufferSize,
+  const Eigen::Index nRows,
+  const Eigen::Index nCols)
+{
+  if (bufferSize < sparseMatrixMetaData::structStat()) return 0;
+  sparseMatrixMetaData metaData;
+  size_t offset = metaData.importFromBuffer(buffer);
+  if ((Eigen::Index)metaData.nRows != nRows || (Eigen::Index)metaData.nCols != nCols) return 0;
+  if (metaData.nnzs < 0 || metaData.nnzs > std::numeric_limits<sparseIndex_t>::max()) return 0;
+
+  const size_t nnzs = metaData.nnzs;
+  if (!fitsInBuffer(nnzs, 1, sizeof(FP_TYPE) + sizeof(storedSparseIndex_t), bufferSize - offset)) return 0;
+  const char *const innerIndices = buffer + offset + sizeof(FP_TYPE) * nnzs;
+  offset += (sizeof(FP_TYPE) + sizeof(storedSparseIndex_t)) * nnzs;
+
+  if (!fitsInBuffer(nCols + 1, 1, sizeof(storedSparseIndex_t), bufferSize - offset)) return 0;
+  const char *const outerIndices = buffer + offset;
+  offset += sizeof(storedSparseIndex_t) * (nCols + 1);
+
+  // Each column holds strictly increasing row indices, and the columns tile the nonzeros
+  storedSparseIndex_t columnStart, columnEnd;
+  memcpy(&columnStart, outerIndices, sizeof(columnStart));
+  if (columnStart != 0) return 0;
+  for (Eigen::Index col = 0; col < nCols; ++col) {
+    memcpy(&columnEnd, outerIndices + sizeof(storedSparseIndex_t) * (col + 1), sizeof(columnEnd));
+    if (columnEnd < columnStart || columnEnd > (storedSparseIndex_t)nnzs) return 0;
+    storedSparseIndex_t previousRow = -1;
+    for (storedSparseIndex_t i = columnStart; i < columnEnd; ++i) {
+      storedSparseIndex_t row;
+      memcpy(&row, innerIndices + sizeof(storedSparseIndex_t) * i, sizeof(row));
+      if (row <= previousRow || row >= nRows || row > std::numeric_limits<sparseIndex_t>::max()) return 0;
+      previousRow = row;
+    }
+    columnStart = columnEnd;
+  }
+  if (columnStart != (storedSparseIndex_t)nnzs) return 0;
+
+  return offset;
+}
+
 void EdgeML::writeMatrixInASCII(
   const MatrixXuf& mat,
   const std::string& outDir,
   const std::string& fileName)
 {
-  std::string filePath = outDir + "/" + fileName;
-  std::ofstream f(filePath, std::ofstream::out);
-  f << mat.format(eigen_tsv);
+  // Same text as mat.format(eigen_tsv): FullPrecision is digits10() significant digits
+  const int digits = Eigen::NumTraits<FP_TYPE>::digits10();
+  OutputWriter f(outDir + "/" + fileName);
+  for (Eigen::Index i = 0; i < mat.rows(); ++i) {
+    if (i > 0)
+      f.put('\n');
+    for (Eigen::Index j = 0; j < mat.cols(); ++j) {
+      if (j > 0)
+        f.put('\t');
+      f.putFloat(mat(i, j), digits);
+    }
+  }
   f.close();
 }
 
@@ -374,5 +485,24 @@ void EdgeML::writeSparseMatrixInASCII(
   const std::string& outDir,
   const std::string& fileName)
 {
-  writeMatrixInASCII(MatrixXuf(mat), outDir, fileName);
+  // Written row by row from a row-major copy, as writeMatrixInASCII would write MatrixXuf(mat)
+  const int digits = Eigen::NumTraits<FP_TYPE>::digits10();
+  const SparseMatrix<FP_TYPE, RowMajor, sparseIndex_t> rowMajor(mat);
+  OutputWriter f(outDir + "/" + fileName);
+  for (Eigen::Index i = 0; i < rowMajor.rows(); ++i) {
+    if (i > 0)
+      f.put('\n');
+    Eigen::Index j = 0;
+    for (SparseMatrix<FP_TYPE, RowMajor, sparseIndex_t>::InnerIterator it(rowMajor, i); it; ++it) {
+      for (; j < it.col(); ++j)
+        f.put(j > 0 ? "\t0" : "0");
+      if (j > 0)
+        f.put('\t');
+      f.putFloat(it.value(), digits);
+      ++j;
+    }
+    for (; j < rowMajor.cols(); ++j)
+      f.put(j > 0 ? "\t0" : "0");
+  }
+  f.close();
 }
@@ -8,6 +8,9 @@
 
 namespace EdgeML
 {
+  // Width of the sparse indices in exported buffers and model files, whatever sparseIndex_t is
+  typedef int64_t storedSparseIndex_t;
+
   struct sparseMatrixMetaData
   {
     featureCount_t nRows;
@@ -85,6 +88,19 @@ namespace EdgeML
   size_t importSparseMatrix(SparseMatrixuf& mat, const char *const buffer);
   size_t importDenseMatrix(MatrixXuf& mat, const size_t& bufferSize, const char *const buffer);
 
+  //
+  // Bounds checks for model buffers read from untrusted files, which never assert.
+  // fitsInBuffer tells whether @rows x @cols elements of @elementBytes each fit in @bufferSize
+  // bytes. checkDenseMatrixBuffer and checkSparseMatrixBuffer return the number of bytes
+  // importDenseMatrix and importSparseMatrix would read from @buffer, or 0 if these run past
+  // @bufferSize, the stored shape is not @nRows x @nCols or a stored index is out of range.
+  //
+  bool fitsInBuffer(const size_t rows, const size_t cols, const size_t elementBytes, const size_t bufferSize);
+  size_t checkDenseMatrixBuffer(const char *const buffer, const size_t bufferSize,
+    const Eigen::Index nRows, const Eigen::Index nCols);
+  size_t checkSparseMatrixBuffer(const char *const buffer, const size_t bufferSize,
+    const Eigen::Index nRows, const Eigen::Index nCols);
+
   void writeMatrixInASCII(const MatrixXuf& mat, const std::string& outDir, const std::string& fileName);
   void writeSparseMatrixInASCII(const SparseMatrixuf& mat, const std::string& outDir, const std::string& fileName);
 }
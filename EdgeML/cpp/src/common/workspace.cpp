@@ -0,0 +1,177 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#include "workspace.h"
+#include "hugepages.h"
+#include <atomic>
+#include <climits>
+
+#ifdef LINUX
+#include <malloc.h>
+#include <sys/resource.h>
+#endif
+
+using namespace EdgeML;
+
+static std::atomic<uint64_t> workspaceAllocations(0);
+
+static const size_t cacheLine = 64;
+
+//
+// A matrix of the pool. Requests are matched on the number of coefficients, whatever the
+// position of the stack they come from, since loops interleave many shapes (full and last
+// partial batches of training and validation, the phases of alternating minimization)
+// at the same positions.
+//
+struct Workspace::MatrixSlot
+{
+  MatrixXuf matrix;
+  uint64_t lastUse;
+  bool isFree;
+};
+
+// Free matrices not asked for in this many requests are released on the next pool miss
+static const uint64_t staleUses = 1 << 16;
+
+Workspace::Workspace()
+  : bufferTop(0), useCount(0)
+{}
+
+Workspace::~Workspace()
+{
+  for (size_t i = 0; i < matrixSlots.size(); ++i)
+    delete matrixSlots[i];
+  for (size_t i = 0; i < buffers.size(); ++i)
+    freePages(buffers[i].data, buffers[i].bytes);
+}
+
+Workspace& Workspace::local()
+{
+  static thread_local Workspace workspace;
+  return workspace;
+}
+
+Workspace::Scope::Scope()
+  : workspace(Workspace::local()),
+  matrixMark(workspace.matrixStack.size()),
+  bufferMark(workspace.bufferTop)
+{}
+
+Workspace::Scope::~Scope()
+{
+  assert(workspace.matrixStack.size() >= matrixMark && workspace.bufferTop >= bufferMark
+    && "Workspace scopes must be destroyed in reverse order of creation");
+  for (size_t i = matrixMark; i < workspace.matrixStack.size(); ++i)
+    workspace.matrixStack[i]->isFree = true;
+  workspace.matrixStack.resize(matrixMark);
+  workspace.bufferTop = bufferMark;
+}
+
+MatrixXuf& Workspace::Scope::matrix(const Eigen::Index rows, const Eigen::Index cols)
+{
+  return workspace.takeMatrix(rows, cols);
+}
+
+MatrixXuf& Workspace::takeMatrix(const Eigen::Index rows, const Eigen::Index cols)
+{
+  ++useCount;
+  MatrixSlot *pick = NULL;
+  for (size_t s = 0; s < matrixSlots.size() && pick == NULL; ++s)
+    if (matrixSlots[s]->isFree && matrixSlots[s]->matrix.size() == rows * cols)
+      pick = matrixSlots[s];
+
+  if (pick == NULL) {
+    size_t kept = 0;
+    for (size_t s = 0; s < matrixSlots.size(); ++s) {
+      if (matrixSlots[s]->isFree && matrixSlots[s]->lastUse + staleUses < useCount)
+        delete matrixSlots[s];
+      else
+        matrixSlots[kept++] = matrixSlots[s];
+    }
+    matrixSlots.resize(kept);
+
+    pick = new MatrixSlot;
+    matrixSlots.push_back(pick);
+    if (rows * cols != 0)
+      ++workspaceAllocations;
+  }
+
+  // resize only reallocates when the number of coefficients changes
+  pick->matrix.resize(rows, cols);
+  pick->lastUse = useCount;
+  pick->isFree = false;
+  matrixStack.push_back(pick);
+  return pick->matrix;
+}
+
+FP_TYPE* Workspace::Scope::buffer(const size_t count)
+{
+  const size_t bytes = std::max(count * sizeof(FP_TYPE), cacheLine);
+  if (workspace.bufferTop == workspace.buffers.size()) {
+    Buffer empty = { NULL, 0 };
+    workspace.buffers.push_back(empty);
+  }
+
+  Buffer& buf = workspace.buffers[workspace.bufferTop++];
+  if (buf.bytes >= bytes)
+    return (FP_TYPE*)buf.data;
+
+  if (buf.data != NULL)
+    freePages(buf.data, buf.bytes);
+  ++workspaceAllocations;
+
+  buf.bytes = (bytes + cacheLine - 1) & ~(cacheLine - 1);
+  buf.data = allocatePages(buf.bytes);
+  return (FP_TYPE*)buf.data;
+}
+
+const MatrixXuf& EdgeML::denseView(Workspace::Scope& scope, const SparseMatrixuf& A)
+{
+  MatrixXuf& dense = scope.matrix(A.rows(), A.cols());
+  dense = A;
+  return dense;
+}
+
+void EdgeML::retainFreedMemory()
+{
+#ifdef LINUX
+  // Largest threshold malloc accepts; bigger blocks are still mapped one by one
+  mallopt(M_MMAP_THRESHOLD, 4 * 1024 * 1024 * sizeof(long));
+  mallopt(M_TRIM_THRESHOLD, INT_MAX);
+  // Grow the heap in large steps so that the first iterations do not fault page by page
+  mallopt(M_TOP_PAD, 64 << 20);
+#endif
+}
+
+AllocationStats EdgeML::readAllocationStats()
+{
+  AllocationStats stats = { workspaceAllocations.load(), 0, 0, 0, 0 };
+#ifdef LINUX
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  struct mallinfo2 info = mallinfo2();
+#else
+  struct mallinfo info = mallinfo();
+#endif
+  stats.heapBytes = (size_t)info.arena;
+  stats.mappedBytes = (size_t)info.hblkhd;
+
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    stats.minorFaults = usage.ru_minflt;
+    stats.majorFaults = usage.ru_majflt;
+  }
+#endif
+  return stats;
+}
+
+std::string EdgeML::allocationStatsDelta(
+  const AllocationStats& before,
+  const AllocationStats& after)
+{
+  const double MiB = 1024.0 * 1024.0;
+  return std::to_string(after.workspaceAllocations - before.workspaceAllocations) + " workspace allocations, heap "
+    + std::to_string(((double)after.heapBytes - (double)before.heapBytes) / MiB) + " MiB, mapped "
+    + std::to_string(((double)after.mappedBytes - (double)before.mappedBytes) / MiB) + " MiB, page faults "
+    + std::to_string(after.minorFaults - before.minorFaults) + " minor / "
+    + std::to_string(after.majorFaults - before.majorFaults) + " major";
+}
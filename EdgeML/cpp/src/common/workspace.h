@@ -0,0 +1,99 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+#ifndef __WORKSPACE_H__
+#define __WORKSPACE_H__
+
+#include "pre_processor.h"
+
+//
+// Scratch memory for the temporaries of training and scoring hot loops.
+//
+// Every thread has its own workspace, which is a stack of matrices and raw buffers.
+// A Workspace::Scope marks the stack when it is created and pops everything handed out
+// through it when it is destroyed. Popped matrices go back to a pool that hands them out
+// again to any request for the same number of coefficients, and popped buffers are kept
+// for the next scope that asks for at most as much in the same order. So a loop that
+// opens one scope per iteration stops allocating once it has seen all of its shapes.
+//
+namespace EdgeML
+{
+  class Workspace
+  {
+  public:
+    //
+    // Use as a local variable; scopes on a thread must be destroyed in reverse order of
+    // creation. Nothing handed out by a scope may be used after the scope is destroyed.
+    //
+    class Scope
+    {
+      Workspace& workspace;
+      const size_t matrixMark, bufferMark;
+
+      Scope(const Scope&);
+      Scope& operator=(const Scope&);
+
+    public:
+      Scope();
+      ~Scope();
+
+      // A rows x cols matrix with undefined contents
+      MatrixXuf& matrix(const Eigen::Index rows, const Eigen::Index cols);
+
+      // Undefined contents, aligned to a cache line; large buffers follow the huge page policy
+      FP_TYPE* buffer(const size_t count);
+    };
+
+  private:
+    struct MatrixSlot;
+
+    struct Buffer
+    {
+      void *data;
+      size_t bytes;
+    };
+
+    std::vector<MatrixSlot*> matrixSlots;  // Pool of all matrices, handed out or not
+    std::vector<MatrixSlot*> matrixStack;  // Matrices handed out, in order
+    std::vector<Buffer> buffers;
+    size_t bufferTop;
+    uint64_t useCount;
+
+    MatrixXuf& takeMatrix(const Eigen::Index rows, const Eigen::Index cols);
+
+    Workspace();
+    ~Workspace();
+
+    static Workspace& local();
+  };
+
+  // @A itself, or a dense copy of @A in a matrix of @scope
+  inline const MatrixXuf& denseView(Workspace::Scope&, const MatrixXuf& A) { return A; }
+  const MatrixXuf& denseView(Workspace::Scope& scope, const SparseMatrixuf& A);
+
+  //
+  // Keeps the memory that the process frees in malloc's heap instead of returning it to
+  // the system (no munmap of large blocks, no heap trimming), so temporaries that are
+  // still allocated per iteration are served without system calls or page faults.
+  // Process wide; call once before training.
+  //
+  void retainFreedMemory();
+
+  //
+  // Counters to check that a loop has reached a steady state
+  //
+  struct AllocationStats
+  {
+    uint64_t workspaceAllocations;  // Slots and buffers (re)allocated by workspaces, all threads
+    size_t heapBytes;               // Bytes malloc obtained with brk, in all its arenas
+    size_t mappedBytes;             // Bytes in blocks that malloc mapped one by one
+    long minorFaults, majorFaults;  // Page faults of the process
+  };
+
+  AllocationStats readAllocationStats();
+  std::string allocationStatsDelta(
+    const AllocationStats& before,
+    const AllocationStats& after);
+}
+
+#endif
@@ -53,7 +53,7 @@ class Arduino(CodegenBase):
 
         self.printArduinoHeader()
 
-        self.computeScratchLocationsFirstFitPriority() # computeScratchLocations computeScratchLocationsFirstFit computeScratchLocationsFirstFitPriority computeScratchLocationsDLX
+        self.computeScratchLocationsFirstFitPriority() # computeScratchLocations computeScratchLocationsFirstFit computeScratchLocationsFirstFitPriority computeScratchLocationsDLX computeScratchLocationsLayoutSearch
 
         self.printVarDecls()
 
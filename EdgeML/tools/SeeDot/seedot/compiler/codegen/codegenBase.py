@@ -514,12 +514,13 @@ class CodegenBase:
             self.out.printf('%s %s%s;\n', typ_str, idf_str,
                             shape_str, indent=True)
 
-    # The following 4 functions:
+    # The following 5 functions:
     #
     # a) computeScratchLocations
     # b) computeScratchLocationsFirstFit
     # c) computeScratchLocationsFirstFitPriority
     # d) computeScratchLocationsDLX
+    # e) computeScratchLocationsLayoutSearch
     #
     # are used to compute exact memory locations of a variable.
     #
@@ -529,11 +530,14 @@ class CodegenBase:
     # may take a long time to complete, due to which it has timeouts built into it.
     # Function d) uses a technique called dancing links or DLX.
     #
+    # Function e) searches for the same minimum within Config.layoutSearchTimeout seconds. It starts from heuristic allocations,
+    # and if the deadline stops the search, it uses the smallest allocation found so far instead of failing.
+    #
     # It is only recommended to use function d) without timeouts when no other tuning is required for the code (only use for codegen 
     # of the target arduino or m3 device, not during codegen of x86 code which is mostly used by the compiler during exploration).
     #
     # Function preProcessRawMemData is a helper method used to preprocess information about variable sizes and live ranges, and the
-    # output of this method is consequently used by each of the functions a) through d).
+    # output of this method is consequently used by each of the functions a) through e).
 
     # This method uses block based allocation and is used for memory allocation for the results presented in OOPSLA'20 paper.
     # Works well for FastGRNN benchmarks, but does not work very well on larger models (can use memory around twice the optimum).
@@ -848,14 +852,7 @@ class CodegenBase:
             dlxInputDumpDirectory = os.path.join(dlxDumpFilesDirectory, 'dlx.input')
             dlxOutputDumpDirectory = os.path.join(dlxDumpFilesDirectory, 'dlx.output')
             dlxErrorDumpDirectory = os.path.join(dlxDumpFilesDirectory, 'dlx.error')
-            def getBestAlignment(mA, align, maxMem, memUsage, f):
-                while True:
-                    align *= 2
-                    if f(DLXInputGen.generateDLXInput(mA, align, maxMem, True, None), memUsage):
-                        continue
-                    else:
-                        return align // 2
-            alignment = getBestAlignment(memAlloc, alignment, 0, bestCaseMemUsage, operator.eq)
+            alignment = DLXInputGen.getBestAlignment(memAlloc, alignment, 0, bestCaseMemUsage, operator.eq)
             optimalInputGenSuccess = True
             p = mp.Process(target=DLXInputGen.generateDLXInput, args=(memAlloc, alignment, 0, False, dlxInputDumpDirectory))
             p.start()
@@ -865,7 +862,7 @@ class CodegenBase:
                 p.join()
                 optimalInputGenSuccess = False
                 Util.getLogger().error("Timeout while generating DLX input files for optimal memory usage, attempting to fit variables within %d bytes. Returning to exploration..." % maxAllowedMemUsage)
-                alignment = getBestAlignment(memAlloc, alignment, 0, maxAllowedMemUsage, operator.le)
+                alignment = DLXInputGen.getBestAlignment(memAlloc, alignment, 0, maxAllowedMemUsage, operator.le)
                 p = mp.Process(target=DLXInputGen.generateDLXInput, args=(memAlloc, alignment, maxAllowedMemUsage, False, dlxInputDumpDirectory))
                 p.start()
                 p.join(timeout)
@@ -886,7 +883,7 @@ class CodegenBase:
                 if not optimalInputGenSuccess:
                     assert False, "DLX unable to allocate variables within %d bytes. ABORT" % maxAllowedMemUsage
                 else:
-                    alignment = getBestAlignment(memAlloc, alignment, 0, maxAllowedMemUsage, operator.le)
+                    alignment = DLXInputGen.getBestAlignment(memAlloc, alignment, 0, maxAllowedMemUsage, operator.le)
                     p = mp.Process(target=DLXInputGen.generateDLXInput, args=(memAlloc, alignment, maxAllowedMemUsage, False, dlxInputDumpDirectory))
                     p.start()
                     p.join(timeout)
@@ -907,6 +904,50 @@ class CodegenBase:
             self.out.printf("/* %s */"%(str(self.scratchSubs)))
             return totalScratchSize
 
+    # This method uses the layout search (dlx/src/layout.h), a branch and bound over the offsets of the variables, to compute
+    # a memory assignment of minimum size. Unlike DLX it needs no budget to be guessed: each allocation it finds is smaller than
+    # the previous one, and the smallest found within Config.layoutSearchTimeout seconds is used.
+    def computeScratchLocationsLayoutSearch(self):
+        assert not Config.faceDetectionHacks, "Please turn off Config.faceDetectionHacks flag to use the layout search"
+        if not Config.x86MemoryOptimize or forFloat():
+            return
+        else:
+            varToLiveRange, decls = self.preProcessRawMemData()
+            def sortkey(a):
+                return (a[2]*a[3], (a[0][1]-a[0][0])*a[2]*a[3])
+            varToLiveRange.sort(key=sortkey, reverse=True)
+            memAlloc = [(l * m // 8, i, j) for ([i, j], k, l, m) in varToLiveRange if k not in self.notScratch]
+            varOrderAndSize = [(k, l * m // 8) for ([i, j], k, l, m) in varToLiveRange if k not in self.notScratch]
+            maxAllowedMemUsage = Config.memoryLimit
+            timeout = Config.layoutSearchTimeout
+            bestCaseMemUsage = DLXInputGen.generateDLXInput(memAlloc, 1, 0, True)
+            if maxAllowedMemUsage < bestCaseMemUsage:
+                assert False, "Cannot fit the code within stipulated memory limit of %d" % maxAllowedMemUsage
+            # Coarser units make the search smaller, as long as the minimum stays the same
+            alignment = DLXInputGen.getBestAlignment(memAlloc, 1, 0, bestCaseMemUsage, operator.eq)
+            layoutDumpFilesDirectory = os.path.join('seedot', 'compiler', 'codegen', 'dlx')
+            layoutInputDumpDirectory = os.path.join(layoutDumpFilesDirectory, 'layout.input')
+            layoutOutputDumpDirectory = os.path.join(layoutDumpFilesDirectory, 'layout.output')
+            layoutErrorDumpDirectory = os.path.join(layoutDumpFilesDirectory, 'layout.error')
+            DLXInputGen.generateLayoutInput(memAlloc, alignment, maxAllowedMemUsage, layoutInputDumpDirectory)
+            if Util.windows():
+                exeFile = os.path.join(layoutDumpFilesDirectory, "bin", "layout.exe")
+            else:
+                exeFile = os.path.join("./%s" % layoutDumpFilesDirectory, "bin", "layout")
+            with open(layoutInputDumpDirectory) as fin, open(layoutOutputDumpDirectory, 'w') as fout, open(layoutErrorDumpDirectory, 'w') as ferr:
+                try:
+                    # The program stops itself at the deadline; the extra time covers a slow start
+                    process = subprocess.call([exeFile, str(timeout)], stdin=fin, stdout=fout, stderr=ferr, timeout=timeout + 60)
+                except subprocess.TimeoutExpired:
+                    Util.getLogger().error("Layout search for memory management did not stop at its deadline.")
+            if not self.checkLayoutSearchSuccess(layoutErrorDumpDirectory):
+                assert False, "Layout search unable to allocate variables within %d bytes. ABORT" % maxAllowedMemUsage
+            totalScratchSize = self.readDlxAllocation(layoutOutputDumpDirectory, alignment, varOrderAndSize)
+            if not forM3():
+                self.out.printf("char scratch[%d];\n"%(totalScratchSize), indent=True)
+            self.out.printf("/* %s */"%(str(self.scratchSubs)))
+            return totalScratchSize
+
     def preProcessRawMemData(self):
         varToLiveRange = []
         todelete = []
@@ -966,7 +1007,21 @@ class CodegenBase:
             pass
         return found
 
-    # Helper method used by computeScratchLocationsDLX to read the memory allocation generated by the DLX executable.
+    # Helper method used by computeScratchLocationsLayoutSearch to log the progress of the layout search, which reports each
+    # smaller scratch size it finds, and to check whether it succeeded.
+    def checkLayoutSearchSuccess(self, errorFile):
+        found = False
+        try:
+            with open(errorFile) as ferr:
+                for line in ferr.readlines():
+                    Util.getLogger().info("Layout search: %s" % line.strip())
+                    if line[:5] == "Found":
+                        found = True
+        except:
+            pass
+        return found
+
+    # Helper method used by computeScratchLocationsDLX and computeScratchLocationsLayoutSearch to read the memory allocation generated by the DLX and layout search executables.
     def readDlxAllocation(self, outputfile, alignment, varOrderAndSize):
         patternRegex = re.compile(r'v(\d*).l(\d*)')
         memUsage = 0
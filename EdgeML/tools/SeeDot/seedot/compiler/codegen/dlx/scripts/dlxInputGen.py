@@ -5,6 +5,17 @@ import sys
 import math
 
 
+# Returns the largest power of two alignment, starting from align, for which the memory
+# required in the DLX instance still satisfies f(memory, memUsage).
+def getBestAlignment(mA, align, maxMem, memUsage, f):
+    while True:
+        align *= 2
+        if f(generateDLXInput(mA, align, maxMem, True, None), memUsage):
+            continue
+        else:
+            return align // 2
+
+
 def generateDLXInput(mem_alloc, alignment, max_memory, print_only, dumpFile=None):
     # Read all the memory variables
     mem_vars = []
@@ -77,3 +88,17 @@ def generateDLXInput(mem_alloc, alignment, max_memory, print_only, dumpFile=None
 
     outFile.close()
     return None
+
+
+# Input of the layout search (dlx/src/layoutMain.cpp): the number of variables, the memory
+# budget and a line "size start end" per variable, with sizes in units of alignment.
+def generateLayoutInput(mem_alloc, alignment, max_memory, dumpFile):
+    outFile = open(dumpFile, "w")
+
+    outFile.write("%d\n" % len(mem_alloc))
+    outFile.write("%d\n" % math.floor(float(max_memory) / alignment))
+
+    for (size, start, end) in mem_alloc:
+        outFile.write("%d %d %d\n" % (math.ceil(float(size) / alignment), start, end))
+
+    outFile.close()
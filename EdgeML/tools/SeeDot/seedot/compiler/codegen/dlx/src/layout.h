@@ -0,0 +1,417 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+/**
+   Anytime search for a scratch memory layout of minimum size
+
+   Each variable takes the addresses [offset, offset + size) while it is live, during the
+   instructions [start, end]; variables live at the same time must not overlap. This is the
+   problem the DLX instance of dlxInputGen.py encodes as an exact cover for a fixed budget,
+   solved here as an optimization:
+
+   1. Greedy layouts, which place the variables in a few orders each at its lowest free
+      offset, give a first scratch size within milliseconds.
+   2. A branch and bound then looks for layouts smaller than the best so far. Like DLX it
+      places next the variable with the fewest offsets left (ties go to the largest one) and
+      prunes as soon as a variable has none, but the offsets left are bitsets updated only
+      for the variables live at the same time. Offsets are tried lowest first, and the first
+      variable only takes offsets in the lower half of the budget, as mirroring a layout
+      keeps it valid.
+   3. The tree is split into subtrees that threads take in order, all bounded by the best
+      size found by any of them.
+
+   Every improvement is reported with the time it took. The search stops at the deadline,
+   when the size reaches the peak of the live sizes (no layout can be smaller), or when the
+   tree is exhausted, which proves the best layout optimal.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+using namespace std;
+
+
+class LayoutSearch {
+public:
+  struct Variable {
+    int size;
+    int start;
+    int end;
+  };
+
+private:
+  typedef chrono::steady_clock Clock;
+  typedef vector <pair <int, int> > Placements;  // (variable, offset)
+
+  vector <Variable> vars;
+  vector <vector <int> > conflicts;  // For each variable, the others live at the same time
+  vector <long long> areas;          // size * live instructions, to break ties
+  int numSized;                      // Variables with a nonzero size
+  int lowerBound;
+
+  mutex bestMutex;
+  vector <int> bestOffsets;
+  atomic <int> bestSize;
+  atomic <bool> isStopping;
+  atomic <long long> numNodes;
+  Clock::time_point startTime, deadline;
+
+  static int popCount(uint64_t word) {
+#if defined(_MSC_VER)
+    return (int)__popcnt64(word);
+#else
+    return __builtin_popcountll(word);
+#endif
+  }
+
+  static int lowestBit(uint64_t word) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return (int)index;
+#else
+    return __builtin_ctzll(word);
+#endif
+  }
+
+  /** State of one search thread: offsets placed so far and the free offsets of the others */
+  struct Worker {
+    const LayoutSearch& search;
+    int numWords;
+    vector <int> offsets;              // -1 until placed
+    vector <vector <uint64_t> > free;  // Bit o set if offset o does not overlap a placed variable
+    vector <pair <int, int> > saved;   // (variable, first word) of the words saved on the trail
+    vector <uint64_t> savedWords;
+    vector <size_t> frames;            // Trail size before each placement
+    long long sinceClockCheck;
+
+    Worker(const LayoutSearch& _search, int numOffsets) : search(_search) {
+      numWords = (numOffsets + 63) / 64;
+      offsets.assign(search.vars.size(), -1);
+      free.assign(search.vars.size(), vector <uint64_t>(numWords, ~(uint64_t)0));
+      for (size_t v = 0; v < search.vars.size(); v++) {
+        if (search.vars[v].size == 0) {
+          offsets[v] = 0;
+        }
+      }
+      sinceClockCheck = 0;
+    }
+
+    /** Number of free offsets of v at most maxOffset */
+    int countFree(int v, int maxOffset) const {
+      if (maxOffset < 0) return 0;
+      int lastWord = min(maxOffset / 64, numWords - 1);
+      int count = 0;
+      for (int w = 0; w < lastWord; w++) {
+        count += popCount(free[v][w]);
+      }
+      uint64_t last = free[v][lastWord];
+      int lastBit = maxOffset - lastWord * 64;
+      if (lastBit < 63) last &= ((uint64_t)1 << (lastBit + 1)) - 1;
+      return count + popCount(last);
+    }
+
+    /** Lowest free offset of v at least from, or -1 */
+    int nextFree(int v, int from) const {
+      for (int w = from / 64; w < numWords; w++) {
+        uint64_t word = free[v][w];
+        if (w == from / 64) word &= ~(uint64_t)0 << (from % 64);
+        if (word != 0) return w * 64 + lowestBit(word);
+      }
+      return -1;
+    }
+
+    /** Mark offsets [first, last] of v as taken, saving the words changed */
+    void take(int v, int first, int last) {
+      first = max(first, 0);
+      last = min(last, numWords * 64 - 1);
+      if (first > last) return;
+      for (int w = first / 64; w <= last / 64; w++) {
+        saved.push_back(make_pair(v, w));
+        savedWords.push_back(free[v][w]);
+        uint64_t mask = ~(uint64_t)0;
+        if (w == first / 64) mask &= ~(uint64_t)0 << (first % 64);
+        if (w == last / 64 && last % 64 < 63) mask &= ((uint64_t)1 << (last % 64 + 1)) - 1;
+        free[v][w] &= ~mask;
+      }
+    }
+
+    void place(int v, int offset) {
+      frames.push_back(saved.size());
+      offsets[v] = offset;
+      const vector <int>& others = search.conflicts[v];
+      for (size_t k = 0; k < others.size(); k++) {
+        int u = others[k];
+        if (offsets[u] < 0) {
+          take(u, offset - search.vars[u].size + 1, offset + search.vars[v].size - 1);
+        }
+      }
+    }
+
+    void unplace(int v) {
+      size_t frame = frames.back();
+      frames.pop_back();
+      while (saved.size() > frame) {
+        free[saved.back().first][saved.back().second] = savedWords.back();
+        saved.pop_back();
+        savedWords.pop_back();
+      }
+      offsets[v] = -1;
+    }
+
+    /**
+     * Unplaced variable with the fewest free offsets that keep it within maxSize, and that
+     * number. Returns -1 with count 0 if one has none, and -1 with count INT_MAX if all are placed
+     */
+    int choose(int maxSize, int& count) const {
+      int chosen = -1;
+      count = INT_MAX;
+      for (size_t v = 0; v < search.vars.size(); v++) {
+        if (offsets[v] >= 0) continue;
+        int c = countFree((int)v, maxSize - search.vars[v].size);
+        if (c == 0) {
+          count = 0;
+          return -1;
+        }
+        if (c < count || (c == count && search.areas[v] > search.areas[chosen])) {
+          chosen = (int)v;
+          count = c;
+        }
+      }
+      return chosen;
+    }
+  };
+
+  double elapsed() const {
+    return chrono::duration <double>(Clock::now() - startTime).count();
+  }
+
+  /** Keeps the layout if it is smaller than the best so far */
+  void improve(const vector <int>& offsets, const string& how) {
+    int size = 0;
+    for (size_t v = 0; v < vars.size(); v++) {
+      size = max(size, offsets[v] + vars[v].size);
+    }
+    lock_guard <mutex> lock(bestMutex);
+    if (size >= bestSize.load()) return;
+    bestOffsets = offsets;
+    bestSize.store(size);
+    cerr << "Scratch size " << size << " after " << elapsed() << " s (" << how << ")" << endl;
+    if (size <= lowerBound) isStopping.store(true);
+  }
+
+  /** Places the variables of order one after another at their lowest free offset */
+  void greedy(const vector <int>& order, const string& how) {
+    vector <int> offsets(vars.size(), 0);
+    vector <bool> isPlaced(vars.size(), false);
+    vector <pair <int, int> > taken;
+    for (size_t k = 0; k < order.size(); k++) {
+      int v = order[k];
+      taken.clear();
+      for (size_t c = 0; c < conflicts[v].size(); c++) {
+        int u = conflicts[v][c];
+        if (isPlaced[u]) taken.push_back(make_pair(offsets[u], offsets[u] + vars[u].size));
+      }
+      sort(taken.begin(), taken.end());
+      int offset = 0;
+      for (size_t t = 0; t < taken.size() && taken[t].first < offset + vars[v].size; t++) {
+        offset = max(offset, taken[t].second);
+      }
+      offsets[v] = offset;
+      isPlaced[v] = true;
+    }
+    improve(offsets, how);
+  }
+
+  bool shouldStop(Worker& worker) {
+    if (isStopping.load()) return true;
+    if (++worker.sinceClockCheck >= 1024) {
+      numNodes += worker.sinceClockCheck;
+      worker.sinceClockCheck = 0;
+      if (Clock::now() >= deadline) isStopping.store(true);
+    }
+    return isStopping.load();
+  }
+
+  void branch(Worker& worker, int numPlaced) {
+    if (shouldStop(worker)) return;
+    if (numPlaced == numSized) {
+      improve(worker.offsets, "search");
+      return;
+    }
+
+    int count;
+    int chosen = worker.choose(bestSize.load() - 1, count);
+    if (chosen < 0) return;
+
+    int size = vars[chosen].size;
+    for (int offset = worker.nextFree(chosen, 0);
+         offset >= 0 && offset + size <= bestSize.load() - 1;
+         offset = worker.nextFree(chosen, offset + 1)) {
+      worker.place(chosen, offset);
+      branch(worker, numPlaced + 1);
+      worker.unplace(chosen);
+      if (isStopping.load()) return;
+    }
+  }
+
+  /** Prefixes of the search tree, at least minCount of them unless the tree is smaller */
+  vector <Placements> splitTree(int numOffsets, size_t minCount) {
+    vector <Placements> prefixes(1);
+    for (int depth = 0; depth < numSized && prefixes.size() < minCount; depth++) {
+      vector <Placements> children;
+      for (size_t p = 0; p < prefixes.size(); p++) {
+        Worker worker(*this, numOffsets);
+        for (size_t k = 0; k < prefixes[p].size(); k++) {
+          worker.place(prefixes[p][k].first, prefixes[p][k].second);
+        }
+        int maxSize = bestSize.load() - 1;
+        int count;
+        int chosen = worker.choose(maxSize, count);
+        if (chosen < 0) continue;
+
+        int size = vars[chosen].size;
+        // A mirrored layout is as small, so the first variable can stay in the lower half
+        int maxOffset = depth == 0 ? (maxSize - size) / 2 : maxSize - size;
+        for (int offset = worker.nextFree(chosen, 0); offset >= 0 && offset <= maxOffset;
+             offset = worker.nextFree(chosen, offset + 1)) {
+          children.push_back(prefixes[p]);
+          children.back().push_back(make_pair(chosen, offset));
+        }
+      }
+      prefixes.swap(children);
+      if (depth + 1 == numSized) {
+        // Each prefix is a whole layout
+        for (size_t p = 0; p < prefixes.size(); p++) {
+          vector <int> offsets(vars.size(), 0);
+          for (size_t k = 0; k < prefixes[p].size(); k++) {
+            offsets[prefixes[p][k].first] = prefixes[p][k].second;
+          }
+          improve(offsets, "search");
+        }
+        prefixes.clear();
+      }
+    }
+    return prefixes;
+  }
+
+public:
+
+  LayoutSearch(const vector <Variable>& _vars) : vars(_vars) {
+    int n = (int)vars.size();
+    conflicts.resize(n);
+    areas.resize(n);
+    numSized = 0;
+    for (int v = 0; v < n; v++) {
+      areas[v] = (long long)vars[v].size * (vars[v].end - vars[v].start + 1);
+      if (vars[v].size == 0) continue;
+      numSized++;
+      for (int u = 0; u < n; u++) {
+        if (u != v && vars[u].size > 0 && vars[u].start <= vars[v].end && vars[v].start <= vars[u].end) {
+          conflicts[v].push_back(u);
+        }
+      }
+    }
+
+    // No layout is smaller than the largest total size live at one instruction
+    vector <pair <int, int> > events;
+    for (int v = 0; v < n; v++) {
+      events.push_back(make_pair(vars[v].start, vars[v].size));
+      events.push_back(make_pair(vars[v].end + 1, -vars[v].size));
+    }
+    sort(events.begin(), events.end());
+    lowerBound = 0;
+    int live = 0;
+    for (size_t e = 0; e < events.size(); e++) {
+      live += events[e].second;
+      if (e + 1 == events.size() || events[e + 1].first != events[e].first) {
+        lowerBound = max(lowerBound, live);
+      }
+    }
+
+    bestSize.store(INT_MAX);
+    isStopping.store(false);
+    numNodes.store(0);
+  }
+
+  /**
+   * Searches for at most seconds on numThreads threads (0 for one per core).
+   * Returns true if the best layout is proved optimal
+   */
+  bool solve(double seconds, int numThreads) {
+    startTime = Clock::now();
+    deadline = startTime + chrono::duration_cast <Clock::duration>(chrono::duration <double>(seconds));
+    cerr << "Lower bound " << lowerBound << " for " << vars.size() << " variables" << endl;
+
+    int n = (int)vars.size();
+    vector <int> order(n);
+    for (int v = 0; v < n; v++) order[v] = v;
+    greedy(order, "greedy, input order");
+    sort(order.begin(), order.end(), [this](int a, int b) { return vars[a].size > vars[b].size; });
+    greedy(order, "greedy, largest first");
+    sort(order.begin(), order.end(), [this](int a, int b) { return areas[a] > areas[b]; });
+    greedy(order, "greedy, largest area first");
+    sort(order.begin(), order.end(), [this](int a, int b) {
+      return vars[a].start != vars[b].start ? vars[a].start < vars[b].start : vars[a].size > vars[b].size;
+    });
+    greedy(order, "greedy, earliest first");
+    if (isStopping.load() || numSized == 0) return true;
+
+    if (numThreads <= 0) numThreads = max(1, (int)thread::hardware_concurrency());
+    // Offsets at or above the greedy size are never needed
+    int numOffsets = bestSize.load();
+    vector <Placements> prefixes = splitTree(numOffsets, 16 * (size_t)numThreads);
+
+    atomic <size_t> nextPrefix(0);
+    vector <thread> threads;
+    for (int t = 0; t < numThreads; t++) {
+      threads.push_back(thread([this, &prefixes, &nextPrefix, numOffsets]() {
+        Worker worker(*this, numOffsets);
+        for (size_t p = nextPrefix++; p < prefixes.size() && !isStopping.load(); p = nextPrefix++) {
+          // The best size may have dropped since the prefix was made
+          size_t placed = 0;
+          while (placed < prefixes[p].size()) {
+            int v = prefixes[p][placed].first, offset = prefixes[p][placed].second;
+            if (offset + vars[v].size > bestSize.load() - 1 || worker.offsets[v] >= 0 || worker.nextFree(v, offset) != offset) break;
+            worker.place(v, offset);
+            placed++;
+          }
+          if (placed == prefixes[p].size()) {
+            branch(worker, (int)placed);
+          }
+          while (placed > 0) {
+            placed--;
+            worker.unplace(prefixes[p][placed].first);
+          }
+        }
+        numNodes += worker.sinceClockCheck;
+      }));
+    }
+    for (size_t t = 0; t < threads.size(); t++) {
+      threads[t].join();
+    }
+
+    cerr << "Searched " << numNodes.load() << " nodes on " << numThreads << " threads in " << elapsed() << " s" << endl;
+    // Only the deadline stops the search short of the lower bound
+    return bestSize.load() <= lowerBound || !isStopping.load();
+  }
+
+  int getLowerBound() const { return lowerBound; }
+
+  int getBestSize() const { return bestSize.load(); }
+
+  const vector <int>& getBestOffsets() const { return bestOffsets; }
+};
@@ -0,0 +1,53 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+/**
+   Usage: layout [seconds [threads]] < layout.input > layout.output 2> layout.error
+
+   The input, written by generateLayoutInput in dlxInputGen.py, holds the number of variables,
+   the memory budget (0 for none) and a line "size start end" per variable. The output has a
+   line "v<variable>.l<offset>" per variable, like that of dlx, and the error stream reports
+   each smaller scratch size found before a last line starting with "Found" or "Failed".
+
+   Build with: g++ -O3 -std=c++11 -pthread src/layoutMain.cpp -o bin/layout
+ */
+
+#include "layout.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+using namespace std;
+
+int main(int argc, char** argv) {
+  double seconds = argc > 1 ? atof(argv[1]) : 60;
+  int numThreads = argc > 2 ? atoi(argv[2]) : 0;
+
+  int numVars;
+  int budget;
+  cin >> numVars;
+  cin >> budget;
+
+  vector <LayoutSearch::Variable> vars(numVars);
+  for (int i = 0; i < numVars; i++) {
+    cin >> vars[i].size >> vars[i].start >> vars[i].end;
+  }
+
+  LayoutSearch search(vars);
+  bool isOptimal = search.solve(seconds, numThreads);
+
+  int size = search.getBestSize();
+  if (budget > 0 && size > budget) {
+    cerr << "Failed to find solution within " << budget << ", best scratch size " << size << endl;
+    return 0;
+  }
+
+  cerr << "Found solution of scratch size " << size << (isOptimal ? " (optimal)" : " (best within deadline)") << endl;
+  const vector <int>& offsets = search.getBestOffsets();
+  for (int i = 0; i < numVars; i++) {
+    printf("v%d.l%d\n", i, offsets[i]);
+  }
+
+  return 0;
+}
@@ -33,7 +33,7 @@ class M3(CodegenBase):
         self.printCincludes()
         self.printCHeader()
 
-        scratchSize = self.computeScratchLocationsFirstFitPriority() # computeScratchLocations computeScratchLocationsFirstFit computeScratchLocationsFirstFitPriority computeScratchLocationsDLX
+        scratchSize = self.computeScratchLocationsFirstFitPriority() # computeScratchLocations computeScratchLocationsFirstFit computeScratchLocationsFirstFitPriority computeScratchLocationsDLX computeScratchLocationsLayoutSearch
         hFile = os.path.join(self.outputDir, "predict.h")
         hFileOut = Writer(hFile, 'a')
         hFileOut.printf('\n#define MEM_BUF_SIZE %d\n' % scratchSize, indent=True)
@@ -42,6 +42,8 @@ class Config:
         # Enable memory optimization in the generated fixed-point code in x86, arduino or m3 codegen.
     memoryLimit = 200000
         # The maximum memory present on the target device. Used if memory optimizations are enabled in the target codegen.
+    layoutSearchTimeout = 60
+        # Seconds the layout search of computeScratchLocationsLayoutSearch may take. The best layout found by then is used.
     largeVariableLimit = 50000
         # Any variable with more elements than this are prioritized for demotion to 8 bits.
     defragmentEnabled = False